@@ -0,0 +1,313 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "opencv2/opencv.hpp"
+#include "defog.h"
+
+#define MAX_LOADED_FRAMES	(32)
+#define NSYNTHETIC_FRAMES	(8)
+#define PROFILE_TABLE_SIZE	(8192)
+
+/**
+ * \typedef enum bench_mode_t
+ * \brief Processing interfaces under test.
+ */
+typedef enum {
+	MODE_DP,						// process_yuv_dp
+	MODE_DP_PL,						// process_yuv_dp_pl
+	MODE_CE,						// process_yuv_ce
+	MODE_CE_PL						// process_yuv_ce_pl
+}bench_mode_t;
+
+static const char *mode_names[] = {"dp", "dp_pl", "ce", "ce_pl"};
+
+//---------------------------------------------------------
+// Print usage.
+//---------------------------------------------------------
+static void usage(
+	const char *app
+)	{
+	printf("Usage: %s [options]\n", app);
+	printf("  -m mode     dp, dp_pl, ce or ce_pl (default ce)\n");
+	printf("  -s WxH      frame size, e.g. 720x576, 1280x720, 1920x1080, 3840x2160 (default 720x576)\n");
+	printf("  -n frames   number of timed frames (default 300)\n");
+	printf("  -w frames   number of warm up frames, not timed (default 10)\n");
+	printf("  -i file     raw input frames, synthetic frames if not given\n");
+	printf("  -f format   input format, yuv (I420) or bgr (BGR24) (default yuv)\n");
+	printf("The parameters are read from defog.json in the working directory.\n");
+}
+
+//---------------------------------------------------------
+// Get CLOCK_MONOTONIC time in nanoseconds.
+//---------------------------------------------------------
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//---------------------------------------------------------
+// Make hazy test frames: low contrast gradient, texture and
+// a moving bright block, so temporal stages see motion.
+//---------------------------------------------------------
+static void make_synthetic_frames(
+	int32_t width,
+	int32_t height,
+	int32_t nframes,
+	std::vector<uint8_t *> &frames
+)	{
+	srand(1234);
+	for (int32_t f = 0; f < nframes; f++) {
+		cv::Mat bgr(height, width, CV_8UC3);
+		for (int32_t y = 0; y < height; y++) {
+			uint8_t *row = bgr.ptr<uint8_t>(y);
+			for (int32_t x = 0; x < width; x++) {
+				const int32_t haze = 120 + 60 * y / height;
+				const int32_t texture = ((x >> 3) ^ (y >> 3)) & 1 ? 12 : -12;
+				const int32_t noise = rand() % 9 - 4;
+				row[3 * x + 0] = (uint8_t)std::min(255, std::max(0, haze + texture + noise + 10));
+				row[3 * x + 1] = (uint8_t)std::min(255, std::max(0, haze + texture + noise));
+				row[3 * x + 2] = (uint8_t)std::min(255, std::max(0, haze + texture + noise - 10));
+			}
+		}
+
+		const int32_t block = std::max(16, width / 8);
+		const int32_t bx = (f * width / nframes) % std::max(1, width - block);
+		cv::rectangle(bgr, cv::Rect(bx, height / 3, block, block), cv::Scalar(230, 230, 230), -1);
+
+		cv::Mat yuv;
+		cv::cvtColor(bgr, yuv, cv::COLOR_BGR2YUV_I420);
+		uint8_t *frame = new uint8_t[width * height * 3 / 2];
+		assert(frame);
+		memmove(frame, yuv.data, width * height * 3 / 2);
+		frames.push_back(frame);
+	}
+}
+
+//---------------------------------------------------------
+// Load up to MAX_LOADED_FRAMES raw frames as YUV420.
+//---------------------------------------------------------
+static bool load_frames(
+	const char *path,
+	bool bgr,
+	int32_t width,
+	int32_t height,
+	std::vector<uint8_t *> &frames
+)	{
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		printf("Open %s fail!\n", path);
+		return false;
+	}
+
+	const int32_t frame_bytes = bgr ? width * height * 3 : width * height * 3 / 2;
+	uint8_t *raw = new uint8_t[frame_bytes];
+	assert(raw);
+	while (frames.size() < MAX_LOADED_FRAMES && 1 == fread(raw, frame_bytes, 1, fp)) {
+		uint8_t *frame = new uint8_t[width * height * 3 / 2];
+		assert(frame);
+		if (bgr) {
+			cv::Mat yuv;
+			cv::cvtColor(cv::Mat(height, width, CV_8UC3, raw), yuv, cv::COLOR_BGR2YUV_I420);
+			memmove(frame, yuv.data, width * height * 3 / 2);
+		} else {
+			memmove(frame, raw, frame_bytes);
+		}
+		frames.push_back(frame);
+	}
+
+	delete [] raw;
+	fclose(fp);
+
+	if (frames.empty()) {
+		printf("No complete %dx%d frame in %s!\n", width, height, path);
+		return false;
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------
+// Run one processing interface on one frame.
+//---------------------------------------------------------
+static void process_frame(
+	defog *module,
+	bench_mode_t mode,
+	uint8_t *yuv_image
+)	{
+	switch (mode) {
+	case MODE_DP:
+		module->process_yuv_dp(yuv_image);
+		break;
+	case MODE_DP_PL:
+		module->process_yuv_dp_pl(yuv_image);
+		break;
+	case MODE_CE:
+		module->process_yuv_ce(yuv_image);
+		break;
+	case MODE_CE_PL:
+		module->process_yuv_ce_pl(yuv_image);
+		break;
+	}
+}
+
+//---------------------------------------------------------
+// Percentile of sorted latencies.
+//---------------------------------------------------------
+static double percentile(
+	const std::vector<int64_t> &sorted,
+	double p
+)	{
+	const size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return 1e-6 * sorted[index];
+}
+
+int main(
+	int argc,
+	char *argv[]
+)	{
+	bench_mode_t mode = MODE_CE;
+	int32_t width = 720;
+	int32_t height = 576;
+	int32_t nframes = 300;
+	int32_t nwarmup = 10;
+	const char *input = 0;
+	bool bgr = false;
+
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "m:s:n:w:i:f:h"))) {
+		switch (opt) {
+		case 'm': {
+			int32_t i = 0;
+			for (; i < 4; i++) {
+				if (0 == strcmp(optarg, mode_names[i])) {
+					break;
+				}
+			}
+			if (4 == i) {
+				usage(argv[0]);
+				return -1;
+			}
+			mode = (bench_mode_t)i;
+			break;
+		}
+		case 's':
+			if (2 != sscanf(optarg, "%dx%d", &width, &height)) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'n':
+			nframes = atoi(optarg);
+			break;
+		case 'w':
+			nwarmup = atoi(optarg);
+			break;
+		case 'i':
+			input = optarg;
+			break;
+		case 'f':
+			bgr = (0 == strcmp(optarg, "bgr"));
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (width <= 0 || height <= 0 || (width & 1) || (height & 1) || nframes <= 0 || nwarmup < 0) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	// defog::init starts the threads of one pipeline, chosen at build time.
+#if !defined(PIPELINE) || !defined(DARK_PRIOR)
+	if (MODE_DP_PL == mode) {
+		printf("dp_pl needs a build with PIPELINE and DARK_PRIOR, use defog_bench_dp.\n");
+		return -1;
+	}
+#endif
+#if !defined(PIPELINE) || defined(DARK_PRIOR) || !defined(CONTRAST_ENHANCE)
+	if (MODE_CE_PL == mode) {
+		printf("ce_pl needs a build with PIPELINE and CONTRAST_ENHANCE, use defog_bench_ce.\n");
+		return -1;
+	}
+#endif
+
+	std::vector<uint8_t *> frames;
+	if (input) {
+		if (!load_frames(input, bgr, width, height, frames)) {
+			return -1;
+		}
+	} else {
+		make_synthetic_frames(width, height, NSYNTHETIC_FRAMES, frames);
+	}
+
+	const int32_t frame_bytes = width * height * 3 / 2;
+	uint8_t *yuv_image = new uint8_t[frame_bytes];
+	assert(yuv_image);
+	memmove(yuv_image, frames[0], frame_bytes);
+
+	// The pipeline threads never stop, so the instance lives until exit and
+	// one run measures one interface at one size.
+	defog *module = new defog;
+	assert(module);
+	module->init(yuv_image, width, height);
+
+	for (int32_t i = 0; i < nwarmup; i++) {
+		memmove(yuv_image, frames[i % frames.size()], frame_bytes);
+		process_frame(module, mode, yuv_image);
+	}
+
+	// Input copy is outside the timed call.
+	std::vector<int64_t> latency(nframes);
+	int64_t busy = 0;
+	const int64_t start = now_ns();
+	for (int32_t i = 0; i < nframes; i++) {
+		memmove(yuv_image, frames[(nwarmup + i) % frames.size()], frame_bytes);
+		const int64_t call_start = now_ns();
+		process_frame(module, mode, yuv_image);
+		latency[i] = now_ns() - call_start;
+		busy += latency[i];
+	}
+	const int64_t finish = now_ns();
+
+	std::sort(latency.begin(), latency.end());
+	struct rusage usage_self;
+	getrusage(RUSAGE_SELF, &usage_self);
+
+	printf("\nmode %s, %dx%d, %d frames from %s\n", mode_names[mode], width, height, nframes,
+		input ? input : "synthetic frames");
+	printf("fps\t\t%.2lf (%.2lf calls per busy second)\n", 1e9 * nframes / (finish - start),
+		1e9 * nframes / std::max<int64_t>(busy, 1));
+	printf("latency(ms)\tmin %.3lf, mean %.3lf, p50 %.3lf, p90 %.3lf, p99 %.3lf, max %.3lf\n",
+		1e-6 * latency[0], 1e-6 * busy / nframes, percentile(latency, 0.5), percentile(latency, 0.9),
+		percentile(latency, 0.99), 1e-6 * latency[nframes - 1]);
+	printf("peak rss\t%ld KB\n", usage_self.ru_maxrss);
+	if (MODE_DP_PL == mode || MODE_CE_PL == mode) {
+		printf("latency is the call time, the frame latency of the pipeline is in the "
+			"profile with enable_profiler 1.\n");
+	}
+
+	char *table = new char[PROFILE_TABLE_SIZE];
+	assert(table);
+	module->get_profile(table, PROFILE_TABLE_SIZE);
+	printf("\n%s", table);
+
+	delete [] table;
+	delete [] yuv_image;
+	for (size_t i = 0; i < frames.size(); i++) {
+		delete [] frames[i];
+	}
+
+	// The instance is not deleted, detached pipeline threads still use it.
+	return 0;
+}
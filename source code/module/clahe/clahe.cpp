@@ -10,8 +10,9 @@
  *  The main routine (CLAHE) expects an input image that is stored contiguously in
  *  memory;  the CLAHE output image overwrites the original input image and has the
  *  same minimum and maximum values (which must be provided by the user).
- *  This implementation assumes that the X- and Y image resolutions are an integer
- *  multiple of the X- and Y sizes of the contextual regions. A check on various other
+ *  The X- and Y image resolutions need not be an integer multiple of the number of
+ *  contextual regions; the last region of each row and column takes the remainder
+ *  and its histogram is weighted by its own pixel count. A check on various other
  *  error conditions is performed.
  *
  *  #define the symbol BYTE_IMAGE to make this implementation suitable for
@@ -52,35 +53,53 @@ don't be a jerk, and remember that anything free comes with no guarantee.
 #include <unistd.h>
 #include <math.h>
 #include <queue>
+#include <algorithm>
 #include "opencv2/opencv.hpp"
+#include "thread_pool.h"
 
 #define SLICES_PER_THREAD	(5)
 #define SKEWNESS_LIMIT		(12.7278)
 #define NUM_SUB_HIST		(16)
 #define MAX_GRAY_LEVEL		(255)
+#define AUTO_CLIP_STEPS		(8)
 
 static bool reset_flag;
+#ifdef TEST_HIST
+/* Skewness and weaker bins of the last clipped region, for debugging. */
 static float g_skewness;
 static unsigned int g_weaker_bins;
-
-static cv::Point grid[4][5] = {
-	{cv::Point(72, 72), cv::Point(216, 72), cv::Point(360, 72), cv::Point(504, 72), cv::Point(648, 72)},
-	{cv::Point(72, 216), cv::Point(216, 216), cv::Point(360, 216), cv::Point(504, 216), cv::Point(648, 216)},
-	{cv::Point(72, 360), cv::Point(216, 360), cv::Point(360, 360), cv::Point(504, 360), cv::Point(648, 360)},
-	{cv::Point(72, 504), cv::Point(216, 504), cv::Point(360, 504), cv::Point(504, 504), cv::Point(648,504 )}
-};
+#endif
 
 static void MakeLut (kz_pixel_t*, kz_pixel_t, kz_pixel_t, unsigned int);
 static void MakeHistogram (kz_pixel_t*, unsigned int, unsigned int, unsigned int,
                            unsigned long*, unsigned int, kz_pixel_t*);
-static void ClipHistogram (unsigned long*, unsigned int, unsigned long);
+static void ClipHistogram (unsigned long*, unsigned int, unsigned long, bool);
 static void MapHistogram (unsigned long*, kz_pixel_t, kz_pixel_t,
                           unsigned int, unsigned long);
-static void Interpolate (kz_pixel_t*, int, unsigned long*, unsigned long*,
-                         unsigned long*, unsigned long*, unsigned int, unsigned int, kz_pixel_t*);
+static void MakeQuads (kz_pixel_t (*)[4], kz_pixel_t*, kz_pixel_t*, kz_pixel_t*,
+                       kz_pixel_t*, unsigned int);
+static void Interpolate (kz_pixel_t*, unsigned int, kz_pixel_t (*)[4], unsigned short*,
+                         unsigned short*, unsigned int, unsigned int, unsigned long*);
 static void DrawHistogram(unsigned long* pulHistogram, char *filename);
 static float HistogramSkewness(unsigned long* pulHistogram, unsigned int uiNrGreylevels);
 
+/* Parameters shared by the region mapping and the interpolation tasks. */
+typedef struct {
+	kz_pixel_t* pImage;           /* input/output image */
+	unsigned int uiXRes, uiYRes;  /* image resolution */
+	unsigned int uiNrX, uiNrY;    /* number of contextual regions */
+	kz_pixel_t Min, Max;          /* grey value range */
+	unsigned int uiNrBins;        /* number of histogram bins */
+	float fCliplimit;             /* normalized cliplimit, the largest one in auto mode */
+	bool bAutoClip;               /* pick the cliplimit of every region from entropy */
+	kz_pixel_t* pMapArray;        /* greylevel mappings */
+	unsigned short* pusXWeight;   /* Q8 right weights of all columns */
+	unsigned short* pusYWeight;   /* Q8 lower weights of all rows */
+	unsigned long* pulHistArray;  /* histograms of temporal CLAHE */
+	unsigned int uiBlend;         /* weight of previous mappings, 8 bits fraction */
+	kz_pixel_t* pLUT;             /* lookup table of grey values to bins */
+} clahe_task_t;
+
 /* To speed up histogram clipping, the input image [Min,Max] is scaled down to
  * [0,uiNrBins-1]. This function calculates the LUT.
  */
@@ -114,7 +133,7 @@ void MakeHistogram (kz_pixel_t* pImage, unsigned int uiXRes,
 
 #ifdef __ARM_NEON__
 	for (i = 0; i < uiSizeY; i++) {
-		for (j = 0; j < uiSizeX; j += pixels_per_load) {
+		for (j = 0; j + pixels_per_load <= uiSizeX; j += pixels_per_load) {
 			uint8x16_t data_vec = vld1q_u8(pImage);
 			
 			for (k = 0; k < NUM_SUB_HIST; k++) {
@@ -123,6 +142,7 @@ void MakeHistogram (kz_pixel_t* pImage, unsigned int uiXRes,
 			
 			pImage += pixels_per_load;
 		}
+		for (; j < uiSizeX; j++) subHistogram[0][*pImage++]++; /* region width remainder */
 		pImage = &pImage[uiXRes-uiSizeX];
 	}
 	
@@ -143,82 +163,77 @@ void MakeHistogram (kz_pixel_t* pImage, unsigned int uiXRes,
 /* This function performs clipping of the histogram and redistribution of bins.
  * The histogram is clipped and the number of excess pixels is counted. Afterwards
  * the excess pixels are equally redistributed across the whole histogram (providing
- * the bin count is smaller than the cliplimit).
+ * the bin count is smaller than the cliplimit). With bSkewness a strongly skewed
+ * histogram with many weak bins is clipped at a lower fixed cliplimit.
+ * The redistribution is solved in closed form: the free room of the clipped bins
+ * is sorted once and the water level, the largest increment the excess can give
+ * to every bin with room, is found in a single walk. The bins are raised by
+ * min(room, level) and the few pixels left are spread evenly over the bins with
+ * room above the level, so the cost does not depend on the shape of the histogram.
  */
 void ClipHistogram (unsigned long* pulHistogram, unsigned int
-                    uiNrGreylevels, unsigned long ulClipLimit
+                    uiNrGreylevels, unsigned long ulClipLimit, bool bSkewness
 )	{
-	unsigned long* pulBinPointer, *pulEndPointer, *pulHisto;
-	unsigned long ulNrExcess, ulUpper, ulBinIncr, ulStepSize, i;
-	unsigned long ulOldNrExcess;  // #IAC Modification
-
-	long lBinExcess;
+	unsigned long aulRoom[uiNR_OF_GREY];  /* free room of the clipped bins */
+	unsigned long ulNrExcess, ulFilled, ulLevel, ulRest, ulNrAbove, ulAbove, i;
 	
 	const unsigned long weaker_clip_limit = 10;
 	const unsigned long lower_clip_limit = 162;
 	unsigned int weaker_bins = 0;
-	float skewness;
+	float skewness = 0;
 	
-	skewness = HistogramSkewness(pulHistogram, uiNrGreylevels);
+	if (bSkewness) {
+		skewness = HistogramSkewness(pulHistogram, uiNrGreylevels);
 
-	for (i = 0; i < uiNrGreylevels; i++) {
-		if ((long) pulHistogram[i] < weaker_clip_limit) weaker_bins++;
+		for (i = 0; i < uiNrGreylevels; i++) {
+			if ((long) pulHistogram[i] < weaker_clip_limit) weaker_bins++;
+		}
 	}
 	
-	if (skewness < -9 && weaker_bins > 85) {
-		g_skewness = skewness;
-		g_weaker_bins = weaker_bins;
+	if (bSkewness && skewness < -9 && weaker_bins > 85) {
 		ulClipLimit = lower_clip_limit;
 #ifdef TEST_HIST
+		/* Debug globals, TEST_HIST runs the regions serially. */
+		g_skewness = skewness;
+		g_weaker_bins = weaker_bins;
 		reset_flag = true;
 #endif
 	}
 	
 	ulNrExcess = 0;
-	pulBinPointer = pulHistogram;
-	for (i = 0; i < uiNrGreylevels; i++) { /* calculate total number of excess pixels */
-		lBinExcess = (long) pulBinPointer[i] - (long) ulClipLimit;
-		if (lBinExcess > 0) ulNrExcess += lBinExcess;     /* excess in current bin */
-	};
-
-	/* Second part: clip histogram and redistribute excess pixels in each bin */
-	ulBinIncr = ulNrExcess / uiNrGreylevels;              /* average binincrement */
-	ulUpper =  ulClipLimit - ulBinIncr;  /* Bins larger than ulUpper set to cliplimit */
-
-	for (i = 0; i < uiNrGreylevels; i++) {
-		if (pulHistogram[i] > ulClipLimit) pulHistogram[i] = ulClipLimit; /* clip bin */
-		else {
-			if (pulHistogram[i] > ulUpper) {              /* high bin count */
-				ulNrExcess -= pulHistogram[i] - ulUpper;
-				pulHistogram[i]=ulClipLimit;
-			} else {                                      /* low bin count */
-				ulNrExcess -= ulBinIncr;
-				pulHistogram[i] += ulBinIncr;
-			}
+	for (i = 0; i < uiNrGreylevels; i++) { /* clip and count excess pixels */
+		if (pulHistogram[i] > ulClipLimit) {
+			ulNrExcess += pulHistogram[i] - ulClipLimit;
+			pulHistogram[i] = ulClipLimit;
 		}
+		aulRoom[i] = ulClipLimit - pulHistogram[i];
 	}
+	if (!ulNrExcess) return;
 
-	do {   /* Redistribute remaining excess  */
-		pulEndPointer = &pulHistogram[uiNrGreylevels];
-		pulHisto = pulHistogram;
-
-		ulOldNrExcess = ulNrExcess;     /* Store number of excess pixels for test later. */
+	/* Water level: bins with room below it are filled up, the others get it all */
+	std::sort(aulRoom, aulRoom + uiNrGreylevels);
+	ulFilled = 0;
+	for (i = 0; i < uiNrGreylevels; i++) {
+		if (ulFilled + (uiNrGreylevels - i) * aulRoom[i] > ulNrExcess) break;
+		ulFilled += aulRoom[i];
+	}
+	if (i == uiNrGreylevels) {             /* every bin reaches the cliplimit */
+		for (i = 0; i < uiNrGreylevels; i++) pulHistogram[i] = ulClipLimit;
+		return;
+	}
+	ulNrAbove = uiNrGreylevels - i;        /* bins with room above the level */
+	ulLevel = (ulNrExcess - ulFilled) / ulNrAbove;
+	ulRest = (ulNrExcess - ulFilled) % ulNrAbove;
 
-		while (ulNrExcess && pulHisto < pulEndPointer) {
-			ulStepSize = uiNrGreylevels / ulNrExcess;
-			if (ulStepSize < 1)
-				ulStepSize = 1;       /* stepsize at least 1 */
-			for (pulBinPointer=pulHisto; pulBinPointer < pulEndPointer && ulNrExcess;
-			     pulBinPointer += ulStepSize) {
-				if (*pulBinPointer < ulClipLimit) {
-					(*pulBinPointer)++;
-					ulNrExcess--;    /* reduce excess */
-				}
-			}
-			pulHisto++;       /* restart redistributing on other bin location */
-		}
-	} while ((ulNrExcess) && (ulNrExcess < ulOldNrExcess));
-	/* Finish loop when we have no more pixels or we can't redistribute any more pixels */
+	ulAbove = 0;
+	for (i = 0; i < uiNrGreylevels; i++) {
+		if (ulClipLimit - pulHistogram[i] > ulLevel) {
+			/* ulRest of the bins above the level get one more, evenly spaced */
+			pulHistogram[i] += ulLevel + ((ulAbove + 1) * ulRest / ulNrAbove -
+				ulAbove * ulRest / ulNrAbove);
+			ulAbove++;
+		} else pulHistogram[i] = ulClipLimit;
+	}
 }
 
 /* This function calculates the equalized lookup table (mapping) by
@@ -239,178 +254,99 @@ void MapHistogram (unsigned long* pulHistogram, kz_pixel_t Min, kz_pixel_t Max,
 	}
 }
 
-/* pImage      - pointer to input/output image
- * uiXRes      - resolution of image in x-direction
- * pulMap*     - mappings of greylevels from histograms
- * uiXSize     - uiXSize of image submatrix
- * uiYSize     - uiYSize of image submatrix
- * pLUT        - lookup table containing mapping greyvalues to bins
- * This function calculates the new greylevel assignments of pixels within a submatrix
- * of the image with size uiXSize and uiYSize. This is done by a bilinear interpolation
- * between four different mappings in order to eliminate boundary artifacts.
- * It uses a division; since division is often an expensive operation, I added code to
- * perform a logical shift instead when feasible.
+/* This function interleaves the mappings of the four regions around an
+ * interpolation block, so the four neighbours of a greylevel are adjacent and
+ * a pixel is mapped with one small gather.
  */
-void Interpolate (kz_pixel_t * pImage, int uiXRes, unsigned long * pulMapLU,
-                  unsigned long * pulMapRU, unsigned long * pulMapLB,  unsigned long * pulMapRB,
-                  unsigned int uiXSize, unsigned int uiYSize, kz_pixel_t * pLUT
-)	{
-	const unsigned int uiIncr = uiXRes-uiXSize; /* Pointer increment after processing row */
-	kz_pixel_t GreyValue;
-	unsigned int uiNum = uiXSize*uiYSize; /* Normalization factor */
-
-	unsigned int uiXCoef, uiYCoef, uiXInvCoef, uiYInvCoef, uiShift = 0;
-
-	if (uiNum & (uiNum - 1))   /* If uiNum is not a power of two, use division */
-		for (uiYCoef = 0, uiYInvCoef = uiYSize; uiYCoef < uiYSize;
-		     uiYCoef++, uiYInvCoef--,pImage+=uiIncr) {
-			for (uiXCoef = 0, uiXInvCoef = uiXSize; uiXCoef < uiXSize;
-			     uiXCoef++, uiXInvCoef--) {
-				GreyValue = *pImage;             /* get histogram bin value */
-				*pImage++ = (kz_pixel_t ) ((uiYInvCoef * (uiXInvCoef*pulMapLU[GreyValue]
-				                            + uiXCoef * pulMapRU[GreyValue])
-				                            + uiYCoef * (uiXInvCoef * pulMapLB[GreyValue]
-				                                            + uiXCoef * pulMapRB[GreyValue])) / uiNum);
-			}
-		}
-	else {                         /* avoid the division and use a right shift instead */
-		while (uiNum >>= 1) uiShift++;             /* Calculate 2log of uiNum */
-		for (uiYCoef = 0, uiYInvCoef = uiYSize; uiYCoef < uiYSize;
-		     uiYCoef++, uiYInvCoef--,pImage+=uiIncr) {
-			for (uiXCoef = 0, uiXInvCoef = uiXSize; uiXCoef < uiXSize;
-			     uiXCoef++, uiXInvCoef--) {
-				GreyValue = *pImage;         /* get histogram bin value */
-				*pImage++ = (kz_pixel_t)((uiYInvCoef* (uiXInvCoef * pulMapLU[GreyValue]
-				                                       + uiXCoef * pulMapRU[GreyValue])
-				                          + uiYCoef * (uiXInvCoef * pulMapLB[GreyValue]
-				                                       + uiXCoef * pulMapRB[GreyValue])) >> uiShift);
-			}
-		}
+void MakeQuads (kz_pixel_t (*pQuad)[4], kz_pixel_t* pMapLU, kz_pixel_t* pMapRU,
+                kz_pixel_t* pMapLB, kz_pixel_t* pMapRB, unsigned int uiNrGreylevels)
+{
+	unsigned int i;
+	for (i = 0; i < uiNrGreylevels; i++) {
+		pQuad[i][0] = pMapLU[i];
+		pQuad[i][1] = pMapRU[i];
+		pQuad[i][2] = pMapLB[i];
+		pQuad[i][3] = pMapRB[i];
 	}
 }
 
-/* pImage      - pointer to input/output image
+/* pImage      - pointer to the first input/output pixel
  * uiXRes      - resolution of image in x-direction
- * pulMap*     - mappings of greylevels from histograms
+ * pQuad       - interleaved mappings LU, RU, LB, RB of every greylevel
+ * pusXWeight  - Q8 weights of the right mappings of the uiXSize columns
+ * pusYWeight  - Q8 weights of the lower mappings of the uiYSize rows
  * uiXSize     - uiXSize of image submatrix
  * uiYSize     - uiYSize of image submatrix
- * pLUT        - lookup table containing mapping greyvalues to bins
+ * pulHistogram - histogram the input greylevels are added to, or 0
  * This function calculates the new greylevel assignments of pixels within a submatrix
  * of the image with size uiXSize and uiYSize. This is done by a bilinear interpolation
  * between four different mappings in order to eliminate boundary artifacts.
- * It uses Neon to speed up.
+ * The weights are precomputed in 8 bits fixed point, so no division is needed and
+ * the result is rounded. It uses Neon to speed up.
  */
-#ifdef __ARM_NEON__ 
-void NeonInterpolate (kz_pixel_t * pImage, int uiXRes,
-                  unsigned long * pulMapLU, unsigned long * pulMapRU,
-				  unsigned long * pulMapLB, unsigned long * pulMapRB,
-                  unsigned int uiXSize, unsigned int uiYSize, kz_pixel_t * pLUT
+void Interpolate (kz_pixel_t * pImage, unsigned int uiXRes, kz_pixel_t (*pQuad)[4],
+                  unsigned short * pusXWeight, unsigned short * pusYWeight,
+                  unsigned int uiXSize, unsigned int uiYSize, unsigned long * pulHistogram
 )	{
 	const unsigned int uiIncr = uiXRes-uiXSize; /* Pointer increment after processing row */
+	unsigned int uiX, uiY, uiTop, uiBottom;
 	kz_pixel_t GreyValue;
-	unsigned int uiNum = uiXSize*uiYSize; /* Normalization factor */
 
-	unsigned int uiXCoef, uiYCoef, uiXInvCoef, uiYInvCoef, uiShift = 0;
-
-	uint32x4_t ycoef_inv = vdupq_n_u32(uiYSize);
-	uint32x4_t ycoef_step = vdupq_n_u32(1);
-
-	uint32x4_t xcoef_step = vdupq_n_u32(8);
-
-	float32x4_t f32x4_num = vdupq_n_f32(uiNum);
-	float32x4_t inv = vrecpeq_f32(f32x4_num);
-	float32x4_t restep = vrecpsq_f32(f32x4_num, inv);
-	f32x4_num = vmulq_f32(restep, inv);	
-/*	
-	float scale = 1 << 16;
-	float32x4_t f32x4_scale_num = vmulq_n_f32(f32x4_num, scale);
-	uint32x4_t u32x4_scale_num = vcvtq_u32_f32(f32x4_scale_num);
-*/
-	for (uiYCoef = 0; uiYCoef < uiYSize; uiYCoef++, pImage+=uiIncr) {
-		uint32x4_t ycoef = vdupq_n_u32(uiYCoef);
-
-		uint32x4x2_t xcoef;
-		uint32x4x2_t xcoef_inv;
-		
-		for (int32_t i = 0; i < 4; i++) {
-			xcoef.val[0][i] = i;
-			xcoef_inv.val[0][i] = uiXSize - i;
-		}
-		
-		for (int32_t i = 4; i < 8; i++) {
-			xcoef.val[1][i - 4] = i;
-			xcoef_inv.val[1][i - 4] = uiXSize - i;
-		}
-
-		for (uiXCoef = 0; uiXCoef < uiXSize; uiXCoef += 8) {
-			uint8x8_t u8x8_from_data = vld1_u8(pImage);
-
-			uint32x4x2_t map_lu;
-			uint32x4x2_t map_ru;
-			uint32x4x2_t map_lb;
-			uint32x4x2_t map_rb;
-			
-			for (int32_t i = 0; i < 4; i++) {
-				map_lu.val[0][i] = pulMapLU[u8x8_from_data[i]];
-				map_ru.val[0][i] = pulMapRU[u8x8_from_data[i]];
-				map_lb.val[0][i] = pulMapLB[u8x8_from_data[i]];
-				map_rb.val[0][i] = pulMapRB[u8x8_from_data[i]];
-			}
-			
-			for (int32_t i = 4; i < 8; i++) {
-				map_lu.val[1][i - 4] = pulMapLU[u8x8_from_data[i]];
-				map_ru.val[1][i - 4] = pulMapRU[u8x8_from_data[i]];
-				map_lb.val[1][i - 4] = pulMapLB[u8x8_from_data[i]];
-				map_rb.val[1][i - 4] = pulMapRB[u8x8_from_data[i]];
+	for (uiY = 0; uiY < uiYSize; uiY++, pImage+=uiIncr) {
+		const unsigned int uiYCoef = pusYWeight[uiY];
+		uiX = 0;
+#if defined(__ARM_NEON__) && defined(BYTE_IMAGE)
+		const uint16x4_t u16x4_ycoef = vdup_n_u16(uiYCoef);
+		const uint16x4_t u16x4_ycoef_inv = vdup_n_u16(256 - uiYCoef);
+		const uint16x8_t u16x8_one = vdupq_n_u16(256);
+		for (; uiX + 8 <= uiXSize; uiX += 8) {
+			uint32x4_t u32x4_quad[2] = {vdupq_n_u32(0), vdupq_n_u32(0)};
+			if (pulHistogram) {
+				for (int32_t i = 0; i < 8; i++) pulHistogram[pImage[i]]++;
 			}
-
-			uint32x4x2_t u32x4x2_temp;
-			u32x4x2_temp.val[0] = vaddq_u32(vmulq_u32(ycoef_inv, vaddq_u32(vmulq_u32(xcoef_inv.val[0],
-				map_lu.val[0]), vmulq_u32(xcoef.val[0], map_ru.val[0]))), vmulq_u32(ycoef,
-				vaddq_u32(vmulq_u32(xcoef_inv.val[0], map_lb.val[0]), vmulq_u32(xcoef.val[0], map_rb.val[0]))));
-
-			u32x4x2_temp.val[1] = vaddq_u32(vmulq_u32(ycoef_inv, vaddq_u32(vmulq_u32(xcoef_inv.val[1],
-				map_lu.val[1]), vmulq_u32(xcoef.val[1], map_ru.val[1]))), vmulq_u32(ycoef,
-				vaddq_u32(vmulq_u32(xcoef_inv.val[1], map_lb.val[1]), vmulq_u32(xcoef.val[1], map_rb.val[1]))));
-
-			float32x4x2_t f32x4x2_temp;
-			f32x4x2_temp.val[0] = vcvtq_f32_u32(u32x4x2_temp.val[0]);
-			f32x4x2_temp.val[1] = vcvtq_f32_u32(u32x4x2_temp.val[1]);
-
-			float32x4x2_t f32x4x2_result;
-			f32x4x2_result.val[0] = vmulq_f32(f32x4x2_temp.val[0], f32x4_num);
-			f32x4x2_result.val[1] = vmulq_f32(f32x4x2_temp.val[1], f32x4_num);
-
-			uint32x4x2_t u32x4x2_result;
-			u32x4x2_result.val[0] = vcvtq_u32_f32(f32x4x2_result.val[0]);
-			u32x4x2_result.val[1] = vcvtq_u32_f32(f32x4x2_result.val[1]);
-
-			uint16x4x2_t u16x4x2_result;
-			u16x4x2_result.val[0] = vmovn_u32(u32x4x2_result.val[0]);
-			u16x4x2_result.val[1] = vmovn_u32(u32x4x2_result.val[1]);
-/*			
-			uint16x4x2_t u16x4x2_result;
-			u16x4x2_result.val[0] = vshrn_n_u32(vmulq_u32(u32x4x2_temp.val[0], u32x4_scale_num), 16);
-			u16x4x2_result.val[1] = vshrn_n_u32(vmulq_u32(u32x4x2_temp.val[1], u32x4_scale_num), 16);
-*/
-			uint16x8_t u16x8_result;
-			u16x8_result = vcombine_u16(u16x4x2_result.val[0], u16x4x2_result.val[1]);
-
-			uint8x8_t u8x8_result;
-			u8x8_result = vqmovn_u16(u16x8_result);
-
-			vst1_u8(pImage, u8x8_result);
-
+			u32x4_quad[0] = vld1q_lane_u32((const uint32_t *)pQuad[pImage[0]], u32x4_quad[0], 0);
+			u32x4_quad[0] = vld1q_lane_u32((const uint32_t *)pQuad[pImage[1]], u32x4_quad[0], 1);
+			u32x4_quad[0] = vld1q_lane_u32((const uint32_t *)pQuad[pImage[2]], u32x4_quad[0], 2);
+			u32x4_quad[0] = vld1q_lane_u32((const uint32_t *)pQuad[pImage[3]], u32x4_quad[0], 3);
+			u32x4_quad[1] = vld1q_lane_u32((const uint32_t *)pQuad[pImage[4]], u32x4_quad[1], 0);
+			u32x4_quad[1] = vld1q_lane_u32((const uint32_t *)pQuad[pImage[5]], u32x4_quad[1], 1);
+			u32x4_quad[1] = vld1q_lane_u32((const uint32_t *)pQuad[pImage[6]], u32x4_quad[1], 2);
+			u32x4_quad[1] = vld1q_lane_u32((const uint32_t *)pQuad[pImage[7]], u32x4_quad[1], 3);
+
+			/* LU LB of 8 pixels in val[0], RU RB in val[1], then split upper and lower */
+			uint8x16x2_t u8x16x2_pair = vuzpq_u8(vreinterpretq_u8_u32(u32x4_quad[0]),
+				vreinterpretq_u8_u32(u32x4_quad[1]));
+			uint8x8x2_t u8x8x2_left = vuzp_u8(vget_low_u8(u8x16x2_pair.val[0]), vget_high_u8(u8x16x2_pair.val[0]));
+			uint8x8x2_t u8x8x2_right = vuzp_u8(vget_low_u8(u8x16x2_pair.val[1]), vget_high_u8(u8x16x2_pair.val[1]));
+
+			const uint16x8_t u16x8_xcoef = vld1q_u16(pusXWeight + uiX);
+			const uint16x8_t u16x8_xcoef_inv = vsubq_u16(u16x8_one, u16x8_xcoef);
+			uint16x8_t u16x8_top = vmulq_u16(vmovl_u8(u8x8x2_left.val[0]), u16x8_xcoef_inv);
+			u16x8_top = vmlaq_u16(u16x8_top, vmovl_u8(u8x8x2_right.val[0]), u16x8_xcoef);
+			uint16x8_t u16x8_bottom = vmulq_u16(vmovl_u8(u8x8x2_left.val[1]), u16x8_xcoef_inv);
+			u16x8_bottom = vmlaq_u16(u16x8_bottom, vmovl_u8(u8x8x2_right.val[1]), u16x8_xcoef);
+
+			uint32x4_t u32x4_low = vmull_u16(vget_low_u16(u16x8_top), u16x4_ycoef_inv);
+			u32x4_low = vmlal_u16(u32x4_low, vget_low_u16(u16x8_bottom), u16x4_ycoef);
+			uint32x4_t u32x4_high = vmull_u16(vget_high_u16(u16x8_top), u16x4_ycoef_inv);
+			u32x4_high = vmlal_u16(u32x4_high, vget_high_u16(u16x8_bottom), u16x4_ycoef);
+
+			uint16x8_t u16x8_result = vcombine_u16(vrshrn_n_u32(u32x4_low, 16), vrshrn_n_u32(u32x4_high, 16));
+			vst1_u8(pImage, vmovn_u16(u16x8_result));
 			pImage += 8;
-			xcoef.val[0] = vaddq_u32(xcoef.val[0], xcoef_step);
-			xcoef.val[1] = vaddq_u32(xcoef.val[1], xcoef_step);
-			xcoef_inv.val[0] = vsubq_u32(xcoef_inv.val[0], xcoef_step);
-			xcoef_inv.val[1] = vsubq_u32(xcoef_inv.val[1], xcoef_step);
 		}
-		ycoef_inv = vsubq_u32(ycoef_inv, ycoef_step);
+#endif
+		for (; uiX < uiXSize; uiX++) {
+			const unsigned int uiXCoef = pusXWeight[uiX];
+			GreyValue = *pImage;             /* get histogram bin value */
+			if (pulHistogram) pulHistogram[GreyValue]++;
+			uiTop = (256 - uiXCoef) * pQuad[GreyValue][0] + uiXCoef * pQuad[GreyValue][1];
+			uiBottom = (256 - uiXCoef) * pQuad[GreyValue][2] + uiXCoef * pQuad[GreyValue][3];
+			*pImage++ = (kz_pixel_t) ((((unsigned long)(256 - uiYCoef) * uiTop +
+				(unsigned long)uiYCoef * uiBottom) + (1UL << 15)) >> 16);
+		}
 	}
 }
-#endif
 
 void DrawHistogram(unsigned long* pulHistogram, char *filename)
 {
@@ -433,32 +369,281 @@ void DrawHistogram(unsigned long* pulHistogram, char *filename)
 	cv::imwrite(filename, hist_mat);
 }
 
+/* Skewness used by ClipHistogram: the third over the second central moment of the
+ * bin indices around the mean grey level of the region. The moments are summed
+ * exactly in integers and only the final ratio is in floating point.
+ */
 float HistogramSkewness(unsigned long* pulHistogram, unsigned int uiNrGreylevels)
 {
-	unsigned long sum = 0;
-	int mean = 0;
-	float third_order_moment = 0;
+	unsigned long long ullSum = 0, ullNrPixels = 0;
+	long long llSum2 = 0, llSum3 = 0;
+	int mean;
 	
 	for (int i = 0; i < uiNrGreylevels; i++) {
-		sum += i * pulHistogram[i];
+		ullSum += (unsigned long long)i * pulHistogram[i];
+		ullNrPixels += pulHistogram[i];
 	}
+	if (!ullNrPixels) return 0;
 	
-	mean = (int)((float)sum / 20736);
-	float sum1 = 0, sum2 = 0;
+	mean = (int)(ullSum / ullNrPixels);
 	
 	for (int i = 0; i < uiNrGreylevels; i++) {
-		int delta = i - mean;
-		int delta_square = delta * delta;
-		sum1 += delta_square * delta;
-		sum2 += delta_square;
+		const long long delta = i - mean;
+		llSum2 += delta * delta;
+		llSum3 += delta * delta * delta;
 	}
+	if (!llSum2) return 0;
 	
-	sum1 /= 20736;
-	sum2 /= 20736;
-	sum2 = pow(sum2, 1.5);
-	third_order_moment = sum1 / sum2;
+	/* (s3 / n) / (s2 / n)^1.5 */
+	const float fSum2 = (float)llSum2;
+	return (float)llSum3 * sqrtf((float)ullNrPixels) / (fSum2 * sqrtf(fSum2));
+}
+
+/* Offset and size of contextual region uiR along one axis. The regions are
+ * uiRes / uiNr wide, the last one also takes the remainder of the division.
+ */
+static void RegionRange(unsigned int uiR, unsigned int uiNr, unsigned int uiRes,
+                        unsigned int* puiOffset, unsigned int* puiSize)
+{
+	const unsigned int uiSize = uiRes / uiNr;
+	*puiOffset = uiR * uiSize;
+	*puiSize = (uiR == uiNr - 1) ? uiRes - *puiOffset : uiSize;
+}
+
+/* Cliplimit of a region of ulNrPixels pixels, so that regions of different
+ * sizes are clipped at the same fraction of their histograms.
+ */
+static unsigned long RegionClipLimit(float fCliplimit, unsigned long ulNrPixels,
+                                     unsigned int uiNrBins)
+{
+	unsigned long ulClipLimit;
+	if(fCliplimit > 0.0) {                /* Calculate actual cliplimit  */
+		ulClipLimit = (unsigned long) (fCliplimit * ulNrPixels / uiNrBins);
+		ulClipLimit = (ulClipLimit < 1UL) ? 1UL : ulClipLimit;
+	} else ulClipLimit = 1UL<<14;         /* Large value, do not clip (AHE) */
+	return ulClipLimit;
+}
+
+/* Entropy in bits of a histogram of ulNrPixels pixels clipped at ulClipLimit,
+ * with the excess spread evenly over all bins like ClipHistogram does.
+ */
+static float ClippedEntropy(unsigned long* pulHistogram, unsigned int uiNrBins,
+                            unsigned long ulNrPixels, unsigned long ulClipLimit)
+{
+	unsigned long ulNrExcess = 0;
+	unsigned int i;
+	for (i = 0; i < uiNrBins; i++) {
+		if (pulHistogram[i] > ulClipLimit) ulNrExcess += pulHistogram[i] - ulClipLimit;
+	}
+
+	const float fBinIncr = (float)ulNrExcess / uiNrBins;
+	const float fScale = 1.0f / ulNrPixels;
+	float fEntropy = 0;
+	for (i = 0; i < uiNrBins; i++) {
+		const float fProb = ((float)std::min(pulHistogram[i], ulClipLimit) + fBinIncr) * fScale;
+		if (fProb > 0) fEntropy -= fProb * log2f(fProb);
+	}
+	return fEntropy;
+}
 
-	return third_order_moment;
+/* Cliplimit of a region picked from its histogram. The entropy of the clipped
+ * histogram is sampled at AUTO_CLIP_STEPS normalized cliplimits in
+ * [1, fMaxCliplimit]; it falls quickly and then flattens as the cliplimit grows.
+ * The knee of the curve, the sample farthest below the chord between the end
+ * samples, is taken: beyond it a higher cliplimit adds contrast and noise but
+ * hardly any information.
+ */
+static unsigned long EntropyClipLimit(unsigned long* pulHistogram, unsigned int uiNrBins,
+                                      unsigned long ulNrPixels, float fMaxCliplimit)
+{
+	float afCliplimit[AUTO_CLIP_STEPS], afEntropy[AUTO_CLIP_STEPS];
+	int k, iKnee = AUTO_CLIP_STEPS - 1;
+	float fMaxDist = 1e-3f;               /* flat curve keeps the largest cliplimit */
+
+	for (k = 0; k < AUTO_CLIP_STEPS; k++) {
+		afCliplimit[k] = 1.0f + (fMaxCliplimit - 1.0f) * k / (AUTO_CLIP_STEPS - 1);
+		afEntropy[k] = ClippedEntropy(pulHistogram, uiNrBins, ulNrPixels,
+			RegionClipLimit(afCliplimit[k], ulNrPixels, uiNrBins));
+	}
+	for (k = 1; k < AUTO_CLIP_STEPS - 1; k++) {
+		const float fChord = afEntropy[0] + (afEntropy[AUTO_CLIP_STEPS - 1] - afEntropy[0]) *
+			k / (AUTO_CLIP_STEPS - 1);
+		if (fChord - afEntropy[k] > fMaxDist) {
+			fMaxDist = fChord - afEntropy[k];
+			iKnee = k;
+		}
+	}
+	return RegionClipLimit(afCliplimit[iKnee], ulNrPixels, uiNrBins);
+}
+
+/* Cliplimit of a region, picked from entropy in auto mode. */
+static unsigned long TileClipLimit(unsigned long* pulHistogram, unsigned int uiNrBins,
+                                   unsigned long ulNrPixels, float fCliplimit, bool bAutoClip)
+{
+	if (bAutoClip && fCliplimit > 1.0) {
+		return EntropyClipLimit(pulHistogram, uiNrBins, ulNrPixels, fCliplimit);
+	}
+	return RegionClipLimit(fCliplimit, ulNrPixels, uiNrBins);
+}
+
+/* Stores a mapping made by MapHistogram in the compact map array. */
+static void StoreMapping(kz_pixel_t* pMap, unsigned long* pulHistogram, unsigned int uiNrBins)
+{
+	for (unsigned int i = 0; i < uiNrBins; i++) pMap[i] = (kz_pixel_t)pulHistogram[i];
+}
+
+/* Task of the worker pool: make, clip and map the histograms of contextual
+ * regions [begin, end). Regions only read the image, so they are independent.
+ */
+static void MapRegions(int32_t begin, int32_t end, int32_t worker, void* param)
+{
+	clahe_task_t* task = (clahe_task_t*)param;
+	unsigned long aulHist[uiNR_OF_GREY];
+	for (int32_t i = begin; i < end; i++) {
+		unsigned int uiXOffset, uiYOffset, uiXSize, uiYSize;
+		RegionRange(i / task->uiNrX, task->uiNrY, task->uiYRes, &uiYOffset, &uiYSize);
+		RegionRange(i % task->uiNrX, task->uiNrX, task->uiXRes, &uiXOffset, &uiXSize);
+		const unsigned long ulNrPixels = (unsigned long)uiXSize * (unsigned long)uiYSize;
+		kz_pixel_t* pImPointer = &task->pImage[uiYOffset * task->uiXRes + uiXOffset];
+		MakeHistogram(pImPointer, task->uiXRes, uiXSize, uiYSize, aulHist, task->uiNrBins,
+			task->pLUT);
+		ClipHistogram(aulHist, task->uiNrBins, TileClipLimit(aulHist, task->uiNrBins, ulNrPixels,
+			task->fCliplimit, task->bAutoClip), !task->bAutoClip);
+		MapHistogram(aulHist, task->Min, task->Max, task->uiNrBins, ulNrPixels);
+		StoreMapping(&task->pMapArray[task->uiNrBins * i], aulHist, task->uiNrBins);
+	}
+}
+
+/* Position, size and neighbouring regions of interpolation block uiB along one
+ * axis. Blocks span between the centres of neighbouring regions; the first and
+ * the last block reach the image border and use a single region.
+ */
+static void BlockRange(unsigned int uiB, unsigned int uiNr, unsigned int uiRes,
+                       unsigned int* puiOffset, unsigned int* puiSub,
+                       unsigned int* puiLow, unsigned int* puiHigh)
+{
+	unsigned int uiOffset, uiSize, uiEnd;
+	if (uiB == 0) {                                   /* special case: first block */
+		*puiOffset = 0;
+		*puiLow = 0;
+		*puiHigh = 0;
+	} else {
+		RegionRange(uiB - 1, uiNr, uiRes, &uiOffset, &uiSize);
+		*puiOffset = uiOffset + (uiSize >> 1);
+		if (uiB == uiNr) {                            /* special case: last block */
+			*puiLow = uiNr - 1;
+			*puiHigh = *puiLow;
+		} else {                                      /* default values */
+			*puiLow = uiB - 1;
+			*puiHigh = *puiLow + 1;
+		}
+	}
+	if (uiB == uiNr) uiEnd = uiRes;
+	else {
+		RegionRange(uiB, uiNr, uiRes, &uiOffset, &uiSize);
+		uiEnd = uiOffset + (uiSize >> 1);
+	}
+	*puiSub = uiEnd - *puiOffset;
+}
+
+/* Q8 weights of the high mapping for every pixel along one axis, relative to
+ * the interpolation block of the pixel: (uiCoef * 256 + uiSize / 2) / uiSize.
+ */
+static void MakeWeights(unsigned int uiNr, unsigned int uiRes, unsigned short* pusWeight)
+{
+	for (unsigned int uiB = 0; uiB <= uiNr; uiB++) {
+		unsigned int uiOffset, uiSub, uiLow, uiHigh;
+		BlockRange(uiB, uiNr, uiRes, &uiOffset, &uiSub, &uiLow, &uiHigh);
+		for (unsigned int uiCoef = 0; uiCoef < uiSub; uiCoef++) {
+			pusWeight[uiOffset + uiCoef] = (unsigned short)((uiCoef * 256 + (uiSub >> 1)) / uiSub);
+		}
+	}
+}
+
+/* Task of the worker pool: interpolate blocks [begin, end) of the
+ * (uiNrX + 1) x (uiNrY + 1) block grid. Blocks do not overlap.
+ */
+static void InterpolateBlocks(int32_t begin, int32_t end, int32_t worker, void* param)
+{
+	clahe_task_t* task = (clahe_task_t*)param;
+	kz_pixel_t aQuad[uiNR_OF_GREY][4] __attribute__((aligned(16)));
+	for (int32_t i = begin; i < end; i++) {
+		unsigned int uiXOffset, uiYOffset, uiSubX, uiSubY, uiXL, uiXR, uiYU, uiYB;
+		BlockRange(i / (task->uiNrX + 1), task->uiNrY, task->uiYRes, &uiYOffset, &uiSubY, &uiYU, &uiYB);
+		BlockRange(i % (task->uiNrX + 1), task->uiNrX, task->uiXRes, &uiXOffset, &uiSubX, &uiXL, &uiXR);
+		if (uiSubX == 0 || uiSubY == 0) continue;     /* regions of one pixel */
+
+		MakeQuads(aQuad, &task->pMapArray[task->uiNrBins * (uiYU * task->uiNrX + uiXL)],
+			&task->pMapArray[task->uiNrBins * (uiYU * task->uiNrX + uiXR)],
+			&task->pMapArray[task->uiNrBins * (uiYB * task->uiNrX + uiXL)],
+			&task->pMapArray[task->uiNrBins * (uiYB * task->uiNrX + uiXR)], task->uiNrBins);
+		Interpolate(&task->pImage[uiYOffset * task->uiXRes + uiXOffset], task->uiXRes, aQuad,
+			&task->pusXWeight[uiXOffset], &task->pusYWeight[uiYOffset], uiSubX, uiSubY, 0);
+	}
+}
+
+/* Task of the worker pool: equalize contextual regions [begin, end) with the
+ * mappings of the previous frame and make their histograms in the same pass.
+ * A region holds a quarter of each of the four interpolation blocks around
+ * its centre, the regions do not overlap.
+ */
+static void TemporalRegions(int32_t begin, int32_t end, int32_t worker, void* param)
+{
+	clahe_task_t* task = (clahe_task_t*)param;
+	kz_pixel_t aQuad[uiNR_OF_GREY][4] __attribute__((aligned(16)));
+	for (int32_t i = begin; i < end; i++) {
+		const unsigned int uiY = i / task->uiNrX;
+		const unsigned int uiX = i % task->uiNrX;
+		unsigned int uiXOffset, uiYOffset, uiXSize, uiYSize;
+		RegionRange(uiY, task->uiNrY, task->uiYRes, &uiYOffset, &uiYSize);
+		RegionRange(uiX, task->uiNrX, task->uiXRes, &uiXOffset, &uiXSize);
+		unsigned long* pulHist = &task->pulHistArray[task->uiNrBins * i];
+		memset(pulHist, 0, sizeof(unsigned long) * task->uiNrBins);
+
+		for (unsigned int uiPY = 0; uiPY < 2; uiPY++) {  /* upper and lower half */
+			const unsigned int uiY0 = uiYOffset + uiPY * (uiYSize >> 1);
+			const unsigned int uiH = uiPY ? uiYSize - (uiYSize >> 1) : uiYSize >> 1;
+			unsigned int uiBOffsetY, uiSubY, uiYU, uiYB;
+			BlockRange(uiY + uiPY, task->uiNrY, task->uiYRes, &uiBOffsetY, &uiSubY, &uiYU, &uiYB);
+			for (unsigned int uiPX = 0; uiPX < 2; uiPX++) {  /* left and right half */
+				const unsigned int uiX0 = uiXOffset + uiPX * (uiXSize >> 1);
+				const unsigned int uiW = uiPX ? uiXSize - (uiXSize >> 1) : uiXSize >> 1;
+				unsigned int uiBOffsetX, uiSubX, uiXL, uiXR;
+				BlockRange(uiX + uiPX, task->uiNrX, task->uiXRes, &uiBOffsetX, &uiSubX, &uiXL, &uiXR);
+				if (uiW == 0 || uiH == 0) continue;
+
+				MakeQuads(aQuad, &task->pMapArray[task->uiNrBins * (uiYU * task->uiNrX + uiXL)],
+					&task->pMapArray[task->uiNrBins * (uiYU * task->uiNrX + uiXR)],
+					&task->pMapArray[task->uiNrBins * (uiYB * task->uiNrX + uiXL)],
+					&task->pMapArray[task->uiNrBins * (uiYB * task->uiNrX + uiXR)], task->uiNrBins);
+				Interpolate(&task->pImage[uiY0 * task->uiXRes + uiX0], task->uiXRes, aQuad,
+					&task->pusXWeight[uiX0], &task->pusYWeight[uiY0], uiW, uiH, pulHist);
+			}
+		}
+	}
+}
+
+/* Task of the worker pool: clip and map the histograms of contextual regions
+ * [begin, end) made by TemporalRegions, and blend them into the mappings used
+ * for the next frame.
+ */
+static void UpdateRegions(int32_t begin, int32_t end, int32_t worker, void* param)
+{
+	clahe_task_t* task = (clahe_task_t*)param;
+	for (int32_t i = begin; i < end; i++) {
+		unsigned int uiXOffset, uiYOffset, uiXSize, uiYSize;
+		RegionRange(i / task->uiNrX, task->uiNrY, task->uiYRes, &uiYOffset, &uiYSize);
+		RegionRange(i % task->uiNrX, task->uiNrX, task->uiXRes, &uiXOffset, &uiXSize);
+		const unsigned long ulNrPixels = (unsigned long)uiXSize * (unsigned long)uiYSize;
+		unsigned long* pulHist = &task->pulHistArray[task->uiNrBins * i];
+		kz_pixel_t* pMap = &task->pMapArray[task->uiNrBins * i];
+		ClipHistogram(pulHist, task->uiNrBins, TileClipLimit(pulHist, task->uiNrBins, ulNrPixels,
+			task->fCliplimit, task->bAutoClip), !task->bAutoClip);
+		MapHistogram(pulHist, task->Min, task->Max, task->uiNrBins, ulNrPixels);
+		for (unsigned int k = 0; k < task->uiNrBins; k++) {
+			pMap[k] = (kz_pixel_t)((pMap[k] * task->uiBlend + pulHist[k] * (256 - task->uiBlend)) >> 8);
+		}
+	}
 }
 
 /*   pImage - Pointer to the input/output image
@@ -466,10 +651,17 @@ float HistogramSkewness(unsigned long* pulHistogram, unsigned int uiNrGreylevels
  *   uiYRes - Image resolution in the Y direction
  *   Min - Minimum greyvalue of input image (also becomes minimum of output image)
  *   Max - Maximum greyvalue of input image (also becomes maximum of output image)
- *   uiNrX - Number of contextial regions in the X direction (min 2, max uiMAX_REG_X)
- *   uiNrY - Number of contextial regions in the Y direction (min 2, max uiMAX_REG_Y)
+ *   uiNrX - Number of contextial regions in the X direction (min 2, max uiXRes)
+ *   uiNrY - Number of contextial regions in the Y direction (min 2, max uiYRes)
  *   uiNrBins - Number of greybins for histogram ("dynamic range")
  *   float fCliplimit - Normalized cliplimit (higher values give more contrast)
+ *   pool - Worker pool, regions and interpolation blocks run on it when not null.
+ *          Every region and block is computed as in the serial order, so the
+ *          output is bit-identical.
+ *   bAutoClip - Pick the cliplimit of every region at the knee of the entropy
+ *          of its clipped histogram, fCliplimit is then the largest cliplimit.
+ *          The histograms are already made, so no extra image pass is needed.
+ *   Return value - 0 on success, negative on invalid parameters or no memory
  * The number of "effective" greylevels in the output image is set by uiNrBins; selecting
  * a small value (eg. 128) speeds up processing and still produce an output image of
  * good quality. The output image will have the same minimum and maximum value as the input
@@ -477,21 +669,22 @@ float HistogramSkewness(unsigned long* pulHistogram, unsigned int uiNrGreylevels
  */
 int CLAHEq (kz_pixel_t* pImage, unsigned int uiXRes, unsigned int uiYRes,
             kz_pixel_t Min, kz_pixel_t Max, unsigned int uiNrX, unsigned int uiNrY,
-            unsigned int uiNrBins, float fCliplimit
+            unsigned int uiNrBins, float fCliplimit, thread_pool* pool, bool bAutoClip
 )	{
 	unsigned int uiX, uiY;                /* counters */
-	unsigned int uiXSize, uiYSize, uiSubX, uiSubY; /* size of context. reg. and subimages */
-	unsigned int uiXL, uiXR, uiYU, uiYB;  /* auxiliary variables interpolation routine */
+	unsigned int uiXSize, uiYSize;        /* size of context. reg. */
+	unsigned int uiXOffset, uiYOffset;    /* position of context. reg. */
 	unsigned long ulClipLimit, ulNrPixels;/* clip limit and region pixel count */
 	kz_pixel_t* pImPointer;                /* pointer to image */
 	kz_pixel_t aLUT[uiNR_OF_GREY];          /* lookup table used for scaling of input image */
-	unsigned long* pulHist, *pulMapArray; /* pointer to histogram and mappings*/
-	unsigned long* pulLU, *pulLB, *pulRU, *pulRB; /* auxiliary pointers interpolation */
+	unsigned long aulHist[uiNR_OF_GREY];  /* histogram of a region */
+	unsigned long* pulHist = aulHist;     /* pointer to histogram */
+	kz_pixel_t* pMapArray;                /* mappings of all regions */
+	unsigned short* pusWeight;            /* interpolation weights of columns and rows */
+	clahe_task_t task;                     /* parameters of region and block tasks */
 
 	if (uiNrX > uiXRes) return -1;    /* # of regions x-direction too large */
 	if (uiNrY > uiYRes) return -2;    /* # of regions y-direction too large */
-	if (uiXRes % uiNrX) return -3;        /* x-resolution no multiple of uiNrX */
-	if (uiYRes % uiNrY) return -4;        /* y-resolution no multiple of uiNrY #TPB FIX */
 #ifndef BYTE_IMAGE					  /* #TPB FIX */
 	if (Max >= uiNR_OF_GREY) return -5;    /* maximum too large */
 #endif
@@ -499,18 +692,17 @@ int CLAHEq (kz_pixel_t* pImage, unsigned int uiXRes, unsigned int uiYRes,
 	if (uiNrX < 2 || uiNrY < 2) return -7;/* at least 4 contextual regions required */
 	if (fCliplimit == 1.0) return 0;      /* is OK, immediately returns original image. */
 	if (uiNrBins == 0) uiNrBins = 128;    /* default value when not specified */
-
-	pulMapArray=(unsigned long *)malloc(sizeof(unsigned long)*uiNrX*uiNrY*uiNrBins);
-	if (pulMapArray == 0) return -8;      /* Not enough memory! (try reducing uiNrBins) */
-
-	uiXSize = uiXRes/uiNrX;
-	uiYSize = uiYRes/uiNrY;  /* Actual size of contextual regions */
-	ulNrPixels = (unsigned long)uiXSize * (unsigned long)uiYSize;
-
-	if(fCliplimit > 0.0) {                /* Calculate actual cliplimit  */
-		ulClipLimit = (unsigned long) (fCliplimit * (uiXSize * uiYSize) / uiNrBins);
-		ulClipLimit = (ulClipLimit < 1UL) ? 1UL : ulClipLimit;
-	} else ulClipLimit = 1UL<<14;         /* Large value, do not clip (AHE) */
+	if (uiNrBins > uiNR_OF_GREY) return -9;/* more bins than greylevels */
+
+	pMapArray=(kz_pixel_t *)malloc(sizeof(kz_pixel_t)*uiNrX*uiNrY*uiNrBins);
+	pusWeight=(unsigned short *)malloc(sizeof(unsigned short)*(uiXRes+uiYRes));
+	if (pMapArray == 0 || pusWeight == 0) {
+		free(pMapArray);
+		free(pusWeight);
+		return -8;                        /* Not enough memory! (try reducing uiNrBins) */
+	}
+	MakeWeights(uiNrX, uiXRes, pusWeight);
+	MakeWeights(uiNrY, uiYRes, pusWeight + uiXRes);
 
 #ifdef TEST_CLAHE	
 	clock_t total[3] = {0, 0, 0};
@@ -519,11 +711,33 @@ int CLAHEq (kz_pixel_t* pImage, unsigned int uiXRes, unsigned int uiYRes,
 
 	// MakeLut(aLUT, Min, Max, uiNrBins);    /* Make lookup table for mapping of greyvalues */
 
+	task.pImage = pImage;
+	task.uiXRes = uiXRes;
+	task.uiYRes = uiYRes;
+	task.uiNrX = uiNrX;
+	task.uiNrY = uiNrY;
+	task.Min = Min;
+	task.Max = Max;
+	task.uiNrBins = uiNrBins;
+	task.fCliplimit = fCliplimit;
+	task.bAutoClip = bAutoClip;
+	task.pMapArray = pMapArray;
+	task.pusXWeight = pusWeight;
+	task.pusYWeight = pusWeight + uiXRes;
+	task.pLUT = aLUT;
+#ifdef TEST_HIST
+	pool = 0;                             /* debug output needs serial regions */
+#endif
+
 	char filename[64];
 	/* Calculate greylevel mappings for each contextual region */
-	for (uiY = 0, pImPointer = pImage; uiY < uiNrY; uiY++) {
-		for (uiX = 0; uiX < uiNrX; uiX++, pImPointer += uiXSize) {
-			pulHist = &pulMapArray[uiNrBins * (uiY * uiNrX + uiX)];
+	if (pool) pool->parallel_for(0, uiNrX * uiNrY, uiNrX * uiNrY, MapRegions, &task);
+	else for (uiY = 0; uiY < uiNrY; uiY++) {
+		RegionRange(uiY, uiNrY, uiYRes, &uiYOffset, &uiYSize);
+		for (uiX = 0; uiX < uiNrX; uiX++) {
+			RegionRange(uiX, uiNrX, uiXRes, &uiXOffset, &uiXSize);
+			pImPointer = &pImage[uiYOffset * uiXRes + uiXOffset];
+			ulNrPixels = (unsigned long)uiXSize * (unsigned long)uiYSize;
 #ifdef TEST_CLAHE
 			start = clock();
 #endif
@@ -541,14 +755,16 @@ int CLAHEq (kz_pixel_t* pImage, unsigned int uiXRes, unsigned int uiYRes,
 			DrawHistogram(pulHist, filename);
 			reset_flag = false;
 #endif
-			ClipHistogram(pulHist, uiNrBins, ulClipLimit);
+			ulClipLimit = TileClipLimit(pulHist, uiNrBins, ulNrPixels, fCliplimit, bAutoClip);
+			ClipHistogram(pulHist, uiNrBins, ulClipLimit, !bAutoClip);
 #ifdef TEST_HIST
 			sprintf(filename, "clip_hist_%d_%d.png", uiY, uiX);
 			DrawHistogram(pulHist, filename);
 
 			if (reset_flag) {
 				printf("Reset clip limit with skewness %.0f and weaker bins %u\n", g_skewness, g_weaker_bins);
-				cv::circle(cv::Mat(uiYRes, uiXRes, CV_8UC1, pImage), grid[uiY][uiX], 16, cv::Scalar(255), 16);
+				cv::circle(cv::Mat(uiYRes, uiXRes, CV_8UC1, pImage), cv::Point(uiXOffset + (uiXSize >> 1),
+					uiYOffset + (uiYSize >> 1)), 16, cv::Scalar(255), 16);
 			}
 #endif
 #ifdef TEST_CLAHE
@@ -558,6 +774,7 @@ int CLAHEq (kz_pixel_t* pImage, unsigned int uiXRes, unsigned int uiYRes,
 			start = clock();
 #endif
 			MapHistogram(pulHist, Min, Max, uiNrBins, ulNrPixels);
+			StoreMapping(&pMapArray[uiNrBins * (uiY * uiNrX + uiX)], pulHist, uiNrBins);
 #ifdef TEST_HIST
 			sprintf(filename, "map_hist%d_%d.png", uiY, uiX);
 			DrawHistogram(pulHist, filename);
@@ -567,7 +784,6 @@ int CLAHEq (kz_pixel_t* pImage, unsigned int uiXRes, unsigned int uiYRes,
 			total[2] += (finish - start);
 #endif
 		}
-		pImPointer += (uiYSize - 1) * uiXRes;             /* skip lines, set pointer */
 	}
 	
 #ifdef TEST_CLAHE
@@ -577,57 +793,123 @@ int CLAHEq (kz_pixel_t* pImage, unsigned int uiXRes, unsigned int uiYRes,
 	start = clock();
 #endif
 
-	/* Interpolate greylevel mappings to get CLAHE image */
-	for (pImPointer = pImage, uiY = 0; uiY <= uiNrY; uiY++) {
-		if (uiY == 0) {                                   /* special case: top row */
-			uiSubY = uiYSize >> 1;
-			uiYU = 0;
-			uiYB = 0;
-		} else {
-			if (uiY == uiNrY) {                           /* special case: bottom row */
-				uiSubY = uiYSize >> 1;
-				uiYU = uiNrY-1;
-				uiYB = uiYU;
-			} else {                                      /* default values */
-				uiSubY = uiYSize;
-				uiYU = uiY - 1;
-				uiYB = uiYU + 1;
-			}
-		}
-		for (uiX = 0; uiX <= uiNrX; uiX++) {
-			if (uiX == 0) {                               /* special case: left column */
-				uiSubX = uiXSize >> 1;
-				uiXL = 0;
-				uiXR = 0;
-			} else {
-				if (uiX == uiNrX) {                       /* special case: right column */
-					uiSubX = uiXSize >> 1;
-					uiXL = uiNrX - 1;
-					uiXR = uiXL;
-				} else {                                  /* default values */
-					uiSubX = uiXSize;
-					uiXL = uiX - 1;
-					uiXR = uiXL + 1;
-				}
-			}
+	/* Interpolate greylevel mappings to get CLAHE image, after all mappings
+	 * are done since interpolation writes the image in place */
+	const unsigned int uiNrBlocks = (uiNrX + 1) * (uiNrY + 1);
+	if (pool) pool->parallel_for(0, uiNrBlocks, uiNrBlocks, InterpolateBlocks, &task);
+	else InterpolateBlocks(0, uiNrBlocks, 0, &task);
+#ifdef TEST_CLAHE
+	finish = clock();
+	printf("Interpolate %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
+#endif
+	free(pMapArray);                                      /* free space for mappings */
+	free(pusWeight);
+	return 0;                                             /* return status OK */
+}
+/*   pImage - Pointer to the input/output image
+ *   uiXRes, uiYRes, Min, Max, uiNrX, uiNrY, uiNrBins, fCliplimit - As CLAHEq
+ *   fBlend - Weight of the previous mappings in [0, 1), larger values flicker less
+ *   pState - Mappings kept between frames, zeroed before the first frame
+ *   pool - Worker pool, regions run on it when not null.
+ *   bAutoClip - As CLAHEq
+ *   Return value - As CLAHEq
+ *
+ * Temporal CLAHE equalizes a frame with the mappings made from the previous
+ * frames, and makes the histograms of the frame while equalizing it. Each pixel
+ * is read once instead of twice. The first frame, or a frame after the
+ * resolution or the grid changes, is mapped from its own histograms first.
+ */
+int CLAHEqTemporal (kz_pixel_t* pImage, unsigned int uiXRes, unsigned int uiYRes,
+                    kz_pixel_t Min, kz_pixel_t Max, unsigned int uiNrX, unsigned int uiNrY,
+                    unsigned int uiNrBins, float fCliplimit, float fBlend,
+                    clahe_state_t* pState, thread_pool* pool, bool bAutoClip
+)	{
+	kz_pixel_t aLUT[uiNR_OF_GREY];          /* lookup table used for scaling of input image */
+	clahe_task_t task;                     /* parameters of region tasks */
 
-			pulLU = &pulMapArray[uiNrBins * (uiYU * uiNrX + uiXL)];
-			pulRU = &pulMapArray[uiNrBins * (uiYU * uiNrX + uiXR)];
-			pulLB = &pulMapArray[uiNrBins * (uiYB * uiNrX + uiXL)];
-			pulRB = &pulMapArray[uiNrBins * (uiYB * uiNrX + uiXR)];
-#ifdef __ARM_NEON__ 
-			NeonInterpolate(pImPointer,uiXRes,pulLU,pulRU,pulLB,pulRB,uiSubX,uiSubY,aLUT);
-#else
-			Interpolate(pImPointer,uiXRes,pulLU,pulRU,pulLB,pulRB,uiSubX,uiSubY,aLUT);
+	if (uiNrX > uiXRes) return -1;    /* # of regions x-direction too large */
+	if (uiNrY > uiYRes) return -2;    /* # of regions y-direction too large */
+#ifndef BYTE_IMAGE					  /* #TPB FIX */
+	if (Max >= uiNR_OF_GREY) return -5;    /* maximum too large */
 #endif
-			pImPointer += uiSubX;                         /* set pointer on next matrix */
+	if (Min >= Max) return -6;            /* minimum equal or larger than maximum */
+	if (uiNrX < 2 || uiNrY < 2) return -7;/* at least 4 contextual regions required */
+	if (fCliplimit == 1.0) return 0;      /* is OK, immediately returns original image. */
+	if (uiNrBins == 0) uiNrBins = 128;    /* default value when not specified */
+	if (uiNrBins > uiNR_OF_GREY) return -9;/* more bins than greylevels */
+	if (uiNrBins <= Max) return -9;       /* greylevels index the histograms directly */
+
+	if (pState->pMapArray == 0 || pState->uiXRes != uiXRes || pState->uiYRes != uiYRes ||
+		pState->uiNrX != uiNrX || pState->uiNrY != uiNrY || pState->uiNrBins != uiNrBins) {
+		CLAHEqRelease(pState);
+		pState->pMapArray = (kz_pixel_t *)malloc(sizeof(kz_pixel_t)*uiNrX*uiNrY*uiNrBins);
+		pState->pulHistArray = (unsigned long *)malloc(sizeof(unsigned long)*uiNrX*uiNrY*uiNrBins);
+		pState->pusWeight = (unsigned short *)malloc(sizeof(unsigned short)*(uiXRes+uiYRes));
+		if (pState->pMapArray == 0 || pState->pulHistArray == 0 || pState->pusWeight == 0) {
+			CLAHEqRelease(pState);
+			return -8;                        /* Not enough memory! (try reducing uiNrBins) */
 		}
-		pImPointer += (uiSubY - 1) * uiXRes;
+		pState->uiXRes = uiXRes;
+		pState->uiYRes = uiYRes;
+		pState->uiNrX = uiNrX;
+		pState->uiNrY = uiNrY;
+		pState->uiNrBins = uiNrBins;
+		MakeWeights(uiNrX, uiXRes, pState->pusWeight);
+		MakeWeights(uiNrY, uiYRes, pState->pusWeight + uiXRes);
+		fBlend = -1;                          /* no previous mappings yet */
 	}
-#ifdef TEST_CLAHE
-	finish = clock();
-	printf("Interpolate %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
+
+	task.pImage = pImage;
+	task.uiXRes = uiXRes;
+	task.uiYRes = uiYRes;
+	task.uiNrX = uiNrX;
+	task.uiNrY = uiNrY;
+	task.Min = Min;
+	task.Max = Max;
+	task.uiNrBins = uiNrBins;
+	task.fCliplimit = fCliplimit;
+	task.bAutoClip = bAutoClip;
+	task.pMapArray = pState->pMapArray;
+	task.pusXWeight = pState->pusWeight;
+	task.pusYWeight = pState->pusWeight + uiXRes;
+	task.pulHistArray = pState->pulHistArray;
+	task.uiBlend = fBlend <= 0 ? 0 : (fBlend >= 1 ? 255 : (unsigned int)(fBlend * 256));
+	task.pLUT = aLUT;
+#ifdef TEST_HIST
+	pool = 0;                             /* debug output needs serial regions */
 #endif
-	free(pulMapArray);                                    /* free space for histograms */
+
+	const unsigned int uiNrRegions = uiNrX * uiNrY;
+	if (fBlend < 0) {                     /* map the first frame from its own histograms */
+		if (pool) pool->parallel_for(0, uiNrRegions, uiNrRegions, MapRegions, &task);
+		else MapRegions(0, uiNrRegions, 0, &task);
+	}
+
+	/* Equalize with the current mappings, then update them once no region
+	 * reads them any more */
+	if (pool) {
+		pool->parallel_for(0, uiNrRegions, uiNrRegions, TemporalRegions, &task);
+		pool->parallel_for(0, uiNrRegions, uiNrRegions, UpdateRegions, &task);
+	} else {
+		TemporalRegions(0, uiNrRegions, 0, &task);
+		UpdateRegions(0, uiNrRegions, 0, &task);
+	}
 	return 0;                                             /* return status OK */
-}
\ No newline at end of file
+}
+
+/* Frees the mappings of temporal CLAHE. */
+void CLAHEqRelease (clahe_state_t* pState)
+{
+	if (pState->pMapArray) {
+		free(pState->pMapArray);
+		pState->pMapArray = 0;
+	}
+	if (pState->pulHistArray) {
+		free(pState->pulHistArray);
+		pState->pulHistArray = 0;
+	}
+	if (pState->pusWeight) {
+		free(pState->pusWeight);
+		pState->pusWeight = 0;
+	}
+}
@@ -11,9 +11,30 @@ typedef unsigned short kz_pixel_t;	 /* for 12 bit-per-pixel images (default) */
 # define uiNR_OF_GREY (4096)
 #endif
 
+class thread_pool;
+
 /******** Prototype of CLAHE function. Put this in a separate include file. *****/
 int CLAHEq(kz_pixel_t* pImage, unsigned int uiXRes, unsigned int uiYRes, kz_pixel_t Min,
            kz_pixel_t Max, unsigned int uiNrX, unsigned int uiNrY,
-           unsigned int uiNrBins, float fCliplimit);
+           unsigned int uiNrBins, float fCliplimit, thread_pool* pool = 0,
+           bool bAutoClip = false);
+
+/* State of temporal CLAHE: greylevel mappings of the previous frame and the
+ * histograms of the current frame. Zero it before the first frame. */
+typedef struct {
+	unsigned int uiXRes, uiYRes;      /* image resolution */
+	unsigned int uiNrX, uiNrY;        /* number of contextual regions */
+	unsigned int uiNrBins;            /* number of histogram bins */
+	kz_pixel_t* pMapArray;            /* mappings applied to the next frame */
+	unsigned long* pulHistArray;      /* histograms of the current frame */
+	unsigned short* pusWeight;        /* Q8 interpolation weights of columns and rows */
+} clahe_state_t;
+
+int CLAHEqTemporal(kz_pixel_t* pImage, unsigned int uiXRes, unsigned int uiYRes, kz_pixel_t Min,
+           kz_pixel_t Max, unsigned int uiNrX, unsigned int uiNrY,
+           unsigned int uiNrBins, float fCliplimit, float fBlend,
+           clahe_state_t* pState, thread_pool* pool = 0, bool bAutoClip = false);
+
+void CLAHEqRelease(clahe_state_t* pState);
 		   
 #endif
@@ -1,7 +1,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
-#ifdef __linux__
+#ifdef __ARM_NEON__
 #include <arm_neon.h>
 #endif
 #include "pthread.h"
@@ -97,9 +97,7 @@ void neon_channel_split(
 	assert(red_image);
 	assert(green_image);
 	assert(blue_image);
-#ifdef _WIN32
-	channel_split(bgr_image, width, height, red_image, green_image, blue_image);
-#elif __linux__
+#ifdef __ARM_NEON__
 	printf("use neon.\n");
 	const int32_t npixels_per_loop = 8;
 	for (int32_t y = 0; y < height; y++) {
@@ -115,7 +113,7 @@ void neon_channel_split(
 		}
 	}
 #else
-#	error "Unknown compiler"
+	channel_split(bgr_image, width, height, red_image, green_image, blue_image);
 #endif
 }
 
@@ -4,7 +4,14 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <cmath>
 #include <cassert>
+#include <algorithm>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -23,71 +30,376 @@ void linear_resample(
 	
 	const int32_t rs_width = static_cast<int32_t>(scale * width);
 	const int32_t rs_height = static_cast<int32_t>(scale * height);
-	const int32_t rss_width = static_cast<int32_t>(scale * (width - 1));
-	const int32_t rss_height = static_cast<int32_t>(scale * (height - 1));
 	
+	// Source positions past the last row and column are clamped, so every
+	// output pixel is written.
 	#pragma omp parallel for
-	for (int32_t y = 0; y < rss_height; y++) {
-		float yy = y / scale;
+	for (int32_t y = 0; y < rs_height; y++) {
+		float yy = std::min(y / scale, static_cast<float>(height - 1));
 		int32_t y1 = static_cast<int32_t>(yy);
-		int32_t y2 = y1 + 1;
-		for (int32_t x = 0; x < rss_width; x++) {
-			float xx = x / scale;
+		int32_t y2 = std::min(y1 + 1, height - 1);
+		float fy = yy - y1;
+		for (int32_t x = 0; x < rs_width; x++) {
+			float xx = std::min(x / scale, static_cast<float>(width - 1));
 			int32_t x1 = static_cast<int32_t>(xx);
-			int32_t x2 = x1 + 1;
+			int32_t x2 = std::min(x1 + 1, width - 1);
+			float fx = xx - x1;
 
 			T tlc_value = raw_image[y1 * width + x1];
 			T trc_value = raw_image[y1 * width + x2];
 			T llc_value = raw_image[y2 * width + x1];
 			T lrc_value = raw_image[y2 * width + x2];
 			
-			float inter1 = (xx - x1) * tlc_value + (x2 - xx) * trc_value;
-			float inter2 = (xx - x1) * llc_value + (x2 - xx) * lrc_value;
-			float inter3 = (yy - y1) * inter1 + (y2 - yy) * inter2;
+			float inter1 = (1 - fx) * tlc_value + fx * trc_value;
+			float inter2 = (1 - fx) * llc_value + fx * lrc_value;
+			float inter3 = (1 - fy) * inter1 + fy * inter2;
 			processed_image[y * rs_width + x] = (T)inter3;
 		}
 	}
+}
+
+//---------------------------------------------------------
+// Store float row as float.
+//---------------------------------------------------------
+inline void resample_store_row(
+	const float *row,
+	int32_t n,
+	float *dst
+)	{
+	memcpy(dst, row, n * sizeof(float));
+}
+
+//---------------------------------------------------------
+// Store float row as rounded and saturated bytes.
+//---------------------------------------------------------
+inline void resample_store_row(
+	const float *row,
+	int32_t n,
+	uint8_t *dst
+)	{
+	for (int32_t i = 0; i < n; i++) {
+		int32_t val = static_cast<int32_t>(row[i] + 0.5f);
+		dst[i] = static_cast<uint8_t>(std::min(std::max(val, 0), 255));
+	}
+}
+
+//---------------------------------------------------------
+// Store float row as rounded and saturated 16-bit words.
+//---------------------------------------------------------
+inline void resample_store_row(
+	const float *row,
+	int32_t n,
+	uint16_t *dst
+)	{
+	for (int32_t i = 0; i < n; i++) {
+		int32_t val = static_cast<int32_t>(row[i] + 0.5f);
+		dst[i] = static_cast<uint16_t>(std::min(std::max(val, 0), 65535));
+	}
+}
+
+//---------------------------------------------------------
+// Blend two rows, out = row0 + alpha * (row1 - row0).
+//---------------------------------------------------------
+inline void resample_blend_rows(
+	const float *row0,
+	const float *row1,
+	float alpha,
+	int32_t n,
+	float *out
+)	{
+	int32_t i = 0;
+#ifdef __ARM_NEON__
+	const float32x4_t f32x4_alpha = vdupq_n_f32(alpha);
+	for (; i < n - 3; i += 4) {
+		float32x4_t top = vld1q_f32(row0 + i);
+		float32x4_t bot = vld1q_f32(row1 + i);
+		vst1q_f32(out + i, vmlaq_f32(top, vsubq_f32(bot, top), f32x4_alpha));
+	}
+#endif
+	for (; i < n; i++) {
+		out[i] = row0[i] + alpha * (row1[i] - row0[i]);
+	}
+}
+
+/**
+ * Separable bilinear resampler with pixel centers aligned like cv::resize.
+ * The coefficient tables of one source and destination size are made once in
+ * init. Each output row blends two horizontally interpolated source rows, and
+ * a source row is interpolated only once per call. Any band of output rows can
+ * be produced, so the consumer can resample the rows it is about to use
+ * instead of storing the full resolution image.
+ */
+class bilinear_resampler
+{
+public:
+	/**
+	 * Default constructor function.
+	 */
+	bilinear_resampler();
+	/**
+	 * Destructor function.
+	 */
+	~bilinear_resampler();
+	/**
+	 * Make coefficient tables and row buffers.
+	 * @param[in] src_width_ Source width.
+	 * @param[in] src_height_ Source height.
+	 * @param[in] dst_width_ Destination width.
+	 * @param[in] dst_height_ Destination height.
+	 * @param[in] nbuffers_ Number of row buffers, one per concurrent caller.
+	 * @return void.
+	 */
+	void init(
+		int32_t src_width_,
+		int32_t src_height_,
+		int32_t dst_width_,
+		int32_t dst_height_,
+		int32_t nbuffers_
+	);
+	/**
+	 * Resample destination rows [row_begin, row_end). Float destination keeps
+	 * the value, integer destination is rounded and saturated.
+	 * @param[in] src Source image.
+	 * @param[in] row_begin First destination row.
+	 * @param[in] row_end One past the last destination row.
+	 * @param[in] buffer Row buffer index, callers running at the same time
+	 *            must use different buffers.
+	 * @param[out] dst Destination of row row_begin.
+	 * @return void.
+	 */
+	template <typename S, typename D>
+	void resample(
+		const S *src,
+		int32_t row_begin,
+		int32_t row_end,
+		int32_t buffer,
+		D *dst
+	);
+private:
+	/**
+	 * Make index and weight table of one axis.
+	 * @return void.
+	 */
+	static void make_table(
+		int32_t src_size,
+		int32_t dst_size,
+		int32_t *ofs,
+		float *alpha
+	);
+	/**
+	 * Interpolate one source row horizontally.
+	 * @return void.
+	 */
+	template <typename S>
+	void resample_row(
+		const S *src_row,
+		float *out
+	);
+	/**
+	 * Free tables and row buffers.
+	 * @return void.
+	 */
+	void release();
+private:
+	int32_t src_width;		// Source width.
+	int32_t src_height;		// Source height.
+	int32_t dst_width;		// Destination width.
+	int32_t dst_height;		// Destination height.
+	int32_t nbuffers;		// Number of row buffers.
+	int32_t *xofs;			// Left and right source column of every destination column.
+	float *xalpha;			// Weight of the right source column.
+	int32_t *yofs;			// Upper and lower source row of every destination row.
+	float *yalpha;			// Weight of the lower source row.
+	float *row_buffer;		// Three rows per buffer: upper, lower and blended.
+};
+
+//---------------------------------------------------------
+// Default constructor function of class bilinear_resampler.
+//---------------------------------------------------------
+inline bilinear_resampler::bilinear_resampler()
+{
+	src_width = 0;
+	src_height = 0;
+	dst_width = 0;
+	dst_height = 0;
+	nbuffers = 0;
+	xofs = 0;
+	xalpha = 0;
+	yofs = 0;
+	yalpha = 0;
+	row_buffer = 0;
+}
+
+//---------------------------------------------------------
+// Destructor function of class bilinear_resampler.
+//---------------------------------------------------------
+inline bilinear_resampler::~bilinear_resampler()
+{
+	release();
+}
+
+//---------------------------------------------------------
+// Make coefficient tables and row buffers.
+//---------------------------------------------------------
+inline void bilinear_resampler::init(
+	int32_t src_width_,
+	int32_t src_height_,
+	int32_t dst_width_,
+	int32_t dst_height_,
+	int32_t nbuffers_
+)	{
+	assert(src_width_ > 0);
+	assert(src_height_ > 0);
+	assert(dst_width_ > 0);
+	assert(dst_height_ > 0);
+	assert(nbuffers_ > 0);
+	
+	release();
+	src_width = src_width_;
+	src_height = src_height_;
+	dst_width = dst_width_;
+	dst_height = dst_height_;
+	nbuffers = nbuffers_;
+	
+	xofs = new int32_t[2 * dst_width];
+	assert(xofs);
 	
-	for (int32_t y = 0; y < rs_height - rss_height; y++) {
-		for (int32_t x = rss_width; x < rs_width; x++) {
-			processed_image[y * rs_width + x] = raw_image[width - 1];
+	xalpha = new float[dst_width];
+	assert(xalpha);
+	
+	yofs = new int32_t[2 * dst_height];
+	assert(yofs);
+	
+	yalpha = new float[dst_height];
+	assert(yalpha);
+	
+	row_buffer = new float[3 * nbuffers * dst_width];
+	assert(row_buffer);
+	
+	make_table(src_width, dst_width, xofs, xalpha);
+	make_table(src_height, dst_height, yofs, yalpha);
+}
+
+//---------------------------------------------------------
+// Resample destination rows.
+//---------------------------------------------------------
+template <typename S, typename D>
+void bilinear_resampler::resample(
+	const S *src,
+	int32_t row_begin,
+	int32_t row_end,
+	int32_t buffer,
+	D *dst
+)	{
+	assert(src);
+	assert(dst);
+	assert(row_begin >= 0 && row_end <= dst_height);
+	assert(buffer >= 0 && buffer < nbuffers);
+	
+	float *rows[2] = {row_buffer + 3 * buffer * dst_width, row_buffer + (3 * buffer + 1) * dst_width};
+	float *blend = row_buffer + (3 * buffer + 2) * dst_width;
+	int32_t cached[2] = {-1, -1};
+	
+	for (int32_t y = row_begin; y < row_end; y++) {
+		const int32_t y0 = yofs[2 * y];
+		const int32_t y1 = yofs[2 * y + 1];
+		
+		// Reuse the source rows of the previous output row.
+		if (y0 != cached[0]) {
+			if (y0 == cached[1]) {
+				std::swap(rows[0], rows[1]);
+				std::swap(cached[0], cached[1]);
+			} else {
+				resample_row(src + y0 * src_width, rows[0]);
+				cached[0] = y0;
+			}
+		}
+		
+		if (y1 != cached[1]) {
+			resample_row(src + y1 * src_width, rows[1]);
+			cached[1] = y1;
 		}
+		
+		resample_blend_rows(rows[0], rows[1], yalpha[y], dst_width, blend);
+		resample_store_row(blend, dst_width, dst);
+		dst += dst_width;
 	}
-	
-	for (int32_t y = rss_height; y < rs_height; y++) {
-		for (int32_t x = 0; x < rs_width - rss_width; x++) {
-			processed_image[y * rs_width + x] = raw_image[(height - 1) * width];
+}
+
+//---------------------------------------------------------
+// Make index and weight table of one axis.
+//---------------------------------------------------------
+inline void bilinear_resampler::make_table(
+	int32_t src_size,
+	int32_t dst_size,
+	int32_t *ofs,
+	float *alpha
+)	{
+	const float scale = static_cast<float>(src_size) / dst_size;
+	for (int32_t i = 0; i < dst_size; i++) {
+		const float s = (i + 0.5f) * scale - 0.5f;
+		int32_t s0 = static_cast<int32_t>(floorf(s));
+		float a = s - s0;
+		if (s0 < 0) {
+			s0 = 0;
+			a = 0;
+		}
+		
+		if (s0 >= src_size - 1) {
+			s0 = src_size - 1;
+			a = 0;
 		}
+		
+		// Both neighbours are stored, border samples repeat.
+		ofs[2 * i] = s0;
+		ofs[2 * i + 1] = std::min(s0 + 1, src_size - 1);
+		alpha[i] = a;
+	}
+}
+
+//---------------------------------------------------------
+// Interpolate one source row horizontally.
+//---------------------------------------------------------
+template <typename S>
+void bilinear_resampler::resample_row(
+	const S *src_row,
+	float *out
+)	{
+	for (int32_t x = 0; x < dst_width; x++) {
+		const float left = src_row[xofs[2 * x]];
+		const float right = src_row[xofs[2 * x + 1]];
+		out[x] = left + xalpha[x] * (right - left);
+	}
+}
+
+//---------------------------------------------------------
+// Free tables and row buffers.
+//---------------------------------------------------------
+inline void bilinear_resampler::release()
+{
+	if (xofs) {
+		delete [] xofs;
+		xofs = 0;
 	}
 	
-	for (int32_t y = rss_height; y < rs_height; y++) {
-		for (int32_t x = rss_width; x < rs_width; x++) {
-			processed_image[y * rs_width + x] = raw_image[(height - 1) * width + width - 1];
-		}
+	if (xalpha) {
+		delete [] xalpha;
+		xalpha = 0;
 	}
 	
-	for (int32_t y = rs_height - rss_height; y < rss_height; y++) {
-		float yy = y / scale;
-		int32_t y1 = static_cast<int32_t>(yy);
-		int32_t y2 = y1 + 1;
-		for (int32_t x = rss_width; x < rs_width; x++) {
-			T top_value = raw_image[y1 * width + width - 1];
-			T bottom_value = raw_image[y2 * width + width - 1];
-			float inter = (yy - y1) * top_value + (y2 - yy) * bottom_value;
-			processed_image[y * rs_width + x] = (T)inter;
-		}
+	if (yofs) {
+		delete [] yofs;
+		yofs = 0;
 	}
 	
-	for (int32_t y = rss_height; y < rs_height; y++) {
-		for (int32_t x = rs_width - rss_width; x < rss_width; x++) {
-			float xx = x / scale;
-			int32_t x1 = static_cast<int32_t>(xx);
-			int32_t x2 = x1 + 1;
-			T left_value = raw_image[(height - 1) * width + x1];
-			T right_value = raw_image[(height - 1) * width + x2];
-			float inter = (xx - x1) * left_value + (x2 - xx) * right_value;
-			processed_image[y * rs_width + x] = (T)inter;
-		}
+	if (yalpha) {
+		delete [] yalpha;
+		yalpha = 0;
+	}
+	
+	if (row_buffer) {
+		delete [] row_buffer;
+		row_buffer = 0;
 	}
 }
 
@@ -0,0 +1,148 @@
+#ifndef _LUT_CHAIN_H_
+#define _LUT_CHAIN_H_
+
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+/**
+ * Composition of pointwise gray level transformations into one 256 entry
+ * table. Every appended stage maps the output of the previous stages, so a
+ * chain of full image passes becomes a single table lookup. The chain is made
+ * when the parameters change, not per frame.
+ */
+class lut_chain
+{
+public:
+	/**
+	 * Default constructor function, the chain starts as identity.
+	 */
+	lut_chain();
+	/**
+	 * Reset the chain to identity.
+	 * @return void.
+	 */
+	void reset();
+	/**
+	 * Append clipping of gray level to [minv, maxv].
+	 * @param[in] minv Floor.
+	 * @param[in] maxv Ceiling.
+	 * @return void.
+	 */
+	void clip(
+		uint8_t minv,
+		uint8_t maxv
+	);
+	/**
+	 * Append segmented linear transformation with the Q4 fixed point 16-bit
+	 * arithmetic of seg_linar_transf, so the table matches it exactly.
+	 * @param[in] low_in Low input knee.
+	 * @param[in] low_out Low output knee.
+	 * @param[in] hig_in High input knee.
+	 * @param[in] hig_out High output knee.
+	 * @return void.
+	 */
+	void seg_linear(
+		uint8_t low_in,
+		uint8_t low_out,
+		uint8_t hig_in,
+		uint8_t hig_out
+	);
+	/**
+	 * Append any pointwise transformation given as a table.
+	 * @param[in] stage Table of 256 entries.
+	 * @return void.
+	 */
+	void append(
+		const uint8_t stage[256]
+	);
+	/**
+	 * Get the composed table.
+	 * @return Table of 256 entries.
+	 */
+	const uint8_t *data() const;
+private:
+	uint8_t table[256];		// Composed table.
+};
+
+//---------------------------------------------------------
+// Default constructor function of class lut_chain.
+//---------------------------------------------------------
+inline lut_chain::lut_chain()
+{
+	reset();
+}
+
+//---------------------------------------------------------
+// Reset the chain to identity.
+//---------------------------------------------------------
+inline void lut_chain::reset()
+{
+	for (int32_t i = 0; i < 256; i++) {
+		table[i] = i;
+	}
+}
+
+//---------------------------------------------------------
+// Append gray level clipping.
+//---------------------------------------------------------
+inline void lut_chain::clip(
+	uint8_t minv,
+	uint8_t maxv
+)	{
+	for (int32_t i = 0; i < 256; i++) {
+		table[i] = std::min(std::max(table[i], minv), maxv);
+	}
+}
+
+//---------------------------------------------------------
+// Append segmented linear transformation.
+//---------------------------------------------------------
+inline void lut_chain::seg_linear(
+	uint8_t low_in,
+	uint8_t low_out,
+	uint8_t hig_in,
+	uint8_t hig_out
+)	{
+	assert(low_in > 0 && low_in < hig_in && hig_in < 255);
+	const int16_t scale[3] = {
+		(int16_t)((low_out << 4) / low_in),
+		(int16_t)(((hig_out - low_out) << 4) / (hig_in - low_in)),
+		(int16_t)(((255 - hig_out) << 4) / (255 - hig_in))
+	};
+	const int16_t bias[3] = {
+		0,
+		(int16_t)((low_out << 4) - scale[1] * low_in),
+		(int16_t)((hig_out << 4) - scale[2] * hig_in)
+	};
+	for (int32_t i = 0; i < 256; i++) {
+		const int32_t s = table[i] < low_in ? 0 : (table[i] < hig_in ? 1 : 2);
+		const int16_t prod = (int16_t)(scale[s] * table[i]);
+		const int16_t sum = (int16_t)(prod + bias[s]);
+		const int32_t val = sum >> 4;
+		table[i] = val < 0 ? 0 : (val > 255 ? 255 : val);
+	}
+}
+
+//---------------------------------------------------------
+// Append pointwise transformation table.
+//---------------------------------------------------------
+inline void lut_chain::append(
+	const uint8_t stage[256]
+)	{
+	assert(stage);
+	for (int32_t i = 0; i < 256; i++) {
+		table[i] = stage[table[i]];
+	}
+}
+
+//---------------------------------------------------------
+// Get the composed table.
+//---------------------------------------------------------
+inline const uint8_t *lut_chain::data() const
+{
+	return table;
+}
+
+#endif
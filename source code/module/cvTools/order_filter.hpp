@@ -7,356 +7,259 @@
 #include <cstdint>
 #include <ctime>
 #include <cassert>
-#include <deque>
+#include <algorithm>
 #include <limits>
 
-#ifdef _OPENMP
-#include <omp.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
 #endif
 
+/**
+ * \struct min_filter_op
+ * \brief Row wise minimum operation of the order filter.
+ */
 template <typename T>
-void min_filter(
-	T *raw_image,
-	int32_t width,
-	int32_t height,
-	int32_t ksize,
-	T *processed_image
-)	{
-	assert(raw_image);
-	assert(processed_image);
-	
-	T *cache_image = new T[width * height];
-	assert(cache_image);
-
-	// Row minimum filter for central region.
-	const int32_t kradii = ksize / 2;
-	#pragma omp parallel for
-	for (int32_t y = 0; y < height; y++) {
-		std::deque<int32_t> L;
-		T *data = raw_image + y * width;
-		T *todata = cache_image + y * width + kradii;
-		for (int32_t x = 1; x < width; x++) {
-			if (x >= ksize) {
-				todata[x - ksize] = data[L.size() > 0 ? L.front() : x - 1];
-			}
-			if (data[x] > data[x - 1]) {
-				L.push_back(x - 1);
-				if (x == ksize + L.front()) {
-					L.pop_front();
-				}
-			} else {
-				while (L.size() > 0) {
-					if (data[x] >= data[L.back()]) {
-						if (x == ksize + L.front()) {
-							L.pop_front();
-						}
-						break;
-					}
-					L.pop_back();
-				}
-			}
+struct min_filter_op
+{
+	static T identity() {return (std::numeric_limits<T>::max)();}
+	static void apply(const T *a, const T *b, T *dst, int32_t n) {
+		for (int32_t i = 0; i < n; i++) {
+			dst[i] = std::min(a[i], b[i]);
 		}
-		todata[width - ksize] = data[L.size() > 0 ? L.front() : width - 1];
 	}
+};
 
-	// Column minimum filter for central region.
-	#pragma omp parallel for
-	for (int32_t x = 0; x < width; x++) {
-		std::deque<int32_t> L;
-		T *data = cache_image;
-		T *todata = processed_image + kradii * width;
-		for (int32_t y = 1; y < height; y++) {
-			if (y >= ksize) {
-				todata[(y - ksize) * width + x] = data[L.size() > 0 ? L.front() : ((y - 1) * width + x)];
-			}
-			if (data[y * width + x] > data[(y - 1) * width + x]) {
-				L.push_back((y - 1) * width + x);
-				if (y * width + x == ksize * width + L.front()) {
-					L.pop_front();
-				}
-			} else {
-				while (L.size() > 0) {
-					if (data[y * width + x] >= data[L.back()]) {
-						if (y * width + x == ksize * width + L.front()) {
-							L.pop_front();
-						}
-						break;
-					}
-					L.pop_back();
-				}
-			}
+/**
+ * \struct max_filter_op
+ * \brief Row wise maximum operation of the order filter.
+ */
+template <typename T>
+struct max_filter_op
+{
+	static T identity() {return (std::numeric_limits<T>::min)();}
+	static void apply(const T *a, const T *b, T *dst, int32_t n) {
+		for (int32_t i = 0; i < n; i++) {
+			dst[i] = std::max(a[i], b[i]);
 		}
-		todata[(height - ksize) * width + x] = data[L.size() > 0 ? L.front() : ((height - 1) * width + x)];
 	}
-	
-	for (int32_t y = 0; y < kradii; y++) {
-		// Top left region.
-		for (int32_t x = 0; x < kradii; x++) {
-			T min_val = (std::numeric_limits<T>::max)();
-			for (int32_t ky = 0; ky < y + kradii; ky++) {
-				for (int32_t kx = 0; kx < x + kradii; kx++) {
-					min_val = std::min(min_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = min_val;
+};
+
+template <>
+struct max_filter_op<float>
+{
+	static float identity() {return -(std::numeric_limits<float>::max)();}
+	static void apply(const float *a, const float *b, float *dst, int32_t n) {
+		int32_t i = 0;
+#ifdef __ARM_NEON__
+		for (; i < n - 3; i += 4) {
+			vst1q_f32(dst + i, vmaxq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
 		}
-		// Top right region.
-		for (int32_t x = width - kradii; x < width; x++) {
-			T min_val = (std::numeric_limits<T>::max)();
-			for (int32_t ky = 0; ky < y + kradii; ky++) {
-				for (int32_t kx = x - kradii; kx < width; kx++) {
-					min_val = std::min(min_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = min_val;
+#endif
+		for (; i < n; i++) {
+			dst[i] = std::max(a[i], b[i]);
 		}
 	}
-	
-	for (int32_t y = height - kradii; y < height; y++) {
-		// Lower left region.
-		for (int32_t x = 0; x < kradii; x++) {
-			T min_val = (std::numeric_limits<T>::max)();
-			for (int32_t ky = y - kradii; ky < height; ky++) {
-				for (int32_t kx = 0; kx < x + kradii; kx++) {
-					min_val = std::min(min_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = min_val;
+};
+
+#ifdef __ARM_NEON__
+template <>
+struct min_filter_op<uint8_t>
+{
+	static uint8_t identity() {return 255;}
+	static void apply(const uint8_t *a, const uint8_t *b, uint8_t *dst, int32_t n) {
+		int32_t i = 0;
+		for (; i < n - 15; i += 16) {
+			vst1q_u8(dst + i, vminq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
 		}
-		// Lower right region.
-		for (int32_t x = width - kradii; x < width; x++) {
-			T min_val = (std::numeric_limits<T>::max)();
-			for (int32_t ky = y - kradii; ky < height; ky++) {
-				for (int32_t kx = x - kradii; kx < width; kx++) {
-					min_val = std::min(min_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = min_val;
+		for (; i < n; i++) {
+			dst[i] = std::min(a[i], b[i]);
 		}
 	}
-	
-	for (int32_t x = kradii; x < width - kradii; x++) {
-		// Top central region.
-		for (int32_t y = 0; y < kradii; y++) {
-			T min_val = (std::numeric_limits<T>::max)();
-			for (int32_t ky = 0; ky < y + kradii; ky++) {
-				for (int32_t kx = x - kradii; kx < x + kradii; kx++) {
-					min_val = std::min(min_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = min_val;
+};
+
+template <>
+struct max_filter_op<uint8_t>
+{
+	static uint8_t identity() {return 0;}
+	static void apply(const uint8_t *a, const uint8_t *b, uint8_t *dst, int32_t n) {
+		int32_t i = 0;
+		for (; i < n - 15; i += 16) {
+			vst1q_u8(dst + i, vmaxq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
 		}
-		// Lower central region.
-		for (int32_t y = height - kradii; y < height; y++) {
-			T min_val = (std::numeric_limits<T>::max)();
-			for (int32_t ky = y - kradii; ky < height; ky++) {
-				for (int32_t kx = x - kradii; kx < x + kradii; kx++) {
-					min_val = std::min(min_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = min_val;
+		for (; i < n; i++) {
+			dst[i] = std::max(a[i], b[i]);
 		}
 	}
-	
-	for (int32_t y = kradii; y < height - kradii; y++) {
-		// Left central region.
-		for (int32_t x = 0; x < kradii; x++) {
-			T min_val = (std::numeric_limits<T>::max)();
-			for (int32_t ky = y - kradii; ky < y + kradii; ky++) {
-				for (int32_t kx = 0; kx < x + kradii; kx++) {
-					min_val = std::min(min_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = min_val;
+};
+
+template <>
+struct min_filter_op<float>
+{
+	static float identity() {return (std::numeric_limits<float>::max)();}
+	static void apply(const float *a, const float *b, float *dst, int32_t n) {
+		int32_t i = 0;
+		for (; i < n - 3; i += 4) {
+			vst1q_f32(dst + i, vminq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
 		}
-		// Right central region.
-		for (int32_t x = width - kradii; x < width; x++) {
-			T min_val = (std::numeric_limits<T>::max)();
-			for (int32_t ky = y - kradii; ky < y + kradii; ky++) {
-				for (int32_t kx = width - kradii; kx < width; kx++) {
-					min_val = std::min(min_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = min_val;
+		for (; i < n; i++) {
+			dst[i] = std::min(a[i], b[i]);
 		}
 	}
+};
+#endif
 
-	if (cache_image) {
-		delete [] cache_image;
-		cache_image = 0;
+/**
+ * Tiled transpose of a matrix.
+ * @param[in] src Source matrix.
+ * @param[in] width Source width.
+ * @param[in] height Source height.
+ * @param[out] dst Destination matrix, height columns and width rows.
+ * @return void.
+ */
+template <typename T>
+void order_filter_transpose(
+	const T *src,
+	int32_t width,
+	int32_t height,
+	T *dst
+)	{
+	const int32_t tile = 32;
+	for (int32_t y0 = 0; y0 < height; y0 += tile) {
+		const int32_t y1 = std::min(y0 + tile, height);
+		for (int32_t x0 = 0; x0 < width; x0 += tile) {
+			const int32_t x1 = std::min(x0 + tile, width);
+			for (int32_t x = x0; x < x1; x++) {
+				T *todata = dst + x * height;
+				for (int32_t y = y0; y < y1; y++) {
+					todata[y] = src[y * width + x];
+				}
+			}
+		}
 	}
 }
 
-template <typename T>
-void max_filter(
-	T *raw_image,
+/**
+ * Van Herk/Gil-Werman vertical order filter. The image is padded with ksize / 2
+ * identity rows at both ends and cut into blocks of ksize rows. For each block
+ * the suffix and the prefix of the next block are computed, every output row
+ * is one more operation of them, so three operations per pixel are spent
+ * whatever the kernel size is. All operations act on whole rows.
+ * @param[in] raw_image Input image.
+ * @param[in] width Image width.
+ * @param[in] height Image height.
+ * @param[in] ksize Kernel size, should be odd.
+ * @param[in] cache Cache buffer, size of (2 * ksize + 1) * width.
+ * @param[out] processed_image Output image.
+ * @return void.
+ */
+template <typename T, typename Op>
+void order_filter_vertical(
+	const T *raw_image,
 	int32_t width,
 	int32_t height,
 	int32_t ksize,
+	T *cache,
 	T *processed_image
 )	{
-	assert(raw_image);
-	assert(processed_image);
-	
-	T *cache_image = new T[width * height];
-	assert(cache_image);
-	
-	// Row maximum filter for central region.
 	const int32_t kradii = ksize / 2;
-	for (int32_t y = 0; y < height; y++) {
-		std::deque<int32_t> U;
-		T *data = raw_image + y * width;
-		T *todata = cache_image + y * width + kradii;
-		for (int32_t x = 1; x < width; x++) {
-			if (x >= ksize) {
-				todata[x - ksize] = data[U.size() > 0 ? U.front() : x - 1];
-			}
-			if (data[x] > data[x - 1]) {
-				while (U.size() > 0) {
-					if (data[x] <= data[U.back()]) {
-						if (x == ksize + U.front()) {
-							U.pop_front();
-						}
-						break;
-					}
-					U.pop_back();
-				}
-			} else {
-				U.push_back(x - 1);
-				if (x == ksize + U.front()) {
-					U.pop_front();
-				}
-			}
-		}
-		todata[width - ksize] = data[U.size() > 0 ? U.front() : width - 1];
-	}
-	
-	// Column maximum filter for central region.
+	T *suffix = cache;
+	T *prefix = cache + ksize * width;
+	T *identity = cache + 2 * ksize * width;
 	for (int32_t x = 0; x < width; x++) {
-		std::deque<int32_t> U;
-		std::deque<int32_t> L;
-		T *data = cache_image;
-		T *todata = processed_image + kradii * width;
-		for (int32_t y = 1; y < height; y++) {
-			if (y >= ksize) {
-				todata[(y - ksize) * width + x] = data[U.size() > 0 ? U.front() : ((y - 1) * width + x)];
-			}
-			if (data[y * width + x] > data[(y - 1) * width + x]) {
-				while (U.size() > 0) {
-					if (data[y * width + x] <= data[U.back()]) {
-						if (y * width + x == ksize * width + U.front()) {
-							U.pop_front();
-						}
-						break;
-					}
-					U.pop_back();
-				}
-			} else {
-				U.push_back((y - 1) * width + x);
-				if (y * width + x == ksize * width + U.front()) {
-					U.pop_front();
-				}
-			}
-		}
-		todata[(height - ksize) * width + x] = data[U.size() > 0 ? U.front() : ((height - 1) * width + x)];
-	}
-	
-	for (int32_t y = 0; y < kradii; y++) {
-		// Top left region.
-		for (int32_t x = 0; x < kradii; x++) {
-			T max_val = (std::numeric_limits<T>::min)();
-			for (int32_t ky = 0; ky < y + kradii; ky++) {
-				for (int32_t kx = 0; kx < x + kradii; kx++) {
-					max_val = std::max(max_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = max_val;
-		}
-		// Top right region.
-		for (int32_t x = width - kradii; x < width; x++) {
-			T max_val = (std::numeric_limits<T>::min)();
-			for (int32_t ky = 0; ky < y + kradii; ky++) {
-				for (int32_t kx = x - kradii; kx < width; kx++) {
-					max_val = std::max(max_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = max_val;
-		}
+		identity[x] = Op::identity();
 	}
-	
-	for (int32_t y = height - kradii; y < height; y++) {
-		// Lower left region.
-		for (int32_t x = 0; x < kradii; x++) {
-			T max_val = (std::numeric_limits<T>::min)();
-			for (int32_t ky = y - kradii; ky < height; ky++) {
-				for (int32_t kx = 0; kx < x + kradii; kx++) {
-					max_val = std::max(max_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = max_val;
-		}
-		// Lower right region.
-		for (int32_t x = width - kradii; x < width; x++) {
-			T max_val = (std::numeric_limits<T>::min)();
-			for (int32_t ky = y - kradii; ky < height; ky++) {
-				for (int32_t kx = x - kradii; kx < width; kx++) {
-					max_val = std::max(max_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = max_val;
-		}
-	}
-	
-	for (int32_t x = kradii; x < width - kradii; x++) {
-		// Top central region.
-		for (int32_t y = 0; y < kradii; y++) {
-			T max_val = (std::numeric_limits<T>::min)();
-			for (int32_t ky = 0; ky < y + kradii; ky++) {
-				for (int32_t kx = x - kradii; kx < x + kradii; kx++) {
-					max_val = std::max(max_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = max_val;
-		}
-		// Lower central region.
-		for (int32_t y = height - kradii; y < height; y++) {
-			T max_val = (std::numeric_limits<T>::min)();
-			for (int32_t ky = y - kradii; ky < height; ky++) {
-				for (int32_t kx = x - kradii; kx < x + kradii; kx++) {
-					max_val = std::max(max_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = max_val;
+
+	// Row of padded image.
+	#define PADDED_ROW(p) ((p) < kradii || (p) >= height + kradii ? identity : \
+		raw_image + ((p) - kradii) * width)
+
+	for (int32_t b = 0; b < height; b += ksize) {
+		// Suffix of current block.
+		memcpy(suffix + (ksize - 1) * width, PADDED_ROW(b + ksize - 1), width * sizeof(T));
+		for (int32_t i = ksize - 2; i >= 0; i--) {
+			Op::apply(suffix + (i + 1) * width, PADDED_ROW(b + i), suffix + i * width, width);
 		}
-	}
-	
-	for (int32_t y = kradii; y < height - kradii; y++) {
-		// Left central region.
-		for (int32_t x = 0; x < kradii; x++) {
-			T max_val = (std::numeric_limits<T>::min)();
-			for (int32_t ky = y - kradii; ky < y + kradii; ky++) {
-				for (int32_t kx = 0; kx < x + kradii; kx++) {
-					max_val = std::max(max_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = max_val;
+
+		// Prefix of next block.
+		memcpy(prefix, PADDED_ROW(b + ksize), width * sizeof(T));
+		const int32_t nrows = std::min(ksize, height - b);
+		for (int32_t i = 1; i < nrows - 1; i++) {
+			Op::apply(prefix + (i - 1) * width, PADDED_ROW(b + ksize + i), prefix + i * width, width);
 		}
-		// Right central region.
-		for (int32_t x = width - kradii; x < width; x++) {
-			T max_val = (std::numeric_limits<T>::min)();
-			for (int32_t ky = y - kradii; ky < y + kradii; ky++) {
-				for (int32_t kx = width - kradii; kx < width; kx++) {
-					max_val = std::max(max_val, raw_image[ky * width + kx]);
-				}
-			}
-			processed_image[y * width + x] = max_val;
+
+		memcpy(processed_image + b * width, suffix, width * sizeof(T));
+		for (int32_t i = 1; i < nrows; i++) {
+			Op::apply(suffix + i * width, prefix + (i - 1) * width, processed_image + (b + i) * width, width);
 		}
 	}
-	
+
+	#undef PADDED_ROW
+}
+
+/**
+ * Separable order filter. The row pass is run as a vertical pass over the
+ * transposed image, so both passes stream whole rows.
+ * @param[in] raw_image Input image.
+ * @param[in] width Image width.
+ * @param[in] height Image height.
+ * @param[in] ksize Kernel size, should be odd.
+ * @param[out] processed_image Output image.
+ * @return void.
+ */
+template <typename T, typename Op>
+void order_filter(
+	T *raw_image,
+	int32_t width,
+	int32_t height,
+	int32_t ksize,
+	T *processed_image
+)	{
+	assert(raw_image);
+	assert(processed_image);
+
+	const int32_t npixels = width * height;
+	const int32_t ncache = (2 * ksize + 1) * std::max(width, height);
+	T *cache_image = new T[2 * npixels + ncache];
+	assert(cache_image);
+
+	T *vert_image = cache_image;
+	T *trans_image = cache_image + npixels;
+	T *cache = cache_image + 2 * npixels;
+
+	// Column pass.
+	order_filter_vertical<T, Op>(raw_image, width, height, ksize, cache, vert_image);
+
+	// Row pass in transposed order.
+	order_filter_transpose<T>(vert_image, width, height, trans_image);
+	order_filter_vertical<T, Op>(trans_image, height, width, ksize, cache, vert_image);
+	order_filter_transpose<T>(vert_image, height, width, processed_image);
+
 	if (cache_image) {
 		delete [] cache_image;
 		cache_image = 0;
 	}
 }
 
-#endif
\ No newline at end of file
+template <typename T>
+void min_filter(
+	T *raw_image,
+	int32_t width,
+	int32_t height,
+	int32_t ksize,
+	T *processed_image
+)	{
+	order_filter<T, min_filter_op<T> >(raw_image, width, height, ksize, processed_image);
+}
+
+template <typename T>
+void max_filter(
+	T *raw_image,
+	int32_t width,
+	int32_t height,
+	int32_t ksize,
+	T *processed_image
+)	{
+	order_filter<T, max_filter_op<T> >(raw_image, width, height, ksize, processed_image);
+}
+
+#endif
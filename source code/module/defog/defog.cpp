@@ -26,14 +26,97 @@
 #include "cvgeo_tran.hpp"
 #include "clahe.h"
 #include "clhe.h"
+#include "guided_filter.h"
+#include "simd.h"
 
 #define MAX_TRANSMISSION	(100)
 #define MAX_CACHE_FRAMES	(25)
+#define STAGE_CACHE_FRAMES	(4)
+#define CE_POOL_FRAMES		(2 * STAGE_CACHE_FRAMES + 4)
 #define Y_FLOOR				(16)
 #define Y_CEILING			(235)
 #define CBCR_FLOOR			(16)
 #define CBCR_CEILING		(240)
 #define vector_size 		(16)
+#define QUADTREE_MIN_SIZE	(16)
+
+// Profiled stages, named in profile_stage_names.
+enum {
+	PROFILE_DOWNSAMPLE_FRAME,
+	PROFILE_DARK_CHANNEL,
+	PROFILE_ATMOSPHERIC_LIGHT,
+	PROFILE_ATMO_HISTOGRAM,
+	PROFILE_ATMO_QUADTREE,
+	PROFILE_ESTIMATE_TRANSMISSION,
+	PROFILE_REFINE_TRANSMISSION,
+	PROFILE_MAKE_TRANSMISSION_MAP,
+	PROFILE_INVERSE_TRANSMISSION,
+	PROFILE_LINEAR_RESAMPLE,
+	PROFILE_RECOVER_SCENE_RADIANCE,
+	PROFILE_AUTO_LEVEL_THRESH,
+	PROFILE_MAKE_STRETCH_TABLE,
+	PROFILE_AUTO_LEVELS,
+	PROFILE_PROCESS_RGB_DP,
+	PROFILE_PROCESS_RGB_ASYNC,
+	PROFILE_PROCESS_YUV_NATIVE,
+	PROFILE_PROCESS_YUV_STRIPS,
+	PROFILE_YUV2BGR,
+	PROFILE_BGR2YUV,
+	PROFILE_DP_PL_LATENCY,
+	PROFILE_CLIP_GRAY_LEVEL,
+	PROFILE_LUT_MINMAX,
+	PROFILE_CLAHEQ,
+	PROFILE_GAUSSIAN_BLUR,
+	PROFILE_FILTER3X3,
+	PROFILE_MOTION_ADAPT_NOISE_REDUCTION,
+	PROFILE_SATURATION_ADJUSTMENT,
+	PROFILE_MEDIAN_FILTER3X3,
+	PROFILE_PROCESS_YUV_CE,
+	PROFILE_PL_SLT,
+	PROFILE_PL_CLAHE,
+	PROFILE_PL_EDGE_ENHANCE,
+	PROFILE_PL_SAT_ADJUST_MANR,
+	PROFILE_CE_PL_LATENCY,
+	NPROFILE_STAGES
+};
+
+static const char *const profile_stage_names[NPROFILE_STAGES] = {
+	"downsample_frame",
+	"dark_channel",
+	"estimate_atmospheric_light",
+	"atmo_light histogram",
+	"atmo_light quadtree",
+	"estimate_transmission",
+	"refine_transmission",
+	"make_transmission_map",
+	"inverse_transmission",
+	"linear_resample",
+	"recover_scene_radiance",
+	"auto_level_thresh",
+	"make_stretch_table",
+	"auto_levels",
+	"process_rgb_dp",
+	"process_rgb_async",
+	"process_yuv_native",
+	"process_yuv_strips",
+	"yuv2bgr",
+	"bgr2yuv",
+	"process_yuv_dp_pl latency",
+	"clip_gray_level",
+	"lut_minmax",
+	"CLAHEq",
+	"GaussianBlur",
+	"filter3x3",
+	"motion_adapt_noise_reduction",
+	"saturation_adjustment",
+	"median_filter3x3",
+	"process_yuv_ce",
+	"slt thread",
+	"clahe thread",
+	"edge_enhance thread",
+	"sat_adjust_manr thread",
+	"process_yuv_ce_pl latency"
+};
 
 #define vminmax(a, b) \
 	do { \
@@ -93,53 +176,111 @@
 } while (0)
 
 /**
- * \typedef struct min_filter_thread_param_t
- * \brief Data structure for the minimum filter thread parameters.
+ * \typedef struct recover_thread_param_t
+ * \brief Data structure for the recover thread parameters.
  */
-typedef struct {
-	uint8_t *raw_data;			// Raw image.
-	int32_t width;				// Image width.
-	int32_t height;				// Image height.
-	int32_t ksize;				// Kernel size.
-	uint8_t *processed_data;	// Processed image.
-}min_filter_thread_param_t;
+typedef struct
+{
+	uint8_t *hazzy_data;	// Original hazzy image.
+	float *tran_data;		// Transmission image.
+	int32_t width;			// Image width.
+	uint8_t *atmo_light;		// Atmospheric light.
+	int32_t (*diff_table)[3];
+	uint8_t *recover_data;	// Recover image.
+	int32_t *sub_hist;		// Per worker histograms, null to skip.
+}recover_thread_param_t;
 
 /**
- * \typedef struct normalize_thread_param_t
- * \brief Data structure for the normalize minimum filter image parameters.
+ * \typedef struct lut_recover_thread_param_t
+ * \brief Data structure for the table lookup recover thread parameters.
  */
-typedef struct {
-	uint8_t *data;			// Minimum filter image.
-	int32_t npixels;		// Number of pixels.
-	uint8_t atmo_light;		// Atmospheric light.
-	float *norm_data;		// Normalized minimum filter image.
-}normalize_thread_param_t;
+typedef struct
+{
+	uint8_t *hazzy_data;	// Original hazzy image.
+	uint8_t *tran_map;		// Quantized transmission map.
+	int32_t width;			// Image width.
+	uint8_t ***recover_table;
+	uint8_t *recover_data;	// Recover image.
+	int32_t *sub_hist;		// Per worker histograms, null to skip.
+}lut_recover_thread_param_t;
 
 /**
- * \typedef struct recover_thread_param_t
- * \brief Data structure for the recover thread parameters.
+ * \typedef struct neon_recover_thread_param_t
+ * \brief Data structure for the SIMD recover thread parameters.
  */
 typedef struct
 {
-	uint8_t *hazzy_data;	// Original sub-hazzy image.
-	float *tran_data;		// Transmission sub-image.	
-	int npixels;			// Number of pixels of sub-image.
-	uint8_t *atmo_light;		// Atmospheric light.
-	int32_t (*diff_table)[3];
-	uint8_t *recover_data;	// Recover sub-image.
-}recover_thread_param_t;
+	defog *pdefog;			// Defog instance.
+	uint8_t *hazzy_data;	// Original hazzy image.
+	float *tran_data;		// Transmission inverse image.
+	int32_t width;			// Image width.
+	uint8_t *atmo_light;	// Atmospheric light.
+	uint8_t *recover_data;	// Recover image.
+	int32_t *sub_hist;		// Per worker histograms, null to skip.
+}neon_recover_thread_param_t;
+
+/**
+ * \typedef struct plane_recover_thread_param_t
+ * \brief Data structure for the in place plane recover thread parameters.
+ */
+typedef struct
+{
+	uint8_t *plane_data;	// Y, U or V plane.
+	uint8_t *tran_map;		// Quantized transmission map.
+	int32_t width;			// Plane width.
+	uint8_t **recover_table;
+	uint8_t *stretch_table;
+	int32_t *sub_hist;		// Per worker histograms, null to skip.
+}plane_recover_thread_param_t;
 
 /**
  * \typedef struct auto_level_thread_param_t
  * \brief Data structure for the auto level thread parameters.
  */
 typedef struct {
-	uint8_t *recover_data;	// Recover sub-image.
-	int32_t npixels;		// Number of pixels of sub-image.
+	uint8_t *recover_data;	// Recover image.
+	int32_t width;			// Image width.
 	uint8_t **stretch_table;
-	uint8_t *stretch_data;	// Stretch sub-image.
+	uint8_t *stretch_data;	// Stretch image.
 }auto_level_thread_param_t;
 
+/**
+ * \typedef struct min_pool_thread_param_t
+ * \brief Data structure for the min-pooling decimator thread parameters.
+ */
+typedef struct {
+	uint8_t *frame;			// Full resolution RGB image.
+	int32_t width;			// Image width.
+	int32_t height;			// Image height.
+	int32_t ds_width;		// Down sampled width.
+	int32_t ds_height;		// Down sampled height.
+	uint8_t *line_buffer;	// Line buffers of all workers.
+	int32_t line_bytes;		// Line buffer bytes of one worker.
+	uint8_t **ds_rgb;		// Block average RGB image array.
+	uint8_t *min_chan;		// Block minimum of minimum channel.
+}min_pool_thread_param_t;
+
+/**
+ * \typedef struct upsample_thread_param_t
+ * \brief Data structure for the transmission up sampling thread parameters.
+ */
+typedef struct {
+	bilinear_resampler *resampler;	// Resampler of the source and destination size.
+	const void *src;				// Down sampled transmission.
+	void *dst;						// Up sampled transmission.
+	int32_t width;					// Destination width.
+}upsample_thread_param_t;
+
+/**
+ * \typedef struct strip_thread_param_t
+ * \brief Data structure for the strip executor thread parameters.
+ */
+typedef struct {
+	defog *pdefog;			// Defog instance.
+	uint8_t *yuv_data;		// YUV420 image processed in place.
+	bool update;			// Collect histogram for stretch table.
+}strip_thread_param_t;
+
 /**
  * Motion tranformation function.
  */
@@ -154,6 +295,22 @@ static uint8_t MTF[64] = {
 	3,   2,   2,   2,   1,   1,  1,  0
 };
 
+//---------------------------------------------------------
+// Accumulate histograms of the three channels of image.
+//---------------------------------------------------------
+static void accumulate_hist(
+	const uint8_t *image,
+	int32_t npixels,
+	int32_t *hist
+)	{
+	for (int32_t i = 0; i < npixels; i++) {
+		hist[image[0]]++;
+		hist[256 + image[1]]++;
+		hist[512 + image[2]]++;
+		image += 3;
+	}
+}
+
 //---------------------------------------------------------
 // Default constructor function of class defog.
 //---------------------------------------------------------
@@ -188,13 +345,34 @@ defog::defog(
 	update_period = 1;
 	nrecover_threads = 30;
 	nstretch_threads = 10;
+	npool_threads = 0;
+	guided_subsample = 4;
+	recover_mode = 0;
+	yuv_native = 0;
+	async_estimate = 0;
+	strip_rows = 0;
+	l2_cache_size = 1048576;
+	min_pool = 0;
+	atmo_light_method = 0;
+	memset(quadtree_atmo_light, 0, sizeof(quadtree_atmo_light));
 	clip_limit = 2;
+	clahe_grid_x = 5;
+	clahe_grid_y = 4;
+	clahe_error = 0;
+	clahe_temporal = 0;
+	clahe_temporal_blend = 0.5;
+	auto_clip_limit = 0;
+	memset(&clahe_state, 0, sizeof(clahe_state));
 	gamma = 1.0;
 	enable_uv_adjust = 0;
 	enable_edge_enhan = 0;
 	enable_T_noise_reduce = 0;
 	enable_2D_noise_reduce = 0;
 	enable_module = 1;
+	pipeline_delay = 0;
+	enable_profiler = 0;
+	ce_seq = 0;
+	dp_seq = 0;
 	slt[0] = 48;
 	slt[1] = 72;
 	slt[2] = 208;
@@ -206,6 +384,7 @@ defog::defog(
 	ds_height = static_cast<int32_t>(downsample * height);
 	// Guided filter kernel size.
 	kgud_size = 4 * kmin_size + 1;
+	gud_filter.init(ds_width, ds_height, kgud_size, guided_subsample, 1.0e-5f);
 	
 	bgr_image = new uint8_t[3 * width * height];
 	assert(bgr_image);
@@ -217,6 +396,9 @@ defog::defog(
 	// Allocate memory for minimum channel image.
 	min_chan_img = new uint8_t[ds_width * ds_height];
 	assert(min_chan_img);
+	// Allocate memory for dark channel image.
+	dark_chan_img = new uint8_t[ds_width * ds_height];
+	assert(dark_chan_img);
 	
 	const int32_t nchannels = 3;
 	for (int32_t c = 0; c < nchannels; c++) {
@@ -226,16 +408,7 @@ defog::defog(
 		
 		dsrgb_img[c] = new uint8_t[ds_width * ds_height];
 		assert(dsrgb_img[c]);
-		// Allocate memory for minimum filter image.
-		min_filt_rgb_img[c] = new uint8_t[ds_width * ds_height];
-		assert(min_filt_rgb_img[c]);
-		// Allocate memory for normalized minimum filter image.
-		norm_min_filt_rgb_img[c] = new float[ds_width * ds_height];
-		assert(norm_min_filt_rgb_img[c]);
-	}
-	// Allocate memory for normalized minimum filter image.
-	norm_min_chan_img = new float[ds_width * ds_height];
-	assert(norm_min_chan_img);
+	}
 	// Allocate memory for transmission image.
 	transm_img = new float[ds_width * ds_height];
 	assert(transm_img);
@@ -246,6 +419,12 @@ defog::defog(
 	transm_inv = new float[ds_width * ds_height];
 	assert(transm_inv);
 	
+	transm_map = new uint8_t[ds_width * ds_height];
+	assert(transm_map);
+	
+	uv_transm_map = new uint8_t[(width >> 1) * (height >> 1)];
+	assert(uv_transm_map);
+	
 	u8_transmission_image = new uint8_t[width * height];
 	assert(u8_transmission_image);
 	// Allocate memory for recover image.
@@ -269,6 +448,7 @@ defog::defog(
 			assert(recover_table[i][j]);
 		}
 	}
+	recover_table_ready = false;
 	// Allocate memory for stretch table.
 	stretch_table = new uint8_t *[nchannels];
 	assert(stretch_table);
@@ -280,6 +460,8 @@ defog::defog(
 	gamma_correct_table = new uint8_t[nlevels];
 	assert(gamma_correct_table);
 	
+	init_ce_lut();
+	
 	old_y = new uint8_t[width * height];
 	assert(old_y);
 	
@@ -291,17 +473,38 @@ defog::defog(
 	mfilt_y_image = new uint8_t[width * height];
 	assert(mfilt_y_image);
 	
-	pthread_mutex_init(&in_yuv_image_mutex, NULL);
-	pthread_mutex_init(&in_bgr_image_mutex, NULL);
-	pthread_mutex_init(&out_bgr_image_mutex, NULL);
-	pthread_mutex_init(&out_yuv_image_mutex, NULL);
+	edge_blur_y_image = new uint8_t[width * height];
+	assert(edge_blur_y_image);
 	
-	pthread_mutex_init(&raw_y_image_mutex, NULL);
-	pthread_mutex_init(&clip_yuv_image_mutex, NULL);
-	pthread_mutex_init(&slt_yuv_image_mutex, NULL);
-	pthread_mutex_init(&clahe_yuv_image_mutex, NULL);
-	pthread_mutex_init(&edge_yuv_image_mutex, NULL);
-	pthread_mutex_init(&sa_manr_yuv_image_mutex, NULL);
+	ce_frames.init(CE_POOL_FRAMES, width * height * 3 / 2);
+	ce_raw_y_frames.init(CE_POOL_FRAMES, width * height);
+	
+	// A fixed delay keeps pipeline_delay + 1 frames in flight.
+	pipeline_delay = std::min(pipeline_delay, CE_POOL_FRAMES - 1);
+	
+	profile.init(NPROFILE_STAGES, profile_stage_names);
+	profile.enable(1 == enable_profiler);
+	
+	in_yuv_image_queue.init(MAX_CACHE_FRAMES);
+	in_bgr_image_queue.init(STAGE_CACHE_FRAMES);
+	out_bgr_image_queue.init(STAGE_CACHE_FRAMES);
+	out_yuv_image_queue.init(STAGE_CACHE_FRAMES);
+	
+	raw_y_image_queue.init(CE_POOL_FRAMES);
+	clip_yuv_image_queue.init(MAX_CACHE_FRAMES);
+	slt_yuv_image_queue.init(STAGE_CACHE_FRAMES);
+	clahe_yuv_image_queue.init(STAGE_CACHE_FRAMES);
+	edge_yuv_image_queue.init(STAGE_CACHE_FRAMES);
+	sa_manr_yuv_image_queue.init(STAGE_CACHE_FRAMES);
+	
+	workers.init(npool_threads);
+	transm_resampler.init(ds_width, ds_height, width, height, workers.size());
+	recover_hist = new int32_t[workers.size() * 3 * 256];
+	assert(recover_hist);
+	uv_transm_resampler.init(ds_width, ds_height, width >> 1, height >> 1, workers.size());
+	init_estimator();
+	init_strips();
+	init_min_pool();
 }
 
 //---------------------------------------------------------
@@ -309,6 +512,11 @@ defog::defog(
 //---------------------------------------------------------
 defog::~defog()
 {
+	release_estimator();
+	release_strips();
+	release_min_pool();
+	CLAHEqRelease(&clahe_state);
+	
 	if (bgr_image) {
 		delete [] bgr_image;
 		bgr_image = 0;
@@ -325,6 +533,12 @@ defog::~defog()
 		min_chan_img = 0;
 	}
 	
+	// Free dark channel image memory.
+	if (dark_chan_img) {
+		delete [] dark_chan_img;
+		dark_chan_img = 0;
+	}
+	
 	const int32_t nchannels = 3;
 	for (int32_t c = 0; c < nchannels; c++) {
 		// Free original single channel image memory.
@@ -337,21 +551,6 @@ defog::~defog()
 			delete [] dsrgb_img[c];
 			dsrgb_img[c] = 0;
 		}
-		// Free minimum filter image image memory.
-		if (min_filt_rgb_img[c]) {
-			delete [] min_filt_rgb_img[c];
-			min_filt_rgb_img[c] = 0;
-		}
-		// Free normalized minimum filter image memory.
-		if (norm_min_filt_rgb_img[c]) {
-			delete [] norm_min_filt_rgb_img[c];
-			norm_min_filt_rgb_img[c] = 0;
-		}
-	}
-	// Free normalized minimum channel image.
-	if (norm_min_chan_img) {
-		delete [] norm_min_chan_img;
-		norm_min_chan_img = 0;
 	}
 	// Free transmission image memory.
 	if (transm_img) {
@@ -369,6 +568,16 @@ defog::~defog()
 		transm_inv = 0;
 	}
 	
+	if (transm_map) {
+		delete [] transm_map;
+		transm_map = 0;
+	}
+	
+	if (uv_transm_map) {
+		delete [] uv_transm_map;
+		uv_transm_map = 0;
+	}
+	
 	if (u8_transmission_image) {
 		delete [] u8_transmission_image;
 		u8_transmission_image = 0;
@@ -422,6 +631,11 @@ defog::~defog()
 		gamma_correct_table = 0;
 	}
 	
+	if (recover_hist) {
+		delete [] recover_hist;
+		recover_hist = 0;
+	}
+	
 	if (old_y) {
 		delete [] old_y;
 		old_y = 0;
@@ -437,17 +651,10 @@ defog::~defog()
 		mfilt_y_image = 0;
 	}
 	
-	pthread_mutex_destroy(&in_yuv_image_mutex);
-	pthread_mutex_destroy(&in_bgr_image_mutex);
-	pthread_mutex_destroy(&out_bgr_image_mutex);
-	pthread_mutex_destroy(&out_yuv_image_mutex);
-	
-	pthread_mutex_destroy(&raw_y_image_mutex);
-	pthread_mutex_destroy(&clip_yuv_image_mutex);
-	pthread_mutex_destroy(&slt_yuv_image_mutex);
-	pthread_mutex_destroy(&clahe_yuv_image_mutex);
-	pthread_mutex_destroy(&edge_yuv_image_mutex);
-	pthread_mutex_destroy(&sa_manr_yuv_image_mutex);
+	if (edge_blur_y_image) {
+		delete [] edge_blur_y_image;
+		edge_blur_y_image = 0;
+	}
 }
 
 //---------------------------------------------------------
@@ -462,6 +669,21 @@ void defog::init_gamma_correct_table()
 	}
 }
 
+//---------------------------------------------------------
+// Compose pointwise Y transformations of process_yuv_ce.
+//---------------------------------------------------------
+void defog::init_ce_lut()
+{
+	ce_lut.reset();
+	// Saturation adjustment needs the clipped Y, it is clipped by its own pass.
+	if (!enable_uv_adjust) {
+		ce_lut.clip(Y_FLOOR, Y_CEILING);
+	}
+	if (gamma < 0.999f || gamma > 1.001f) {
+		ce_lut.seg_linear(slt[0], slt[1], slt[2], slt[3]);
+	}
+}
+
 //---------------------------------------------------------
 // Init defog instance.
 //---------------------------------------------------------
@@ -488,13 +710,34 @@ void defog::init(
 	update_period = 1;
 	nrecover_threads = 30;
 	nstretch_threads = 10;
+	npool_threads = 0;
+	guided_subsample = 4;
+	recover_mode = 0;
+	yuv_native = 0;
+	async_estimate = 0;
+	strip_rows = 0;
+	l2_cache_size = 1048576;
+	min_pool = 0;
+	atmo_light_method = 0;
+	memset(quadtree_atmo_light, 0, sizeof(quadtree_atmo_light));
 	clip_limit = 2;
+	clahe_grid_x = 5;
+	clahe_grid_y = 4;
+	clahe_error = 0;
+	clahe_temporal = 0;
+	clahe_temporal_blend = 0.5;
+	auto_clip_limit = 0;
+	memset(&clahe_state, 0, sizeof(clahe_state));
 	gamma = 1.0;
 	enable_uv_adjust = 0;
 	enable_edge_enhan = 0;
 	enable_T_noise_reduce = 0;
 	enable_2D_noise_reduce = 0;
 	enable_module = 1;
+	pipeline_delay = 0;
+	enable_profiler = 0;
+	ce_seq = 0;
+	dp_seq = 0;
 	slt[0] = 48;
 	slt[1] = 72;
 	slt[2] = 208;
@@ -506,6 +749,7 @@ void defog::init(
 	ds_height = static_cast<int32_t>(downsample * height);
 	// Guided filter kernel size.
 	kgud_size = 4 * kmin_size + 1;
+	gud_filter.init(ds_width, ds_height, kgud_size, guided_subsample, 1.0e-5f);
 	
 	bgr_image = new uint8_t[3 * width * height];
 	assert(bgr_image);
@@ -517,6 +761,9 @@ void defog::init(
 	// Allocate memory for minimum channel image.
 	min_chan_img = new uint8_t[ds_width * ds_height];
 	assert(min_chan_img);
+	// Allocate memory for dark channel image.
+	dark_chan_img = new uint8_t[ds_width * ds_height];
+	assert(dark_chan_img);
 	
 	const int32_t nchannels = 3;
 	for (int32_t c = 0; c < nchannels; c++) {
@@ -526,16 +773,7 @@ void defog::init(
 		
 		dsrgb_img[c] = new uint8_t[ds_width * ds_height];
 		assert(dsrgb_img[c]);
-		// Allocate memory for minimum filter image.
-		min_filt_rgb_img[c] = new uint8_t[ds_width * ds_height];
-		assert(min_filt_rgb_img[c]);
-		// Allocate memory for normalized minimum filter image.
-		norm_min_filt_rgb_img[c] = new float[ds_width * ds_height];
-		assert(norm_min_filt_rgb_img[c]);
-	}
-	// Allocate memory for normalized minimum filter image.
-	norm_min_chan_img = new float[ds_width * ds_height];
-	assert(norm_min_chan_img);
+	}
 	// Allocate memory for transmission image.
 	transm_img = new float[ds_width * ds_height];
 	assert(transm_img);
@@ -546,6 +784,12 @@ void defog::init(
 	transm_inv = new float[ds_width * ds_height];
 	assert(transm_inv);
 	
+	transm_map = new uint8_t[ds_width * ds_height];
+	assert(transm_map);
+	
+	uv_transm_map = new uint8_t[(width >> 1) * (height >> 1)];
+	assert(uv_transm_map);
+	
 	u8_transmission_image = new uint8_t[width * height];
 	assert(u8_transmission_image);
 	// Allocate memory for recover image.
@@ -569,6 +813,7 @@ void defog::init(
 			assert(recover_table[i][j]);
 		}
 	}
+	recover_table_ready = false;
 	// Allocate memory for stretch table.
 	stretch_table = new uint8_t *[nchannels];
 	assert(stretch_table);
@@ -581,6 +826,7 @@ void defog::init(
 	assert(gamma_correct_table);
 	
 	init_gamma_correct_table();
+	init_ce_lut();
 	
 	old_y = new uint8_t[width * height];
 	assert(old_y);
@@ -593,17 +839,38 @@ void defog::init(
 	mfilt_y_image = new uint8_t[width * height];
 	assert(mfilt_y_image);
 	
-	pthread_mutex_init(&in_yuv_image_mutex, NULL);
-	pthread_mutex_init(&in_bgr_image_mutex, NULL);
-	pthread_mutex_init(&out_bgr_image_mutex, NULL);
-	pthread_mutex_init(&out_yuv_image_mutex, NULL);
+	edge_blur_y_image = new uint8_t[width * height];
+	assert(edge_blur_y_image);
+	
+	ce_frames.init(CE_POOL_FRAMES, width * height * 3 / 2);
+	ce_raw_y_frames.init(CE_POOL_FRAMES, width * height);
+	
+	// A fixed delay keeps pipeline_delay + 1 frames in flight.
+	pipeline_delay = std::min(pipeline_delay, CE_POOL_FRAMES - 1);
 	
-	pthread_mutex_init(&raw_y_image_mutex, NULL);
-	pthread_mutex_init(&clip_yuv_image_mutex, NULL);
-	pthread_mutex_init(&slt_yuv_image_mutex, NULL);
-	pthread_mutex_init(&clahe_yuv_image_mutex, NULL);
-	pthread_mutex_init(&edge_yuv_image_mutex, NULL);
-	pthread_mutex_init(&sa_manr_yuv_image_mutex, NULL);
+	profile.init(NPROFILE_STAGES, profile_stage_names);
+	profile.enable(1 == enable_profiler);
+	
+	in_yuv_image_queue.init(MAX_CACHE_FRAMES);
+	in_bgr_image_queue.init(STAGE_CACHE_FRAMES);
+	out_bgr_image_queue.init(STAGE_CACHE_FRAMES);
+	out_yuv_image_queue.init(STAGE_CACHE_FRAMES);
+	
+	raw_y_image_queue.init(CE_POOL_FRAMES);
+	clip_yuv_image_queue.init(MAX_CACHE_FRAMES);
+	slt_yuv_image_queue.init(STAGE_CACHE_FRAMES);
+	clahe_yuv_image_queue.init(STAGE_CACHE_FRAMES);
+	edge_yuv_image_queue.init(STAGE_CACHE_FRAMES);
+	sa_manr_yuv_image_queue.init(STAGE_CACHE_FRAMES);
+	
+	workers.init(npool_threads);
+	transm_resampler.init(ds_width, ds_height, width, height, workers.size());
+	recover_hist = new int32_t[workers.size() * 3 * 256];
+	assert(recover_hist);
+	uv_transm_resampler.init(ds_width, ds_height, width >> 1, height >> 1, workers.size());
+	init_estimator();
+	init_strips();
+	init_min_pool();
 
 #ifdef PIPELINE	
 #ifdef DARK_PRIOR
@@ -640,11 +907,28 @@ void defog::load_parameters()
 		highcut_thresh = root["highcut_thresh"].asDouble();
 		nrecover_threads = root["nrecover_threads"].asInt();
 		nstretch_threads = root["nstretch_threads"].asInt();
+		npool_threads = root["npool_threads"].asInt();
+		guided_subsample = root["guided_subsample"].asInt();
+		recover_mode = root["recover_mode"].asInt();
+		yuv_native = root["yuv_native"].asInt();
+		async_estimate = root["async_estimate"].asInt();
+		strip_rows = root["strip_rows"].asInt();
+		l2_cache_size = root["l2_cache_size"].asInt();
+		min_pool = root["min_pool"].asInt();
+		atmo_light_method = root["atmo_light_method"].asInt();
 		clip_limit = root["clip_limit"].asDouble();
+		// Older configurations have no grid, CLAHE needs at least 2x2 regions.
+		clahe_grid_x = std::max(root.get("clahe_grid_x", 5).asInt(), 2);
+		clahe_grid_y = std::max(root.get("clahe_grid_y", 4).asInt(), 2);
+		clahe_temporal = root["clahe_temporal"].asInt();
+		clahe_temporal_blend = root["clahe_temporal_blend"].asDouble();
+		auto_clip_limit = root["auto_clip_limit"].asInt();
 		gamma = root["gamma"].asDouble();
 		enable_uv_adjust = root["enable_uv_adjust"].asInt();
 		enable_edge_enhan = root["enable_edge_enhan"].asInt();
 		enable_module = root["enable_module"].asInt();
+		pipeline_delay = root["pipeline_delay"].asInt();
+		enable_profiler = root["enable_profiler"].asInt();
 		slt[0] = root["slt0"].asInt();
 		slt[1] = root["slt1"].asInt();
 		slt[2] = root["slt2"].asInt();
@@ -662,7 +946,21 @@ void defog::load_parameters()
 		printf("highcut_thresh\t\t%f\n", highcut_thresh);
 		printf("nrecover_threads\t%d\n", nrecover_threads);
 		printf("nstretch_threads\t%d\n", nstretch_threads);
+		printf("npool_threads\t\t%d\n", npool_threads);
+		printf("guided_subsample\t%d\n", guided_subsample);
+		printf("recover_mode\t\t%d\n", recover_mode);
+		printf("yuv_native\t\t%d\n", yuv_native);
+		printf("async_estimate\t\t%d\n", async_estimate);
+		printf("strip_rows\t\t%d\n", strip_rows);
+		printf("l2_cache_size\t\t%d\n", l2_cache_size);
+		printf("min_pool\t\t%d\n", min_pool);
+		printf("atmo_light_method\t%d\n", atmo_light_method);
 		printf("clip_limit\t\t%f\n", clip_limit);
+		printf("clahe_grid_x\t\t%d\n", clahe_grid_x);
+		printf("clahe_grid_y\t\t%d\n", clahe_grid_y);
+		printf("clahe_temporal\t\t%d\n", clahe_temporal);
+		printf("clahe_temporal_blend\t%f\n", clahe_temporal_blend);
+		printf("auto_clip_limit\t\t%d\n", auto_clip_limit);
 		printf("gamma\t\t\t%f\n", gamma);
 		printf("enable_uv_adjust\t%d\n", enable_uv_adjust);
 		printf("enable_edge_enhan\t%d\n", enable_edge_enhan);
@@ -673,6 +971,8 @@ void defog::load_parameters()
 		printf("enable_T_noise_reduce\t%d\n", enable_T_noise_reduce);
 		printf("enable_2D_noise_reduce\t%d\n", enable_2D_noise_reduce);
 		printf("enable_module\t\t%d\n", enable_module);
+		printf("pipeline_delay\t\t%d\n", pipeline_delay);
+		printf("enable_profiler\t\t%d\n", enable_profiler);
 	} else {
 		printf("Not found configuration, use default sets.\n");
 	}
@@ -848,6 +1148,8 @@ void defog::yuv2bgr(
 			row_loop_counter++;
 		}
 	}
+#else
+	simd_kernels()->yuv2rgb(yuv_image, width, height, bgr_image);
 #endif
 }
 
@@ -1023,351 +1325,661 @@ void defog::bgr2yuv(
 			bgr_image += (npixels_per_loop * nchannels);
 		}
 	}
+#else
+	simd_kernels()->rgb2yuv(bgr_image, width, height, yuv_image);
 #endif
 }
 
 //---------------------------------------------------------
-// Minimum filter thread.
+// Estimate dark channel, atmospheric light and transmission
+// from the down sampled RGB image.
 //---------------------------------------------------------
-void *min_filter_thread(
-	void *param
+void defog::estimate_parameters(
+	bool min_chan_ready
 )	{
-	min_filter_thread_param_t *min_filt = (min_filter_thread_param_t *)param;
-	min_filter<uint8_t>(min_filt->raw_data, min_filt->width, min_filt->height, min_filt->ksize, min_filt->processed_data);
-	return (void *)(0);
+	// Calculate dark channel image. Minimum filter of minimum channel equals
+	// minimum channel of minimum filter.
+	{
+		scoped_timer timer(&profile, PROFILE_DARK_CHANNEL);
+		if (!min_chan_ready) {
+			min_channel<uint8_t>(dsrgb_img, min_chan_img, ds_width, ds_height);
+		}
+		min_filter<uint8_t>(min_chan_img, ds_width, ds_height, kmin_size, dark_chan_img);
+	}
+	// Estimate atmospheric light.
+	{
+		scoped_timer timer(&profile, PROFILE_ATMOSPHERIC_LIGHT);
+		if (1 == atmo_light_method) {
+			quadtree_atmospheric_light(dsrgb_img, dark_chan_img, ds_width, ds_height, atmo_light_ceiling, atmo_light);
+		} else if (2 == atmo_light_method) {
+			// Run both methods and keep the histogram result, get_profile reports them.
+			{
+				scoped_timer compare_timer(&profile, PROFILE_ATMO_QUADTREE);
+				quadtree_atmospheric_light(dsrgb_img, dark_chan_img, ds_width, ds_height, atmo_light_ceiling,
+					quadtree_atmo_light);
+			}
+			{
+				scoped_timer compare_timer(&profile, PROFILE_ATMO_HISTOGRAM);
+				estimate_atmospheric_light(dsrgb_img, dark_chan_img, ds_width, ds_height, atmo_light_ceiling,
+					atmo_light);
+			}
+		} else {
+			estimate_atmospheric_light(dsrgb_img, dark_chan_img, ds_width, ds_height, atmo_light_ceiling, atmo_light);
+		}
+	}
+	// Estimate transmission map.
+	{
+		scoped_timer timer(&profile, PROFILE_ESTIMATE_TRANSMISSION);
+		estimate_transmission(dsrgb_img, ds_width, ds_height, atmo_light, omega, transm_inv, transm_img);
+	}
+	// Refine transmission map with guided filter.
+	{
+		scoped_timer timer(&profile, PROFILE_REFINE_TRANSMISSION);
+		refine_transmission(dsrgb_img[0], transm_img, ds_width, ds_height, tran_thresh);
+	}
 }
 
 //---------------------------------------------------------
-// Minimum filter.
+// Accumulate column sums and column minimum of one row.
 //---------------------------------------------------------
-void defog::min_filter(
-	uint8_t *raw_image[3],
+static void min_pool_row(
+	const uint8_t *rgb_row,
 	int32_t width,
-	int32_t height,
-	int32_t ksize,
-	uint8_t *processed_image[3]
+	uint16_t *sum[3],
+	uint8_t *min_row
 )	{
-	const int32_t nchannels = 3;
-	pthread_t tid[nchannels];
-	min_filter_thread_param_t min_filt[nchannels];
-	
-	for (int32_t c = 0; c < nchannels; c++) {
-		min_filt[c].raw_data = raw_image[c];
-		min_filt[c].width = width;
-		min_filt[c].height = height;
-		min_filt[c].ksize = ksize;
-		min_filt[c].processed_data = processed_image[c];
-	}
-	
-	for (int32_t c = 0; c < nchannels; c++) {
-		int32_t ret = pthread_create(&tid[c], NULL, min_filter_thread, &min_filt[c]);
-		if (0 != ret) {
-			printf("Create minimum filter thread[%d] fail!\n", c);
-			exit(-1);
+#ifdef __ARM_NEON__
+	const int32_t npixels_per_loop = 16;
+	int32_t x = 0;
+	for (; x <= width - npixels_per_loop; x += npixels_per_loop) {
+		uint8x16x3_t rgb = vld3q_u8(rgb_row + 3 * x);
+		for (int32_t c = 0; c < 3; c++) {
+			uint16x8_t low = vld1q_u16(sum[c] + x);
+			uint16x8_t hig = vld1q_u16(sum[c] + x + 8);
+			vst1q_u16(sum[c] + x, vaddw_u8(low, vget_low_u8(rgb.val[c])));
+			vst1q_u16(sum[c] + x + 8, vaddw_u8(hig, vget_high_u8(rgb.val[c])));
 		}
+		
+		uint8x16_t minv = vminq_u8(vminq_u8(rgb.val[0], rgb.val[1]), rgb.val[2]);
+		vst1q_u8(min_row + x, vminq_u8(minv, vld1q_u8(min_row + x)));
 	}
-
-	for (int32_t c = 0; c < nchannels; c++) {
-		pthread_join(tid[c], NULL);
+	
+	for (; x < width; x++) {
+		const uint8_t *pixel = rgb_row + 3 * x;
+		sum[0][x] += pixel[0];
+		sum[1][x] += pixel[1];
+		sum[2][x] += pixel[2];
+		min_row[x] = std::min(min_row[x], std::min(std::min(pixel[0], pixel[1]), pixel[2]));
 	}
+#else
+	simd_kernels()->min_pool_row(rgb_row, width, sum, min_row);
+#endif
 }
 
 //---------------------------------------------------------
-// Guided filter.
+// Min-pooling decimator thread.
 //---------------------------------------------------------
-cv::Mat defog::guided_filter(
-	cv::Mat G,
-	cv::Mat P,
-	int ksize
+static void min_pool_thread(
+	int32_t begin,
+	int32_t end,
+	int32_t worker,
+	void *param
 )	{
-	cv::Mat PG = P.mul(G);
-	cv::Mat MPG;
-	cv::boxFilter(PG, MPG, CV_32FC1, cv::Size(ksize, ksize));	// Mean of PG.
-
-	cv::Mat MP, MG;
-	cv::boxFilter(P, MP, CV_32FC1, cv::Size(ksize, ksize));		// Mean of P.
-	cv::boxFilter(G, MG, CV_32FC1, cv::Size(ksize, ksize));		// Mean of G
-	cv::Mat CovPG = MPG - MP.mul(MG);						// Covariance of MP and MG.
-
-	cv::Mat GG = G.mul(G);
-	cv::Mat MGG;
-	cv::boxFilter(GG, MGG, CV_32FC1, cv::Size(ksize, ksize));	// Mean of GG.
-	cv::Mat VarG = MGG - MG.mul(MG);						// Variance of MG.
-	  
-	double eps = 1.0e-5;
-	cv::Mat A = CovPG / (VarG + eps);
-	cv::Mat B = MP - A.mul(MG);
-
-	cv::Mat MA, MB;
-	cv::boxFilter(A, MA, CV_32FC1, cv::Size(ksize, ksize));		// Mean of A.
-	cv::boxFilter(B, MB, CV_32FC1, cv::Size(ksize, ksize));		// Mean of B.
-
-	cv::Mat Q = MA.mul(G) + MB;
-	return Q;
+	min_pool_thread_param_t *thread_param = (min_pool_thread_param_t *)param;
+	
+	const int32_t width = thread_param->width;
+	const int32_t height = thread_param->height;
+	const int32_t ds_width = thread_param->ds_width;
+	const int32_t ds_height = thread_param->ds_height;
+	const int32_t bytes_per_pixel = 3;
+	uint16_t *line = (uint16_t *)(thread_param->line_buffer + worker * thread_param->line_bytes);
+	uint16_t *sum[3] = {line, line + width, line + 2 * width};
+	uint8_t *min_row = (uint8_t *)(line + 3 * width);
+	
+	for (int32_t y = begin; y < end; y++) {
+		const int32_t y0 = y * height / ds_height;
+		const int32_t y1 = (y + 1) * height / ds_height;
+		
+		// Vertical pass over the block rows, kept in column sums.
+		memset(line, 0, 3 * width * sizeof(uint16_t));
+		memset(min_row, 255, width);
+		for (int32_t sy = y0; sy < y1; sy++) {
+			min_pool_row(thread_param->frame + sy * width * bytes_per_pixel, width, sum, min_row);
+		}
+		
+		// Horizontal pass, memory channel m is dsrgb_img[2 - m].
+		for (int32_t x = 0; x < ds_width; x++) {
+			const int32_t x0 = x * width / ds_width;
+			const int32_t x1 = (x + 1) * width / ds_width;
+			const int32_t area = (x1 - x0) * (y1 - y0);
+			int32_t block_sum[3] = {0, 0, 0};
+			uint8_t block_min = 255;
+			for (int32_t sx = x0; sx < x1; sx++) {
+				block_sum[0] += sum[0][sx];
+				block_sum[1] += sum[1][sx];
+				block_sum[2] += sum[2][sx];
+				block_min = std::min(block_min, min_row[sx]);
+			}
+			
+			const int32_t i = y * ds_width + x;
+			thread_param->ds_rgb[2][i] = (block_sum[0] + (area >> 1)) / area;
+			thread_param->ds_rgb[1][i] = (block_sum[1] + (area >> 1)) / area;
+			thread_param->ds_rgb[0][i] = (block_sum[2] + (area >> 1)) / area;
+			thread_param->min_chan[i] = block_min;
+		}
+	}
 }
 
 //---------------------------------------------------------
-// Totally process function.
+// Down sample RGB image to the estimator inputs.
 //---------------------------------------------------------
-void defog::process_rgb_dp(
-	uint8_t *raw_image
+void defog::downsample_frame(
+	uint8_t *frame
 )	{
-	hazzy_img = raw_image;
-	
-	if (false == enable_module) {
+	if (1 == min_pool) {
+		// Block average channels guide the filter, block minimum of the
+		// channel minimum keeps the dark pixels bilinear would blur away.
+		min_pool_thread_param_t thread_param;
+		thread_param.frame = frame;
+		thread_param.width = width;
+		thread_param.height = height;
+		thread_param.ds_width = ds_width;
+		thread_param.ds_height = ds_height;
+		thread_param.line_buffer = min_pool_buffer;
+		thread_param.line_bytes = min_pool_bytes;
+		thread_param.ds_rgb = dsrgb_img;
+		thread_param.min_chan = min_chan_img;
+		
+		workers.parallel_for(0, ds_height, workers.size(), min_pool_thread, &thread_param);
 		return;
 	}
-
-#ifdef EASY_TEST_DEFOG
-	clock_t start = clock();
-#endif
-#ifdef TEST_DEFOG
-	clock_t start, finish, total = 0;
-	start = clock();
-#endif
-	if (frame_index % update_period == 0) {
-		cv::resize(cv::Mat(height, width, CV_8UC3, hazzy_img), cv::Mat(ds_height, ds_width, CV_8UC3, dsbgr_image),
-			cv::Size(ds_width, ds_height));
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("color resize %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif		
-		cv::Mat dsbgr_mat[3] = {cv::Mat(ds_height, ds_width, CV_8UC1, dsrgb_img[2]),
-			cv::Mat(ds_height, ds_width, CV_8UC1, dsrgb_img[1]), cv::Mat(ds_height, ds_width, CV_8UC1, dsrgb_img[0])};
-		cv::split(cv::Mat(ds_height, ds_width, CV_8UC3, dsbgr_image), dsbgr_mat);
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("channel split %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif	
-		// Minimum filter for every channel.
-		min_filter(dsrgb_img, ds_width, ds_height, kmin_size, min_filt_rgb_img);
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("min_filter %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif
-		// Calculate minimum channel image.
-		min_channel<uint8_t>(min_filt_rgb_img, min_chan_img, ds_width, ds_height);
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("min_channel1 %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif
-		// Estimate atmospheric light.
-		estimate_atmospheric_light(dsrgb_img, min_chan_img, ds_width, ds_height, atmo_light_ceiling, atmo_light);
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("estimate_atmospheric_light %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif
-		// Calculate normalized minimum filter image.
-		normalize_min_filt_image(min_filt_rgb_img, ds_width, ds_height, atmo_light, norm_min_filt_rgb_img);
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("normalize_min_filt_image %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif
-		// Calculate normalized minimum channel image.
-		min_channel<float>(norm_min_filt_rgb_img, norm_min_chan_img, ds_width, ds_height);
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("min_channel2 %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif
-		// Estimate transmission map.
-		estimate_transmission(norm_min_chan_img, ds_width, ds_height, omega, transm_img);
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("estimate_transmission %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif
-		// Refine transmission map with guided filter.
-		refine_transmission(dsrgb_img[0], transm_img, ds_width, ds_height, kgud_size, tran_thresh);
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("refine_transmission %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif	
-		inverse_transmission(transm_img, ds_width, ds_height, transm_inv);
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("inverse_transmission %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif
-		cv::resize(cv::Mat(ds_height, ds_width, CV_32FC1, transm_inv), cv::Mat(height, width, CV_32FC1,
-			ustransm_img), cv::Size(width, height));
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("linear_resample %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif
-	}
-#ifdef TEST_DEFOG
-	start = clock();
-#endif
-	// Calculate recover scene radiance image.
-#ifdef _WIN32
-	recover_scene_radiance(hazzy_img, ustransm_img, width, height, atmo_light, recover_img);
-#else
-	neon_recover_scene_radiance(hazzy_img, ustransm_img, width, height, atmo_light, recover_img);
-#endif
-#ifdef TEST_DEFOG
-	finish = clock();
-	total += finish - start;
-#ifdef _WIN32
-	printf("recover_scene_radiance %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#else
-	printf("neon_recover_scene_radiance %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
-#endif
-	if (frame_index % update_period == 0) {
-#ifdef TEST_DEFOG
-		start = clock();
-#endif
-		auto_level_thresh(recover_img, width, height, lowcut_thresh, highcut_thresh, auto_level_floor, auto_level_ceiling);
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("auto_level_thresh %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif
-		make_stretch_table(auto_level_floor, auto_level_ceiling, stretch_table);
-#ifdef TEST_DEFOG
-		finish = clock();
-		total += finish - start;
-		printf("make_stretch_table %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-		start = clock();
-#endif
-	}
-#ifdef TEST_DEFOG
-	start = clock();
-#endif
-	// Auto levels image.
-	auto_levels(recover_img, width, height, stretch_table, stretch_img);
-#ifdef TEST_DEFOG
-	finish = clock();
-	total += finish - start;
-	printf("auto_levels %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-	printf("total %.0lfms.\n", 1000.0 * total / CLOCKS_PER_SEC);
-#endif
-#ifdef EASY_TEST_DEFOG
-	clock_t finish = clock();
-	printf("total %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif	
-	frame_index++;
+	
+	cv::resize(cv::Mat(height, width, CV_8UC3, frame), cv::Mat(ds_height, ds_width, CV_8UC3, dsbgr_image),
+		cv::Size(ds_width, ds_height));
+	cv::Mat dsbgr_mat[3] = {cv::Mat(ds_height, ds_width, CV_8UC1, dsrgb_img[2]),
+		cv::Mat(ds_height, ds_width, CV_8UC1, dsrgb_img[1]), cv::Mat(ds_height, ds_width, CV_8UC1, dsrgb_img[0])};
+	cv::split(cv::Mat(ds_height, ds_width, CV_8UC3, dsbgr_image), dsbgr_mat);
 }
 
 //---------------------------------------------------------
-// Enhance YUV image with DEFOG.
+// Allocate min-pooling line buffers.
 //---------------------------------------------------------
-void defog::process_yuv_dp(
-	uint8_t *yuv_image
-)	{
-	assert(yuv_image);
+void defog::init_min_pool()
+{
+	min_pool_buffer = 0;
+	min_pool_bytes = 0;
 	
-	if (false == enable_module) {
+	if (1 != min_pool) {
 		return;
 	}
 	
-#ifdef TEST_DEFOG
-	clock_t start = clock();
-#endif
-	yuv2bgr(yuv_image, width, height, bgr_image);
-#ifdef TEST_DEFOG
-	clock_t finish = clock();
-	printf("\nyuv2bgr %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
-	process_rgb_dp(bgr_image);
+	// Column sums are 16-bit, one block holds at most 257 rows.
+	assert((height + ds_height - 1) / ds_height <= 257);
+	
+	// Three column sums and one column minimum per worker.
+	const int32_t align = 64;
+	min_pool_bytes = (3 * width * sizeof(uint16_t) + width + align - 1) & ~(align - 1);
+	min_pool_buffer = new uint8_t[workers.size() * min_pool_bytes];
+	assert(min_pool_buffer);
+}
 
-#ifdef TEST_DEFOG
-	start = clock();
-#endif
-	bgr2yuv(stretch_img, width, height, yuv_image);
-#ifdef TEST_DEFOG
-	finish = clock();
-	printf("bgr2yuv %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif	
+//---------------------------------------------------------
+// Free min-pooling line buffers.
+//---------------------------------------------------------
+void defog::release_min_pool()
+{
+	if (min_pool_buffer) {
+		delete [] min_pool_buffer;
+		min_pool_buffer = 0;
+	}
 }
 
 //---------------------------------------------------------
-// Find the minimum with Neon acceleration.
+// Up sample transmission thread.
 //---------------------------------------------------------
-static void neon_min(
-	uint8_t *image,
-	int32_t npixels,
-	uint8_t *minv
+template <typename S, typename D>
+static void upsample_thread(
+	int32_t begin,
+	int32_t end,
+	int32_t worker,
+	void *param
 )	{
-	assert(image);
-#ifdef __ARM_NEON__ 	
-	uint8x16_t min_val = vdupq_n_u8(255);
-	for (int32_t i = 0; i < npixels; i += 16) {
-		uint8x16_t data = vld1q_u8(image);
-		min_val = vminq_u8(data, min_val);
-		image += 16;
-	}
+	upsample_thread_param_t *thread_param = (upsample_thread_param_t *)param;
+	thread_param->resampler->resample((const S *)thread_param->src, begin, end, worker,
+		(D *)thread_param->dst + begin * thread_param->width);
+}
+
+//---------------------------------------------------------
+// Up sample transmission with row chunks on the pool.
+//---------------------------------------------------------
+template <typename S, typename D>
+static void parallel_upsample(
+	thread_pool *workers,
+	bilinear_resampler *resampler,
+	const S *src,
+	int32_t width,
+	int32_t height,
+	int32_t nchunks,
+	D *dst
+)	{
+	upsample_thread_param_t thread_param;
+	thread_param.resampler = resampler;
+	thread_param.src = src;
+	thread_param.dst = dst;
+	thread_param.width = width;
 	
-	uint8_t min_buf[16];
-	vst1q_u8(min_buf, min_val);
-	*minv = 255;
+	workers->parallel_for(0, height, nchunks, upsample_thread<S, D>, &thread_param);
+}
+
+//---------------------------------------------------------
+// Estimate parameters of one frame into published buffers.
+//---------------------------------------------------------
+void defog::estimate_frame(
+	uint8_t *frame,
+	int32_t index
+)	{
+	downsample_frame(frame);
+	estimate_parameters(1 == min_pool);
+	memcpy(async_atmo[index], atmo_light, sizeof(atmo_light));
 	
-	for (int32_t i = 0; i < 16; i++) {
-		if (min_buf[i] < *minv) {
-			*minv = min_buf[i];
-		}
+	if (1 == recover_mode) {
+		make_transmission_map(transm_img, ds_width, ds_height, transm_map);
+		parallel_upsample(&workers, &transm_resampler, transm_map, width, height, nrecover_threads,
+			async_transm_map[index]);
+	} else {
+		inverse_transmission(transm_img, ds_width, ds_height, transm_inv);
+		parallel_upsample(&workers, &transm_resampler, transm_inv, width, height, nrecover_threads,
+			async_ustransm[index]);
 	}
-#endif
 }
 
 //---------------------------------------------------------
-// Find the maximum with Neon acceleration.
+// Parameter estimator thread.
 //---------------------------------------------------------
-static void neon_max(
-	uint8_t *image,
-	int32_t npixels,
-	uint8_t *maxv
+void *estimator_thread(
+	void *param
 )	{
-	assert(image);
-#ifdef __ARM_NEON__ 	
-	uint8x16_t max_val = vdupq_n_u8(0);
-	for (int32_t i = 0; i < npixels; i += 16) {
-		uint8x16_t data = vld1q_u8(image);
-		max_val = vmaxq_u8(data, max_val);
-		image += 16;
-	}
-	
-	uint8_t max_buf[16];
-	vst1q_u8(max_buf, max_val);
-	*maxv = 0;
+	defog *pdefog = (defog *)param;
+	printf("start estimator_thread\n");
 	
-	for (int32_t i = 0; i < 16; i++) {
-		if (max_buf[i] > *maxv) {
-			*maxv = max_buf[i];
+	pthread_mutex_lock(&pdefog->estimator_mutex);
+	while (1) {
+		while (!pdefog->estimator_quit && !pdefog->estimator_pending) {
+			pthread_cond_wait(&pdefog->estimator_cond, &pdefog->estimator_mutex);
+		}
+		
+		if (pdefog->estimator_quit) {
+			break;
 		}
+		
+		pdefog->estimator_pending = false;
+		const int32_t generation = pdefog->published_generation;
+		pthread_mutex_unlock(&pdefog->estimator_mutex);
+		
+		// Write the buffer not in use, then publish it.
+		pdefog->estimate_frame(pdefog->estimator_frame, (generation + 1) & 1);
+		__atomic_store_n(&pdefog->published_generation, generation + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&pdefog->estimator_busy, 0, __ATOMIC_RELEASE);
+		
+		pthread_mutex_lock(&pdefog->estimator_mutex);
 	}
-#endif
+	pthread_mutex_unlock(&pdefog->estimator_mutex);
+	
+	return 0;
 }
 
 //---------------------------------------------------------
-// Find the minimum and maximum with Neon acceleration.
+// Allocate published buffers and start estimator thread.
 //---------------------------------------------------------
-static void neon_minmax(
-	uint8_t *image,
-	int32_t npixels,
-	uint8_t *minv,
-	uint8_t *maxv
+void defog::init_estimator()
+{
+	estimator_frame = 0;
+	for (int32_t i = 0; i < 2; i++) {
+		async_ustransm[i] = 0;
+		async_transm_map[i] = 0;
+	}
+	estimator_busy = 0;
+	estimator_pending = false;
+	estimator_quit = false;
+	published_generation = 0;
+	consumed_generation = 0;
+	
+	if (!async_estimate) {
+		return;
+	}
+	
+	estimator_frame = new uint8_t[3 * width * height];
+	assert(estimator_frame);
+	
+	for (int32_t i = 0; i < 2; i++) {
+		if (1 == recover_mode) {
+			async_transm_map[i] = new uint8_t[width * height];
+			assert(async_transm_map[i]);
+		} else {
+			async_ustransm[i] = new float[width * height];
+			assert(async_ustransm[i]);
+		}
+	}
+	
+	pthread_mutex_init(&estimator_mutex, NULL);
+	pthread_cond_init(&estimator_cond, NULL);
+	
+	int32_t ret = pthread_create(&estimator_tid, NULL, estimator_thread, this);
+	if (0 != ret) {
+		printf("Create estimator thread fail!\n");
+		exit(-1);
+	}
+}
+
+//---------------------------------------------------------
+// Stop estimator thread and free published buffers.
+//---------------------------------------------------------
+void defog::release_estimator()
+{
+	if (!async_estimate) {
+		return;
+	}
+	
+	pthread_mutex_lock(&estimator_mutex);
+	estimator_quit = true;
+	pthread_cond_signal(&estimator_cond);
+	pthread_mutex_unlock(&estimator_mutex);
+	pthread_join(estimator_tid, NULL);
+	
+	pthread_mutex_destroy(&estimator_mutex);
+	pthread_cond_destroy(&estimator_cond);
+	
+	if (estimator_frame) {
+		delete [] estimator_frame;
+		estimator_frame = 0;
+	}
+	
+	for (int32_t i = 0; i < 2; i++) {
+		if (async_ustransm[i]) {
+			delete [] async_ustransm[i];
+			async_ustransm[i] = 0;
+		}
+		
+		if (async_transm_map[i]) {
+			delete [] async_transm_map[i];
+			async_transm_map[i] = 0;
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Process function with parameters estimated in background.
+//---------------------------------------------------------
+void defog::process_rgb_async(
+	uint8_t *raw_image
+)	{
+	scoped_timer timer(&profile, PROFILE_PROCESS_RGB_ASYNC);
+	// Idle estimator has published everything it took, so read
+	// the generation after the busy flag.
+	const int32_t busy = __atomic_load_n(&estimator_busy, __ATOMIC_ACQUIRE);
+	int32_t generation = __atomic_load_n(&published_generation, __ATOMIC_ACQUIRE);
+	if (0 == generation) {
+		// Nothing published yet, estimate the first frame in place.
+		estimate_frame(raw_image, 1);
+		generation = 1;
+		__atomic_store_n(&published_generation, generation, __ATOMIC_RELEASE);
+	} else if (!busy && frame_index % update_period == 0) {
+		// Hand over a copy, the estimator writes the other buffer.
+		memcpy(estimator_frame, raw_image, 3 * width * height);
+		__atomic_store_n(&estimator_busy, 1, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&estimator_mutex);
+		estimator_pending = true;
+		pthread_cond_signal(&estimator_cond);
+		pthread_mutex_unlock(&estimator_mutex);
+	}
+	
+	// Recover with the latest published parameters, stretch thresholds
+	// follow every new generation.
+	const int32_t index = generation & 1;
+	const bool update = (generation != consumed_generation);
+	if (1 == recover_mode) {
+		update_recover_table(async_atmo[index]);
+	}
+	
+	int32_t hist[3][256];
+	recover_image(raw_image, async_transm_map[index], async_ustransm[index], async_atmo[index], update ? hist : 0);
+	if (update) {
+		auto_level_thresh(hist, width * height, lowcut_thresh, highcut_thresh, auto_level_floor,
+			auto_level_ceiling);
+		make_stretch_table(auto_level_floor, auto_level_ceiling, stretch_table);
+		consumed_generation = generation;
+	}
+	
+	auto_levels(recover_img, width, height, stretch_table, stretch_img);
+	frame_index++;
+}
+
+//---------------------------------------------------------
+// Totally process function.
+//---------------------------------------------------------
+void defog::process_rgb_dp(
+	uint8_t *raw_image
+)	{
+	hazzy_img = raw_image;
+	
+	if (false == enable_module) {
+		return;
+	}
+	
+	if (async_estimate) {
+		process_rgb_async(raw_image);
+		return;
+	}
+
+	scoped_timer total(&profile, PROFILE_PROCESS_RGB_DP);
+	if (frame_index % update_period == 0) {
+		{
+			scoped_timer timer(&profile, PROFILE_DOWNSAMPLE_FRAME);
+			downsample_frame(hazzy_img);
+		}
+		// Dark channel, atmospheric light and refined transmission.
+		estimate_parameters(1 == min_pool);
+		if (1 == recover_mode) {
+			scoped_timer timer(&profile, PROFILE_MAKE_TRANSMISSION_MAP);
+			// Recover table only depends on atmospheric light.
+			update_recover_table(atmo_light);
+			// Quantized transmission map, upsampled as bytes.
+			make_transmission_map(transm_img, ds_width, ds_height, transm_map);
+			parallel_upsample(&workers, &transm_resampler, transm_map, width, height, nrecover_threads,
+				u8_transmission_image);
+		} else {
+			{
+				scoped_timer timer(&profile, PROFILE_INVERSE_TRANSMISSION);
+				inverse_transmission(transm_img, ds_width, ds_height, transm_inv);
+			}
+			scoped_timer timer(&profile, PROFILE_LINEAR_RESAMPLE);
+			parallel_upsample(&workers, &transm_resampler, transm_inv, width, height, nrecover_threads,
+				ustransm_img);
+		}
+	}
+	// Calculate recover scene radiance image, with histograms on update frames.
+	const bool update = (frame_index % update_period == 0);
+	int32_t hist[3][256];
+	{
+		scoped_timer timer(&profile, PROFILE_RECOVER_SCENE_RADIANCE);
+		recover_image(hazzy_img, u8_transmission_image, ustransm_img, atmo_light, update ? hist : 0);
+	}
+	if (update) {
+		{
+			scoped_timer timer(&profile, PROFILE_AUTO_LEVEL_THRESH);
+			auto_level_thresh(hist, width * height, lowcut_thresh, highcut_thresh, auto_level_floor,
+				auto_level_ceiling);
+		}
+		scoped_timer timer(&profile, PROFILE_MAKE_STRETCH_TABLE);
+		make_stretch_table(auto_level_floor, auto_level_ceiling, stretch_table);
+	}
+	// Auto levels image.
+	{
+		scoped_timer timer(&profile, PROFILE_AUTO_LEVELS);
+		auto_levels(recover_img, width, height, stretch_table, stretch_img);
+	}
+	frame_index++;
+}
+
+//---------------------------------------------------------
+// Enhance YUV image with DEFOG.
+//---------------------------------------------------------
+void defog::process_yuv_dp(
+	uint8_t *yuv_image
+)	{
+	assert(yuv_image);
+	
+	if (false == enable_module) {
+		return;
+	}
+	
+	if (yuv_native) {
+		scoped_timer timer(&profile, PROFILE_PROCESS_YUV_NATIVE);
+		process_yuv_native(yuv_image);
+		return;
+	}
+	
+	if (strip_rows > 0) {
+		scoped_timer timer(&profile, PROFILE_PROCESS_YUV_STRIPS);
+		process_yuv_strips(yuv_image);
+		return;
+	}
+	
+	{
+		scoped_timer timer(&profile, PROFILE_YUV2BGR);
+		yuv2bgr(yuv_image, width, height, bgr_image);
+	}
+	process_rgb_dp(bgr_image);
+	{
+		scoped_timer timer(&profile, PROFILE_BGR2YUV);
+		bgr2yuv(stretch_img, width, height, yuv_image);
+	}
+}
+
+//---------------------------------------------------------
+// Dehaze YUV image in place without full resolution RGB.
+//---------------------------------------------------------
+void defog::process_yuv_native(
+	uint8_t *yuv_image
+)	{
+	const int32_t npixels = width * height;
+	const int32_t uv_width = width >> 1;
+	const int32_t uv_height = height >> 1;
+	uint8_t *y_plane = yuv_image;
+	uint8_t *u_plane = y_plane + npixels;
+	uint8_t *v_plane = u_plane + (npixels >> 2);
+	const bool update = (frame_index % update_period == 0);
+	
+	if (update) {
+		yuv2dsrgb(yuv_image, width, height, ds_width, ds_height, dsrgb_img);
+		estimate_parameters(false);
+		// Recovery is affine per channel, so it commutes with the color
+		// transformation. Atmospheric light is taken to YUV instead.
+		const float R = atmo_light[2];
+		const float G = atmo_light[1];
+		const float B = atmo_light[0];
+		uint8_t atmo_yuv[3];
+		atmo_yuv[0] = cv::saturate_cast<uint8_t>(0.257f * R + 0.504f * G + 0.098f * B + 16);
+		atmo_yuv[1] = cv::saturate_cast<uint8_t>(-0.148f * R - 0.291f * G + 0.439f * B + 128);
+		atmo_yuv[2] = cv::saturate_cast<uint8_t>(0.439f * R - 0.368f * G - 0.071f * B + 128);
+		update_recover_table(atmo_yuv);
+		
+		make_transmission_map(transm_img, ds_width, ds_height, transm_map);
+		parallel_upsample(&workers, &transm_resampler, transm_map, width, height, nrecover_threads,
+			u8_transmission_image);
+		parallel_upsample(&workers, &uv_transm_resampler, transm_map, uv_width, uv_height, nrecover_threads,
+			uv_transm_map);
+		
+		// Stretch thresholds come from the histogram of the recovered luma,
+		// gathered while it is recovered.
+		int32_t hist[3][256];
+		recover_plane(y_plane, u8_transmission_image, width, height, recover_table[0], 0, hist[0]);
+		uint8_t luma_floor, luma_ceiling;
+		auto_level_thresh(hist, npixels, lowcut_thresh, highcut_thresh, &luma_floor, &luma_ceiling, 1);
+		make_yuv_stretch_table(luma_floor, luma_ceiling, stretch_table);
+		recover_plane(y_plane, 0, width, height, 0, stretch_table[0]);
+	} else {
+		recover_plane(y_plane, u8_transmission_image, width, height, recover_table[0], stretch_table[0]);
+	}
+	
+	recover_plane(u_plane, uv_transm_map, uv_width, uv_height, recover_table[1], stretch_table[1]);
+	recover_plane(v_plane, uv_transm_map, uv_width, uv_height, recover_table[2], stretch_table[1]);
+	
+	frame_index++;
+}
+
+//---------------------------------------------------------
+// Find the minimum with Neon acceleration.
+//---------------------------------------------------------
+static void neon_min(
+	uint8_t *image,
+	int32_t npixels,
+	uint8_t *minv
+)	{
+	assert(image);
+#ifdef __ARM_NEON__ 	
+	uint8x16_t min_val = vdupq_n_u8(255);
+	for (int32_t i = 0; i < npixels; i += 16) {
+		uint8x16_t data = vld1q_u8(image);
+		min_val = vminq_u8(data, min_val);
+		image += 16;
+	}
+	
+	uint8_t min_buf[16];
+	vst1q_u8(min_buf, min_val);
+	*minv = 255;
+	
+	for (int32_t i = 0; i < 16; i++) {
+		if (min_buf[i] < *minv) {
+			*minv = min_buf[i];
+		}
+	}
+#else
+	uint8_t maxv;
+	simd_kernels()->minmax(image, npixels, minv, &maxv);
+#endif
+}
+
+//---------------------------------------------------------
+// Find the maximum with Neon acceleration.
+//---------------------------------------------------------
+static void neon_max(
+	uint8_t *image,
+	int32_t npixels,
+	uint8_t *maxv
+)	{
+	assert(image);
+#ifdef __ARM_NEON__ 	
+	uint8x16_t max_val = vdupq_n_u8(0);
+	for (int32_t i = 0; i < npixels; i += 16) {
+		uint8x16_t data = vld1q_u8(image);
+		max_val = vmaxq_u8(data, max_val);
+		image += 16;
+	}
+	
+	uint8_t max_buf[16];
+	vst1q_u8(max_buf, max_val);
+	*maxv = 0;
+	
+	for (int32_t i = 0; i < 16; i++) {
+		if (max_buf[i] > *maxv) {
+			*maxv = max_buf[i];
+		}
+	}
+#else
+	uint8_t minv;
+	simd_kernels()->minmax(image, npixels, &minv, maxv);
+#endif
+}
+
+//---------------------------------------------------------
+// Find the minimum and maximum with Neon acceleration.
+//---------------------------------------------------------
+static void neon_minmax(
+	uint8_t *image,
+	int32_t npixels,
+	uint8_t *minv,
+	uint8_t *maxv
 )	{
 	assert(image);
 #ifdef __ARM_NEON__ 	
@@ -1396,6 +2008,80 @@ static void neon_minmax(
 			*maxv = max_buf[i];
 		}
 	}
+#else
+	simd_kernels()->minmax(image, npixels, minv, maxv);
+#endif
+}
+
+//---------------------------------------------------------
+// Apply lookup table and find the minimum and the maximum of
+// the result with Neon acceleration. The table is looked up
+// in eight blocks of 32 entries, indices out of a block keep
+// the result of the previous blocks.
+//---------------------------------------------------------
+static void lut_minmax(
+	const uint8_t *raw_image,
+	int32_t npixels,
+	const uint8_t table[256],
+	uint8_t *processed_image,
+	uint8_t *minv,
+	uint8_t *maxv
+)	{
+	assert(raw_image);
+	assert(table);
+	assert(processed_image);
+#ifdef __ARM_NEON__ 	
+	uint8x8x4_t table_vec[8];
+	for (int32_t k = 0; k < 8; k++) {
+		for (int32_t j = 0; j < 4; j++) {
+			table_vec[k].val[j] = vld1_u8(table + 32 * k + 8 * j);
+		}
+	}
+	
+	const uint8x8_t step = vdup_n_u8(32);
+	uint8x8_t min_val = vdup_n_u8(255);
+	uint8x8_t max_val = vdup_n_u8(0);
+	int32_t i = 0;
+	for (; i <= npixels - 8; i += 8) {
+		uint8x8_t index = vld1_u8(raw_image + i);
+		uint8x8_t result = vtbl4_u8(table_vec[0], index);
+		for (int32_t k = 1; k < 8; k++) {
+			index = vsub_u8(index, step);
+			result = vtbx4_u8(result, table_vec[k], index);
+		}
+		vst1_u8(processed_image + i, result);
+		min_val = vmin_u8(min_val, result);
+		max_val = vmax_u8(max_val, result);
+	}
+	
+	uint8_t min_buf[8];
+	vst1_u8(min_buf, min_val);
+	*minv = 255;
+	
+	uint8_t max_buf[8];
+	vst1_u8(max_buf, max_val);
+	*maxv = 0;
+	
+	for (int32_t j = 0; j < 8; j++) {
+		if (min_buf[j] < *minv) {
+			*minv = min_buf[j];
+		}
+		if (max_buf[j] > *maxv) {
+			*maxv = max_buf[j];
+		}
+	}
+	
+	for (; i < npixels; i++) {
+		processed_image[i] = table[raw_image[i]];
+		if (processed_image[i] < *minv) {
+			*minv = processed_image[i];
+		}
+		if (processed_image[i] > *maxv) {
+			*maxv = processed_image[i];
+		}
+	}
+#else
+	simd_kernels()->lookup_table_minmax(raw_image, npixels, table, processed_image, minv, maxv);
 #endif
 }
 
@@ -1679,6 +2365,8 @@ void defog::saturation_adjustment(
 		raw_y += width;
 		new_y += width;
 	}
+#else
+	simd_kernels()->saturation_adjustment(raw_y, new_y, uv, width, height);
 #endif
 }
 
@@ -1695,7 +2383,6 @@ static void seg_linar_transf(
 	uint8_t hig_out
 )	{
 	assert(image);
-#ifdef __ARM_NEON__ 	
 	const int32_t npixels = width * height;
 	const int16_t scale[3] = {
 		(int16_t)((low_out << 4) / low_in),
@@ -1707,7 +2394,7 @@ static void seg_linar_transf(
 		(int16_t)((low_out << 4) - scale[1] * low_in),
 		(int16_t)((hig_out << 4) - scale[2] * hig_in)
 	};
-
+#ifdef __ARM_NEON__ 	
 	int16x8_t scale_vec;
 	int16x8_t bias_vec;
 	uint8x8_t result_vec;
@@ -1733,23 +2420,29 @@ static void seg_linar_transf(
 		vst1_u8(image, result_vec);
 		image += 8;
 	}
+#else
+	simd_kernels()->seg_linear_transf(image, npixels, low_in, hig_in, scale, bias);
 #endif
 }
 
 //---------------------------------------------------------
 // Convolution with NEON speed up.
 //---------------------------------------------------------
-#ifdef __ARM_NEON__ 
 static void filter3x3(
 	uint8_t *raw_image,
 	int32_t width,
 	int32_t height,
-	int16x8_t *mask,
+	const int16_t mask[9],
 	uint8_t *new_image
 )	{
 	assert(raw_image);
 	assert(mask);
 	assert(new_image);
+#ifdef __ARM_NEON__ 
+	int16x8_t mask_vec[9];
+	for (int32_t i = 0; i < 9; i++) {
+		mask_vec[i] = vdupq_n_s16(mask[i]);
+	}
 	
 	uint8_t *raw_line[3] = {raw_image, raw_image + width, raw_image + 2 * width};
 	uint8_t *new_line = new_image + width + 1;
@@ -1775,9 +2468,9 @@ static void filter3x3(
 			uint8x8_t secnd_vec = vext_u8(prev_vec[0], next_vec[0], 1);
 			uint8x8_t third_vec = vext_u8(prev_vec[0], next_vec[0], 2);
 			
-			int16x8_t first_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(first_vec)), mask[0]);			
-			int16x8_t secnd_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(secnd_vec)), mask[1]);		
-			int16x8_t third_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(third_vec)), mask[2]);
+			int16x8_t first_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(first_vec)), mask_vec[0]);			
+			int16x8_t secnd_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(secnd_vec)), mask_vec[1]);		
+			int16x8_t third_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(third_vec)), mask_vec[2]);
 					
 			int16x8_t add_vec = vdupq_n_s16(0);
 			add_vec = vaddq_s16(add_vec, first_prod_vec);
@@ -1792,9 +2485,9 @@ static void filter3x3(
 			// Keep center pixel vector.
 			uint8x8_t original = secnd_vec;
 			
-			first_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(first_vec)), mask[3]);
-			secnd_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(secnd_vec)), mask[4]);
-			third_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(third_vec)), mask[5]);
+			first_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(first_vec)), mask_vec[3]);
+			secnd_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(secnd_vec)), mask_vec[4]);
+			third_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(third_vec)), mask_vec[5]);
 			
 			add_vec = vaddq_s16(add_vec, first_prod_vec);
 			add_vec = vaddq_s16(add_vec, secnd_prod_vec);
@@ -1805,9 +2498,9 @@ static void filter3x3(
 			secnd_vec = vext_u8(prev_vec[2], next_vec[2], 1);
 			third_vec = vext_u8(prev_vec[2], next_vec[2], 2);
 			
-			first_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(first_vec)), mask[6]);
-			secnd_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(secnd_vec)), mask[7]);
-			third_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(third_vec)), mask[8]);
+			first_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(first_vec)), mask_vec[6]);
+			secnd_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(secnd_vec)), mask_vec[7]);
+			third_prod_vec = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8(third_vec)), mask_vec[8]);
 			
 			add_vec = vaddq_s16(add_vec, first_prod_vec);
 			add_vec = vaddq_s16(add_vec, secnd_prod_vec);
@@ -1837,8 +2530,10 @@ static void filter3x3(
 		raw_line[1] -= 8;
 		raw_line[2] -= 8;
 	}
-}
+#else
+	simd_kernels()->filter3x3(raw_image, width, height, mask, new_image);
 #endif
+}
 
 //---------------------------------------------------------
 // Clip gray level of Y component.
@@ -1863,6 +2558,8 @@ static void clip_gray_level(
 		vst1q_u8(image, data_vec);
 		image += 16;
 	}
+#else
+	simd_kernels()->clip_gray_level(image, width * height, minv, maxv);
 #endif
 }
 
@@ -2054,6 +2751,8 @@ void median_filter3x3(
 		vst1q_u8(&new_image[width * y + x], q4);
 	}
 	
+#else
+	simd_kernels()->median_filter3x3(raw_image, width, height, new_image);
 #endif
 }
 
@@ -2066,43 +2765,17 @@ void *segment_linear_transf_thread(
 	defog *pdefog = (defog *)param;
 	printf("start segment_linear_transf_thread\n");
 	while (1) {
-		pthread_mutex_lock(&pdefog->clip_yuv_image_mutex);
-		int32_t queue_size = pdefog->clip_yuv_image_queue.size();
-		pthread_mutex_unlock(&pdefog->clip_yuv_image_mutex);
-		if (queue_size > 0) {
-#ifdef TEST_DEFOG
-			printf("clip_yuv_image_queue %d\n", queue_size);
-#endif
-			pthread_mutex_lock(&pdefog->clip_yuv_image_mutex);
-			uint8_t *clip_yuv_image = pdefog->clip_yuv_image_queue.front();
-			
+		defog::frame_t frame;
+		pdefog->clip_yuv_image_queue.pop(frame);
+		uint8_t *clip_yuv_image = frame.data;
+		
+		{
+			scoped_timer timer(&pdefog->profile, PROFILE_PL_SLT);
 			seg_linar_transf(clip_yuv_image, pdefog->width, pdefog->height, pdefog->slt[0],
 				pdefog->slt[1], pdefog->slt[2], pdefog->slt[3]);
-			
-			uint8_t *slt_yuv_image = new uint8_t[pdefog->width * pdefog->height * 3 / 2];
-			assert(slt_yuv_image);
-			
-			memmove(slt_yuv_image, clip_yuv_image, pdefog->width * pdefog->height * 3 / 2);
-			
-			pthread_mutex_lock(&pdefog->slt_yuv_image_mutex);
-			pdefog->slt_yuv_image_queue.push(slt_yuv_image);
-			pthread_mutex_unlock(&pdefog->slt_yuv_image_mutex);
-			
-			if (clip_yuv_image) {
-				delete [] clip_yuv_image;
-				clip_yuv_image = 0;
-			}
-			pdefog->clip_yuv_image_queue.pop();
-			pthread_mutex_unlock(&pdefog->clip_yuv_image_mutex);
-		} else {
-#ifdef _WIN32
-			Sleep(1);
-#elif __linux__
-			usleep(1000);
-#else
-#			error "Unknown compiler"
-#endif
 		}
+		
+		pdefog->slt_yuv_image_queue.push(frame);
 	}
 }
 
@@ -2133,45 +2806,34 @@ void *clahe_thread(
 	defog *pdefog = (defog *)param;
 	printf("start clahe_thread\n");
 	while (1) {
-		pthread_mutex_lock(&pdefog->slt_yuv_image_mutex);
-		int32_t queue_size = pdefog->slt_yuv_image_queue.size();
-		pthread_mutex_unlock(&pdefog->slt_yuv_image_mutex);
-		if (queue_size > 0) {
-#ifdef TEST_DEFOG
-			printf("slt_yuv_image_queue %d\n", queue_size);
-#endif
-			pthread_mutex_lock(&pdefog->slt_yuv_image_mutex);
-			uint8_t *slt_yuv_image = pdefog->slt_yuv_image_queue.front();
-			
+		defog::frame_t frame;
+		pdefog->slt_yuv_image_queue.pop(frame);
+		uint8_t *slt_yuv_image = frame.data;
+		
+		{
+			scoped_timer timer(&pdefog->profile, PROFILE_PL_CLAHE);
 			uint8_t minimum, maximum;
 			neon_minmax(slt_yuv_image, pdefog->width * pdefog->height, &minimum, &maximum);
 			
-			CLAHEq(slt_yuv_image, pdefog->width, pdefog->height, minimum, maximum, 5, 4, 256, pdefog->clip_limit);
-			
-			uint8_t *clahe_yuv_image = new uint8_t[pdefog->width * pdefog->height * 3 / 2];
-			assert(clahe_yuv_image);
-			
-			memmove(clahe_yuv_image, slt_yuv_image, pdefog->width * pdefog->height * 3 / 2);
-			
-			pthread_mutex_lock(&pdefog->clahe_yuv_image_mutex);
-			pdefog->clahe_yuv_image_queue.push(clahe_yuv_image);
-			pthread_mutex_unlock(&pdefog->clahe_yuv_image_mutex);
+			int32_t ret;
+			if (1 == pdefog->clahe_temporal) {
+				ret = CLAHEqTemporal(slt_yuv_image, pdefog->width, pdefog->height, minimum, maximum,
+					pdefog->clahe_grid_x, pdefog->clahe_grid_y, 256, pdefog->clip_limit,
+					pdefog->clahe_temporal_blend, &pdefog->clahe_state, &pdefog->workers,
+					1 == pdefog->auto_clip_limit);
+			} else {
+				ret = CLAHEq(slt_yuv_image, pdefog->width, pdefog->height, minimum, maximum, pdefog->clahe_grid_x,
+					pdefog->clahe_grid_y, 256, pdefog->clip_limit, &pdefog->workers,
+					1 == pdefog->auto_clip_limit);
+			}
 			
-			if (slt_yuv_image) {
-				delete [] slt_yuv_image;
-				slt_yuv_image = 0;
+			if (ret && 0 == pdefog->clahe_error) {
+				printf("CLAHEq fail %d, frames are not equalized.\n", ret);
+				pdefog->clahe_error = ret;
 			}
-			pdefog->slt_yuv_image_queue.pop();
-			pthread_mutex_unlock(&pdefog->slt_yuv_image_mutex);
-		} else {
-#ifdef _WIN32
-			Sleep(1);
-#elif __linux__
-			usleep(1000);
-#else
-#			error "Unknown compiler"
-#endif
 		}
+		
+		pdefog->clahe_yuv_image_queue.push(frame);
 	}
 }
 
@@ -2202,50 +2864,23 @@ void *edge_enhance_thread(
 	defog *pdefog = (defog *)param;
 	printf("start edge_enhance_thread\n");
 	while (1) {
-		pthread_mutex_lock(&pdefog->clahe_yuv_image_mutex);
-		int32_t queue_size = pdefog->clahe_yuv_image_queue.size();
-		pthread_mutex_unlock(&pdefog->clahe_yuv_image_mutex);
-		if (queue_size > 0) {
-#ifdef TEST_DEFOG
-			printf("clahe_yuv_image_queue %d\n", queue_size);
-#endif
-			pthread_mutex_lock(&pdefog->clahe_yuv_image_mutex);
-			uint8_t *clahe_yuv_image = pdefog->clahe_yuv_image_queue.front();
-			
-			uint8_t *edge_yuv_image = new uint8_t[pdefog->width * pdefog->height * 3 / 2];
-			assert(edge_yuv_image);
-			if (pdefog->enable_edge_enhan) {
-				cv::GaussianBlur(cv::Mat(pdefog->height, pdefog->width, CV_8UC1, clahe_yuv_image),
-					cv::Mat(pdefog->height, pdefog->width, CV_8UC1, edge_yuv_image), cv::Size(3, 3), 0, 0);
-#ifdef __ARM_NEON__ 		
-				int16x8_t mask[9] = {vdupq_n_s16(1), vdupq_n_s16(1),  vdupq_n_s16(1),
-									 vdupq_n_s16(1), vdupq_n_s16(-8), vdupq_n_s16(1),
-									 vdupq_n_s16(1), vdupq_n_s16(1),  vdupq_n_s16(1)};
-									 
-				filter3x3(edge_yuv_image, pdefog->width, pdefog->height, mask, clahe_yuv_image);
-#endif
-			}
+		defog::frame_t frame;
+		pdefog->clahe_yuv_image_queue.pop(frame);
+		uint8_t *clahe_yuv_image = frame.data;
 		
-			memmove(edge_yuv_image, clahe_yuv_image, pdefog->width * pdefog->height * 3 / 2);
-			pthread_mutex_lock(&pdefog->edge_yuv_image_mutex);
-			pdefog->edge_yuv_image_queue.push(edge_yuv_image);
-			pthread_mutex_unlock(&pdefog->edge_yuv_image_mutex);
-			
-			if (clahe_yuv_image) {
-				delete [] clahe_yuv_image;
-				clahe_yuv_image = 0;
-			}
-			pdefog->clahe_yuv_image_queue.pop();
-			pthread_mutex_unlock(&pdefog->clahe_yuv_image_mutex);
-		} else {
-#ifdef _WIN32
-			Sleep(1);
-#elif __linux__
-			usleep(1000);
-#else
-#			error "Unknown compiler"
-#endif
+		if (pdefog->enable_edge_enhan) {
+			scoped_timer timer(&pdefog->profile, PROFILE_PL_EDGE_ENHANCE);
+			// The blur needs a second Y plane, the filter writes back into the frame.
+			cv::GaussianBlur(cv::Mat(pdefog->height, pdefog->width, CV_8UC1, clahe_yuv_image),
+				cv::Mat(pdefog->height, pdefog->width, CV_8UC1, pdefog->edge_blur_y_image), cv::Size(3, 3), 0, 0);
+			const int16_t mask[9] = {1, 1,  1,
+									 1, -8, 1,
+									 1, 1,  1};
+								 
+			filter3x3(pdefog->edge_blur_y_image, pdefog->width, pdefog->height, mask, clahe_yuv_image);
 		}
+	
+		pdefog->edge_yuv_image_queue.push(frame);
 	}
 }
 
@@ -2305,6 +2940,8 @@ static void motion_adapt_noise_reduction(
 		curr_image += 8;
 		prev_image += 8;
 	}
+#else
+	simd_kernels()->motion_adapt_noise_reduction(curr_image, prev_image, width * height, MTF);
 #endif
 }
 
@@ -2317,19 +2954,12 @@ void *sat_adjust_manr_thread(
 	defog *pdefog = (defog *)param;
 	printf("start sat_adjust_manr_thread\n");
 	while (1) {
-		pthread_mutex_lock(&pdefog->edge_yuv_image_mutex);
-		int32_t queue_size = pdefog->edge_yuv_image_queue.size();
-		pthread_mutex_unlock(&pdefog->edge_yuv_image_mutex);
-		if (queue_size > 0) {
-#ifdef TEST_DEFOG
-			printf("edge_yuv_image_queue %d\n", queue_size);
-#endif
-			pthread_mutex_lock(&pdefog->edge_yuv_image_mutex);
-			uint8_t *edge_yuv_image = pdefog->edge_yuv_image_queue.front();
-			
-			uint8_t *sa_manr_yuv_image = new uint8_t[pdefog->width * pdefog->height * 3 / 2];
-			assert(sa_manr_yuv_image);
-			
+		defog::frame_t frame;
+		pdefog->edge_yuv_image_queue.pop(frame);
+		uint8_t *edge_yuv_image = frame.data;
+		
+		{
+			scoped_timer timer(&pdefog->profile, PROFILE_PL_SAT_ADJUST_MANR);
 			if (pdefog->enable_T_noise_reduce) {
 				if (false == pdefog->init_prev_manr_y_image_flag) {
 					memmove(pdefog->prev_manr_y_image, edge_yuv_image, pdefog->width * pdefog->height);
@@ -2339,56 +2969,23 @@ void *sat_adjust_manr_thread(
 					memmove(pdefog->prev_manr_y_image, edge_yuv_image, pdefog->width * pdefog->height);
 				}
 			}
-			
+		
 			if (pdefog->enable_2D_noise_reduce) {
 				median_filter3x3(edge_yuv_image, pdefog->width, pdefog->height, pdefog->mfilt_y_image);
 				memmove(edge_yuv_image, pdefog->mfilt_y_image, pdefog->width * pdefog->height);
 			}
-			
+		
 			if (pdefog->enable_uv_adjust) {
-				pthread_mutex_lock(&pdefog->raw_y_image_mutex);
-				queue_size = pdefog->raw_y_image_queue.size();
-				pthread_mutex_unlock(&pdefog->raw_y_image_mutex);
-				
-				if (queue_size > 0) {
-#ifdef TEST_DEFOG
-					printf("raw_y_image_queue %d\n", queue_size);
-#endif
-					pthread_mutex_lock(&pdefog->raw_y_image_mutex);
-					uint8_t *raw_y_image = pdefog->raw_y_image_queue.front();
+				uint8_t *raw_y_image;
+				if (pdefog->raw_y_image_queue.try_pop(raw_y_image)) {
 					pdefog->saturation_adjustment(raw_y_image, edge_yuv_image, edge_yuv_image +
 						pdefog->width * pdefog->height, pdefog->width, pdefog->height);
-					if (raw_y_image) {
-						delete [] raw_y_image;
-						raw_y_image = 0;
-					}
-					
-					pdefog->raw_y_image_queue.pop();
-					pthread_mutex_unlock(&pdefog->raw_y_image_mutex);
+					pdefog->ce_raw_y_frames.release(raw_y_image);
 				}
 			}
-			
-			memmove(sa_manr_yuv_image, edge_yuv_image, pdefog->width * pdefog->height * 3 / 2);
-			pthread_mutex_lock(&pdefog->sa_manr_yuv_image_mutex);
-			pdefog->sa_manr_yuv_image_queue.push(sa_manr_yuv_image);
-			pthread_mutex_unlock(&pdefog->sa_manr_yuv_image_mutex);
-			
-			if (edge_yuv_image) {
-				delete [] edge_yuv_image;
-				edge_yuv_image = 0;
-			}
-			
-			pdefog->edge_yuv_image_queue.pop();
-			pthread_mutex_unlock(&pdefog->edge_yuv_image_mutex);
-		} else {
-#ifdef _WIN32
-			Sleep(1);
-#elif __linux__
-			usleep(1000);
-#else
-#			error "Unknown compiler"
-#endif
 		}
+		
+		pdefog->sa_manr_yuv_image_queue.push(frame);
 	}
 }
 
@@ -2422,118 +3019,87 @@ void defog::process_yuv_ce(
 		return;
 	}
 	
-#ifdef EASY_TEST_DEFOG
-	clock_t start = clock();
-#endif
-#ifdef TEST_DEFOG
-	clock_t start, finish;
-	printf("\n");
-#endif
-
-#ifdef TEST_DEFOG	
-	start = clock();
-#endif
-	clip_gray_level(yuv_image, width, height, Y_FLOOR, Y_CEILING);
-#ifdef TEST_DEFOG
-	finish = clock();
-	printf("clip_gray_level %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
+	scoped_timer total(&profile, PROFILE_PROCESS_YUV_CE);
 	if (enable_uv_adjust) {
+		{
+			scoped_timer timer(&profile, PROFILE_CLIP_GRAY_LEVEL);
+			clip_gray_level(yuv_image, width, height, Y_FLOOR, Y_CEILING);
+		}
 		memmove(old_y, yuv_image, width * height);
 	}
-
-	if (gamma < 0.999f || gamma > 1.001f) {
-#ifdef TEST_DEFOG	
-		start = clock();
-#endif
-		seg_linar_transf(yuv_image, width, height, slt[0], slt[1], slt[2], slt[3]);
-#ifdef TEST_DEFOG
-		finish = clock();
-		printf("seg_linar_transf %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif	
-	}
 	
-#ifdef TEST_DEFOG
-	start = clock();
-#endif
+	// Clipping, segmented linear transformation and min/max in one pass.
 	uint8_t minv, maxv;
-	neon_minmax(yuv_image, width * height, &minv, &maxv);
-#ifdef TEST_DEFOG
-	finish = clock();
-	printf("neon_minmax %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-	start = clock();
-#endif
+	{
+		scoped_timer timer(&profile, PROFILE_LUT_MINMAX);
+		lut_minmax(yuv_image, width * height, ce_lut.data(), yuv_image, &minv, &maxv);
+	}
 	
-	CLAHEq(yuv_image, width, height, minv, maxv, 5, 4, 256, clip_limit);
-#ifdef TEST_DEFOG
-	finish = clock();
-	printf("CLAHEq %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
+	{
+		scoped_timer timer(&profile, PROFILE_CLAHEQ);
+		int32_t ret;
+		if (1 == clahe_temporal) {
+			ret = CLAHEqTemporal(yuv_image, width, height, minv, maxv, clahe_grid_x, clahe_grid_y, 256, clip_limit,
+				clahe_temporal_blend, &clahe_state, &workers, 1 == auto_clip_limit);
+		} else {
+			ret = CLAHEq(yuv_image, width, height, minv, maxv, clahe_grid_x, clahe_grid_y, 256, clip_limit, &workers,
+				1 == auto_clip_limit);
+		}
+		
+		if (ret && 0 == clahe_error) {
+			printf("CLAHEq fail %d, frames are not equalized.\n", ret);
+			clahe_error = ret;
+		}
+	}
 
 	if (enable_edge_enhan) {
 		cv::Mat blur_y;
-#ifdef TEST_DEFOG		
-		start = clock();
-#endif
-		cv::GaussianBlur(cv::Mat(height, width, CV_8UC1, yuv_image), blur_y, cv::Size(3, 3), 0, 0);
-#ifdef TEST_DEFOG
-		finish = clock();
-		printf("GaussianBlur %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif		
-		int16x8_t mask[9] = {vdupq_n_s16(1), vdupq_n_s16(1),  vdupq_n_s16(1),
-							 vdupq_n_s16(1), vdupq_n_s16(-8), vdupq_n_s16(1),
-							 vdupq_n_s16(1), vdupq_n_s16(1),  vdupq_n_s16(1)};
-
-#ifdef TEST_DEFOG		
-		start = clock();
-#endif
+		{
+			scoped_timer timer(&profile, PROFILE_GAUSSIAN_BLUR);
+			cv::GaussianBlur(cv::Mat(height, width, CV_8UC1, yuv_image), blur_y, cv::Size(3, 3), 0, 0);
+		}
+		const int16_t mask[9] = {1, 1,  1,
+								 1, -8, 1,
+								 1, 1,  1};
+
+		scoped_timer timer(&profile, PROFILE_FILTER3X3);
 		filter3x3(blur_y.data, width, height, mask, yuv_image);
-#ifdef TEST_DEFOG
-		finish = clock();
-		printf("filter3x3 %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif		
 	}
 	
 	if (false == init_prev_manr_y_image_flag) {
 		memmove(prev_manr_y_image, yuv_image, width * height);
 		init_prev_manr_y_image_flag = true;
 	} else {
-#ifdef TEST_DEFOG		
-		start = clock();
-#endif
-		motion_adapt_noise_reduction(yuv_image, prev_manr_y_image, width, height);
-#ifdef TEST_DEFOG
-		finish = clock();
-		printf("motion_adapt_noise_reduction %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
+		{
+			scoped_timer timer(&profile, PROFILE_MOTION_ADAPT_NOISE_REDUCTION);
+			motion_adapt_noise_reduction(yuv_image, prev_manr_y_image, width, height);
+		}
 		memmove(prev_manr_y_image, yuv_image, width * height);
 	}
 	
 	if (enable_uv_adjust) {
 		// cv::imwrite("raw.png", cv::Mat(height, width, CV_8UC1, yuv_image));
-#ifdef TEST_DEFOG		
-		start = clock();
-#endif
-		saturation_adjustment(old_y, yuv_image, yuv_image + width * height, width, height);
-#ifdef TEST_DEFOG
-		finish = clock();
-		printf("saturation_adjustment %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
-#ifdef TEST_DEFOG		
-		start = clock();
-#endif
-		median_filter3x3(yuv_image, width, height, mfilt_y_image);	
-#ifdef TEST_DEFOG
-		finish = clock();
-		printf("median_filter3x3 %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
+		{
+			scoped_timer timer(&profile, PROFILE_SATURATION_ADJUSTMENT);
+			saturation_adjustment(old_y, yuv_image, yuv_image + width * height, width, height);
+		}
+		{
+			scoped_timer timer(&profile, PROFILE_MEDIAN_FILTER3X3);
+			median_filter3x3(yuv_image, width, height, mfilt_y_image);
+		}
 		memmove(yuv_image, mfilt_y_image, width * height);
 		// cv::imwrite("mfilt.png", cv::Mat(height, width, CV_8UC1, mfilt_y_image));
 	}
-#ifdef EASY_TEST_DEFOG
-	clock_t finish = clock();
-	printf("CLAHE all %lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
+}
+
+//---------------------------------------------------------
+// Monotonic time in microseconds for frame timestamps.
+//---------------------------------------------------------
+static int64_t monotonic_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 //---------------------------------------------------------
@@ -2548,51 +3114,72 @@ void defog::process_yuv_ce_pl(
 		return;
 	}
 	
-	uint8_t *clip_yuv_image = new uint8_t[width * height * 3 / 2];
-	assert(clip_yuv_image);
-	
-	memmove(clip_yuv_image, yuv_image, width * height * 3 / 2);
-	clip_gray_level(clip_yuv_image, width, height, Y_FLOOR, Y_CEILING);
-	
-	if (enable_uv_adjust) {
-		uint8_t *raw_y_image = new uint8_t[width * height];
-		assert(raw_y_image);
-		memmove(raw_y_image, clip_yuv_image, width * height);
-		pthread_mutex_lock(&raw_y_image_mutex);
-		raw_y_image_queue.push(raw_y_image);
-		pthread_mutex_unlock(&raw_y_image_mutex);
+	// The frame moves through all stages in one pool buffer and comes back to
+	// the pool here. Drop the frame when the pipeline is behind: no free buffer
+	// or a full ring. Only this thread pushes, so a ring that is not full takes
+	// the frame, and the raw luma ring holds one for every pool frame.
+	frame_t frame;
+	frame.data = ce_frames.acquire();
+	frame.seq = ce_seq++;
+	frame.timestamp = monotonic_us();
+	uint8_t *raw_y_image = 0;
+	if (frame.data && enable_uv_adjust) {
+		raw_y_image = ce_raw_y_frames.acquire();
+		if (!raw_y_image) {
+			ce_frames.release(frame.data);
+			frame.data = 0;
+		}
 	}
 	
-	pthread_mutex_lock(&clip_yuv_image_mutex);
-	clip_yuv_image_queue.push(clip_yuv_image);
-	pthread_mutex_unlock(&clip_yuv_image_mutex);
+	if (frame.data && !clip_yuv_image_queue.full()) {
+		memmove(frame.data, yuv_image, width * height * 3 / 2);
+		clip_gray_level(frame.data, width, height, Y_FLOOR, Y_CEILING);
+		if (raw_y_image) {
+			memmove(raw_y_image, frame.data, width * height);
+			raw_y_image_queue.push(raw_y_image);
+		}
+		
+		clip_yuv_image_queue.push(frame);
+	} else {
+		// With a fixed delay at most pipeline_delay + 1 frames are in flight,
+		// so nothing is dropped and every output frame has its successor.
+		assert(pipeline_delay <= 0);
+		if (frame.data) {
+			ce_frames.release(frame.data);
+		}
+		if (raw_y_image) {
+			ce_raw_y_frames.release(raw_y_image);
+		}
+	}
 	
+	frame_t out;
+	if (pipeline_delay > 0) {
+		// Wait for the frame pipeline_delay frames back. The first
+		// pipeline_delay frames are passed through unchanged.
+		if (frame.seq < pipeline_delay) {
+			return;
+		}
+		
+		sa_manr_yuv_image_queue.pop(out);
+		assert(out.seq == frame.seq - pipeline_delay);
+	} else {
 #ifdef _WIN32
-	Sleep(1);
+		Sleep(1);
 #elif __linux__
-	usleep(1000);
+		usleep(1000);
 #else
-#	error "Unknown compiler"
+#		error "Unknown compiler"
 #endif
-	
-	pthread_mutex_lock(&sa_manr_yuv_image_mutex);
-	int32_t queue_size = sa_manr_yuv_image_queue.size();
-	pthread_mutex_unlock(&sa_manr_yuv_image_mutex);
-	if (queue_size > 0) {
-#ifdef TEST_DEFOG
-		printf("sa_manr_yuv_image_queue %d\n", queue_size);
-#endif
-		pthread_mutex_lock(&sa_manr_yuv_image_mutex);
-		uint8_t *sa_manr_yuv_image = sa_manr_yuv_image_queue.front();			
-		memmove(yuv_image, sa_manr_yuv_image, width * height * 3 / 2);
-	
-		if (sa_manr_yuv_image) {
-			delete [] sa_manr_yuv_image;
-			sa_manr_yuv_image = 0;
+		if (!sa_manr_yuv_image_queue.try_pop(out)) {
+			return;
 		}
-		sa_manr_yuv_image_queue.pop();
-		pthread_mutex_unlock(&sa_manr_yuv_image_mutex);
 	}
+	
+	if (profile.enabled()) {
+		profile.record(PROFILE_CE_PL_LATENCY, 1000 * (monotonic_us() - out.timestamp));
+	}
+	memmove(yuv_image, out.data, width * height * 3 / 2);
+	ce_frames.release(out.data);
 }
 
 //---------------------------------------------------------
@@ -2694,58 +3281,84 @@ void defog::estimate_atmospheric_light(
 }
 
 //---------------------------------------------------------
-// Normalize minimum filter image thread.
-//---------------------------------------------------------
-void *normalize_min_filt_image_thread(
-	void *param
-)	{
-	normalize_thread_param_t *normalize_min_filt = (normalize_thread_param_t *)param;
-	const int32_t npixels = normalize_min_filt->npixels;
-	const uint8_t atmo_light = normalize_min_filt->atmo_light;
-	const int32_t nlevels = 256;
-	float norm_table[nlevels];
-	
-	for (int32_t i = 0; i < nlevels; i++) {
-		norm_table[i] = (float)i / atmo_light;
-	}
-	
-	for (int32_t i = 0; i < npixels; i++) {
-		normalize_min_filt->norm_data[i] = norm_table[normalize_min_filt->data[i]];
-	}
-	return (void *)(0);
-}
-
-//---------------------------------------------------------
-// Normalize minimum filter image.
+// Estimate atmospheric light with quadtree subdivision.
 //---------------------------------------------------------
-void defog::normalize_min_filt_image(
+void defog::quadtree_atmospheric_light(
 	uint8_t *raw_image[3],
+	uint8_t *dark_channel_image,
 	int32_t width,
 	int32_t height,
-	uint8_t atmo_light[3],
-	float *processed_image[3]
-)	{	
-	const int32_t nchannels = 3;
-	pthread_t tid[nchannels];
-	normalize_thread_param_t normalize_min_filt[nchannels];
-	
-	for (int32_t c = 0; c < nchannels; c++) {
-		normalize_min_filt[c].data = raw_image[c];
-		normalize_min_filt[c].npixels = width * height;
-		normalize_min_filt[c].atmo_light = atmo_light[c];
-		normalize_min_filt[c].norm_data = processed_image[c];
+	uint8_t atmo_light_ceiling,
+	uint8_t atmo_light[3]
+)	{
+	// Keep the quadrant of the dark channel with the highest mean minus
+	// standard deviation, i.e. the brightest and flattest haze region.
+	int32_t left = 0;
+	int32_t top = 0;
+	int32_t region_width = width;
+	int32_t region_height = height;
+	while (region_width > QUADTREE_MIN_SIZE && region_height > QUADTREE_MIN_SIZE) {
+		const int32_t half_width = region_width >> 1;
+		const int32_t half_height = region_height >> 1;
+		const int32_t quad_left[4] = {left, left + half_width, left, left + half_width};
+		const int32_t quad_top[4] = {top, top, top + half_height, top + half_height};
+		const int32_t quad_width[4] = {half_width, region_width - half_width, half_width,
+			region_width - half_width};
+		const int32_t quad_height[4] = {half_height, half_height, region_height - half_height,
+			region_height - half_height};
+		
+		int32_t best = 0;
+		float best_score = -std::numeric_limits<float>::max();
+		for (int32_t q = 0; q < 4; q++) {
+			int64_t sum = 0;
+			int64_t square_sum = 0;
+			for (int32_t y = quad_top[q]; y < quad_top[q] + quad_height[q]; y++) {
+				const uint8_t *dark = dark_channel_image + y * width + quad_left[q];
+				for (int32_t x = 0; x < quad_width[q]; x++) {
+					sum += dark[x];
+					square_sum += dark[x] * dark[x];
+				}
+			}
+			
+			const float area = static_cast<float>(quad_width[q] * quad_height[q]);
+			const float mean = sum / area;
+			const float var = std::max(square_sum / area - mean * mean, 0.0f);
+			const float score = mean - sqrtf(var);
+			if (score > best_score) {
+				best_score = score;
+				best = q;
+			}
+		}
+		
+		left = quad_left[best];
+		top = quad_top[best];
+		region_width = quad_width[best];
+		region_height = quad_height[best];
 	}
 	
-	for (int32_t c = 0; c < nchannels; c++) {
-		int32_t ret = pthread_create(&tid[c], NULL, normalize_min_filt_image_thread, &normalize_min_filt[c]);
-		if (0 != ret) {
-			printf("Create normalize minimum filter image thread[%d] fail!\n", c);
-			exit(-1);
+	// Pick the pixel closest to white in the selected region.
+	int32_t best_distance = std::numeric_limits<int32_t>::max();
+	for (int32_t y = top; y < top + region_height; y++) {
+		for (int32_t x = left; x < left + region_width; x++) {
+			const int32_t i = y * width + x;
+			const int32_t d0 = 255 - raw_image[0][i];
+			const int32_t d1 = 255 - raw_image[1][i];
+			const int32_t d2 = 255 - raw_image[2][i];
+			const int32_t distance = d0 * d0 + d1 * d1 + d2 * d2;
+			if (distance < best_distance) {
+				best_distance = distance;
+				atmo_light[0] = raw_image[0][i];
+				atmo_light[1] = raw_image[1][i];
+				atmo_light[2] = raw_image[2][i];
+			}
 		}
 	}
-
+	
+	const int32_t nchannels = 3;
 	for (int32_t c = 0; c < nchannels; c++) {
-		pthread_join(tid[c], NULL);
+		if (atmo_light[c] > atmo_light_ceiling) {
+			atmo_light[c] = atmo_light_ceiling;
+		}
 	}
 }
 
@@ -2753,16 +3366,33 @@ void defog::normalize_min_filt_image(
 // Estimate transmission.
 //---------------------------------------------------------
 void defog::estimate_transmission(
-	float *norm_dark_channel_image,
+	uint8_t *raw_image[3],
 	int32_t width,
 	int32_t height,
+	uint8_t atmo_light[3],
 	float omega,
+	float *cache_image,
 	float *transmission_image
-)	{	
+)	{
+	// 1 - omega * min(I / A) equals max(1 - omega * I / A), so the
+	// per-channel transmission can be looked up directly.
+	const int32_t nlevels = 256;
+	float tran_table[3][nlevels];
+	for (int32_t c = 0; c < 3; c++) {
+		const float scale = omega / (atmo_light[c] > 0 ? atmo_light[c] : 1);
+		for (int32_t i = 0; i < nlevels; i++) {
+			tran_table[c][i] = 1 - scale * i;
+		}
+	}
+	
 	const int32_t npixels = width * height;
 	for (int32_t i = 0; i < npixels; i++) {
-		transmission_image[i] = 1 - omega * norm_dark_channel_image[i];
+		cache_image[i] = std::max(std::max(tran_table[0][raw_image[0][i]], tran_table[1][raw_image[1][i]]),
+			tran_table[2][raw_image[2][i]]);
 	}
+	
+	// Maximum filter of transmission equals minimum filter of normalized image.
+	max_filter<float>(cache_image, width, height, kmin_size, transmission_image);
 }
 
 //---------------------------------------------------------
@@ -2773,37 +3403,17 @@ void defog::refine_transmission(
 	float *transmission_image,
 	int32_t width,
 	int32_t height,
-	int32_t ksize,
 	float tran_thresh
 )	{
-	cv::Mat P(height, width, CV_32FC1, transmission_image);
+	gud_filter.filter(red_image, transmission_image, transmission_image);
 
-	cv::Mat G(height, width, CV_32FC1);
-	float *pG = (float *)G.data;
-	
-	const int32_t nlevels = 256;
-	float norm_table[nlevels];
-	for (int32_t i = 0; i < nlevels; i++) {
-		norm_table[i] = i / 255.0f;
-	}
-	
 	const int32_t npixels = width * height;
-	#pragma omp parallel for
-	for (int32_t i = 0; i < npixels; i++) {
-		pG[i] = norm_table[red_image[i]];
-	}
-
-	cv::Mat Q = guided_filter(G, P, ksize);
-	float *pQ = (float *)Q.data;
-
-	#pragma omp parallel for
 	for (int32_t i = 0; i < npixels; i++) {
-		if (pQ[i] > 1) {
-			pQ[i] = 1;
-		} else if (pQ[i] < tran_thresh) {
-			pQ[i] = tran_thresh;
+		if (transmission_image[i] > 1) {
+			transmission_image[i] = 1;
+		} else if (transmission_image[i] < tran_thresh) {
+			transmission_image[i] = tran_thresh;
 		}
-		transmission_image[i] = pQ[i];
 	}
 }
 
@@ -2814,13 +3424,36 @@ void defog::make_transmission_map(
 	float *transmission_image,
 	int32_t width,
 	int32_t height,
-	int32_t *transmission_map
+	uint8_t *transmission_map
 )	{
 	const int32_t npixels = width * height;
 	
-	#pragma omp parallel for
 	for (int32_t i = 0; i < npixels; i++) {
-		transmission_map[i] = transmission_image[i] * MAX_TRANSMISSION;
+		int32_t level = static_cast<int32_t>(transmission_image[i] * MAX_TRANSMISSION + 0.5f);
+		transmission_map[i] = std::min(std::max(level, 1), MAX_TRANSMISSION);
+	}
+}
+
+//---------------------------------------------------------
+// Make recover table.
+//---------------------------------------------------------
+void defog::make_recover_table(
+	uint8_t atmo_light[3],
+	uint8_t ***recover_table
+)	{
+	const int32_t nchannels = 3;
+	const int32_t nlevels = 256;
+	
+	for (int32_t c = 0; c < nchannels; c++) {
+		for (int32_t i = 0; i < nlevels; i++) {
+			uint8_t *table = recover_table[c][i];
+			const float diff = static_cast<float>(i - atmo_light[c]);
+			// Level zero never occurs in transmission map.
+			table[0] = cv::saturate_cast<uint8_t>(diff * MAX_TRANSMISSION + atmo_light[c]);
+			for (int32_t t = 1; t <= MAX_TRANSMISSION; t++) {
+				table[t] = cv::saturate_cast<uint8_t>(diff * MAX_TRANSMISSION / t + atmo_light[c]);
+			}
+		}
 	}
 }
 
@@ -2852,26 +3485,32 @@ void defog::inverse_transmission(
 		transmission_image += npixels_per_loop;
 		transmission_inv += npixels_per_loop;
 	}
+#else
+	simd_kernels()->reciprocal(transmission_image, width * height, transmission_inv);
 #endif
 }
 
 //---------------------------------------------------------
 // Recover scene radiance thread.
 //---------------------------------------------------------
-void *recover_scene_radiance_thread(
+static void recover_scene_radiance_thread(
+	int32_t begin,
+	int32_t end,
+	int32_t worker,
 	void *param
 )	{
 	recover_thread_param_t *thread_param = (recover_thread_param_t *)param;
 	
-	uint8_t *hazzy_data = thread_param->hazzy_data;
+	const int32_t nchannels = 3;
+	const int32_t bytes_per_pixel = 3;
+	const int32_t first_pixel = begin * thread_param->width;
+	uint8_t *hazzy_data = thread_param->hazzy_data + first_pixel * bytes_per_pixel;
 	uint8_t *atmo_light = thread_param->atmo_light;
-	float *tran_data = thread_param->tran_data;
-	const int32_t npixels = thread_param->npixels;
+	float *tran_data = thread_param->tran_data + first_pixel;
+	const int32_t npixels = (end - begin) * thread_param->width;
 	int32_t (*diff_table)[3] = thread_param->diff_table;
-	uint8_t *recover_data = thread_param->recover_data;
+	uint8_t *recover_data = thread_param->recover_data + first_pixel * bytes_per_pixel;
 
-	const int32_t nchannels = 3;
-	const int32_t bytes_per_pixel = 3;
 	for (int32_t i = 0; i < npixels; i++) {
 		float trans = tran_data[i];
 		for (int32_t c = 0; c < nchannels; c++) {
@@ -2880,7 +3519,10 @@ void *recover_scene_radiance_thread(
 			recover_data[ic] = cv::saturate_cast<uint8_t>(val);
 		}
 	}
-	return (void *)(0);
+	
+	if (thread_param->sub_hist) {
+		accumulate_hist(recover_data, npixels, thread_param->sub_hist + worker * nchannels * 256);
+	}
 }
 
 //---------------------------------------------------------
@@ -2892,7 +3534,8 @@ void defog::recover_scene_radiance(
 	int32_t width,
 	int32_t height,
 	uint8_t atmo_light[3],
-	uint8_t *processed_image
+	uint8_t *processed_image,
+	int32_t *sub_hist
 )	{
 	const int32_t nchannels = 3;
 	const int32_t nlevels = 256;
@@ -2903,46 +3546,323 @@ void defog::recover_scene_radiance(
 		diff_table[i][2] = i - atmo_light[2];
 	}
 
-	const int32_t nthreads = nrecover_threads;
-	pthread_t tid[nthreads];
-	recover_thread_param_t thread_param[nthreads];
-	const int32_t sample_height = height / nthreads;
-	const int32_t nsample_pixels = width * sample_height;
+	// Number of recover threads is the number of row chunks.
+	recover_thread_param_t thread_param;
+	thread_param.hazzy_data = raw_image;
+	thread_param.tran_data = transmission_image;
+	thread_param.width = width;
+	thread_param.atmo_light = atmo_light;
+	thread_param.diff_table = diff_table;
+	thread_param.recover_data = processed_image;
+	thread_param.sub_hist = sub_hist;
+	
+	workers.parallel_for(0, height, nrecover_threads, recover_scene_radiance_thread, &thread_param);
+}
 
-	for (int32_t t = 0; t < nthreads - 1; t++) {
-		thread_param[t].hazzy_data = raw_image + t * nsample_pixels * nchannels;
-		thread_param[t].tran_data = transmission_image + t * nsample_pixels;	
-		thread_param[t].npixels = nsample_pixels;		
-		thread_param[t].atmo_light = atmo_light;	
-		thread_param[t].diff_table = diff_table;
-		thread_param[t].recover_data = processed_image + t * nsample_pixels * nchannels;
+//---------------------------------------------------------
+// Rebuild recover table when atmospheric light changes.
+//---------------------------------------------------------
+void defog::update_recover_table(
+	uint8_t atmo_light[3]
+)	{
+	const int32_t nchannels = 3;
+	if (recover_table_ready && 0 == memcmp(recover_table_atmo, atmo_light, nchannels)) {
+		return;
+	}
+	
+	make_recover_table(atmo_light, recover_table);
+	memcpy(recover_table_atmo, atmo_light, nchannels);
+	recover_table_ready = true;
+}
+
+//---------------------------------------------------------
+// Table lookup recover scene radiance thread.
+//---------------------------------------------------------
+static void lut_recover_scene_radiance_thread(
+	int32_t begin,
+	int32_t end,
+	int32_t worker,
+	void *param
+)	{
+	lut_recover_thread_param_t *thread_param = (lut_recover_thread_param_t *)param;
+	
+	const int32_t bytes_per_pixel = 3;
+	const int32_t first_pixel = begin * thread_param->width;
+	const uint8_t *hazzy_data = thread_param->hazzy_data + first_pixel * bytes_per_pixel;
+	const uint8_t *tran_map = thread_param->tran_map + first_pixel;
+	const int32_t npixels = (end - begin) * thread_param->width;
+	uint8_t *recover_data = thread_param->recover_data + first_pixel * bytes_per_pixel;
+	// Table of memory channel m is recover_table[2 - m].
+	uint8_t **table0 = thread_param->recover_table[2];
+	uint8_t **table1 = thread_param->recover_table[1];
+	uint8_t **table2 = thread_param->recover_table[0];
+
+	if (thread_param->sub_hist) {
+		// Histogram is gathered while the recovered pixel is in registers.
+		int32_t *hist = thread_param->sub_hist + worker * bytes_per_pixel * 256;
+		for (int32_t i = 0; i < npixels; i++) {
+			const uint8_t t = tran_map[i];
+			recover_data[0] = table0[hazzy_data[0]][t];
+			recover_data[1] = table1[hazzy_data[1]][t];
+			recover_data[2] = table2[hazzy_data[2]][t];
+			hist[recover_data[0]]++;
+			hist[256 + recover_data[1]]++;
+			hist[512 + recover_data[2]]++;
+			hazzy_data += bytes_per_pixel;
+			recover_data += bytes_per_pixel;
+		}
+		return;
+	}
+	
+	for (int32_t i = 0; i < npixels; i++) {
+		const uint8_t t = tran_map[i];
+		recover_data[0] = table0[hazzy_data[0]][t];
+		recover_data[1] = table1[hazzy_data[1]][t];
+		recover_data[2] = table2[hazzy_data[2]][t];
+		hazzy_data += bytes_per_pixel;
+		recover_data += bytes_per_pixel;
+	}
+}
+
+//---------------------------------------------------------
+// Recover scene radiance with recover table.
+//---------------------------------------------------------
+void defog::lut_recover_scene_radiance(
+	uint8_t *raw_image,
+	uint8_t *transmission_map,
+	int32_t width,
+	int32_t height,
+	uint8_t ***recover_table,
+	uint8_t *processed_image,
+	int32_t *sub_hist
+)	{
+	assert(raw_image);
+	assert(transmission_map);
+	assert(recover_table);
+	assert(processed_image);
+	
+	lut_recover_thread_param_t thread_param;
+	thread_param.hazzy_data = raw_image;
+	thread_param.tran_map = transmission_map;
+	thread_param.width = width;
+	thread_param.recover_table = recover_table;
+	thread_param.recover_data = processed_image;
+	thread_param.sub_hist = sub_hist;
+	
+	workers.parallel_for(0, height, nrecover_threads, lut_recover_scene_radiance_thread, &thread_param);
+}
+
+//---------------------------------------------------------
+// In place plane recover thread.
+//---------------------------------------------------------
+static void recover_plane_thread(
+	int32_t begin,
+	int32_t end,
+	int32_t worker,
+	void *param
+)	{
+	plane_recover_thread_param_t *thread_param = (plane_recover_thread_param_t *)param;
+	
+	const int32_t first_pixel = begin * thread_param->width;
+	uint8_t *plane_data = thread_param->plane_data + first_pixel;
+	const int32_t npixels = (end - begin) * thread_param->width;
+	uint8_t **recover_table = thread_param->recover_table;
+	uint8_t *stretch_table = thread_param->stretch_table;
+	
+	if (!recover_table) {
+		for (int32_t i = 0; i < npixels; i++) {
+			plane_data[i] = stretch_table[plane_data[i]];
+		}
+		return;
+	}
+	
+	const uint8_t *tran_map = thread_param->tran_map + first_pixel;
+	if (!stretch_table) {
+		for (int32_t i = 0; i < npixels; i++) {
+			plane_data[i] = recover_table[plane_data[i]][tran_map[i]];
+		}
+	} else {
+		for (int32_t i = 0; i < npixels; i++) {
+			plane_data[i] = stretch_table[recover_table[plane_data[i]][tran_map[i]]];
+		}
+	}
+	
+	// The chunk just written is still in cache.
+	if (thread_param->sub_hist) {
+		int32_t *hist = thread_param->sub_hist + worker * 3 * 256;
+		for (int32_t i = 0; i < npixels; i++) {
+			hist[plane_data[i]]++;
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Recover and stretch single plane in place.
+//---------------------------------------------------------
+void defog::recover_plane(
+	uint8_t *plane,
+	uint8_t *transmission_map,
+	int32_t width,
+	int32_t height,
+	uint8_t **recover_table,
+	uint8_t *stretch_table,
+	int32_t hist[256]
+)	{
+	assert(plane);
+	assert(recover_table || stretch_table);
+	assert(!recover_table || transmission_map);
+	
+	// Worker histograms use the first channel of the recover histograms.
+	const int32_t nchannels = 3;
+	const int32_t nlevels = 256;
+	int32_t *sub_hist = 0;
+	if (hist) {
+		sub_hist = recover_hist;
+		memset(sub_hist, 0, workers.size() * nchannels * nlevels * sizeof(int32_t));
 	}
 	
-	int32_t t = nthreads - 1;
-	thread_param[t].hazzy_data = raw_image + t * nsample_pixels * nchannels;
-	thread_param[t].tran_data = transmission_image + t * nsample_pixels;	
-	thread_param[t].npixels = width * height - t * nsample_pixels;		
-	thread_param[t].atmo_light = atmo_light;		
-	thread_param[t].diff_table = diff_table;
-	thread_param[t].recover_data = processed_image + t * nsample_pixels * nchannels;
+	plane_recover_thread_param_t thread_param;
+	thread_param.plane_data = plane;
+	thread_param.tran_map = transmission_map;
+	thread_param.width = width;
+	thread_param.recover_table = recover_table;
+	thread_param.stretch_table = stretch_table;
+	thread_param.sub_hist = sub_hist;
+	
+	workers.parallel_for(0, height, nrecover_threads, recover_plane_thread, &thread_param);
+	
+	if (!hist) {
+		return;
+	}
 	
-	for (int32_t t = 0; t < nthreads; t++) {
-		int32_t ret = pthread_create(&tid[t], NULL, recover_scene_radiance_thread, &thread_param[t]);
-		if (0 != ret) {
-			printf("Create recover scene radiance thread[%d] fail!\n", t);
-			exit(-1);
+	// Merge the per worker histograms.
+	memset(hist, 0, nlevels * sizeof(int32_t));
+	for (int32_t i = 0; i < workers.size(); i++) {
+		const int32_t *worker_hist = sub_hist + i * nchannels * nlevels;
+		for (int32_t lev = 0; lev < nlevels; lev++) {
+			hist[lev] += worker_hist[lev];
 		}
 	}
+}
+
+//---------------------------------------------------------
+// Down sample YUV image to RGB planes.
+//---------------------------------------------------------
+void defog::yuv2dsrgb(
+	uint8_t *yuv_image,
+	int32_t width,
+	int32_t height,
+	int32_t ds_width,
+	int32_t ds_height,
+	uint8_t *rgb_image[3]
+)	{
+	const int32_t npixels = width * height;
+	const int32_t uv_width = width >> 1;
+	const uint8_t *y_plane = yuv_image;
+	const uint8_t *u_plane = y_plane + npixels;
+	const uint8_t *v_plane = u_plane + (npixels >> 2);
+	const float xscale = static_cast<float>(width) / ds_width;
+	const float yscale = static_cast<float>(height) / ds_height;
+	
+	for (int32_t y = 0; y < ds_height; y++) {
+		const int32_t sy = std::min(static_cast<int32_t>((y + 0.5f) * yscale), height - 1);
+		const uint8_t *y_line = y_plane + sy * width;
+		const uint8_t *u_line = u_plane + (sy >> 1) * uv_width;
+		const uint8_t *v_line = v_plane + (sy >> 1) * uv_width;
+		for (int32_t x = 0; x < ds_width; x++) {
+			const int32_t sx = std::min(static_cast<int32_t>((x + 0.5f) * xscale), width - 1);
+			const float Y = y_line[sx];
+			const float U = u_line[sx >> 1] - 128.0f;
+			const float V = v_line[sx >> 1] - 128.0f;
+			const int32_t i = y * ds_width + x;
+			rgb_image[2][i] = cv::saturate_cast<uint8_t>(Y + 1.402f * V);
+			rgb_image[1][i] = cv::saturate_cast<uint8_t>(Y - 0.34414f * U - 0.71414f * V);
+			rgb_image[0][i] = cv::saturate_cast<uint8_t>(Y + 1.772f * U);
+		}
+	}
+}
+
+//---------------------------------------------------------
+// SIMD recover scene radiance thread.
+//---------------------------------------------------------
+void neon_recover_thread(
+	int32_t begin,
+	int32_t end,
+	int32_t worker,
+	void *param
+)	{
+	neon_recover_thread_param_t *thread_param = (neon_recover_thread_param_t *)param;
+	
+	const int32_t nchannels = 3;
+	const int32_t first_pixel = begin * thread_param->width;
+	const int32_t npixels = (end - begin) * thread_param->width;
+	uint8_t *recover_data = thread_param->recover_data + first_pixel * nchannels;
+	thread_param->pdefog->neon_recover_scene_radiance(thread_param->hazzy_data + first_pixel * nchannels,
+		thread_param->tran_data + first_pixel, thread_param->width, end - begin, thread_param->atmo_light,
+		recover_data);
+	
+	// The chunk just written is still in cache.
+	if (thread_param->sub_hist) {
+		accumulate_hist(recover_data, npixels, thread_param->sub_hist + worker * nchannels * 256);
+	}
+}
 
-	for (int32_t t = 0; t < nthreads; t++) {
-		pthread_join(tid[t], NULL);
+//---------------------------------------------------------
+// Recover scene radiance image and gather its histogram.
+//---------------------------------------------------------
+void defog::recover_image(
+	uint8_t *raw_image,
+	uint8_t *transmission_map,
+	float *transmission_inv,
+	uint8_t atmo_light[3],
+	int32_t hist[3][256]
+)	{
+	const int32_t nchannels = 3;
+	const int32_t nlevels = 256;
+	int32_t *sub_hist = 0;
+	if (hist) {
+		sub_hist = recover_hist;
+		memset(sub_hist, 0, workers.size() * nchannels * nlevels * sizeof(int32_t));
+	}
+	
+	if (1 == recover_mode) {
+		lut_recover_scene_radiance(raw_image, transmission_map, width, height, recover_table, recover_img, sub_hist);
+	} else {
+#ifdef _WIN32
+		recover_scene_radiance(raw_image, transmission_inv, width, height, atmo_light, recover_img, sub_hist);
+#else
+		neon_recover_thread_param_t thread_param;
+		thread_param.pdefog = this;
+		thread_param.hazzy_data = raw_image;
+		thread_param.tran_data = transmission_inv;
+		thread_param.width = width;
+		thread_param.atmo_light = atmo_light;
+		thread_param.recover_data = recover_img;
+		thread_param.sub_hist = sub_hist;
+		
+		workers.parallel_for(0, height, nrecover_threads, neon_recover_thread, &thread_param);
+#endif
+	}
+	
+	if (!hist) {
+		return;
+	}
+	
+	// Merge the per worker histograms.
+	memset(hist, 0, nchannels * nlevels * sizeof(int32_t));
+	for (int32_t i = 0; i < workers.size(); i++) {
+		const int32_t *worker_hist = sub_hist + i * nchannels * nlevels;
+		for (int32_t c = 0; c < nchannels; c++) {
+			for (int32_t lev = 0; lev < nlevels; lev++) {
+				hist[c][lev] += worker_hist[c * nlevels + lev];
+			}
+		}
 	}
 }
 
 //---------------------------------------------------------
 // Recover scene radiance.
 //---------------------------------------------------------
-#ifdef __ARM_NEON__
 void defog::neon_recover_scene_radiance(
 	uint8_t * __restrict raw_image,
 	float * __restrict transmission_image,
@@ -2954,7 +3874,7 @@ void defog::neon_recover_scene_radiance(
 	assert(raw_image);
 	assert(transmission_image);
 	assert(processed_image);
-	
+#ifdef __ARM_NEON__	
 	const int32_t nchannels = 3;
 	const int32_t npixels_per_loop = 8;
 	const int32_t nloops = width * height / npixels_per_loop;
@@ -3073,38 +3993,27 @@ void defog::neon_recover_scene_radiance(
 		transmission_image += 4;
 		processed_image += nchannels * npixels_per_loop;
 	}
-}
+#else
+	// Atmospheric light in memory channel order.
+	const uint8_t atmo[3] = {atmo_light[2], atmo_light[1], atmo_light[0]};
+	simd_kernels()->recover_scene_radiance(raw_image, transmission_image, width * height, atmo, processed_image);
 #endif
+}
 
 //---------------------------------------------------------
-// Calculate auto level threshold.
+// Calculate auto level threshold from histogram.
 //---------------------------------------------------------
 void defog::auto_level_thresh(
-	uint8_t *image,
-	int32_t width,
-	int32_t height,
+	int32_t hist[3][256],
+	int32_t npixels,
 	float lowcut_thresh,
 	float highcut_thresh,
-	uint8_t auto_level_floor[3],
-	uint8_t auto_level_ceiling[3]
+	uint8_t *auto_level_floor,
+	uint8_t *auto_level_ceiling,
+	int32_t nchannels
 )	{
-	const int32_t nlevels = 256;
-	const int32_t nchannels = 3;
-	int32_t hist[nchannels][nlevels];
-	memset(hist, 0, sizeof(hist));
-	
-	const int32_t bytes_per_pixel = 3;
-	const int32_t npixels = width * height;
-	
-	for (int32_t i = 0; i < npixels; i += 2) {
-		int32_t i0 = i * bytes_per_pixel;
-		hist[0][image[i0]]++;
-		hist[1][image[i0 + 1]]++;
-		hist[2][image[i0 + 2]]++;
-	}
-	
-	const int32_t lowcut_pixels = lowcut_thresh * width * height;
-	const int32_t highcut_pixels = highcut_thresh * width * height;
+	const int32_t lowcut_pixels = lowcut_thresh * npixels;
+	const int32_t highcut_pixels = highcut_thresh * npixels;
 	for (int32_t c = 0; c < nchannels; c++) {
 		int32_t counter = 0;
 		for (int32_t lev = 0; lev <= 255; lev++) {
@@ -3157,27 +4066,51 @@ void defog::make_stretch_table(
 	}
 }
 
+//---------------------------------------------------------
+// Make YUV stretch table.
+//---------------------------------------------------------
+void defog::make_yuv_stretch_table(
+	uint8_t auto_level_floor,
+	uint8_t auto_level_ceiling,
+	uint8_t **stretch_table
+)	{
+	const int32_t nlevels = 256;
+	const int32_t range = std::max(auto_level_ceiling - auto_level_floor, 1);
+	const float scale = static_cast<float>(Y_CEILING - Y_FLOOR) / range;
+	
+	// Equal gain on R, G and B scales U and V around 128 by the same factor.
+	for (int32_t i = 0; i < nlevels; i++) {
+		int32_t luma = static_cast<int32_t>(scale * (i - auto_level_floor) + Y_FLOOR + 0.5f);
+		stretch_table[0][i] = std::min(std::max(luma, Y_FLOOR), Y_CEILING);
+		int32_t chroma = static_cast<int32_t>(floorf(scale * (i - 128) + 128.5f));
+		stretch_table[1][i] = std::min(std::max(chroma, CBCR_FLOOR), CBCR_CEILING);
+	}
+}
+
 //---------------------------------------------------------
 // Auto levels thread.
 //---------------------------------------------------------
-void *auto_levels_thread(
+static void auto_levels_thread(
+	int32_t begin,
+	int32_t end,
+	int32_t worker,
 	void *param
 )	{
 	auto_level_thread_param_t *thread_param = (auto_level_thread_param_t *)param;
 	
-	uint8_t *recover_data = thread_param->recover_data;
-	int32_t npixels = thread_param->npixels;
+	const int32_t bytes_per_pixel = 3;
+	const int32_t first_byte = begin * thread_param->width * bytes_per_pixel;
+	uint8_t *recover_data = thread_param->recover_data + first_byte;
+	int32_t npixels = (end - begin) * thread_param->width;
 	uint8_t **stretch_table = thread_param->stretch_table;
-	uint8_t *stretch_data = thread_param->stretch_data;
+	uint8_t *stretch_data = thread_param->stretch_data + first_byte;
 	
-	const int32_t bytes_per_pixel = 3;
 	for (int32_t i = 0; i < npixels; i++) {
 		int32_t i0 = i * bytes_per_pixel;
 		stretch_data[i0] = stretch_table[0][recover_data[i0]];
 		stretch_data[i0 + 1] = stretch_table[1][recover_data[i0 + 1]];
 		stretch_data[i0 + 2] = stretch_table[2][recover_data[i0 + 2]];
 	}
-	return (void *)(0);
 }
 
 //---------------------------------------------------------
@@ -3190,37 +4123,220 @@ void defog::auto_levels(
 	uint8_t **stretch_table,
 	uint8_t *processed_image
 )	{
-	const int32_t nchannels = 3;
-	int32_t nthreads = nstretch_threads;
-	pthread_t tid[nthreads];
-	auto_level_thread_param_t thread_param[nthreads];
-	const int32_t sample_height = height / nthreads;
-	const int32_t nsample_pixels = width * sample_height;
+	// Number of stretch threads is the number of row chunks.
+	auto_level_thread_param_t thread_param;
+	thread_param.recover_data = raw_image;
+	thread_param.width = width;
+	thread_param.stretch_table = stretch_table;
+	thread_param.stretch_data = processed_image;
+	
+	workers.parallel_for(0, height, nstretch_threads, auto_levels_thread, &thread_param);
+}
+
+//---------------------------------------------------------
+// Strip executor thread. Every stage of one strip runs on
+// the worker's own scratch memory, which stays in cache.
+//---------------------------------------------------------
+void strip_thread(
+	int32_t begin,
+	int32_t end,
+	int32_t worker,
+	void *param
+)	{
+	strip_thread_param_t *thread_param = (strip_thread_param_t *)param;
+	defog *pdefog = thread_param->pdefog;
+	
+	const int32_t width = pdefog->width;
+	const int32_t height = pdefog->height;
+	const int32_t uv_width = width >> 1;
+	const int32_t npixels = width * height;
+	uint8_t *y_plane = thread_param->yuv_data;
+	uint8_t *u_plane = y_plane + npixels;
+	uint8_t *v_plane = u_plane + (npixels >> 2);
 	
-	for (int32_t t = 0; t < nthreads - 1; t++) {
-		thread_param[t].recover_data = raw_image + t * nsample_pixels * nchannels;	
-		thread_param[t].npixels = nsample_pixels;		
-		thread_param[t].stretch_table = stretch_table;
-		thread_param[t].stretch_data = processed_image + t * nsample_pixels * nchannels;	
+	uint8_t *scratch = pdefog->strip_buffer + worker * pdefog->strip_bytes;
+	int32_t (*hist)[256] = (int32_t (*)[256])scratch;
+	uint8_t *map = scratch + pdefog->strip_offset[0];
+	uint8_t *yuv = scratch + pdefog->strip_offset[1];
+	uint8_t *bgr = scratch + pdefog->strip_offset[2];
+	uint8_t *rec = scratch + pdefog->strip_offset[3];
+	
+	for (int32_t s = begin; s < end; s++) {
+		const int32_t row_begin = s * pdefog->strip_rows;
+		const int32_t row_end = std::min(row_begin + pdefog->strip_rows, height);
+		const int32_t rows = row_end - row_begin;
+		const int32_t y_bytes = rows * width;
+		const int32_t uv_bytes = (rows >> 1) * uv_width;
+		const int32_t uv_first = (row_begin >> 1) * uv_width;
+		
+		// Gather YUV rows of the strip and convert to BGR.
+		memcpy(yuv, y_plane + row_begin * width, y_bytes);
+		memcpy(yuv + y_bytes, u_plane + uv_first, uv_bytes);
+		memcpy(yuv + y_bytes + uv_bytes, v_plane + uv_first, uv_bytes);
+		pdefog->yuv2bgr(yuv, width, rows, bgr);
+		
+		// Up sample transmission rows and recover scene radiance.
+		if (1 == pdefog->recover_mode) {
+			pdefog->transm_resampler.resample(pdefog->transm_map, row_begin, row_end, worker, map);
+			lut_recover_thread_param_t recover_param;
+			recover_param.hazzy_data = bgr;
+			recover_param.tran_map = map;
+			recover_param.width = width;
+			recover_param.recover_table = pdefog->recover_table;
+			recover_param.recover_data = rec;
+			recover_param.sub_hist = 0;
+			lut_recover_scene_radiance_thread(0, rows, worker, &recover_param);
+		} else {
+			pdefog->transm_resampler.resample(pdefog->transm_inv, row_begin, row_end, worker, (float *)map);
+			pdefog->neon_recover_scene_radiance(bgr, (float *)map, width, rows, pdefog->atmo_light, rec);
+		}
+		
+		// Histogram of the recovered strip, for the next stretch table.
+		if (thread_param->update) {
+			accumulate_hist(rec, y_bytes, &hist[0][0]);
+		}
+		
+		// Stretch in place and scatter YUV rows back.
+		auto_level_thread_param_t stretch_param;
+		stretch_param.recover_data = rec;
+		stretch_param.width = width;
+		stretch_param.stretch_table = pdefog->stretch_table;
+		stretch_param.stretch_data = rec;
+		auto_levels_thread(0, rows, worker, &stretch_param);
+		
+		pdefog->bgr2yuv(rec, width, rows, yuv);
+		memcpy(y_plane + row_begin * width, yuv, y_bytes);
+		memcpy(u_plane + uv_first, yuv + y_bytes, uv_bytes);
+		memcpy(v_plane + uv_first, yuv + y_bytes + uv_bytes, uv_bytes);
+	}
+}
+
+//---------------------------------------------------------
+// Allocate strip scratch memory.
+//---------------------------------------------------------
+void defog::init_strips()
+{
+	strip_buffer = 0;
+	
+	if (0 == strip_rows) {
+		return;
 	}
 	
-	int32_t t = nthreads - 1;
-	thread_param[t].recover_data = raw_image + t * nsample_pixels * nchannels;	
-	thread_param[t].npixels = width * height - t * nsample_pixels;		
-	thread_param[t].stretch_table = stretch_table;
-	thread_param[t].stretch_data = processed_image + t * nsample_pixels * nchannels;
+	// The strip path estimates from its own YUV down sample and stretches
+	// with the thresholds of the last update frame.
+	if (yuv_native) {
+		printf("strip_rows is ignored, yuv_native takes precedence.\n");
+	}
+	if (async_estimate) {
+		printf("async_estimate is ignored by strip execution.\n");
+	}
+	if (1 == min_pool) {
+		printf("min_pool is ignored by strip execution.\n");
+	}
 	
-	for (int32_t t = 0; t < nthreads; t++) {
-		int32_t ret = pthread_create(&tid[t], NULL, auto_levels_thread, &thread_param[t]);
-		if (0 != ret) {
-			printf("Create auto level thread[%d] fail!\n", t);
-			exit(-1);
+	const int32_t nlevels = 256;
+	const int32_t nchannels = 3;
+	const int32_t align = 64;
+	if (strip_rows < 0) {
+		// All workers run strips at once and share L2. A strip row costs
+		// transmission (4), YUV (1.5), BGR (3) and recover (3) bytes per pixel.
+		const int32_t nworkers = std::max(workers.size(), 1);
+		const int32_t fixed_bytes = nchannels * nlevels * sizeof(int32_t) + 5 * align;
+		const int32_t row_bytes = (23 * width + 1) >> 1;
+		strip_rows = (l2_cache_size / nworkers - fixed_bytes) / row_bytes;
+		strip_rows = std::min(std::max(strip_rows & ~1, 2), (height + 1) & ~1);
+	}
+	
+	// Chroma rows are shared by row pairs, so strips start on even rows.
+	strip_rows = (strip_rows + 1) & ~1;
+	
+	const int32_t npixels = strip_rows * width;
+	const int32_t sizes[5] = {static_cast<int32_t>(nchannels * nlevels * sizeof(int32_t)),
+		static_cast<int32_t>(npixels * sizeof(float)), (npixels * 3) >> 1, nchannels * npixels,
+		nchannels * npixels};
+	
+	// Histogram, transmission, YUV, BGR and recover strip of one worker.
+	strip_bytes = 0;
+	for (int32_t i = 0; i < 5; i++) {
+		if (i > 0) {
+			strip_offset[i - 1] = strip_bytes;
 		}
+		strip_bytes += (sizes[i] + align - 1) & ~(align - 1);
 	}
+	
+	strip_buffer = new uint8_t[workers.size() * strip_bytes];
+	assert(strip_buffer);
+	
+	// Histogram lags one frame, so the first frame is not stretched.
+	uint8_t identity_floor[3] = {0, 0, 0};
+	uint8_t identity_ceiling[3] = {255, 255, 255};
+	make_stretch_table(identity_floor, identity_ceiling, stretch_table);
+}
 
-	for (int32_t t = 0; t < nthreads; t++) {
-		pthread_join(tid[t], NULL);
+//---------------------------------------------------------
+// Free strip scratch memory.
+//---------------------------------------------------------
+void defog::release_strips()
+{
+	if (strip_buffer) {
+		delete [] strip_buffer;
+		strip_buffer = 0;
+	}
+}
+
+//---------------------------------------------------------
+// Dehaze YUV image in place strip by strip.
+//---------------------------------------------------------
+void defog::process_yuv_strips(
+	uint8_t *yuv_image
+)	{
+	const int32_t nlevels = 256;
+	const int32_t nchannels = 3;
+	const bool update = (frame_index % update_period == 0);
+	
+	if (update) {
+		yuv2dsrgb(yuv_image, width, height, ds_width, ds_height, dsrgb_img);
+		estimate_parameters(false);
+		if (1 == recover_mode) {
+			update_recover_table(atmo_light);
+			make_transmission_map(transm_img, ds_width, ds_height, transm_map);
+		} else {
+			inverse_transmission(transm_img, ds_width, ds_height, transm_inv);
+		}
+		
+		for (int32_t i = 0; i < workers.size(); i++) {
+			memset(strip_buffer + i * strip_bytes, 0, nchannels * nlevels * sizeof(int32_t));
+		}
+	}
+	
+	strip_thread_param_t thread_param;
+	thread_param.pdefog = this;
+	thread_param.yuv_data = yuv_image;
+	thread_param.update = update;
+	
+	// One chunk per strip balances the workers.
+	const int32_t nstrips = (height + strip_rows - 1) / strip_rows;
+	workers.parallel_for(0, nstrips, nstrips, strip_thread, &thread_param);
+	
+	// Thresholds of this frame stretch the following frames.
+	if (update) {
+		int32_t hist[nchannels][nlevels];
+		memset(hist, 0, sizeof(hist));
+		for (int32_t i = 0; i < workers.size(); i++) {
+			int32_t (*sub_hist)[256] = (int32_t (*)[256])(strip_buffer + i * strip_bytes);
+			for (int32_t c = 0; c < nchannels; c++) {
+				for (int32_t lev = 0; lev < nlevels; lev++) {
+					hist[c][lev] += sub_hist[c][lev];
+				}
+			}
+		}
+		
+		auto_level_thresh(hist, width * height, lowcut_thresh, highcut_thresh, auto_level_floor,
+			auto_level_ceiling);
+		make_stretch_table(auto_level_floor, auto_level_ceiling, stretch_table);
 	}
+	
+	frame_index++;
 }
 
 //---------------------------------------------------------
@@ -3281,6 +4397,19 @@ void defog::gamma_correct(
 		raw_image += npixels_per_loop;
 		processed_image += npixels_per_loop;
 	}
+#else
+	const int32_t max_level = 255;
+	const float constant = scale * pow(max_level, 1 - power);
+	
+	// Same truncation and narrowing as the Neon version.
+	uint8_t table[max_level + 1];
+	for (int32_t i = 0; i <= max_level; i++) {
+		float val = (float)pow(i, power) * constant;
+		uint32_t u32_val = val > 0 ? (uint32_t)val : 0;
+		table[i] = std::min<uint16_t>((uint16_t)u32_val, max_level);
+	}
+	
+	simd_kernels()->lookup_table(raw_image, width * height, table, processed_image);
 #endif
 }
 
@@ -3291,7 +4420,6 @@ void defog::get_dark_channel_image(
 	uint8_t *dark_chan_img_
 )	{
 	assert(dark_chan_img_);
-	dark_chan_img = min_chan_img;
 	memmove(dark_chan_img_, dark_chan_img, ds_width * ds_height);
 }
 
@@ -3324,6 +4452,24 @@ float defog::get_scale()
 	return downsample;
 }
 
+//---------------------------------------------------------
+// Get stage timing table.
+//---------------------------------------------------------
+int32_t defog::get_profile(
+	char *table,
+	int32_t size
+)	{
+	assert(table);
+	int32_t len = profile.report(table, size);
+	if (2 == atmo_light_method) {
+		len += snprintf(len < size ? table + len : 0, len < size ? size - len : 0,
+			"atmospheric light: histogram %u, %u, %u, quadtree %u, %u, %u\n", atmo_light[0], atmo_light[1],
+			atmo_light[2], quadtree_atmo_light[0], quadtree_atmo_light[1], quadtree_atmo_light[2]);
+	}
+	
+	return len;
+}
+
 //---------------------------------------------------------
 // YUV420 to BGR24 pipeline thread.
 //---------------------------------------------------------
@@ -3333,53 +4479,21 @@ void *yuv2bgr_pipeline_thread(
 	defog *pdefog = (defog *)param;
 	printf("start yuv2bgr_pipeline_thread\n");
 	while (1) {
-		pthread_mutex_lock(&pdefog->in_yuv_image_mutex);
-		int32_t queue_size = pdefog->in_yuv_image_queue.size();
-		pthread_mutex_unlock(&pdefog->in_yuv_image_mutex);
-		if (queue_size > 0) {
-#ifdef TEST_DEFOG
-			printf("in_yuv_image_queue %d\n", queue_size);
-#endif
-			pthread_mutex_lock(&pdefog->in_yuv_image_mutex);
-			
-			while (pdefog->in_yuv_image_queue.size() > MAX_CACHE_FRAMES) {
-				uint8_t *oldest = pdefog->in_yuv_image_queue.front();
-				if (oldest) {
-					delete [] oldest;
-					oldest = 0;
-				}
-				pdefog->in_yuv_image_queue.pop();
-			}
-			
-			uint8_t *in_yuv_image = pdefog->in_yuv_image_queue.front();
-			uint8_t *in_bgr_image = new uint8_t[pdefog->width * pdefog->height * 3];
-			assert(in_bgr_image);
-#ifdef TEST_DEFOG
-			clock_t start = clock();
-#endif
+		defog::frame_t frame;
+		pdefog->in_yuv_image_queue.pop(frame);
+		uint8_t *in_yuv_image = frame.data;
+		uint8_t *in_bgr_image = new uint8_t[pdefog->width * pdefog->height * 3];
+		assert(in_bgr_image);
+		{
+			scoped_timer timer(&pdefog->profile, PROFILE_YUV2BGR);
 			pdefog->yuv2bgr(in_yuv_image, pdefog->width, pdefog->height, in_bgr_image);
-#ifdef TEST_DEFOG
-			clock_t finish = clock();
-			printf("yuv2bgr %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
-			pthread_mutex_lock(&pdefog->in_bgr_image_mutex);
-			pdefog->in_bgr_image_queue.push(in_bgr_image);
-			pthread_mutex_unlock(&pdefog->in_bgr_image_mutex);
-			
-			if (in_yuv_image) {
-				delete [] in_yuv_image;
-				in_yuv_image = 0;
-			}
-			pdefog->in_yuv_image_queue.pop();
-			pthread_mutex_unlock(&pdefog->in_yuv_image_mutex);
-		} else {
-#ifdef _WIN32
-			Sleep(1);
-#elif __linux__
-			usleep(1000);
-#else
-#			error "Unknown compiler"
-#endif
+		}
+		frame.data = in_bgr_image;
+		pdefog->in_bgr_image_queue.push(frame);
+		
+		if (in_yuv_image) {
+			delete [] in_yuv_image;
+			in_yuv_image = 0;
 		}
 	}
 }
@@ -3411,54 +4525,19 @@ void *defog_pipeline_thread(
 	defog *pdefog = (defog *)param;
 	printf("start defog_pipeline_thread\n");
 	while (1) {
-		pthread_mutex_lock(&pdefog->in_bgr_image_mutex);
-		int32_t queue_size = pdefog->in_bgr_image_queue.size();
-		pthread_mutex_unlock(&pdefog->in_bgr_image_mutex);
-		if (queue_size > 0) {
-#ifdef TEST_DEFOG
-			printf("in_bgr_image_queue %d\n", queue_size);
-#endif
-			pthread_mutex_lock(&pdefog->in_bgr_image_mutex);
-			
-			while (pdefog->in_bgr_image_queue.size() > MAX_CACHE_FRAMES) {
-				uint8_t *oldest = pdefog->in_bgr_image_queue.front();
-				if (oldest) {
-					delete [] oldest;
-					oldest = 0;
-				}
-				pdefog->in_bgr_image_queue.pop();
-			}
-			
-			uint8_t *in_bgr_image = pdefog->in_bgr_image_queue.front();
-			uint8_t *out_bgr_image = new uint8_t[pdefog->width * pdefog->height * 3];
-			assert(out_bgr_image);
-#ifdef TEST_DEFOG
-			clock_t start = clock();
-#endif			
-			pdefog->process_rgb_dp(in_bgr_image);
-#ifdef TEST_DEFOG
-			clock_t finish = clock();
-			printf("process %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
-			memmove(out_bgr_image, pdefog->stretch_img, pdefog->width * pdefog->height * 3);
-			pthread_mutex_lock(&pdefog->out_bgr_image_mutex);
-			pdefog->out_bgr_image_queue.push(out_bgr_image);
-			pthread_mutex_unlock(&pdefog->out_bgr_image_mutex);
-			
-			if (in_bgr_image) {
-				delete [] in_bgr_image;
-				in_bgr_image = 0;
-			}
-			pdefog->in_bgr_image_queue.pop();
-			pthread_mutex_unlock(&pdefog->in_bgr_image_mutex);
-		} else {
-#ifdef _WIN32
-			Sleep(1);
-#elif __linux__
-			usleep(1000);
-#else
-#			error "Unknown compiler"
-#endif
+		defog::frame_t frame;
+		pdefog->in_bgr_image_queue.pop(frame);
+		uint8_t *in_bgr_image = frame.data;
+		uint8_t *out_bgr_image = new uint8_t[pdefog->width * pdefog->height * 3];
+		assert(out_bgr_image);
+		pdefog->process_rgb_dp(in_bgr_image);
+		memmove(out_bgr_image, pdefog->stretch_img, pdefog->width * pdefog->height * 3);
+		frame.data = out_bgr_image;
+		pdefog->out_bgr_image_queue.push(frame);
+		
+		if (in_bgr_image) {
+			delete [] in_bgr_image;
+			in_bgr_image = 0;
 		}
 	}
 }
@@ -3491,92 +4570,38 @@ void *bgr2yuv_pipeline_thread(
 	printf("start bgr2yuv_pipeline_thread\n");
 	while (1) {
 #if 1
-		pthread_mutex_lock(&pdefog->out_bgr_image_mutex);
-		int32_t queue_size = pdefog->out_bgr_image_queue.size();
-		pthread_mutex_unlock(&pdefog->out_bgr_image_mutex);
-		if (queue_size > 0) {
-#ifdef TEST_DEFOG
-			printf("out_bgr_image_queue %d\n", queue_size);
-#endif
-			pthread_mutex_lock(&pdefog->out_bgr_image_mutex);
-			
-			while (pdefog->out_bgr_image_queue.size() > MAX_CACHE_FRAMES) {
-				uint8_t *oldest = pdefog->out_bgr_image_queue.front();
-				if (oldest) {
-					delete [] oldest;
-					oldest = 0;
-				}
-				pdefog->out_bgr_image_queue.pop();
-			}
-			
-			uint8_t *out_bgr_image = pdefog->out_bgr_image_queue.front();
-			uint8_t *out_yuv_image = new uint8_t[(pdefog->width * pdefog->height * 3) >> 1];
-			assert(out_yuv_image);
-#ifdef TEST_DEFOG
-			clock_t start = clock();
-#endif				
+		defog::frame_t frame;
+		pdefog->out_bgr_image_queue.pop(frame);
+		uint8_t *out_bgr_image = frame.data;
+		uint8_t *out_yuv_image = new uint8_t[(pdefog->width * pdefog->height * 3) >> 1];
+		assert(out_yuv_image);
+		{
+			scoped_timer timer(&pdefog->profile, PROFILE_BGR2YUV);
 			pdefog->bgr2yuv(out_bgr_image, pdefog->width, pdefog->height, out_yuv_image);
-#ifdef TEST_DEFOG
-			clock_t finish = clock();
-			printf("bgr2yuv %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
-			pthread_mutex_lock(&pdefog->out_yuv_image_mutex);
-			pdefog->out_yuv_image_queue.push(out_yuv_image);
-			pthread_mutex_unlock(&pdefog->out_yuv_image_mutex);
-			
-			if (out_bgr_image) {
-				delete [] out_bgr_image;
-				out_bgr_image = 0;
-			}
-			pdefog->out_bgr_image_queue.pop();
-			pthread_mutex_unlock(&pdefog->out_bgr_image_mutex);
-		} else {
-#ifdef _WIN32
-			Sleep(1);
-#elif __linux__
-			usleep(1000);
-#else
-#			error "Unknown compiler"
-#endif
+		}
+		frame.data = out_yuv_image;
+		pdefog->out_yuv_image_queue.push(frame);
+		
+		if (out_bgr_image) {
+			delete [] out_bgr_image;
+			out_bgr_image = 0;
 		}
 #else
-		pthread_mutex_lock(&pdefog->in_bgr_image_mutex);
-		int32_t queue_size = pdefog->in_bgr_image_queue.size();
-		pthread_mutex_unlock(&pdefog->in_bgr_image_mutex);
-		if (queue_size > 0) {
-#ifdef TEST_DEFOG
-			printf("in_bgr_image_queue %d\n", queue_size);
-#endif
-			pthread_mutex_lock(&pdefog->in_bgr_image_mutex);
-			uint8_t *out_bgr_image = pdefog->in_bgr_image_queue.front();
-			uint8_t *out_yuv_image = new uint8_t[(pdefog->width * pdefog->height * 3) >> 1];
-			assert(out_yuv_image);
-#ifdef TEST_DEFOG
-			clock_t start = clock();
-#endif				
+		defog::frame_t frame;
+		pdefog->in_bgr_image_queue.pop(frame);
+		uint8_t *out_bgr_image = frame.data;
+		uint8_t *out_yuv_image = new uint8_t[(pdefog->width * pdefog->height * 3) >> 1];
+		assert(out_yuv_image);
+		{
+			scoped_timer timer(&pdefog->profile, PROFILE_BGR2YUV);
 			pdefog->bgr2yuv(out_bgr_image, pdefog->width, pdefog->height, out_yuv_image);
-#ifdef TEST_DEFOG
-			clock_t finish = clock();
-			printf("bgr2yuv %.0lfms.\n", 1000.0 * (finish - start) / CLOCKS_PER_SEC);
-#endif
-			pthread_mutex_lock(&pdefog->out_yuv_image_mutex);
-			pdefog->out_yuv_image_queue.push(out_yuv_image);
-			pthread_mutex_unlock(&pdefog->out_yuv_image_mutex);
-			
-			if (out_bgr_image) {
-				delete [] out_bgr_image;
-				out_bgr_image = 0;
-			}
-			pdefog->in_bgr_image_queue.pop();
-			pthread_mutex_unlock(&pdefog->in_bgr_image_mutex);
-		} else {
-#ifdef _WIN32
-			Sleep(1);
-#elif __linux__
-			usleep(1000);
-#else
-#			error "Unknown compiler"
-#endif
+		}
+		frame.data = out_yuv_image;
+		pdefog->out_yuv_image_queue.push(frame);
+		
+		if (out_bgr_image) {
+			delete [] out_bgr_image;
+			out_bgr_image = 0;
 		}
 #endif
 	}
@@ -3612,31 +4637,43 @@ void defog::process_yuv_dp_pl(
 		return;
 	}
 	
-	uint8_t *in_yuv_image = new uint8_t[(width * height * 3) >> 1];
-	assert(in_yuv_image);
+	frame_t frame;
+	frame.data = new uint8_t[(width * height * 3) >> 1];
+	assert(frame.data);
+	frame.seq = dp_seq++;
+	frame.timestamp = monotonic_us();
 	
-	memmove(in_yuv_image, yuv_image, (width * height * 3) >> 1);
-	pthread_mutex_lock(&in_yuv_image_mutex);
-	in_yuv_image_queue.push(in_yuv_image);
-	pthread_mutex_unlock(&in_yuv_image_mutex);
-	
-	pthread_mutex_lock(&out_yuv_image_mutex);
-	int32_t queue_size = out_yuv_image_queue.size();
-	pthread_mutex_unlock(&out_yuv_image_mutex);
+	memmove(frame.data, yuv_image, (width * height * 3) >> 1);
+	if (pipeline_delay > 0) {
+		// At most pipeline_delay + 1 frames are in flight, so this never waits.
+		in_yuv_image_queue.push(frame);
+	} else if (!in_yuv_image_queue.try_push(frame)) {
+		// Pipeline is behind, drop the frame.
+		delete [] frame.data;
+		frame.data = 0;
+	}
 	
-	if (queue_size > 0) {
-#ifdef TEST_DEFOG
-		printf("out_yuv_image_queue %d\n", queue_size);
-#endif
-		pthread_mutex_lock(&out_yuv_image_mutex);
-		uint8_t *out_yuv_image = out_yuv_image_queue.front();
-		memmove(yuv_image, out_yuv_image, (width * height * 3) >> 1);
-		
-		if (out_yuv_image) {
-			delete [] out_yuv_image;
-			out_yuv_image = 0;
+	frame_t out;
+	if (pipeline_delay > 0) {
+		// Wait for the frame pipeline_delay frames back. The first
+		// pipeline_delay frames are passed through unchanged.
+		if (frame.seq < pipeline_delay) {
+			return;
 		}
-		out_yuv_image_queue.pop();
-		pthread_mutex_unlock(&out_yuv_image_mutex);
+		
+		out_yuv_image_queue.pop(out);
+		assert(out.seq == frame.seq - pipeline_delay);
+	} else if (!out_yuv_image_queue.try_pop(out)) {
+		return;
+	}
+	
+	if (profile.enabled()) {
+		profile.record(PROFILE_DP_PL_LATENCY, 1000 * (monotonic_us() - out.timestamp));
+	}
+	memmove(yuv_image, out.data, (width * height * 3) >> 1);
+	
+	if (out.data) {
+		delete [] out.data;
+		out.data = 0;
 	}
 }
\ No newline at end of file
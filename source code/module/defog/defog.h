@@ -2,9 +2,16 @@
 #define _DEFOG_H_
 
 #include <cstdint>
-#include <queue>
 #include "pthread.h"
 #include "opencv2/opencv.hpp"
+#include "thread_pool.h"
+#include "guided_filter.h"
+#include "cvgeo_tran.hpp"
+#include "lut_chain.hpp"
+#include "spsc_ring.hpp"
+#include "frame_pool.hpp"
+#include "profiler.h"
+#include "clahe.h"
 
 class defog
 {
@@ -55,6 +62,27 @@ public:
 	void process_yuv_dp(
 		uint8_t *yuv_image
 	);
+	/**
+	 * Dehaze YUV420 image in place. Parameters are estimated from a down
+	 * sampled RGB image taken from the YUV planes, recovery and luma auto
+	 * levels run on the Y, U and V planes directly.
+	 * @param[in,out] yuv_image YUV420 image.
+	 * @return void.
+	 */
+	void process_yuv_native(
+		uint8_t *yuv_image
+	);
+	/**
+	 * Dehaze YUV420 image in place strip by strip. Color conversion,
+	 * transmission up sampling, recovery and auto levels of one strip
+	 * run back to back, so no full size intermediate image is written.
+	 * Stretch thresholds of a frame are applied from the next frame.
+	 * @param[in,out] yuv_image YUV420 image.
+	 * @return void.
+	 */
+	void process_yuv_strips(
+		uint8_t *yuv_image
+	);
 	/**
 	 * Output dark channel image.
 	 * @param[out] dark_chan_img_ Dark channel image.
@@ -84,9 +112,23 @@ public:
 	 * @return Scale factor.
 	 */
 	float get_scale();
+	/**
+	 * Get stage timings, collected while enable_profiler is 1.
+	 * @param[out] table Text table, one line per stage: count and
+	 *             min, mean, p50, p99 and max in milliseconds. With
+	 *             atmo_light_method 2 a last line has both atmospheric lights.
+	 * @param[in] size Size of table.
+	 * @return Length of the full table.
+	 */
+	int32_t get_profile(
+		char *table,
+		int32_t size
+	);
 	/**
 	 * Process image with dark prior defog.
-	 * @param[in] yuv_image YUV420 image.
+	 * With pipeline_delay N > 0 the output is the input of N calls before and
+	 * the call waits for it, otherwise it is the latest ready frame, if any.
+	 * @param[in,out] yuv_image YUV420 image.
 	 * @return void.
 	 */
 	void process_yuv_dp_pl(
@@ -102,13 +144,23 @@ public:
 	);
 	/**
 	 * SLT & CLAHE & LOG & SA.
-	 * @param[in] yuv_image YUV420 image.
+	 * Output is delayed as in process_yuv_dp_pl.
+	 * @param[in,out] yuv_image YUV420 image.
 	 * @return void.
 	 */
 	void process_yuv_ce_pl(
 		uint8_t *yuv_image
 	);
 private:
+	/**
+	 * \typedef struct frame_t
+	 * \brief Data structure for a frame moving through a pipeline.
+	 */
+	typedef struct {
+		uint8_t *data;			// Image data.
+		int64_t seq;			// Input sequence number.
+		int64_t timestamp;		// Input time in microseconds, CLOCK_MONOTONIC.
+	}frame_t;
 	/**
 	 * Load parameters from configuration.
 	 * @return void.
@@ -142,17 +194,6 @@ private:
 		int32_t height,
 		uint8_t *yuv_image
 	);
-	/**
-	 * Minimum filter.
-	 * @return void.
-	 */
-	void min_filter(
-		uint8_t *raw_image[3],
-		int32_t width,
-		int32_t height,
-		int32_t ksize,
-		uint8_t *processed_image[3]
-	);
 	/**
 	 * Calculate minimum channel image.
 	 * @param[in] chan1_img Channel 1 image.
@@ -170,6 +211,109 @@ private:
 		int32_t width,
 		int32_t height
 	);
+	/**
+	 * Estimate dark channel, atmospheric light and refined transmission from
+	 * the down sampled RGB image array.
+	 * @param[in] min_chan_ready Minimum channel image is already computed.
+	 * @return void.
+	 */
+	void estimate_parameters(
+		bool min_chan_ready
+	);
+	/**
+	 * Down sample RGB image to the RGB image array, with bilinear resize or
+	 * with the min-pooling decimator which also outputs the minimum channel.
+	 * @param[in] frame Input RGB image.
+	 * @return void.
+	 */
+	void downsample_frame(
+		uint8_t *frame
+	);
+	/**
+	 * Allocate min-pooling line buffers if min-pooling is enabled.
+	 * @return void.
+	 */
+	void init_min_pool();
+	/**
+	 * Free min-pooling line buffers.
+	 * @return void.
+	 */
+	void release_min_pool();
+	/**
+	 * Estimate parameters of one frame into the published buffers.
+	 * @param[in] frame Input RGB image.
+	 * @param[in] index Index of the published buffers to write.
+	 * @return void.
+	 */
+	void estimate_frame(
+		uint8_t *frame,
+		int32_t index
+	);
+	/**
+	 * Parameter estimator thread.
+	 * @return void*.
+	 */
+	friend void *estimator_thread(
+		void *param
+	);
+	/**
+	 * Allocate published buffers and start estimator thread if
+	 * asynchronous estimation is enabled.
+	 * @return void.
+	 */
+	void init_estimator();
+	/**
+	 * Stop estimator thread and free published buffers.
+	 * @return void.
+	 */
+	void release_estimator();
+	/**
+	 * Recover and stretch with the latest parameters published by the
+	 * estimator thread, hand the frame to the estimator when it is idle.
+	 * @param[in] raw_image Input RGB image.
+	 * @return void.
+	 */
+	void process_rgb_async(
+		uint8_t *raw_image
+	);
+	/**
+	 * Strip executor thread.
+	 * @return void.
+	 */
+	friend void strip_thread(
+		int32_t begin,
+		int32_t end,
+		int32_t worker,
+		void *param
+	);
+	/**
+	 * Allocate strip scratch memory if strip execution is enabled.
+	 * @return void.
+	 */
+	void init_strips();
+	/**
+	 * Free strip scratch memory.
+	 * @return void.
+	 */
+	void release_strips();
+	/**
+	 * Down sample YUV420 image to RGB image array.
+	 * @param[in] yuv_image YUV420 image.
+	 * @param[in] width Image width.
+	 * @param[in] height Image height.
+	 * @param[in] ds_width Down sampled width.
+	 * @param[in] ds_height Down sampled height.
+	 * @param[out] rgb_image Down sampled RGB image array.
+	 * @return void.
+	 */
+	void yuv2dsrgb(
+		uint8_t *yuv_image,
+		int32_t width,
+		int32_t height,
+		int32_t ds_width,
+		int32_t ds_height,
+		uint8_t *rgb_image[3]
+	);
 	/**
 	 * Estimate atmospheric light.
 	 * @return void.
@@ -183,41 +327,49 @@ private:
 		uint8_t atmo_light[3]
 	);
 	/**
-	 * Normalize minimum filter image.
+	 * Estimate atmospheric light by quadtree subdivision of the dark channel.
+	 * The quadrant with the highest mean minus standard deviation is split
+	 * until it is smaller than QUADTREE_MIN_SIZE, then the pixel closest to
+	 * white in it gives the atmospheric light.
 	 * @return void.
 	 */
-	void normalize_min_filt_image(
+	void quadtree_atmospheric_light(
 		uint8_t *raw_image[3],
+		uint8_t *dark_channel_image,
 		int32_t width,
 		int32_t height,
-		uint8_t atmo_light[3],
-		float *processed_image[3]
+		uint8_t atmo_light_ceiling,
+		uint8_t atmo_light[3]
 	);
 	/**
-	 * Estimate transmission.
+	 * Estimate transmission. The minimum filter of the image normalized by the
+	 * atmospheric light is replaced by a maximum filter of the per-channel
+	 * transmission looked up from a table.
+	 * @param[in] raw_image Down sampled RGB image array.
+	 * @param[in] width Image width.
+	 * @param[in] height Image height.
+	 * @param[in] atmo_light Atmospheric light.
+	 * @param[in] omega Adjust factor of transmission image.
+	 * @param[in] cache_image Cache image, size of width * height.
+	 * @param[out] transmission_image Transmission image.
 	 * @return void.
 	 */
 	void estimate_transmission(
-		float *norm_dark_channel_image,
+		uint8_t *raw_image[3],
 		int32_t width,
 		int32_t height,
+		uint8_t atmo_light[3],
 		float omega,
+		float *cache_image,
 		float *transmission_image
 	);
-	/**
-	 * Guided filter.
-	 * @param[in] G_ Guided image.
-	 * @param[in] P_ Input image.
-	 * @param[in] ksize Kernel size.
-	 * @return Filtered image.
-	 */
-	cv::Mat guided_filter(
-		cv::Mat G,
-		cv::Mat P,
-		int ksize
-	);
 	/**
 	 * Refine transmission with guided filter.
+	 * @param[in] red_image Guide image.
+	 * @param[in,out] transmission_image Transmission image.
+	 * @param[in] width Image width.
+	 * @param[in] height Image height.
+	 * @param[in] tran_thresh Transmission threshold.
 	 * @return void.
 	 */
 	void refine_transmission(
@@ -225,7 +377,6 @@ private:
 		float *transmission_image,
 		int32_t width,
 		int32_t height,
-		int32_t ksize,
 		float tran_thresh
 	);
 	/**
@@ -233,14 +384,34 @@ private:
 	 * @param[in] transmission_image Transmission image.
 	 * @param[in] width Image width.
 	 * @param[in] height Image height.
-	 * @param[out] transmission_map Transmission map.
+	 * @param[out] transmission_map Transmission map quantized to
+	 *  [1, MAX_TRANSMISSION].
 	 * @return void.
 	 */
 	void make_transmission_map(
 		float *transmission_image,
 		int32_t width,
 		int32_t height,
-		int32_t *transmission_map
+		uint8_t *transmission_map
+	);
+	/**
+	 * Make recover table, J = (I - A) / t + A for every input level
+	 * and quantized transmission.
+	 * @param[in] atmo_light Atmospheric light.
+	 * @param[out] recover_table Recover table.
+	 * @return void.
+	 */
+	void make_recover_table(
+		uint8_t atmo_light[3],
+		uint8_t ***recover_table
+	);
+	/**
+	 * Rebuild recover table if atmospheric light changes.
+	 * @param[in] atmo_light Atmospheric light.
+	 * @return void.
+	 */
+	void update_recover_table(
+		uint8_t atmo_light[3]
 	);
 	/**
 	 * Inverse transmission.
@@ -257,17 +428,30 @@ private:
 		float *transmission_inv
 	);
 	/**
-	 * Calculate auto level threshold.
+	 * Calculate auto level threshold from histogram.
+	 * @param[in] hist Histogram of three channels.
+	 * @param[in] npixels Number of image pixels.
+	 * @param[in] nchannels Number of leading channels to threshold.
 	 * @return void.
 	 */
 	void auto_level_thresh(
-		uint8_t *image,
-		int32_t width,
-		int32_t height,
+		int32_t hist[3][256],
+		int32_t npixels,
 		float lowcut_thresh,
 		float highcut_thresh,
-		uint8_t auto_level_floor[3],
-		uint8_t auto_level_ceiling[3]
+		uint8_t *auto_level_floor,
+		uint8_t *auto_level_ceiling,
+		int32_t nchannels = 3
+	);
+	/**
+	 * Make luma and chroma stretch tables, luma goes to stretch_table[0] and
+	 * chroma to stretch_table[1].
+	 * @return void.
+	 */
+	void make_yuv_stretch_table(
+		uint8_t auto_level_floor,
+		uint8_t auto_level_ceiling,
+		uint8_t **stretch_table
 	);
 	/**
 	 * Make stretch table.
@@ -290,9 +474,81 @@ private:
 		int32_t width,
 		int32_t height,
 		uint8_t atmo_light[3],
-		uint8_t *processed_image
+		uint8_t *processed_image,
+		int32_t *sub_hist
+	);
+	/**
+	 * Recover scene radiance image with recover table.
+	 * @param[in] raw_image Raw image.
+	 * @param[in] transmission_map Quantized transmission map.
+	 * @param[in] width Image width.
+	 * @param[in] height Image height.
+	 * @param[in] recover_table Recover table.
+	 * @param[out] processed_image Recovered image.
+	 * @param[out] sub_hist Per worker histograms, null to skip.
+	 * @return void.
+	 */
+	void lut_recover_scene_radiance(
+		uint8_t *raw_image,
+		uint8_t *transmission_map,
+		int32_t width,
+		int32_t height,
+		uint8_t ***recover_table,
+		uint8_t *processed_image,
+		int32_t *sub_hist
+	);
+	/**
+	 * Recover and stretch single plane in place, either table may be null.
+	 * @param[in,out] plane Image plane.
+	 * @param[in] transmission_map Quantized transmission map of plane size.
+	 * @param[in] width Plane width.
+	 * @param[in] height Plane height.
+	 * @param[in] recover_table Recover table of the plane.
+	 * @param[in] stretch_table Stretch table of the plane.
+	 * @param[out] hist Histogram of the output plane, null to skip.
+	 * @return void.
+	 */
+	void recover_plane(
+		uint8_t *plane,
+		uint8_t *transmission_map,
+		int32_t width,
+		int32_t height,
+		uint8_t **recover_table,
+		uint8_t *stretch_table,
+		int32_t hist[256] = 0
 	);
-#ifdef __ARM_NEON__
+	/**
+	 * SIMD recover scene radiance thread.
+	 * @return void.
+	 */
+	friend void neon_recover_thread(
+		int32_t begin,
+		int32_t end,
+		int32_t worker,
+		void *param
+	);
+	/**
+	 * Recover scene radiance image into recover_img with the method of
+	 * recover_mode. Histograms are gathered by the recover workers when
+	 * hist is not null.
+	 * @param[in] raw_image Raw image.
+	 * @param[in] transmission_map Quantized transmission map, recover_mode 1.
+	 * @param[in] transmission_inv Transmission inverse, recover_mode 0.
+	 * @param[in] atmo_light Atmospheric light.
+	 * @param[out] hist Histogram of three channels of recovered image.
+	 * @return void.
+	 */
+	void recover_image(
+		uint8_t *raw_image,
+		uint8_t *transmission_map,
+		float *transmission_inv,
+		uint8_t atmo_light[3],
+		int32_t hist[3][256]
+	);
+	/**
+	 * Recover scene radiance image with SIMD speed up.
+	 * @return void.
+	 */
 	void neon_recover_scene_radiance(
 		uint8_t *raw_image,
 		float *transmission_image,
@@ -301,7 +557,6 @@ private:
 		uint8_t atmo_light[3],
 		uint8_t *processed_image
 	);
-#endif
 	/**
 	 * Auto levels.
 	 * @return void.
@@ -404,6 +659,11 @@ private:
 	 * @return void.
 	 */
 	void init_gamma_correct_table();
+	/**
+	 * Compose the pointwise Y transformations of process_yuv_ce into one table.
+	 * @return void.
+	 */
+	void init_ce_lut();
 	/**
 	 * Test classify image type.
 	 * @param[in] yuv_image YUV image.
@@ -469,26 +729,16 @@ private:
 	 */
 	void start_sat_adjust_manr_thread();
 
-	std::queue<uint8_t *> in_yuv_image_queue;
-	std::queue<uint8_t *> in_bgr_image_queue;
-	std::queue<uint8_t *> out_bgr_image_queue;
-	std::queue<uint8_t *> out_yuv_image_queue;
-	pthread_mutex_t in_yuv_image_mutex;
-	pthread_mutex_t in_bgr_image_mutex;
-	pthread_mutex_t out_bgr_image_mutex;
-	pthread_mutex_t out_yuv_image_mutex;
-	std::queue<uint8_t *> raw_y_image_queue;
-	std::queue<uint8_t *> clip_yuv_image_queue;
-	std::queue<uint8_t *> slt_yuv_image_queue;
-	std::queue<uint8_t *> clahe_yuv_image_queue;
-	std::queue<uint8_t *> edge_yuv_image_queue;
-	std::queue<uint8_t *> sa_manr_yuv_image_queue;
-	pthread_mutex_t raw_y_image_mutex;
-	pthread_mutex_t clip_yuv_image_mutex;
-	pthread_mutex_t slt_yuv_image_mutex;
-	pthread_mutex_t clahe_yuv_image_mutex;
-	pthread_mutex_t edge_yuv_image_mutex;
-	pthread_mutex_t sa_manr_yuv_image_mutex;
+	spsc_ring<frame_t> in_yuv_image_queue;
+	spsc_ring<frame_t> in_bgr_image_queue;
+	spsc_ring<frame_t> out_bgr_image_queue;
+	spsc_ring<frame_t> out_yuv_image_queue;
+	spsc_ring<uint8_t *> raw_y_image_queue;
+	spsc_ring<frame_t> clip_yuv_image_queue;
+	spsc_ring<frame_t> slt_yuv_image_queue;
+	spsc_ring<frame_t> clahe_yuv_image_queue;
+	spsc_ring<frame_t> edge_yuv_image_queue;
+	spsc_ring<frame_t> sa_manr_yuv_image_queue;
 	int32_t width;						// Image width.
 	int32_t height;						// Image height.
 	float downsample;					// Down sample
@@ -496,23 +746,26 @@ private:
 	int32_t ds_height;					// Down sampled height.
 	int32_t kmin_size;					// Patch size of minimum filter.
 	int32_t kgud_size;					// Guided filter size.
+	int32_t guided_subsample;			// Guided filter subsample factor.
+	fast_guided_filter gud_filter;		// Guided filter with its workspace.
 	uint8_t *bgr_image;					// BGR image.
 	uint8_t *dsbgr_image;				// Downsampled BGR image.
 	uint8_t *hazzy_img;					// Input RGB image.
 	uint8_t *rgb_img[3];				// RGB image array.
 	uint8_t *dsrgb_img[3];				// Down sampled RGB image array.
-	uint8_t *min_filt_rgb_img[3];		// Minimum filter RGB image array.
 	uint8_t *min_chan_img;				// Minimum channel image.
 	float bright_ratio_thresh;			// Brightest pixel ratio threshold of dark channel image.
+	int32_t atmo_light_method;			// 0: histogram, 1: quadtree, 2: compare both.
 	uint8_t atmo_light_ceiling;			// Atmospheric light ceiling.
 	uint8_t atmo_light[3];				// Atmospheric light
-	float *norm_min_filt_rgb_img[3];	// Normalized minimum filter RGB image array.
-	float *norm_min_chan_img;			// Normalized minimum channel image.
+	uint8_t quadtree_atmo_light[3];		// Quadtree atmospheric light of the last comparison.
 	uint8_t *dark_chan_img;				// Dark channel image.
 	float omega;						// Adjust factor of transmission image.
 	float *transm_img;					// Transmission image.
 	float *ustransm_img;				// Up sampled transmission image.
 	float *transm_inv;					// Transmission inverse.
+	uint8_t *transm_map;				// Quantized transmission map.
+	uint8_t *uv_transm_map;				// Quantized transmission map of chroma planes.
 	uint8_t *u8_transmission_image;		// Unsigned int8-transmission image.
 	float tran_thresh;					// Transmission threshold.
 	uint8_t *recover_img;				// Recover image.
@@ -525,15 +778,60 @@ private:
 	int32_t update_period;				// Parameter update period.
 	int32_t *transmission;				// Transmission map.
 	uint8_t ***recover_table;			// Recover table.
+	uint8_t recover_table_atmo[3];		// Atmospheric light of recover table.
+	bool recover_table_ready;			// Recover table is valid.
+	int32_t recover_mode;				// 0: float recovery, 1: table lookup recovery.
+	int32_t yuv_native;					// Dehaze YUV planes without full resolution RGB.
+	int32_t async_estimate;				// Estimate parameters in background thread.
+	pthread_t estimator_tid;			// Estimator thread identity.
+	pthread_mutex_t estimator_mutex;	// Protect estimator request.
+	pthread_cond_t estimator_cond;		// Signal estimator request or quit.
+	bool estimator_pending;				// Estimator request is pending.
+	bool estimator_quit;				// Stop estimator thread.
+	int32_t estimator_busy;				// Estimator owns its frame and back buffer.
+	uint8_t *estimator_frame;			// Frame copy handed to estimator.
+	int32_t published_generation;		// Number of published estimates, buffer index is its lowest bit.
+	int32_t consumed_generation;		// Generation of the current stretch table.
+	float *async_ustransm[2];			// Published up sampled transmission inverse.
+	uint8_t *async_transm_map[2];		// Published up sampled quantized transmission map.
+	uint8_t async_atmo[2][3];			// Published atmospheric light.
+	// Rows of one strip of process_yuv_dp, 0 disables strip execution and a
+	// negative value sizes strips from l2_cache_size. Strips stretch with the
+	// thresholds of the previous update frame, the first frame is not
+	// stretched, and async_estimate and min_pool do not apply.
+	int32_t strip_rows;
+	int32_t l2_cache_size;				// L2 bytes shared by the workers, sizes strips when strip_rows is negative.
+	uint8_t *strip_buffer;				// Scratch memory of all workers.
+	int32_t strip_bytes;				// Scratch bytes of one worker.
+	int32_t strip_offset[4];			// Transmission, YUV, BGR and recover strip offsets.
+	bilinear_resampler transm_resampler;	// Transmission up sampler to image size.
+	bilinear_resampler uv_transm_resampler;	// Transmission up sampler to chroma size.
+	int32_t *recover_hist;				// Per worker histograms gathered by recovery.
+	int32_t min_pool;					// 0: bilinear down sampling, 1: min-pooling decimator.
+	uint8_t *min_pool_buffer;			// Line buffers of all workers.
+	int32_t min_pool_bytes;				// Line buffer bytes of one worker.
 	uint8_t **stretch_table;			// Stretch table.
 	int32_t nrecover_threads;			// Number of recover threads.
 	int32_t nstretch_threads;			// Number of stretch threads.
+	int32_t npool_threads;				// Number of worker pool threads.
+	thread_pool workers;				// Worker pool shared by per-frame stages.
 	float clip_limit;					// Histogram clip limit.
+	int32_t clahe_grid_x;				// Number of CLAHE contextual regions in x direction.
+	int32_t clahe_grid_y;				// Number of CLAHE contextual regions in y direction.
+	int32_t clahe_temporal;				// 0: CLAHE of current frame, 1: previous frame mappings.
+	float clahe_temporal_blend;			// Weight of previous mappings in temporal CLAHE.
+	int32_t auto_clip_limit;			// 1: clip limit of every tile from entropy, clip_limit bounds it.
+	clahe_state_t clahe_state;			// Mappings of temporal CLAHE.
+	int32_t clahe_error;				// First CLAHE error code, printed once.
 	float gamma;						// Gamma transformation power.
 	uint8_t *gamma_correct_table;		// Gamma transformation table.
+	lut_chain ce_lut;					// Composed pointwise Y transformations of process_yuv_ce.
 	uint8_t *old_y;						// Input Y image.
 	uint8_t *prev_manr_y_image;			// Previous MANR Y image.
 	uint8_t *mfilt_y_image;				// Median filter image.
+	uint8_t *edge_blur_y_image;			// Blurred Y image of edge enhancement thread.
+	frame_pool ce_frames;				// YUV420 frames of SLT & CLAHE & LOG & SA pipeline.
+	frame_pool ce_raw_y_frames;			// Input Y images of SLT & CLAHE & LOG & SA pipeline.
 	int32_t enable_uv_adjust;			// Saturation adjustment switch.
 	int32_t enable_edge_enhan;			// Edge enhancement switch.
 	int32_t slt[4];						// Segmented linear transformation parameters.
@@ -541,6 +839,11 @@ private:
 	int32_t enable_T_noise_reduce;		// Enable time noise reduction.
 	int32_t enable_2D_noise_reduce;		// Enable 2D noise reduction.
 	int32_t enable_module;
+	int32_t pipeline_delay;				// 0: output the latest ready frame, N: fixed delay of N frames.
+	int64_t ce_seq;						// Next input sequence number of SLT & CLAHE & LOG & SA pipeline.
+	int64_t dp_seq;						// Next input sequence number of defog pipeline.
+	int32_t enable_profiler;			// 1: time the stages.
+	profiler profile;					// Stage timings.
 };
 
 #endif
\ No newline at end of file
@@ -32,6 +32,11 @@ void defog_module_in_out(unsigned char *image)
 #endif
 }
 
+int defog_module_profile(char *table, int size)
+{
+	return defog_module.get_profile(table, size);
+}
+
 void defog_module_free()
 {
 	;
@@ -10,6 +10,8 @@ void defog_module_init(unsigned char *raw_image, int width, int height);
 
 void defog_module_in_out(unsigned char *image);
 
+int defog_module_profile(char *table, int size);
+
 void defog_module_free();
 
 #ifdef __cplusplus
@@ -0,0 +1,337 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include "guided_filter.h"
+
+#define WORKSPACE_ALIGN		(32)
+
+//---------------------------------------------------------
+// Default constructor function of class fast_guided_filter.
+//---------------------------------------------------------
+fast_guided_filter::fast_guided_filter()
+{
+	width = 0;
+	height = 0;
+	subsample = 1;
+	ss_width = 0;
+	ss_height = 0;
+	kradii = 0;
+	eps = 0;
+	workspace = 0;
+}
+
+//---------------------------------------------------------
+// Destructor function of class fast_guided_filter.
+//---------------------------------------------------------
+fast_guided_filter::~fast_guided_filter()
+{
+	release();
+}
+
+//---------------------------------------------------------
+// Free the workspace.
+//---------------------------------------------------------
+void fast_guided_filter::release()
+{
+	if (workspace) {
+		free(workspace);
+		workspace = 0;
+	}
+}
+
+//---------------------------------------------------------
+// Allocate the workspace.
+//---------------------------------------------------------
+void fast_guided_filter::init(
+	int32_t width_,
+	int32_t height_,
+	int32_t ksize,
+	int32_t subsample_,
+	float eps_
+)	{
+	release();
+
+	width = width_;
+	height = height_;
+	subsample = std::max(subsample_, 1);
+	ss_width = (width + subsample - 1) / subsample;
+	ss_height = (height + subsample - 1) / subsample;
+	kradii = std::max(ksize / 2 / subsample, 1);
+	eps = eps_;
+
+	// Every array starts at an aligned offset.
+	const int32_t nplanes = sizeof(planes) / sizeof(planes[0]);
+	const int32_t ncolsums = sizeof(colsum) / sizeof(colsum[0]);
+	const size_t align_floats = WORKSPACE_ALIGN / sizeof(float);
+	#define ALIGNED_SIZE(n) ((((size_t)(n) + align_floats - 1) / align_floats) * align_floats)
+	const size_t plane_size = ALIGNED_SIZE(ss_width * ss_height);
+	const size_t colsum_size = ALIGNED_SIZE(ss_width);
+	const size_t row_size = ALIGNED_SIZE(width);
+	const size_t nfloats = nplanes * plane_size + ncolsums * colsum_size + ALIGNED_SIZE(ss_width) +
+		ALIGNED_SIZE(ss_height) + ALIGNED_SIZE(2 * width) + row_size + ALIGNED_SIZE(2 * height) +
+		ALIGNED_SIZE(height) + 4 * row_size;
+
+	int32_t ret = posix_memalign(&workspace, WORKSPACE_ALIGN, nfloats * sizeof(float));
+	if (0 != ret) {
+		printf("Allocate guided filter workspace fail!\n");
+		exit(-1);
+	}
+
+	float *ptr = (float *)workspace;
+	for (int32_t i = 0; i < nplanes; i++) {
+		planes[i] = ptr;
+		ptr += plane_size;
+	}
+
+	for (int32_t i = 0; i < ncolsums; i++) {
+		colsum[i] = ptr;
+		ptr += colsum_size;
+	}
+
+	inv_xcount = ptr;
+	ptr += ALIGNED_SIZE(ss_width);
+	inv_ycount = ptr;
+	ptr += ALIGNED_SIZE(ss_height);
+	xindex = (int32_t *)ptr;
+	ptr += ALIGNED_SIZE(2 * width);
+	xweight = ptr;
+	ptr += row_size;
+	yindex = (int32_t *)ptr;
+	ptr += ALIGNED_SIZE(2 * height);
+	yweight = ptr;
+	ptr += ALIGNED_SIZE(height);
+	for (int32_t i = 0; i < 2; i++) {
+		row_a[i] = ptr;
+		ptr += row_size;
+		row_b[i] = ptr;
+		ptr += row_size;
+	}
+	#undef ALIGNED_SIZE
+
+	// Inverse number of pixels covered by the clipped window.
+	for (int32_t x = 0; x < ss_width; x++) {
+		inv_xcount[x] = 1.0f / (std::min(x + kradii, ss_width - 1) - std::max(x - kradii, 0) + 1);
+	}
+
+	for (int32_t y = 0; y < ss_height; y++) {
+		inv_ycount[y] = 1.0f / (std::min(y + kradii, ss_height - 1) - std::max(y - kradii, 0) + 1);
+	}
+
+	// Bilinear upsample tables, pixel centers aligned.
+	for (int32_t x = 0; x < width; x++) {
+		float sx = (x + 0.5f) / subsample - 0.5f;
+		sx = std::min(std::max(sx, 0.0f), (float)(ss_width - 1));
+		const int32_t x0 = (int32_t)sx;
+		xindex[2 * x] = x0;
+		xindex[2 * x + 1] = std::min(x0 + 1, ss_width - 1);
+		xweight[x] = sx - x0;
+	}
+
+	for (int32_t y = 0; y < height; y++) {
+		float sy = (y + 0.5f) / subsample - 0.5f;
+		sy = std::min(std::max(sy, 0.0f), (float)(ss_height - 1));
+		const int32_t y0 = (int32_t)sy;
+		yindex[2 * y] = y0;
+		yindex[2 * y + 1] = std::min(y0 + 1, ss_height - 1);
+		yweight[y] = sy - y0;
+	}
+}
+
+//---------------------------------------------------------
+// Subsample guide image and input image.
+//---------------------------------------------------------
+void fast_guided_filter::subsample_images(
+	const uint8_t *guide_image,
+	const float *input_image
+)	{
+	float *I = planes[0];
+	float *P = planes[1];
+	float *II = planes[2];
+	float *IP = planes[3];
+	const float norm = 1.0f / 255;
+
+	for (int32_t sy = 0; sy < ss_height; sy++) {
+		const int32_t y0 = sy * subsample;
+		const int32_t y1 = std::min(y0 + subsample, height);
+		for (int32_t sx = 0; sx < ss_width; sx++) {
+			const int32_t x0 = sx * subsample;
+			const int32_t x1 = std::min(x0 + subsample, width);
+			int32_t sum_guide = 0;
+			float sum_input = 0;
+			for (int32_t y = y0; y < y1; y++) {
+				const uint8_t *guide = guide_image + y * width;
+				const float *input = input_image + y * width;
+				for (int32_t x = x0; x < x1; x++) {
+					sum_guide += guide[x];
+					sum_input += input[x];
+				}
+			}
+			const float inv_count = 1.0f / ((y1 - y0) * (x1 - x0));
+			const int32_t i = sy * ss_width + sx;
+			I[i] = sum_guide * norm * inv_count;
+			P[i] = sum_input * inv_count;
+			II[i] = I[i] * I[i];
+			IP[i] = I[i] * P[i];
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Mean filter with running sums.
+//---------------------------------------------------------
+void fast_guided_filter::box_mean(
+	float *const *src,
+	float *const *dst,
+	int32_t nplanes
+)	{
+	assert(nplanes <= 4);
+
+	for (int32_t k = 0; k < nplanes; k++) {
+		memset(colsum[k], 0, ss_width * sizeof(float));
+	}
+
+	// Column sums of the first window.
+	for (int32_t y = 0; y <= std::min(kradii, ss_height - 1); y++) {
+		for (int32_t k = 0; k < nplanes; k++) {
+			const float *data = src[k] + y * ss_width;
+			float *sum = colsum[k];
+			for (int32_t x = 0; x < ss_width; x++) {
+				sum[x] += data[x];
+			}
+		}
+	}
+
+	for (int32_t y = 0; y < ss_height; y++) {
+		// Slide column sums down.
+		const int32_t yadd = y + kradii;
+		const int32_t ysub = y - kradii - 1;
+		if (y > 0 && yadd < ss_height) {
+			for (int32_t k = 0; k < nplanes; k++) {
+				const float *data = src[k] + yadd * ss_width;
+				float *sum = colsum[k];
+				for (int32_t x = 0; x < ss_width; x++) {
+					sum[x] += data[x];
+				}
+			}
+		}
+		if (ysub >= 0) {
+			for (int32_t k = 0; k < nplanes; k++) {
+				const float *data = src[k] + ysub * ss_width;
+				float *sum = colsum[k];
+				for (int32_t x = 0; x < ss_width; x++) {
+					sum[x] -= data[x];
+				}
+			}
+		}
+
+		// Slide row sums right.
+		const float inv_ycount_y = inv_ycount[y];
+		for (int32_t k = 0; k < nplanes; k++) {
+			const float *sum = colsum[k];
+			float *mean = dst[k] + y * ss_width;
+			float row_sum = 0;
+			for (int32_t x = 0; x <= std::min(kradii, ss_width - 1); x++) {
+				row_sum += sum[x];
+			}
+			mean[0] = row_sum * inv_xcount[0] * inv_ycount_y;
+			for (int32_t x = 1; x < ss_width; x++) {
+				if (x + kradii < ss_width) {
+					row_sum += sum[x + kradii];
+				}
+				if (x - kradii - 1 >= 0) {
+					row_sum -= sum[x - kradii - 1];
+				}
+				mean[x] = row_sum * inv_xcount[x] * inv_ycount_y;
+			}
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Upsample the coefficients and apply them.
+//---------------------------------------------------------
+void fast_guided_filter::upsample_apply(
+	const uint8_t *guide_image,
+	float *output_image
+)	{
+	const float *A = planes[4];
+	const float *B = planes[5];
+	const float norm = 1.0f / 255;
+	// Subsampled row held by each row cache.
+	int32_t cached[2] = {-1, -1};
+
+	for (int32_t y = 0; y < height; y++) {
+		// Horizontal upsample of the two neighbour rows, each row only once.
+		float *ra[2];
+		float *rb[2];
+		for (int32_t j = 0; j < 2; j++) {
+			const int32_t sy = yindex[2 * y + j];
+			const int32_t slot = sy & 1;
+			ra[j] = row_a[slot];
+			rb[j] = row_b[slot];
+			if (cached[slot] == sy) {
+				continue;
+			}
+			const float *a = A + sy * ss_width;
+			const float *b = B + sy * ss_width;
+			for (int32_t x = 0; x < width; x++) {
+				const int32_t x0 = xindex[2 * x];
+				const int32_t x1 = xindex[2 * x + 1];
+				const float wx = xweight[x];
+				ra[j][x] = a[x0] + wx * (a[x1] - a[x0]);
+				rb[j][x] = b[x0] + wx * (b[x1] - b[x0]);
+			}
+			cached[slot] = sy;
+		}
+
+		const float wy = yweight[y];
+		const uint8_t *guide = guide_image + y * width;
+		float *output = output_image + y * width;
+		for (int32_t x = 0; x < width; x++) {
+			const float a = ra[0][x] + wy * (ra[1][x] - ra[0][x]);
+			const float b = rb[0][x] + wy * (rb[1][x] - rb[0][x]);
+			output[x] = a * guide[x] * norm + b;
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Filter image.
+//---------------------------------------------------------
+void fast_guided_filter::filter(
+	const uint8_t *guide_image,
+	const float *input_image,
+	float *output_image
+)	{
+	assert(workspace);
+	assert(guide_image);
+	assert(input_image);
+	assert(output_image);
+
+	subsample_images(guide_image, input_image);
+
+	// Means of I, P, II and IP in one sweep.
+	box_mean(planes, planes + 4, 4);
+
+	// Linear coefficients, A and B overwrite the subsampled I and P.
+	const int32_t npixels = ss_width * ss_height;
+	const float *MI = planes[4];
+	const float *MP = planes[5];
+	const float *MII = planes[6];
+	const float *MIP = planes[7];
+	float *A = planes[0];
+	float *B = planes[1];
+	for (int32_t i = 0; i < npixels; i++) {
+		const float cov = MIP[i] - MI[i] * MP[i];
+		const float var = MII[i] - MI[i] * MI[i];
+		A[i] = cov / (var + eps);
+		B[i] = MP[i] - A[i] * MI[i];
+	}
+
+	// Means of A and B in one sweep.
+	box_mean(planes, planes + 4, 2);
+
+	upsample_apply(guide_image, output_image);
+}
@@ -0,0 +1,106 @@
+#ifndef _GUIDED_FILTER_H_
+#define _GUIDED_FILTER_H_
+
+#include <cstdint>
+
+/**
+ * Fast guided filter. The linear coefficients are estimated on a subsampled
+ * guide and input, then upsampled bilinearly and applied at full resolution.
+ * All memory is allocated in init, filter does not touch the heap.
+ */
+class fast_guided_filter
+{
+public:
+	/**
+	 * Default constructor function.
+	 */
+	fast_guided_filter();
+	/**
+	 * Destructor function.
+	 */
+	~fast_guided_filter();
+	/**
+	 * Allocate the workspace.
+	 * @param[in] width_ Image width.
+	 * @param[in] height_ Image height.
+	 * @param[in] ksize Kernel size at full resolution.
+	 * @param[in] subsample_ Subsample factor, 1 means no subsampling.
+	 * @param[in] eps_ Regularization of the guide variance.
+	 * @return void.
+	 */
+	void init(
+		int32_t width_,
+		int32_t height_,
+		int32_t ksize,
+		int32_t subsample_,
+		float eps_
+	);
+	/**
+	 * Filter image. The input and output image can be the same.
+	 * @param[in] guide_image Guide image, gray levels in [0, 255].
+	 * @param[in] input_image Input image.
+	 * @param[out] output_image Output image.
+	 * @return void.
+	 */
+	void filter(
+		const uint8_t *guide_image,
+		const float *input_image,
+		float *output_image
+	);
+private:
+	/**
+	 * Free the workspace.
+	 * @return void.
+	 */
+	void release();
+	/**
+	 * Subsample guide image and input image with block average, and make the
+	 * squared guide and the guide-input product planes.
+	 * @return void.
+	 */
+	void subsample_images(
+		const uint8_t *guide_image,
+		const float *input_image
+	);
+	/**
+	 * Mean filter of nplanes low resolution planes in one running sum sweep.
+	 * @param[in] src Source planes.
+	 * @param[out] dst Destination planes.
+	 * @param[in] nplanes Number of planes, at most 4.
+	 * @return void.
+	 */
+	void box_mean(
+		float *const *src,
+		float *const *dst,
+		int32_t nplanes
+	);
+	/**
+	 * Upsample the mean coefficients and apply them to the guide image.
+	 * @return void.
+	 */
+	void upsample_apply(
+		const uint8_t *guide_image,
+		float *output_image
+	);
+
+	int32_t width;			// Image width.
+	int32_t height;			// Image height.
+	int32_t subsample;		// Subsample factor.
+	int32_t ss_width;		// Subsampled image width.
+	int32_t ss_height;		// Subsampled image height.
+	int32_t kradii;			// Kernel radius at subsampled resolution.
+	float eps;				// Regularization of the guide variance.
+	void *workspace;		// Aligned workspace.
+	float *planes[8];		// Subsampled planes.
+	float *colsum[4];		// Column sums of the box filter.
+	float *inv_xcount;		// Inverse horizontal window size.
+	float *inv_ycount;		// Inverse vertical window size.
+	int32_t *xindex;		// Left and right neighbours of upsampled columns.
+	float *xweight;			// Right weight of upsampled columns.
+	int32_t *yindex;		// Top and bottom neighbours of upsampled rows.
+	float *yweight;			// Bottom weight of upsampled rows.
+	float *row_a[2];		// Horizontally upsampled coefficient A rows.
+	float *row_b[2];		// Horizontally upsampled coefficient B rows.
+};
+
+#endif
@@ -0,0 +1,255 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <ctime>
+#include "profiler.h"
+
+//---------------------------------------------------------
+// Histogram bucket of a duration in microseconds.
+//---------------------------------------------------------
+static int32_t duration_bucket(
+	int64_t us
+)	{
+	if (us < 16) {
+		return us < 0 ? 0 : (int32_t)us;
+	}
+
+	// Eight buckets per octave from 16us.
+	const int32_t e = 63 - __builtin_clzll((unsigned long long)us);
+	const int32_t sub = (int32_t)(us >> (e - 3)) & 7;
+	const int32_t b = 16 + ((e - 4) << 3) + sub;
+	return b < PROFILER_NBUCKETS ? b : PROFILER_NBUCKETS - 1;
+}
+
+//---------------------------------------------------------
+// Middle of a histogram bucket in microseconds.
+//---------------------------------------------------------
+static double bucket_duration(
+	int32_t b
+)	{
+	if (b < 16) {
+		return b;
+	}
+
+	const int32_t e = ((b - 16) >> 3) + 4;
+	const int32_t sub = (b - 16) & 7;
+	const double width = (double)(1LL << (e - 3));
+	return (8 + sub) * width + 0.5 * width;
+}
+
+//---------------------------------------------------------
+// Default constructor function of class profiler.
+//---------------------------------------------------------
+profiler::profiler()
+{
+	names = 0;
+	nstages = 0;
+	on = 0;
+	stats = 0;
+	memset(ready, 0, sizeof(ready));
+	nclaimed = 0;
+}
+
+//---------------------------------------------------------
+// Destructor function of class profiler.
+//---------------------------------------------------------
+profiler::~profiler()
+{
+	if (stats) {
+		delete [] stats;
+		stats = 0;
+	}
+}
+
+//---------------------------------------------------------
+// Set stages.
+//---------------------------------------------------------
+void profiler::init(
+	int32_t nstages_,
+	const char *const *names_
+)	{
+	assert(nstages_ > 0 && names_);
+	if (stats) {
+		delete [] stats;
+	}
+
+	names = names_;
+	nstages = nstages_;
+	stats = new stage_stats_t[PROFILER_MAX_THREADS * nstages];
+	assert(stats);
+	memset(stats, 0, sizeof(stage_stats_t) * PROFILER_MAX_THREADS * nstages);
+	memset(ready, 0, sizeof(ready));
+	nclaimed = 0;
+}
+
+//---------------------------------------------------------
+// Switch timing on or off.
+//---------------------------------------------------------
+void profiler::enable(
+	bool on_
+)	{
+	__atomic_store_n(&on, stats && on_ ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+//---------------------------------------------------------
+// Test whether timing is on.
+//---------------------------------------------------------
+bool profiler::enabled() const
+{
+	return __atomic_load_n(&on, __ATOMIC_RELAXED) != 0;
+}
+
+//---------------------------------------------------------
+// Get stats of calling thread.
+//---------------------------------------------------------
+profiler::stage_stats_t *profiler::thread_stats()
+{
+	const pthread_t self = pthread_self();
+	const int32_t n = __atomic_load_n(&nclaimed, __ATOMIC_ACQUIRE);
+	for (int32_t t = 0; t < n && t < PROFILER_MAX_THREADS; t++) {
+		if (__atomic_load_n(&ready[t], __ATOMIC_ACQUIRE) && pthread_equal(tids[t], self)) {
+			return stats + t * nstages;
+		}
+	}
+
+	const int32_t t = __atomic_fetch_add(&nclaimed, 1, __ATOMIC_ACQ_REL);
+	if (t >= PROFILER_MAX_THREADS) {
+		return 0;
+	}
+
+	tids[t] = self;
+	__atomic_store_n(&ready[t], 1, __ATOMIC_RELEASE);
+	return stats + t * nstages;
+}
+
+//---------------------------------------------------------
+// Add one sample.
+//---------------------------------------------------------
+void profiler::record(
+	int32_t stage,
+	int64_t ns
+)	{
+	assert(stage >= 0 && stage < nstages);
+	stage_stats_t *thread = thread_stats();
+	if (!thread) {
+		return;
+	}
+
+	// Only this thread writes the slot, the stores are atomic for report.
+	stage_stats_t *s = thread + stage;
+	const int64_t count = s->count;
+	__atomic_store_n(&s->sum, s->sum + ns, __ATOMIC_RELAXED);
+	if (0 == count || ns < s->min) {
+		__atomic_store_n(&s->min, ns, __ATOMIC_RELAXED);
+	}
+	if (0 == count || ns > s->max) {
+		__atomic_store_n(&s->max, ns, __ATOMIC_RELAXED);
+	}
+	uint32_t *bin = &s->hist[duration_bucket(ns / 1000)];
+	__atomic_store_n(bin, *bin + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->count, count + 1, __ATOMIC_RELEASE);
+}
+
+//---------------------------------------------------------
+// Write stats table.
+//---------------------------------------------------------
+int32_t profiler::report(
+	char *table,
+	int32_t size
+)	{
+	assert(table && size > 0);
+	int32_t len = snprintf(table, size, "%-32s %8s %10s %10s %10s %10s %10s\n",
+		"stage", "count", "min(ms)", "mean(ms)", "p50(ms)", "p99(ms)", "max(ms)");
+	int32_t nthreads = __atomic_load_n(&nclaimed, __ATOMIC_ACQUIRE);
+	if (nthreads > PROFILER_MAX_THREADS) {
+		nthreads = PROFILER_MAX_THREADS;
+	}
+
+	for (int32_t i = 0; i < nstages; i++) {
+		int64_t count = 0, sum = 0, minv = 0, maxv = 0;
+		uint64_t hist[PROFILER_NBUCKETS] = {0};
+		for (int32_t t = 0; t < nthreads; t++) {
+			if (!__atomic_load_n(&ready[t], __ATOMIC_ACQUIRE)) {
+				continue;
+			}
+			stage_stats_t *s = stats + t * nstages + i;
+			const int64_t n = __atomic_load_n(&s->count, __ATOMIC_ACQUIRE);
+			if (0 == n) {
+				continue;
+			}
+			const int64_t smin = __atomic_load_n(&s->min, __ATOMIC_RELAXED);
+			const int64_t smax = __atomic_load_n(&s->max, __ATOMIC_RELAXED);
+			minv = (0 == count || smin < minv) ? smin : minv;
+			maxv = (0 == count || smax > maxv) ? smax : maxv;
+			count += n;
+			sum += __atomic_load_n(&s->sum, __ATOMIC_RELAXED);
+			for (int32_t b = 0; b < PROFILER_NBUCKETS; b++) {
+				hist[b] += __atomic_load_n(&s->hist[b], __ATOMIC_RELAXED);
+			}
+		}
+
+		if (0 == count) {
+			continue;
+		}
+
+		// Percentiles from the histogram, clamped to the exact extremes.
+		uint64_t total = 0;
+		for (int32_t b = 0; b < PROFILER_NBUCKETS; b++) {
+			total += hist[b];
+		}
+
+		double pct[2] = {0, 0};
+		const double rank[2] = {0.5, 0.99};
+		for (int32_t k = 0; k < 2; k++) {
+			const uint64_t target = (uint64_t)(rank[k] * total + 0.5);
+			uint64_t acc = 0;
+			int32_t b = 0;
+			for (; b < PROFILER_NBUCKETS - 1; b++) {
+				acc += hist[b];
+				if (acc >= target && acc > 0) {
+					break;
+				}
+			}
+			pct[k] = 1000.0 * bucket_duration(b);
+			pct[k] = pct[k] < minv ? minv : (pct[k] > maxv ? maxv : pct[k]);
+		}
+
+		len += snprintf(len < size ? table + len : 0, len < size ? size - len : 0,
+			"%-32s %8lld %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf\n", names[i], (long long)count,
+			1e-6 * minv, 1e-6 * sum / count, 1e-6 * pct[0], 1e-6 * pct[1], 1e-6 * maxv);
+	}
+
+	return len;
+}
+
+//---------------------------------------------------------
+// Get CLOCK_MONOTONIC time.
+//---------------------------------------------------------
+int64_t profiler::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//---------------------------------------------------------
+// Constructor function of class scoped_timer.
+//---------------------------------------------------------
+scoped_timer::scoped_timer(
+	profiler *prof_,
+	int32_t stage_
+)	{
+	prof = prof_;
+	stage = stage_;
+	start = prof->enabled() ? profiler::now() : -1;
+}
+
+//---------------------------------------------------------
+// Destructor function of class scoped_timer.
+//---------------------------------------------------------
+scoped_timer::~scoped_timer()
+{
+	if (start >= 0) {
+		prof->record(stage, profiler::now() - start);
+	}
+}
@@ -0,0 +1,131 @@
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <cstdint>
+#include "pthread.h"
+
+#define PROFILER_MAX_THREADS	(32)
+#define PROFILER_NBUCKETS		(240)
+
+/**
+ * Wall clock profiler of processing stages. Every thread accumulates its
+ * samples in its own slot without locks, a slot is claimed with an atomic
+ * counter on the first sample of a thread. Durations are kept as count, sum,
+ * minimum, maximum and a log scaled histogram with eight buckets per octave of
+ * microseconds, so percentiles are within about 6%. Timing is switched on at
+ * run time; switched off, a timer costs one load.
+ */
+class profiler
+{
+public:
+	/**
+	 * Default constructor function.
+	 */
+	profiler();
+	/**
+	 * Destructor function.
+	 */
+	~profiler();
+	/**
+	 * Set the stages. Not thread safe, call before any sample.
+	 * @param[in] nstages_ Number of stages.
+	 * @param[in] names_ Stage names, not copied.
+	 * @return void.
+	 */
+	void init(
+		int32_t nstages_,
+		const char *const *names_
+	);
+	/**
+	 * Switch timing on or off.
+	 * @param[in] on Timing switch.
+	 * @return void.
+	 */
+	void enable(
+		bool on
+	);
+	/**
+	 * Test whether timing is on.
+	 * @return true if on.
+	 */
+	bool enabled() const;
+	/**
+	 * Add one sample to the stage accumulator of the calling thread.
+	 * @param[in] stage Stage index.
+	 * @param[in] ns Duration in nanoseconds.
+	 * @return void.
+	 */
+	void record(
+		int32_t stage,
+		int64_t ns
+	);
+	/**
+	 * Write the stats table, one line per stage with samples: count and
+	 * minimum, mean, p50, p99 and maximum in milliseconds over all threads.
+	 * Samples added meanwhile may be partly counted.
+	 * @param[out] table Text buffer.
+	 * @param[in] size Text buffer size.
+	 * @return Length of the table, may exceed size - 1 when truncated.
+	 */
+	int32_t report(
+		char *table,
+		int32_t size
+	);
+	/**
+	 * Get CLOCK_MONOTONIC time.
+	 * @return Time in nanoseconds.
+	 */
+	static int64_t now();
+private:
+	/**
+	 * \typedef struct stage_stats_t
+	 * \brief Data structure for the samples of one stage in one thread.
+	 */
+	typedef struct {
+		int64_t count;							// Number of samples.
+		int64_t sum;							// Sum of durations in nanoseconds.
+		int64_t min;							// Minimum duration in nanoseconds.
+		int64_t max;							// Maximum duration in nanoseconds.
+		uint32_t hist[PROFILER_NBUCKETS];		// Histogram of durations in microseconds.
+	}stage_stats_t;
+	/**
+	 * Get the stats of the calling thread, claim a slot on first use.
+	 * @return Stats of all stages, or 0 if all slots are taken.
+	 */
+	stage_stats_t *thread_stats();
+
+	const char *const *names;			// Stage names.
+	int32_t nstages;					// Number of stages.
+	int32_t on;							// Timing switch.
+	stage_stats_t *stats;				// Stats of all slots and stages.
+	pthread_t tids[PROFILER_MAX_THREADS];	// Thread of each slot.
+	int32_t ready[PROFILER_MAX_THREADS];	// Slot thread is set.
+	int32_t nclaimed;					// Number of claimed slots.
+};
+
+/**
+ * Time the enclosing scope as one sample of a stage.
+ */
+class scoped_timer
+{
+public:
+	/**
+	 * Constructor function, start timing if the profiler is on.
+	 * @param[in] prof_ Profiler.
+	 * @param[in] stage_ Stage index.
+	 */
+	scoped_timer(
+		profiler *prof_,
+		int32_t stage_
+	);
+	/**
+	 * Destructor function, add the sample.
+	 */
+	~scoped_timer();
+private:
+	profiler *prof;						// Profiler.
+	int32_t stage;						// Stage index.
+	int64_t start;						// Start time, negative when off.
+};
+
+#endif
@@ -0,0 +1,44 @@
+#include <cstdio>
+#include <cstdlib>
+#include "pthread.h"
+#include "simd.h"
+
+static simd_kernels_t kernels;
+static const char *kernels_name = "c";
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+//---------------------------------------------------------
+// Select kernels by CPU features.
+//---------------------------------------------------------
+static void simd_select()
+{
+	simd_init_c(&kernels);
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		simd_init_avx2(&kernels);
+		kernels_name = "avx2";
+	} else if (__builtin_cpu_supports("sse4.1")) {
+		simd_init_sse41(&kernels);
+		kernels_name = "sse4.1";
+	}
+#endif
+}
+
+//---------------------------------------------------------
+// Get the kernels of the running CPU.
+//---------------------------------------------------------
+const simd_kernels_t *simd_kernels()
+{
+	pthread_once(&kernels_once, simd_select);
+	return &kernels;
+}
+
+//---------------------------------------------------------
+// Get the name of the selected instruction set.
+//---------------------------------------------------------
+const char *simd_name()
+{
+	pthread_once(&kernels_once, simd_select);
+	return kernels_name;
+}
@@ -0,0 +1,159 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include <cstdint>
+
+/**
+ * \typedef struct simd_kernels_t
+ * \brief Table of pixel kernels of one instruction set. The kernels follow the
+ * Neon implementation in defog.cpp: results are truncated toward zero and
+ * saturated to [0, 255], three channel images keep the channel order of the
+ * Neon code (red, green, blue in memory).
+ */
+typedef struct {
+	/**
+	 * Convert I420 image to interleaved RGB image.
+	 * @param[in] yuv_image I420 image, width and height should be even.
+	 * @param[in] width Image width.
+	 * @param[in] height Image height.
+	 * @param[out] rgb_image RGB image.
+	 * @return void.
+	 */
+	void (*yuv2rgb)(const uint8_t *yuv_image, int32_t width, int32_t height, uint8_t *rgb_image);
+	/**
+	 * Convert interleaved RGB image to I420 image, chroma is taken from the
+	 * top left pixel of every 2x2 block.
+	 * @param[in] rgb_image RGB image.
+	 * @param[in] width Image width, should be even.
+	 * @param[in] height Image height, should be even.
+	 * @param[out] yuv_image I420 image.
+	 * @return void.
+	 */
+	void (*rgb2yuv)(const uint8_t *rgb_image, int32_t width, int32_t height, uint8_t *yuv_image);
+	/**
+	 * Recover scene radiance, J = (I - A) * inv_t + A.
+	 * @param[in] raw_image Interleaved three channel image.
+	 * @param[in] transmission_inv Transmission inverse.
+	 * @param[in] npixels Number of pixels.
+	 * @param[in] atmo_light Atmospheric light in memory channel order.
+	 * @param[out] processed_image Recovered image.
+	 * @return void.
+	 */
+	void (*recover_scene_radiance)(const uint8_t *raw_image, const float *transmission_inv, int32_t npixels,
+		const uint8_t atmo_light[3], uint8_t *processed_image);
+	/**
+	 * Clip gray level to [minv, maxv] in place.
+	 * @return void.
+	 */
+	void (*clip_gray_level)(uint8_t *image, int32_t npixels, uint8_t minv, uint8_t maxv);
+	/**
+	 * Find the minimum and the maximum.
+	 * @return void.
+	 */
+	void (*minmax)(const uint8_t *image, int32_t npixels, uint8_t *minv, uint8_t *maxv);
+	/**
+	 * Segmented linear transformation in place with Q4 fixed point 16-bit
+	 * arithmetic, segment 0 below low_in, segment 1 below hig_in, segment 2 else.
+	 * @return void.
+	 */
+	void (*seg_linear_transf)(uint8_t *image, int32_t npixels, uint8_t low_in, uint8_t hig_in,
+		const int16_t scale[3], const int16_t bias[3]);
+	/**
+	 * Subtract the 3x3 correlation from the center pixel with 16-bit
+	 * arithmetic. Only the inner pixels of new_image are written.
+	 * @return void.
+	 */
+	void (*filter3x3)(const uint8_t *raw_image, int32_t width, int32_t height, const int16_t mask[9],
+		uint8_t *new_image);
+	/**
+	 * 3x3 median filter of rows 1 to height - 2, the missing left and right
+	 * neighbours take the edge pixel of the center row.
+	 * @return void.
+	 */
+	void (*median_filter3x3)(const uint8_t *raw_image, int32_t width, int32_t height, uint8_t *new_image);
+	/**
+	 * Motion adaptive noise reduction in place.
+	 * @param[in] mtf Motion transformation function, 16 entries.
+	 * @return void.
+	 */
+	void (*motion_adapt_noise_reduction)(uint8_t *curr_image, const uint8_t *prev_image, int32_t npixels,
+		const uint8_t mtf[16]);
+	/**
+	 * Scale U and V in place by 1.2 times the ratio of new Y to raw Y.
+	 * @return void.
+	 */
+	void (*saturation_adjustment)(const uint8_t *raw_y, const uint8_t *new_y, uint8_t *uv, int32_t width,
+		int32_t height);
+	/**
+	 * Apply a 256 entry lookup table.
+	 * @return void.
+	 */
+	void (*lookup_table)(const uint8_t *raw_image, int32_t npixels, const uint8_t table[256],
+		uint8_t *processed_image);
+	/**
+	 * Apply a 256 entry lookup table and find the minimum and the maximum of
+	 * the result in the same pass. raw_image may be processed_image.
+	 * @return void.
+	 */
+	void (*lookup_table_minmax)(const uint8_t *raw_image, int32_t npixels, const uint8_t table[256],
+		uint8_t *processed_image, uint8_t *minv, uint8_t *maxv);
+	/**
+	 * Reciprocal of float array.
+	 * @return void.
+	 */
+	void (*reciprocal)(const float *data, int32_t n, float *inv);
+	/**
+	 * Accumulate one interleaved row into column sums of every channel and
+	 * column minimum of the channel minimum.
+	 * @param[in] rgb_row Interleaved three channel row.
+	 * @param[in] width Row width.
+	 * @param[in,out] sum Column sums of the channels in memory order.
+	 * @param[in,out] min_row Column minimum of the channel minimum.
+	 * @return void.
+	 */
+	void (*min_pool_row)(const uint8_t *rgb_row, int32_t width, uint16_t *sum[3], uint8_t *min_row);
+}simd_kernels_t;
+
+/**
+ * Get the kernels of the best instruction set supported by the running CPU.
+ * The selection is made once at the first call.
+ * @return Kernel table.
+ */
+const simd_kernels_t *simd_kernels();
+
+/**
+ * Get the name of the selected instruction set.
+ * @return Name string.
+ */
+const char *simd_name();
+
+/**
+ * Fill kernel table with the plain C implementation.
+ * @param[out] kernels Kernel table.
+ * @return void.
+ */
+void simd_init_c(
+	simd_kernels_t *kernels
+);
+
+#if defined(__i386__) || defined(__x86_64__)
+/**
+ * Fill kernel table with the SSE4.1 implementation.
+ * @param[out] kernels Kernel table.
+ * @return void.
+ */
+void simd_init_sse41(
+	simd_kernels_t *kernels
+);
+
+/**
+ * Fill kernel table with the AVX2 implementation.
+ * @param[out] kernels Kernel table.
+ * @return void.
+ */
+void simd_init_avx2(
+	simd_kernels_t *kernels
+);
+#endif
+
+#endif
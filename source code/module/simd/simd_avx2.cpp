@@ -0,0 +1,729 @@
+#if defined(__i386__) || defined(__x86_64__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+#include <immintrin.h>
+#include "simd.h"
+#include "simd_x86.h"
+
+#define vminmax_epu8(a, b) \
+	do { \
+		__m256i minmax_tmp = (a); \
+		(a) = _mm256_min_epu8((a), (b)); \
+		(b) = _mm256_max_epu8(minmax_tmp, (b)); \
+	} while (0)
+
+//---------------------------------------------------------
+// Saturate to unsigned char.
+//---------------------------------------------------------
+static inline uint8_t saturate_u8(
+	int32_t val
+)	{
+	return val < 0 ? 0 : (val > 255 ? 255 : val);
+}
+
+//---------------------------------------------------------
+// Broadcast a 16 bytes shuffle mask to both lanes.
+//---------------------------------------------------------
+static inline __m256i load_mask(
+	const uint8_t mask[16]
+)	{
+	return _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)mask));
+}
+
+//---------------------------------------------------------
+// Split 96 interleaved bytes into three channels. The
+// lower lane holds pixels 0 to 15, the upper lane holds
+// pixels 16 to 31.
+//---------------------------------------------------------
+static inline void deinterleave_u8x32x3(
+	const uint8_t *data,
+	__m256i channel[3]
+)	{
+	__m256i in[3];
+	for (int32_t k = 0; k < 3; k++) {
+		in[k] = _mm256_set_m128i(_mm_loadu_si128((const __m128i *)(data + 48 + 16 * k)),
+			_mm_loadu_si128((const __m128i *)(data + 16 * k)));
+	}
+
+	for (int32_t c = 0; c < 3; c++) {
+		channel[c] = _mm256_or_si256(_mm256_or_si256(
+			_mm256_shuffle_epi8(in[0], load_mask(rgb_deinterleave_mask[c][0])),
+			_mm256_shuffle_epi8(in[1], load_mask(rgb_deinterleave_mask[c][1]))),
+			_mm256_shuffle_epi8(in[2], load_mask(rgb_deinterleave_mask[c][2])));
+	}
+}
+
+//---------------------------------------------------------
+// Merge three channels into 96 interleaved bytes.
+//---------------------------------------------------------
+static inline void interleave_u8x32x3(
+	const __m256i channel[3],
+	uint8_t *data
+)	{
+	for (int32_t k = 0; k < 3; k++) {
+		__m256i out = _mm256_or_si256(_mm256_or_si256(
+			_mm256_shuffle_epi8(channel[0], load_mask(rgb_interleave_mask[k][0])),
+			_mm256_shuffle_epi8(channel[1], load_mask(rgb_interleave_mask[k][1]))),
+			_mm256_shuffle_epi8(channel[2], load_mask(rgb_interleave_mask[k][2])));
+		_mm_storeu_si128((__m128i *)(data + 16 * k), _mm256_castsi256_si128(out));
+		_mm_storeu_si128((__m128i *)(data + 48 + 16 * k), _mm256_extracti128_si256(out, 1));
+	}
+}
+
+//---------------------------------------------------------
+// Convert 32 bytes to 32 floats.
+//---------------------------------------------------------
+static inline void cvt_u8x32_f32x8x4(
+	__m256i data,
+	__m256 val[4]
+)	{
+	const __m128i low = _mm256_castsi256_si128(data);
+	const __m128i hig = _mm256_extracti128_si256(data, 1);
+	val[0] = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(low));
+	val[1] = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(low, 8)));
+	val[2] = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(hig));
+	val[3] = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(hig, 8)));
+}
+
+//---------------------------------------------------------
+// Truncate 32 floats and saturate to 32 bytes.
+//---------------------------------------------------------
+static inline __m256i cvt_f32x8x4_u8x32(
+	const __m256 val[4]
+)	{
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	__m256i low = _mm256_packs_epi32(_mm256_cvttps_epi32(val[0]), _mm256_cvttps_epi32(val[1]));
+	__m256i hig = _mm256_packs_epi32(_mm256_cvttps_epi32(val[2]), _mm256_cvttps_epi32(val[3]));
+	return _mm256_permutevar8x32_epi32(_mm256_packus_epi16(low, hig), order);
+}
+
+//---------------------------------------------------------
+// Saturate 16 shorts to 16 bytes.
+//---------------------------------------------------------
+static inline __m128i packus_i16x16_u8x16(
+	__m256i data
+)	{
+	return _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(data, data), 0x08));
+}
+
+//---------------------------------------------------------
+// Convert I420 image to RGB image.
+//---------------------------------------------------------
+static void yuv2rgb_avx2(
+	const uint8_t *yuv_image,
+	int32_t width,
+	int32_t height,
+	uint8_t *rgb_image
+)	{
+	const int32_t npixels = width * height;
+	const uint8_t *u_start = yuv_image + npixels;
+	const uint8_t *v_start = u_start + (npixels >> 2);
+	const __m256 f32_128 = _mm256_set1_ps(128.0f);
+
+	for (int32_t y = 0; y < height; y++) {
+		const uint8_t *y_line = yuv_image + y * width;
+		const uint8_t *u_line = u_start + (y >> 1) * (width >> 1);
+		const uint8_t *v_line = v_start + (y >> 1) * (width >> 1);
+		int32_t x = 0;
+		for (; x <= width - 32; x += 32) {
+			__m128i u8_u = _mm_loadu_si128((const __m128i *)(u_line + (x >> 1)));
+			__m128i u8_v = _mm_loadu_si128((const __m128i *)(v_line + (x >> 1)));
+			__m256 Y[4], U[4], V[4];
+			cvt_u8x32_f32x8x4(_mm256_loadu_si256((const __m256i *)(y_line + x)), Y);
+			cvt_u8x32_f32x8x4(_mm256_set_m128i(_mm_unpackhi_epi8(u8_u, u8_u), _mm_unpacklo_epi8(u8_u, u8_u)), U);
+			cvt_u8x32_f32x8x4(_mm256_set_m128i(_mm_unpackhi_epi8(u8_v, u8_v), _mm_unpacklo_epi8(u8_v, u8_v)), V);
+
+			__m256 R[4], G[4], B[4];
+			for (int32_t i = 0; i < 4; i++) {
+				U[i] = _mm256_sub_ps(U[i], f32_128);
+				V[i] = _mm256_sub_ps(V[i], f32_128);
+				R[i] = _mm256_add_ps(Y[i], _mm256_mul_ps(V[i], _mm256_set1_ps(1.402f)));
+				G[i] = _mm256_sub_ps(_mm256_sub_ps(Y[i], _mm256_mul_ps(U[i], _mm256_set1_ps(0.34414f))),
+					_mm256_mul_ps(V[i], _mm256_set1_ps(0.71414f)));
+				B[i] = _mm256_add_ps(Y[i], _mm256_mul_ps(U[i], _mm256_set1_ps(1.772f)));
+			}
+
+			__m256i rgb[3] = {cvt_f32x8x4_u8x32(R), cvt_f32x8x4_u8x32(G), cvt_f32x8x4_u8x32(B)};
+			interleave_u8x32x3(rgb, rgb_image);
+			rgb_image += 96;
+		}
+
+		for (; x < width; x++) {
+			const float Yf = y_line[x];
+			const float Uf = u_line[x >> 1] - 128.0f;
+			const float Vf = v_line[x >> 1] - 128.0f;
+			rgb_image[0] = saturate_u8((int32_t)(Yf + Vf * 1.402f));
+			rgb_image[1] = saturate_u8((int32_t)((Yf - Uf * 0.34414f) - Vf * 0.71414f));
+			rgb_image[2] = saturate_u8((int32_t)(Yf + Uf * 1.772f));
+			rgb_image += 3;
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Convert RGB image to I420 image.
+//---------------------------------------------------------
+static void rgb2yuv_avx2(
+	const uint8_t *rgb_image,
+	int32_t width,
+	int32_t height,
+	uint8_t *yuv_image
+)	{
+	const int32_t npixels = width * height;
+	uint8_t *u_pos = yuv_image + npixels;
+	uint8_t *v_pos = u_pos + (npixels >> 2);
+	const __m256i even_mask = load_mask(even_bytes_mask);
+
+	for (int32_t y = 0; y < height; y++) {
+		uint8_t *y_line = yuv_image + y * width;
+		const bool chroma_row = 0 == (y & 1);
+		int32_t x = 0;
+		for (; x <= width - 32; x += 32) {
+			__m256i rgb[3];
+			deinterleave_u8x32x3(rgb_image, rgb);
+			__m256 R[4], G[4], B[4], Y[4];
+			cvt_u8x32_f32x8x4(rgb[0], R);
+			cvt_u8x32_f32x8x4(rgb[1], G);
+			cvt_u8x32_f32x8x4(rgb[2], B);
+			for (int32_t i = 0; i < 4; i++) {
+				Y[i] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(B[i], _mm256_set1_ps(0.098f)),
+					_mm256_mul_ps(G[i], _mm256_set1_ps(0.504f))), _mm256_mul_ps(R[i], _mm256_set1_ps(0.257f))),
+					_mm256_set1_ps(16.0f));
+			}
+			_mm256_storeu_si256((__m256i *)(y_line + x), cvt_f32x8x4_u8x32(Y));
+
+			if (chroma_row) {
+				__m256 U[4], V[4];
+				for (int32_t i = 0; i < 4; i++) {
+					U[i] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(B[i], _mm256_set1_ps(0.439f)),
+						_mm256_mul_ps(G[i], _mm256_set1_ps(-0.291f))), _mm256_mul_ps(R[i], _mm256_set1_ps(-0.148f))),
+						_mm256_set1_ps(128.0f));
+					V[i] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(B[i], _mm256_set1_ps(-0.071f)),
+						_mm256_mul_ps(G[i], _mm256_set1_ps(-0.368f))), _mm256_mul_ps(R[i], _mm256_set1_ps(0.439f))),
+						_mm256_set1_ps(128.0f));
+				}
+				__m256i u8_u = _mm256_shuffle_epi8(cvt_f32x8x4_u8x32(U), even_mask);
+				__m256i u8_v = _mm256_shuffle_epi8(cvt_f32x8x4_u8x32(V), even_mask);
+				_mm_storeu_si128((__m128i *)u_pos, _mm256_castsi256_si128(_mm256_permute4x64_epi64(u8_u, 0x08)));
+				_mm_storeu_si128((__m128i *)v_pos, _mm256_castsi256_si128(_mm256_permute4x64_epi64(u8_v, 0x08)));
+				u_pos += 16;
+				v_pos += 16;
+			}
+			rgb_image += 96;
+		}
+
+		for (; x < width; x++) {
+			const float R = rgb_image[0];
+			const float G = rgb_image[1];
+			const float B = rgb_image[2];
+			y_line[x] = saturate_u8((int32_t)(((B * 0.098f + G * 0.504f) + R * 0.257f) + 16.0f));
+			if (chroma_row && 0 == (x & 1)) {
+				*u_pos++ = saturate_u8((int32_t)(((B * 0.439f + G * -0.291f) + R * -0.148f) + 128.0f));
+				*v_pos++ = saturate_u8((int32_t)(((B * -0.071f + G * -0.368f) + R * 0.439f) + 128.0f));
+			}
+			rgb_image += 3;
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Recover scene radiance.
+//---------------------------------------------------------
+static void recover_scene_radiance_avx2(
+	const uint8_t *raw_image,
+	const float *transmission_inv,
+	int32_t npixels,
+	const uint8_t atmo_light[3],
+	uint8_t *processed_image
+)	{
+	const float atmo[3] = {(float)atmo_light[0], (float)atmo_light[1], (float)atmo_light[2]};
+	const __m256 atmo_vec[3] = {_mm256_set1_ps(atmo[0]), _mm256_set1_ps(atmo[1]), _mm256_set1_ps(atmo[2])};
+
+	int32_t i = 0;
+	for (; i <= npixels - 32; i += 32) {
+		__m256i rgb[3];
+		deinterleave_u8x32x3(raw_image, rgb);
+		__m256 inv[4];
+		for (int32_t j = 0; j < 4; j++) {
+			inv[j] = _mm256_loadu_ps(transmission_inv + i + 8 * j);
+		}
+
+		for (int32_t c = 0; c < 3; c++) {
+			__m256 val[4];
+			cvt_u8x32_f32x8x4(rgb[c], val);
+			for (int32_t j = 0; j < 4; j++) {
+				val[j] = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(val[j], atmo_vec[c]), inv[j]), atmo_vec[c]);
+			}
+			rgb[c] = cvt_f32x8x4_u8x32(val);
+		}
+
+		interleave_u8x32x3(rgb, processed_image);
+		raw_image += 96;
+		processed_image += 96;
+	}
+
+	for (; i < npixels; i++) {
+		for (int32_t c = 0; c < 3; c++) {
+			processed_image[c] = saturate_u8((int32_t)((raw_image[c] - atmo[c]) * transmission_inv[i] + atmo[c]));
+		}
+		raw_image += 3;
+		processed_image += 3;
+	}
+}
+
+//---------------------------------------------------------
+// Clip gray level.
+//---------------------------------------------------------
+static void clip_gray_level_avx2(
+	uint8_t *image,
+	int32_t npixels,
+	uint8_t minv,
+	uint8_t maxv
+)	{
+	const __m256i floor_vec = _mm256_set1_epi8((char)minv);
+	const __m256i ceiling_vec = _mm256_set1_epi8((char)maxv);
+	int32_t i = 0;
+	for (; i <= npixels - 32; i += 32) {
+		__m256i data = _mm256_loadu_si256((const __m256i *)(image + i));
+		data = _mm256_min_epu8(_mm256_max_epu8(data, floor_vec), ceiling_vec);
+		_mm256_storeu_si256((__m256i *)(image + i), data);
+	}
+
+	for (; i < npixels; i++) {
+		image[i] = std::min(std::max(image[i], minv), maxv);
+	}
+}
+
+//---------------------------------------------------------
+// Find the minimum and the maximum.
+//---------------------------------------------------------
+static void minmax_avx2(
+	const uint8_t *image,
+	int32_t npixels,
+	uint8_t *minv,
+	uint8_t *maxv
+)	{
+	__m256i min_vec = _mm256_set1_epi8((char)255);
+	__m256i max_vec = _mm256_setzero_si256();
+	int32_t i = 0;
+	for (; i <= npixels - 32; i += 32) {
+		__m256i data = _mm256_loadu_si256((const __m256i *)(image + i));
+		min_vec = _mm256_min_epu8(min_vec, data);
+		max_vec = _mm256_max_epu8(max_vec, data);
+	}
+
+	uint8_t min_buf[32];
+	uint8_t max_buf[32];
+	_mm256_storeu_si256((__m256i *)min_buf, min_vec);
+	_mm256_storeu_si256((__m256i *)max_buf, max_vec);
+	uint8_t min_val = 255;
+	uint8_t max_val = 0;
+	for (int32_t j = 0; j < 32; j++) {
+		min_val = std::min(min_val, min_buf[j]);
+		max_val = std::max(max_val, max_buf[j]);
+	}
+
+	for (; i < npixels; i++) {
+		min_val = std::min(min_val, image[i]);
+		max_val = std::max(max_val, image[i]);
+	}
+	*minv = min_val;
+	*maxv = max_val;
+}
+
+//---------------------------------------------------------
+// Segmented linear transformation.
+//---------------------------------------------------------
+static void seg_linear_transf_avx2(
+	uint8_t *image,
+	int32_t npixels,
+	uint8_t low_in,
+	uint8_t hig_in,
+	const int16_t scale[3],
+	const int16_t bias[3]
+)	{
+	const __m256i low_vec = _mm256_set1_epi16(low_in);
+	const __m256i hig_vec = _mm256_set1_epi16(hig_in);
+	const __m256i scale_vec[3] = {_mm256_set1_epi16(scale[0]), _mm256_set1_epi16(scale[1]),
+		_mm256_set1_epi16(scale[2])};
+	const __m256i bias_vec[3] = {_mm256_set1_epi16(bias[0]), _mm256_set1_epi16(bias[1]),
+		_mm256_set1_epi16(bias[2])};
+
+	int32_t i = 0;
+	for (; i <= npixels - 16; i += 16) {
+		__m256i data = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(image + i)));
+		__m256i below_low = _mm256_cmpgt_epi16(low_vec, data);
+		__m256i below_hig = _mm256_cmpgt_epi16(hig_vec, data);
+		__m256i s = _mm256_blendv_epi8(_mm256_blendv_epi8(scale_vec[2], scale_vec[1], below_hig),
+			scale_vec[0], below_low);
+		__m256i b = _mm256_blendv_epi8(_mm256_blendv_epi8(bias_vec[2], bias_vec[1], below_hig),
+			bias_vec[0], below_low);
+		__m256i result = _mm256_srai_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, data), b), 4);
+		_mm_storeu_si128((__m128i *)(image + i), packus_i16x16_u8x16(result));
+	}
+
+	for (; i < npixels; i++) {
+		const int32_t s = image[i] < low_in ? 0 : (image[i] < hig_in ? 1 : 2);
+		const int16_t sum = (int16_t)((int16_t)(scale[s] * image[i]) + bias[s]);
+		image[i] = saturate_u8(sum >> 4);
+	}
+}
+
+//---------------------------------------------------------
+// 3x3 filter.
+//---------------------------------------------------------
+static void filter3x3_avx2(
+	const uint8_t *raw_image,
+	int32_t width,
+	int32_t height,
+	const int16_t mask[9],
+	uint8_t *new_image
+)	{
+	__m256i mask_vec[9];
+	for (int32_t k = 0; k < 9; k++) {
+		mask_vec[k] = _mm256_set1_epi16(mask[k]);
+	}
+
+	for (int32_t y = 1; y < height - 1; y++) {
+		int32_t x = 1;
+		for (; x <= width - 17; x += 16) {
+			__m256i sum = _mm256_setzero_si256();
+			for (int32_t ky = 0; ky < 3; ky++) {
+				const uint8_t *data = raw_image + (y + ky - 1) * width + x - 1;
+				for (int32_t kx = 0; kx < 3; kx++) {
+					__m256i pixel = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(data + kx)));
+					sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(pixel, mask_vec[3 * ky + kx]));
+				}
+			}
+			__m256i center = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(raw_image + y * width + x)));
+			_mm_storeu_si128((__m128i *)(new_image + y * width + x),
+				packus_i16x16_u8x16(_mm256_sub_epi16(center, sum)));
+		}
+
+		for (; x < width - 1; x++) {
+			int16_t sum = 0;
+			for (int32_t ky = 0; ky < 3; ky++) {
+				const uint8_t *data = raw_image + (y + ky - 1) * width + x - 1;
+				for (int32_t kx = 0; kx < 3; kx++) {
+					sum = (int16_t)(sum + (int16_t)(mask[3 * ky + kx] * data[kx]));
+				}
+			}
+			new_image[y * width + x] = saturate_u8((int16_t)(raw_image[y * width + x] - sum));
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Median of nine with Paeth's sort network.
+//---------------------------------------------------------
+static inline __m256i paeth_sort_network_u8x32x9(
+	__m256i q0,
+	__m256i q1,
+	__m256i q2,
+	__m256i q3,
+	__m256i q4,
+	__m256i q5,
+	__m256i q6,
+	__m256i q7,
+	__m256i q8
+)	{
+	vminmax_epu8(q0, q3);
+	vminmax_epu8(q1, q4);
+	vminmax_epu8(q0, q1);
+	vminmax_epu8(q2, q5);
+	vminmax_epu8(q0, q2);
+	vminmax_epu8(q4, q5);
+	vminmax_epu8(q1, q2);
+	vminmax_epu8(q3, q5);
+	vminmax_epu8(q3, q4);
+	vminmax_epu8(q1, q3);
+	vminmax_epu8(q1, q6);
+	vminmax_epu8(q4, q6);
+	vminmax_epu8(q2, q6);
+	vminmax_epu8(q2, q3);
+	vminmax_epu8(q4, q7);
+	vminmax_epu8(q2, q4);
+	vminmax_epu8(q3, q7);
+	vminmax_epu8(q4, q8);
+	vminmax_epu8(q3, q8);
+	vminmax_epu8(q3, q4);
+	return q4;
+}
+
+//---------------------------------------------------------
+// 3x3 median filter.
+//---------------------------------------------------------
+static void median_filter3x3_avx2(
+	const uint8_t *raw_image,
+	int32_t width,
+	int32_t height,
+	uint8_t *new_image
+)	{
+	for (int32_t y = 1; y < height - 1; y++) {
+		const uint8_t *line[3] = {raw_image + (y - 1) * width, raw_image + y * width, raw_image + (y + 1) * width};
+		const uint8_t left = line[1][0];
+		const uint8_t right = line[1][width - 1];
+		int32_t x = 0;
+		while (x < width) {
+			if (x > 0 && x <= width - 33) {
+				__m256i q[9];
+				for (int32_t ky = 0; ky < 3; ky++) {
+					q[3 * ky + 0] = _mm256_loadu_si256((const __m256i *)(line[ky] + x - 1));
+					q[3 * ky + 1] = _mm256_loadu_si256((const __m256i *)(line[ky] + x));
+					q[3 * ky + 2] = _mm256_loadu_si256((const __m256i *)(line[ky] + x + 1));
+				}
+				__m256i median = paeth_sort_network_u8x32x9(q[0], q[1], q[2], q[3], q[4], q[5], q[6], q[7], q[8]);
+				_mm256_storeu_si256((__m256i *)(new_image + y * width + x), median);
+				x += 32;
+			} else {
+				uint8_t val[9];
+				for (int32_t ky = 0; ky < 3; ky++) {
+					val[3 * ky + 0] = x > 0 ? line[ky][x - 1] : left;
+					val[3 * ky + 1] = line[ky][x];
+					val[3 * ky + 2] = x < width - 1 ? line[ky][x + 1] : right;
+				}
+				std::nth_element(val, val + 4, val + 9);
+				new_image[y * width + x] = val[4];
+				x++;
+			}
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Motion adaptive noise reduction.
+//---------------------------------------------------------
+static void motion_adapt_noise_reduction_avx2(
+	uint8_t *curr_image,
+	const uint8_t *prev_image,
+	int32_t npixels,
+	const uint8_t mtf[16]
+)	{
+	const __m256i mtf_vec = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)mtf));
+	const __m256i abs_diff_limit = _mm256_set1_epi8(63);
+	const __m256i low_bits = _mm256_set1_epi8(0x0f);
+
+	int32_t i = 0;
+	for (; i <= npixels - 32; i += 32) {
+		__m256i curr = _mm256_loadu_si256((const __m256i *)(curr_image + i));
+		__m256i prev = _mm256_loadu_si256((const __m256i *)(prev_image + i));
+		__m256i abs_diff = _mm256_or_si256(_mm256_subs_epu8(curr, prev), _mm256_subs_epu8(prev, curr));
+		abs_diff = _mm256_and_si256(_mm256_srli_epi16(_mm256_min_epu8(abs_diff, abs_diff_limit), 2), low_bits);
+		__m256i alpha = _mm256_shuffle_epi8(mtf_vec, abs_diff);
+
+		__m256i result[2];
+		for (int32_t h = 0; h < 2; h++) {
+			__m128i c8 = h ? _mm256_extracti128_si256(curr, 1) : _mm256_castsi256_si128(curr);
+			__m128i p8 = h ? _mm256_extracti128_si256(prev, 1) : _mm256_castsi256_si128(prev);
+			__m128i a8 = h ? _mm256_extracti128_si256(alpha, 1) : _mm256_castsi256_si128(alpha);
+			__m256i c16 = _mm256_cvtepu8_epi16(c8);
+			__m256i delta = _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(a8),
+				_mm256_sub_epi16(_mm256_cvtepu8_epi16(p8), c16)), 8);
+			result[h] = _mm256_add_epi16(c16, delta);
+		}
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(result[0], result[1]), 0xd8);
+		_mm256_storeu_si256((__m256i *)(curr_image + i), packed);
+	}
+
+	for (; i < npixels; i++) {
+		const int32_t diff = prev_image[i] - curr_image[i];
+		const int32_t alpha = mtf[std::min(diff < 0 ? -diff : diff, 63) >> 2];
+		const int16_t delta = (int16_t)(alpha * diff) >> 8;
+		curr_image[i] = saturate_u8(curr_image[i] + delta);
+	}
+}
+
+//---------------------------------------------------------
+// Saturation adjustment.
+//---------------------------------------------------------
+static void saturation_adjustment_avx2(
+	const uint8_t *raw_y,
+	const uint8_t *new_y,
+	uint8_t *uv,
+	int32_t width,
+	int32_t height
+)	{
+	const int32_t uv_width = width >> 1;
+	const int32_t uv_height = height >> 1;
+	uint8_t *pU = uv;
+	uint8_t *pV = pU + uv_width * uv_height;
+	const __m128i even_mask = _mm_load_si128((const __m128i *)even_bytes_mask);
+	const __m256i s32_128 = _mm256_set1_epi32(128);
+	const __m256 f32_128 = _mm256_set1_ps(128.0f);
+	const __m256 f32_one = _mm256_set1_ps(1.0f);
+	const __m256 f32_gain = _mm256_set1_ps(1.2f);
+
+	for (int32_t y = 0; y < uv_height; y++) {
+		const uint8_t *raw_line = raw_y + 2 * y * width;
+		const uint8_t *new_line = new_y + 2 * y * width;
+		int32_t x = 0;
+		for (; x <= uv_width - 8 && 2 * x + 16 <= width; x += 8) {
+			__m128i y0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(raw_line + 2 * x)), even_mask);
+			__m128i y1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(new_line + 2 * x)), even_mask);
+			// Zero luma is taken as one.
+			__m256 f32_y0 = _mm256_max_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(y0)), f32_one);
+			__m256 f32_y1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(y1));
+			__m256 ratio = _mm256_mul_ps(_mm256_mul_ps(f32_y1, _mm256_div_ps(f32_one, f32_y0)), f32_gain);
+			__m256 f32_u = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_cvtepu8_epi32(
+				_mm_loadl_epi64((const __m128i *)(pU + x))), s32_128));
+			__m256 f32_v = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_cvtepu8_epi32(
+				_mm_loadl_epi64((const __m128i *)(pV + x))), s32_128));
+			__m256i u32 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(ratio, f32_u), f32_128));
+			__m256i v32 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(ratio, f32_v), f32_128));
+			__m128i u16 = _mm_packs_epi32(_mm256_castsi256_si128(u32), _mm256_extracti128_si256(u32, 1));
+			__m128i v16 = _mm_packs_epi32(_mm256_castsi256_si128(v32), _mm256_extracti128_si256(v32, 1));
+			_mm_storel_epi64((__m128i *)(pU + x), _mm_packus_epi16(u16, u16));
+			_mm_storel_epi64((__m128i *)(pV + x), _mm_packus_epi16(v16, v16));
+		}
+
+		for (; x < uv_width; x++) {
+			const float inv = 1.0f / std::max(raw_line[2 * x], (uint8_t)1);
+			const float ratio = (new_line[2 * x] * inv) * 1.2f;
+			pU[x] = saturate_u8((int32_t)(ratio * (pU[x] - 128) + 128.0f));
+			pV[x] = saturate_u8((int32_t)(ratio * (pV[x] - 128) + 128.0f));
+		}
+		pU += uv_width;
+		pV += uv_width;
+	}
+}
+
+//---------------------------------------------------------
+// Apply lookup table and find the minimum and the maximum.
+// The table is split into 16 blocks of 16 entries for pshufb,
+// indices outside a block saturate to 0x80 and select zero.
+//---------------------------------------------------------
+static void lookup_table_minmax_avx2(
+	const uint8_t *raw_image,
+	int32_t npixels,
+	const uint8_t table[256],
+	uint8_t *processed_image,
+	uint8_t *minv,
+	uint8_t *maxv
+)	{
+	__m256i table_vec[16];
+	for (int32_t k = 0; k < 16; k++) {
+		table_vec[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(table + 16 * k)));
+	}
+	const __m256i step = _mm256_set1_epi8(16);
+	const __m256i bias = _mm256_set1_epi8(0x70);
+	__m256i min_vec = _mm256_set1_epi8((char)255);
+	__m256i max_vec = _mm256_setzero_si256();
+	int32_t i = 0;
+	for (; i <= npixels - 32; i += 32) {
+		__m256i index = _mm256_loadu_si256((const __m256i *)(raw_image + i));
+		__m256i result = _mm256_setzero_si256();
+		for (int32_t k = 0; k < 16; k++) {
+			result = _mm256_or_si256(result, _mm256_shuffle_epi8(table_vec[k], _mm256_adds_epu8(index, bias)));
+			index = _mm256_sub_epi8(index, step);
+		}
+		_mm256_storeu_si256((__m256i *)(processed_image + i), result);
+		min_vec = _mm256_min_epu8(min_vec, result);
+		max_vec = _mm256_max_epu8(max_vec, result);
+	}
+
+	uint8_t min_buf[32];
+	uint8_t max_buf[32];
+	_mm256_storeu_si256((__m256i *)min_buf, min_vec);
+	_mm256_storeu_si256((__m256i *)max_buf, max_vec);
+	uint8_t min_val = 255;
+	uint8_t max_val = 0;
+	for (int32_t j = 0; j < 32; j++) {
+		min_val = std::min(min_val, min_buf[j]);
+		max_val = std::max(max_val, max_buf[j]);
+	}
+
+	for (; i < npixels; i++) {
+		const uint8_t val = table[raw_image[i]];
+		processed_image[i] = val;
+		min_val = std::min(min_val, val);
+		max_val = std::max(max_val, val);
+	}
+	*minv = min_val;
+	*maxv = max_val;
+}
+
+//---------------------------------------------------------
+// Reciprocal.
+//---------------------------------------------------------
+static void reciprocal_avx2(
+	const float *data,
+	int32_t n,
+	float *inv
+)	{
+	const __m256 f32_one = _mm256_set1_ps(1.0f);
+	int32_t i = 0;
+	for (; i <= n - 8; i += 8) {
+		_mm256_storeu_ps(inv + i, _mm256_div_ps(f32_one, _mm256_loadu_ps(data + i)));
+	}
+
+	for (; i < n; i++) {
+		inv[i] = 1.0f / data[i];
+	}
+}
+
+//---------------------------------------------------------
+// Accumulate column sums and column minimum of one row.
+//---------------------------------------------------------
+static void min_pool_row_avx2(
+	const uint8_t *rgb_row,
+	int32_t width,
+	uint16_t *sum[3],
+	uint8_t *min_row
+)	{
+	int32_t x = 0;
+	for (; x <= width - 32; x += 32) {
+		__m256i channel[3];
+		deinterleave_u8x32x3(rgb_row + 3 * x, channel);
+		for (int32_t c = 0; c < 3; c++) {
+			__m256i low = _mm256_loadu_si256((const __m256i *)(sum[c] + x));
+			__m256i hig = _mm256_loadu_si256((const __m256i *)(sum[c] + x + 16));
+			low = _mm256_add_epi16(low, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(channel[c])));
+			hig = _mm256_add_epi16(hig, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(channel[c], 1)));
+			_mm256_storeu_si256((__m256i *)(sum[c] + x), low);
+			_mm256_storeu_si256((__m256i *)(sum[c] + x + 16), hig);
+		}
+		
+		__m256i minv = _mm256_min_epu8(_mm256_min_epu8(channel[0], channel[1]), channel[2]);
+		minv = _mm256_min_epu8(minv, _mm256_loadu_si256((const __m256i *)(min_row + x)));
+		_mm256_storeu_si256((__m256i *)(min_row + x), minv);
+	}
+
+	for (; x < width; x++) {
+		const uint8_t *pixel = rgb_row + 3 * x;
+		sum[0][x] += pixel[0];
+		sum[1][x] += pixel[1];
+		sum[2][x] += pixel[2];
+		min_row[x] = std::min(min_row[x], std::min(std::min(pixel[0], pixel[1]), pixel[2]));
+	}
+}
+
+//---------------------------------------------------------
+// Fill kernel table with the AVX2 implementation.
+//---------------------------------------------------------
+void simd_init_avx2(
+	simd_kernels_t *kernels
+)	{
+	assert(kernels);
+	simd_init_sse41(kernels);
+	kernels->yuv2rgb = yuv2rgb_avx2;
+	kernels->rgb2yuv = rgb2yuv_avx2;
+	kernels->recover_scene_radiance = recover_scene_radiance_avx2;
+	kernels->clip_gray_level = clip_gray_level_avx2;
+	kernels->minmax = minmax_avx2;
+	kernels->seg_linear_transf = seg_linear_transf_avx2;
+	kernels->filter3x3 = filter3x3_avx2;
+	kernels->median_filter3x3 = median_filter3x3_avx2;
+	kernels->motion_adapt_noise_reduction = motion_adapt_noise_reduction_avx2;
+	kernels->saturation_adjustment = saturation_adjustment_avx2;
+	kernels->lookup_table_minmax = lookup_table_minmax_avx2;
+	kernels->reciprocal = reciprocal_avx2;
+	kernels->min_pool_row = min_pool_row_avx2;
+}
+
+#pragma GCC pop_options
+#endif
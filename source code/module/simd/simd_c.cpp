@@ -0,0 +1,332 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+#include "simd.h"
+
+//---------------------------------------------------------
+// Saturate to unsigned char.
+//---------------------------------------------------------
+static inline uint8_t saturate_u8(
+	int32_t val
+)	{
+	return val < 0 ? 0 : (val > 255 ? 255 : val);
+}
+
+//---------------------------------------------------------
+// Convert I420 image to RGB image.
+//---------------------------------------------------------
+static void yuv2rgb_c(
+	const uint8_t *yuv_image,
+	int32_t width,
+	int32_t height,
+	uint8_t *rgb_image
+)	{
+	const int32_t npixels = width * height;
+	const uint8_t *u_start = yuv_image + npixels;
+	const uint8_t *v_start = u_start + (npixels >> 2);
+
+	for (int32_t y = 0; y < height; y++) {
+		const uint8_t *y_line = yuv_image + y * width;
+		const uint8_t *u_line = u_start + (y >> 1) * (width >> 1);
+		const uint8_t *v_line = v_start + (y >> 1) * (width >> 1);
+		for (int32_t x = 0; x < width; x++) {
+			const float Y = y_line[x];
+			const float U = u_line[x >> 1] - 128.0f;
+			const float V = v_line[x >> 1] - 128.0f;
+			rgb_image[0] = saturate_u8((int32_t)(Y + V * 1.402f));
+			rgb_image[1] = saturate_u8((int32_t)((Y - U * 0.34414f) - V * 0.71414f));
+			rgb_image[2] = saturate_u8((int32_t)(Y + U * 1.772f));
+			rgb_image += 3;
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Convert RGB image to I420 image.
+//---------------------------------------------------------
+static void rgb2yuv_c(
+	const uint8_t *rgb_image,
+	int32_t width,
+	int32_t height,
+	uint8_t *yuv_image
+)	{
+	const int32_t npixels = width * height;
+	uint8_t *u_pos = yuv_image + npixels;
+	uint8_t *v_pos = u_pos + (npixels >> 2);
+
+	for (int32_t y = 0; y < height; y++) {
+		for (int32_t x = 0; x < width; x++) {
+			const float R = rgb_image[0];
+			const float G = rgb_image[1];
+			const float B = rgb_image[2];
+			yuv_image[y * width + x] = saturate_u8((int32_t)(((B * 0.098f + G * 0.504f) + R * 0.257f) + 16.0f));
+			if (0 == (y & 1) && 0 == (x & 1)) {
+				*u_pos++ = saturate_u8((int32_t)(((B * 0.439f + G * -0.291f) + R * -0.148f) + 128.0f));
+				*v_pos++ = saturate_u8((int32_t)(((B * -0.071f + G * -0.368f) + R * 0.439f) + 128.0f));
+			}
+			rgb_image += 3;
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Recover scene radiance.
+//---------------------------------------------------------
+static void recover_scene_radiance_c(
+	const uint8_t *raw_image,
+	const float *transmission_inv,
+	int32_t npixels,
+	const uint8_t atmo_light[3],
+	uint8_t *processed_image
+)	{
+	const float atmo[3] = {(float)atmo_light[0], (float)atmo_light[1], (float)atmo_light[2]};
+	for (int32_t i = 0; i < npixels; i++) {
+		const float inv = transmission_inv[i];
+		for (int32_t c = 0; c < 3; c++) {
+			processed_image[c] = saturate_u8((int32_t)((raw_image[c] - atmo[c]) * inv + atmo[c]));
+		}
+		raw_image += 3;
+		processed_image += 3;
+	}
+}
+
+//---------------------------------------------------------
+// Clip gray level.
+//---------------------------------------------------------
+static void clip_gray_level_c(
+	uint8_t *image,
+	int32_t npixels,
+	uint8_t minv,
+	uint8_t maxv
+)	{
+	for (int32_t i = 0; i < npixels; i++) {
+		image[i] = std::min(std::max(image[i], minv), maxv);
+	}
+}
+
+//---------------------------------------------------------
+// Find the minimum and the maximum.
+//---------------------------------------------------------
+static void minmax_c(
+	const uint8_t *image,
+	int32_t npixels,
+	uint8_t *minv,
+	uint8_t *maxv
+)	{
+	uint8_t min_val = 255;
+	uint8_t max_val = 0;
+	for (int32_t i = 0; i < npixels; i++) {
+		min_val = std::min(min_val, image[i]);
+		max_val = std::max(max_val, image[i]);
+	}
+	*minv = min_val;
+	*maxv = max_val;
+}
+
+//---------------------------------------------------------
+// Segmented linear transformation.
+//---------------------------------------------------------
+static void seg_linear_transf_c(
+	uint8_t *image,
+	int32_t npixels,
+	uint8_t low_in,
+	uint8_t hig_in,
+	const int16_t scale[3],
+	const int16_t bias[3]
+)	{
+	for (int32_t i = 0; i < npixels; i++) {
+		const int32_t s = image[i] < low_in ? 0 : (image[i] < hig_in ? 1 : 2);
+		const int16_t prod = (int16_t)(scale[s] * image[i]);
+		const int16_t sum = (int16_t)(prod + bias[s]);
+		image[i] = saturate_u8(sum >> 4);
+	}
+}
+
+//---------------------------------------------------------
+// 3x3 filter.
+//---------------------------------------------------------
+static void filter3x3_c(
+	const uint8_t *raw_image,
+	int32_t width,
+	int32_t height,
+	const int16_t mask[9],
+	uint8_t *new_image
+)	{
+	for (int32_t y = 1; y < height - 1; y++) {
+		for (int32_t x = 1; x < width - 1; x++) {
+			int16_t sum = 0;
+			for (int32_t ky = 0; ky < 3; ky++) {
+				const uint8_t *data = raw_image + (y + ky - 1) * width + x - 1;
+				for (int32_t kx = 0; kx < 3; kx++) {
+					sum = (int16_t)(sum + (int16_t)(mask[3 * ky + kx] * data[kx]));
+				}
+			}
+			new_image[y * width + x] = saturate_u8((int16_t)(raw_image[y * width + x] - sum));
+		}
+	}
+}
+
+//---------------------------------------------------------
+// 3x3 median filter.
+//---------------------------------------------------------
+static void median_filter3x3_c(
+	const uint8_t *raw_image,
+	int32_t width,
+	int32_t height,
+	uint8_t *new_image
+)	{
+	for (int32_t y = 1; y < height - 1; y++) {
+		const uint8_t left = raw_image[y * width];
+		const uint8_t right = raw_image[y * width + width - 1];
+		for (int32_t x = 0; x < width; x++) {
+			uint8_t val[9];
+			for (int32_t ky = 0; ky < 3; ky++) {
+				const uint8_t *data = raw_image + (y + ky - 1) * width;
+				val[3 * ky + 0] = x > 0 ? data[x - 1] : left;
+				val[3 * ky + 1] = data[x];
+				val[3 * ky + 2] = x < width - 1 ? data[x + 1] : right;
+			}
+			std::nth_element(val, val + 4, val + 9);
+			new_image[y * width + x] = val[4];
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Motion adaptive noise reduction.
+//---------------------------------------------------------
+static void motion_adapt_noise_reduction_c(
+	uint8_t *curr_image,
+	const uint8_t *prev_image,
+	int32_t npixels,
+	const uint8_t mtf[16]
+)	{
+	for (int32_t i = 0; i < npixels; i++) {
+		const int32_t diff = prev_image[i] - curr_image[i];
+		const int32_t alpha = mtf[std::min(diff < 0 ? -diff : diff, 63) >> 2];
+		const int16_t delta = (int16_t)(alpha * diff) >> 8;
+		curr_image[i] = saturate_u8(curr_image[i] + delta);
+	}
+}
+
+//---------------------------------------------------------
+// Saturation adjustment.
+//---------------------------------------------------------
+static void saturation_adjustment_c(
+	const uint8_t *raw_y,
+	const uint8_t *new_y,
+	uint8_t *uv,
+	int32_t width,
+	int32_t height
+)	{
+	const int32_t uv_width = width >> 1;
+	const int32_t uv_height = height >> 1;
+	uint8_t *pU = uv;
+	uint8_t *pV = pU + uv_width * uv_height;
+
+	for (int32_t y = 0; y < uv_height; y++) {
+		const uint8_t *raw_line = raw_y + 2 * y * width;
+		const uint8_t *new_line = new_y + 2 * y * width;
+		for (int32_t x = 0; x < uv_width; x++) {
+			// Zero luma is taken as one.
+			const float inv = 1.0f / std::max(raw_line[2 * x], (uint8_t)1);
+			const float ratio = (new_line[2 * x] * inv) * 1.2f;
+			pU[x] = saturate_u8((int32_t)(ratio * (pU[x] - 128) + 128.0f));
+			pV[x] = saturate_u8((int32_t)(ratio * (pV[x] - 128) + 128.0f));
+		}
+		pU += uv_width;
+		pV += uv_width;
+	}
+}
+
+//---------------------------------------------------------
+// Apply lookup table.
+//---------------------------------------------------------
+static void lookup_table_c(
+	const uint8_t *raw_image,
+	int32_t npixels,
+	const uint8_t table[256],
+	uint8_t *processed_image
+)	{
+	for (int32_t i = 0; i < npixels; i++) {
+		processed_image[i] = table[raw_image[i]];
+	}
+}
+
+//---------------------------------------------------------
+// Apply lookup table and find the minimum and the maximum.
+//---------------------------------------------------------
+static void lookup_table_minmax_c(
+	const uint8_t *raw_image,
+	int32_t npixels,
+	const uint8_t table[256],
+	uint8_t *processed_image,
+	uint8_t *minv,
+	uint8_t *maxv
+)	{
+	uint8_t min_val = 255;
+	uint8_t max_val = 0;
+	for (int32_t i = 0; i < npixels; i++) {
+		const uint8_t val = table[raw_image[i]];
+		processed_image[i] = val;
+		min_val = std::min(min_val, val);
+		max_val = std::max(max_val, val);
+	}
+	*minv = min_val;
+	*maxv = max_val;
+}
+
+//---------------------------------------------------------
+// Reciprocal.
+//---------------------------------------------------------
+static void reciprocal_c(
+	const float *data,
+	int32_t n,
+	float *inv
+)	{
+	for (int32_t i = 0; i < n; i++) {
+		inv[i] = 1.0f / data[i];
+	}
+}
+
+//---------------------------------------------------------
+// Accumulate column sums and column minimum of one row.
+//---------------------------------------------------------
+static void min_pool_row_c(
+	const uint8_t *rgb_row,
+	int32_t width,
+	uint16_t *sum[3],
+	uint8_t *min_row
+)	{
+	for (int32_t x = 0; x < width; x++) {
+		const uint8_t *pixel = rgb_row + 3 * x;
+		sum[0][x] += pixel[0];
+		sum[1][x] += pixel[1];
+		sum[2][x] += pixel[2];
+		min_row[x] = std::min(min_row[x], std::min(std::min(pixel[0], pixel[1]), pixel[2]));
+	}
+}
+
+//---------------------------------------------------------
+// Fill kernel table with the plain C implementation.
+//---------------------------------------------------------
+void simd_init_c(
+	simd_kernels_t *kernels
+)	{
+	assert(kernels);
+	kernels->yuv2rgb = yuv2rgb_c;
+	kernels->rgb2yuv = rgb2yuv_c;
+	kernels->recover_scene_radiance = recover_scene_radiance_c;
+	kernels->clip_gray_level = clip_gray_level_c;
+	kernels->minmax = minmax_c;
+	kernels->seg_linear_transf = seg_linear_transf_c;
+	kernels->filter3x3 = filter3x3_c;
+	kernels->median_filter3x3 = median_filter3x3_c;
+	kernels->motion_adapt_noise_reduction = motion_adapt_noise_reduction_c;
+	kernels->saturation_adjustment = saturation_adjustment_c;
+	kernels->lookup_table = lookup_table_c;
+	kernels->lookup_table_minmax = lookup_table_minmax_c;
+	kernels->reciprocal = reciprocal_c;
+	kernels->min_pool_row = min_pool_row_c;
+}
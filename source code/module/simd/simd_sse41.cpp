@@ -0,0 +1,703 @@
+#if defined(__i386__) || defined(__x86_64__)
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+#include <smmintrin.h>
+#include "simd.h"
+#include "simd_x86.h"
+
+#define vminmax_epu8(a, b) \
+	do { \
+		__m128i minmax_tmp = (a); \
+		(a) = _mm_min_epu8((a), (b)); \
+		(b) = _mm_max_epu8(minmax_tmp, (b)); \
+	} while (0)
+
+//---------------------------------------------------------
+// Saturate to unsigned char.
+//---------------------------------------------------------
+static inline uint8_t saturate_u8(
+	int32_t val
+)	{
+	return val < 0 ? 0 : (val > 255 ? 255 : val);
+}
+
+//---------------------------------------------------------
+// Split 48 interleaved bytes into three channels.
+//---------------------------------------------------------
+static inline void deinterleave_u8x16x3(
+	const uint8_t *data,
+	__m128i channel[3]
+)	{
+	const __m128i in0 = _mm_loadu_si128((const __m128i *)data);
+	const __m128i in1 = _mm_loadu_si128((const __m128i *)(data + 16));
+	const __m128i in2 = _mm_loadu_si128((const __m128i *)(data + 32));
+	for (int32_t c = 0; c < 3; c++) {
+		channel[c] = _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(in0, _mm_load_si128((const __m128i *)rgb_deinterleave_mask[c][0])),
+			_mm_shuffle_epi8(in1, _mm_load_si128((const __m128i *)rgb_deinterleave_mask[c][1]))),
+			_mm_shuffle_epi8(in2, _mm_load_si128((const __m128i *)rgb_deinterleave_mask[c][2])));
+	}
+}
+
+//---------------------------------------------------------
+// Merge three channels into 48 interleaved bytes.
+//---------------------------------------------------------
+static inline void interleave_u8x16x3(
+	const __m128i channel[3],
+	uint8_t *data
+)	{
+	for (int32_t k = 0; k < 3; k++) {
+		__m128i out = _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(channel[0], _mm_load_si128((const __m128i *)rgb_interleave_mask[k][0])),
+			_mm_shuffle_epi8(channel[1], _mm_load_si128((const __m128i *)rgb_interleave_mask[k][1]))),
+			_mm_shuffle_epi8(channel[2], _mm_load_si128((const __m128i *)rgb_interleave_mask[k][2])));
+		_mm_storeu_si128((__m128i *)(data + 16 * k), out);
+	}
+}
+
+//---------------------------------------------------------
+// Convert 16 bytes to 16 floats.
+//---------------------------------------------------------
+static inline void cvt_u8x16_f32x4x4(
+	__m128i data,
+	__m128 val[4]
+)	{
+	val[0] = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(data));
+	val[1] = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(data, 4)));
+	val[2] = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(data, 8)));
+	val[3] = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(data, 12)));
+}
+
+//---------------------------------------------------------
+// Truncate 16 floats and saturate to 16 bytes.
+//---------------------------------------------------------
+static inline __m128i cvt_f32x4x4_u8x16(
+	const __m128 val[4]
+)	{
+	__m128i low = _mm_packs_epi32(_mm_cvttps_epi32(val[0]), _mm_cvttps_epi32(val[1]));
+	__m128i hig = _mm_packs_epi32(_mm_cvttps_epi32(val[2]), _mm_cvttps_epi32(val[3]));
+	return _mm_packus_epi16(low, hig);
+}
+
+//---------------------------------------------------------
+// Convert I420 image to RGB image.
+//---------------------------------------------------------
+static void yuv2rgb_sse41(
+	const uint8_t *yuv_image,
+	int32_t width,
+	int32_t height,
+	uint8_t *rgb_image
+)	{
+	const int32_t npixels = width * height;
+	const uint8_t *u_start = yuv_image + npixels;
+	const uint8_t *v_start = u_start + (npixels >> 2);
+	const __m128 f32_128 = _mm_set1_ps(128.0f);
+
+	for (int32_t y = 0; y < height; y++) {
+		const uint8_t *y_line = yuv_image + y * width;
+		const uint8_t *u_line = u_start + (y >> 1) * (width >> 1);
+		const uint8_t *v_line = v_start + (y >> 1) * (width >> 1);
+		int32_t x = 0;
+		for (; x <= width - 16; x += 16) {
+			__m128i u8_u = _mm_loadl_epi64((const __m128i *)(u_line + (x >> 1)));
+			__m128i u8_v = _mm_loadl_epi64((const __m128i *)(v_line + (x >> 1)));
+			__m128 Y[4], U[4], V[4];
+			cvt_u8x16_f32x4x4(_mm_loadu_si128((const __m128i *)(y_line + x)), Y);
+			cvt_u8x16_f32x4x4(_mm_unpacklo_epi8(u8_u, u8_u), U);
+			cvt_u8x16_f32x4x4(_mm_unpacklo_epi8(u8_v, u8_v), V);
+
+			__m128 R[4], G[4], B[4];
+			for (int32_t i = 0; i < 4; i++) {
+				U[i] = _mm_sub_ps(U[i], f32_128);
+				V[i] = _mm_sub_ps(V[i], f32_128);
+				R[i] = _mm_add_ps(Y[i], _mm_mul_ps(V[i], _mm_set1_ps(1.402f)));
+				G[i] = _mm_sub_ps(_mm_sub_ps(Y[i], _mm_mul_ps(U[i], _mm_set1_ps(0.34414f))),
+					_mm_mul_ps(V[i], _mm_set1_ps(0.71414f)));
+				B[i] = _mm_add_ps(Y[i], _mm_mul_ps(U[i], _mm_set1_ps(1.772f)));
+			}
+
+			__m128i rgb[3] = {cvt_f32x4x4_u8x16(R), cvt_f32x4x4_u8x16(G), cvt_f32x4x4_u8x16(B)};
+			interleave_u8x16x3(rgb, rgb_image);
+			rgb_image += 48;
+		}
+
+		for (; x < width; x++) {
+			const float Yf = y_line[x];
+			const float Uf = u_line[x >> 1] - 128.0f;
+			const float Vf = v_line[x >> 1] - 128.0f;
+			rgb_image[0] = saturate_u8((int32_t)(Yf + Vf * 1.402f));
+			rgb_image[1] = saturate_u8((int32_t)((Yf - Uf * 0.34414f) - Vf * 0.71414f));
+			rgb_image[2] = saturate_u8((int32_t)(Yf + Uf * 1.772f));
+			rgb_image += 3;
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Convert RGB image to I420 image.
+//---------------------------------------------------------
+static void rgb2yuv_sse41(
+	const uint8_t *rgb_image,
+	int32_t width,
+	int32_t height,
+	uint8_t *yuv_image
+)	{
+	const int32_t npixels = width * height;
+	uint8_t *u_pos = yuv_image + npixels;
+	uint8_t *v_pos = u_pos + (npixels >> 2);
+	const __m128i even_mask = _mm_load_si128((const __m128i *)even_bytes_mask);
+
+	for (int32_t y = 0; y < height; y++) {
+		uint8_t *y_line = yuv_image + y * width;
+		const bool chroma_row = 0 == (y & 1);
+		int32_t x = 0;
+		for (; x <= width - 16; x += 16) {
+			__m128i rgb[3];
+			deinterleave_u8x16x3(rgb_image, rgb);
+			__m128 R[4], G[4], B[4], Y[4];
+			cvt_u8x16_f32x4x4(rgb[0], R);
+			cvt_u8x16_f32x4x4(rgb[1], G);
+			cvt_u8x16_f32x4x4(rgb[2], B);
+			for (int32_t i = 0; i < 4; i++) {
+				Y[i] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(B[i], _mm_set1_ps(0.098f)),
+					_mm_mul_ps(G[i], _mm_set1_ps(0.504f))), _mm_mul_ps(R[i], _mm_set1_ps(0.257f))), _mm_set1_ps(16.0f));
+			}
+			_mm_storeu_si128((__m128i *)(y_line + x), cvt_f32x4x4_u8x16(Y));
+
+			if (chroma_row) {
+				__m128 U[4], V[4];
+				for (int32_t i = 0; i < 4; i++) {
+					U[i] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(B[i], _mm_set1_ps(0.439f)),
+						_mm_mul_ps(G[i], _mm_set1_ps(-0.291f))), _mm_mul_ps(R[i], _mm_set1_ps(-0.148f))),
+						_mm_set1_ps(128.0f));
+					V[i] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(B[i], _mm_set1_ps(-0.071f)),
+						_mm_mul_ps(G[i], _mm_set1_ps(-0.368f))), _mm_mul_ps(R[i], _mm_set1_ps(0.439f))),
+						_mm_set1_ps(128.0f));
+				}
+				_mm_storel_epi64((__m128i *)u_pos, _mm_shuffle_epi8(cvt_f32x4x4_u8x16(U), even_mask));
+				_mm_storel_epi64((__m128i *)v_pos, _mm_shuffle_epi8(cvt_f32x4x4_u8x16(V), even_mask));
+				u_pos += 8;
+				v_pos += 8;
+			}
+			rgb_image += 48;
+		}
+
+		for (; x < width; x++) {
+			const float R = rgb_image[0];
+			const float G = rgb_image[1];
+			const float B = rgb_image[2];
+			y_line[x] = saturate_u8((int32_t)(((B * 0.098f + G * 0.504f) + R * 0.257f) + 16.0f));
+			if (chroma_row && 0 == (x & 1)) {
+				*u_pos++ = saturate_u8((int32_t)(((B * 0.439f + G * -0.291f) + R * -0.148f) + 128.0f));
+				*v_pos++ = saturate_u8((int32_t)(((B * -0.071f + G * -0.368f) + R * 0.439f) + 128.0f));
+			}
+			rgb_image += 3;
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Recover scene radiance.
+//---------------------------------------------------------
+static void recover_scene_radiance_sse41(
+	const uint8_t *raw_image,
+	const float *transmission_inv,
+	int32_t npixels,
+	const uint8_t atmo_light[3],
+	uint8_t *processed_image
+)	{
+	const float atmo[3] = {(float)atmo_light[0], (float)atmo_light[1], (float)atmo_light[2]};
+	const __m128 atmo_vec[3] = {_mm_set1_ps(atmo[0]), _mm_set1_ps(atmo[1]), _mm_set1_ps(atmo[2])};
+
+	int32_t i = 0;
+	for (; i <= npixels - 16; i += 16) {
+		__m128i rgb[3];
+		deinterleave_u8x16x3(raw_image, rgb);
+		__m128 inv[4];
+		for (int32_t j = 0; j < 4; j++) {
+			inv[j] = _mm_loadu_ps(transmission_inv + i + 4 * j);
+		}
+
+		for (int32_t c = 0; c < 3; c++) {
+			__m128 val[4];
+			cvt_u8x16_f32x4x4(rgb[c], val);
+			for (int32_t j = 0; j < 4; j++) {
+				val[j] = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(val[j], atmo_vec[c]), inv[j]), atmo_vec[c]);
+			}
+			rgb[c] = cvt_f32x4x4_u8x16(val);
+		}
+
+		interleave_u8x16x3(rgb, processed_image);
+		raw_image += 48;
+		processed_image += 48;
+	}
+
+	for (; i < npixels; i++) {
+		for (int32_t c = 0; c < 3; c++) {
+			processed_image[c] = saturate_u8((int32_t)((raw_image[c] - atmo[c]) * transmission_inv[i] + atmo[c]));
+		}
+		raw_image += 3;
+		processed_image += 3;
+	}
+}
+
+//---------------------------------------------------------
+// Clip gray level.
+//---------------------------------------------------------
+static void clip_gray_level_sse41(
+	uint8_t *image,
+	int32_t npixels,
+	uint8_t minv,
+	uint8_t maxv
+)	{
+	const __m128i floor_vec = _mm_set1_epi8((char)minv);
+	const __m128i ceiling_vec = _mm_set1_epi8((char)maxv);
+	int32_t i = 0;
+	for (; i <= npixels - 16; i += 16) {
+		__m128i data = _mm_loadu_si128((const __m128i *)(image + i));
+		data = _mm_min_epu8(_mm_max_epu8(data, floor_vec), ceiling_vec);
+		_mm_storeu_si128((__m128i *)(image + i), data);
+	}
+
+	for (; i < npixels; i++) {
+		image[i] = std::min(std::max(image[i], minv), maxv);
+	}
+}
+
+//---------------------------------------------------------
+// Find the minimum and the maximum.
+//---------------------------------------------------------
+static void minmax_sse41(
+	const uint8_t *image,
+	int32_t npixels,
+	uint8_t *minv,
+	uint8_t *maxv
+)	{
+	__m128i min_vec = _mm_set1_epi8((char)255);
+	__m128i max_vec = _mm_setzero_si128();
+	int32_t i = 0;
+	for (; i <= npixels - 16; i += 16) {
+		__m128i data = _mm_loadu_si128((const __m128i *)(image + i));
+		min_vec = _mm_min_epu8(min_vec, data);
+		max_vec = _mm_max_epu8(max_vec, data);
+	}
+
+	uint8_t min_buf[16];
+	uint8_t max_buf[16];
+	_mm_storeu_si128((__m128i *)min_buf, min_vec);
+	_mm_storeu_si128((__m128i *)max_buf, max_vec);
+	uint8_t min_val = 255;
+	uint8_t max_val = 0;
+	for (int32_t j = 0; j < 16; j++) {
+		min_val = std::min(min_val, min_buf[j]);
+		max_val = std::max(max_val, max_buf[j]);
+	}
+
+	for (; i < npixels; i++) {
+		min_val = std::min(min_val, image[i]);
+		max_val = std::max(max_val, image[i]);
+	}
+	*minv = min_val;
+	*maxv = max_val;
+}
+
+//---------------------------------------------------------
+// Segmented linear transformation.
+//---------------------------------------------------------
+static void seg_linear_transf_sse41(
+	uint8_t *image,
+	int32_t npixels,
+	uint8_t low_in,
+	uint8_t hig_in,
+	const int16_t scale[3],
+	const int16_t bias[3]
+)	{
+	const __m128i low_vec = _mm_set1_epi16(low_in);
+	const __m128i hig_vec = _mm_set1_epi16(hig_in);
+	const __m128i scale_vec[3] = {_mm_set1_epi16(scale[0]), _mm_set1_epi16(scale[1]), _mm_set1_epi16(scale[2])};
+	const __m128i bias_vec[3] = {_mm_set1_epi16(bias[0]), _mm_set1_epi16(bias[1]), _mm_set1_epi16(bias[2])};
+
+	int32_t i = 0;
+	for (; i <= npixels - 8; i += 8) {
+		__m128i data = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(image + i)));
+		__m128i below_low = _mm_cmplt_epi16(data, low_vec);
+		__m128i below_hig = _mm_cmplt_epi16(data, hig_vec);
+		__m128i s = _mm_blendv_epi8(_mm_blendv_epi8(scale_vec[2], scale_vec[1], below_hig), scale_vec[0], below_low);
+		__m128i b = _mm_blendv_epi8(_mm_blendv_epi8(bias_vec[2], bias_vec[1], below_hig), bias_vec[0], below_low);
+		__m128i result = _mm_srai_epi16(_mm_add_epi16(_mm_mullo_epi16(s, data), b), 4);
+		_mm_storel_epi64((__m128i *)(image + i), _mm_packus_epi16(result, result));
+	}
+
+	for (; i < npixels; i++) {
+		const int32_t s = image[i] < low_in ? 0 : (image[i] < hig_in ? 1 : 2);
+		const int16_t sum = (int16_t)((int16_t)(scale[s] * image[i]) + bias[s]);
+		image[i] = saturate_u8(sum >> 4);
+	}
+}
+
+//---------------------------------------------------------
+// 3x3 filter.
+//---------------------------------------------------------
+static void filter3x3_sse41(
+	const uint8_t *raw_image,
+	int32_t width,
+	int32_t height,
+	const int16_t mask[9],
+	uint8_t *new_image
+)	{
+	__m128i mask_vec[9];
+	for (int32_t k = 0; k < 9; k++) {
+		mask_vec[k] = _mm_set1_epi16(mask[k]);
+	}
+
+	for (int32_t y = 1; y < height - 1; y++) {
+		int32_t x = 1;
+		for (; x <= width - 9; x += 8) {
+			__m128i sum = _mm_setzero_si128();
+			for (int32_t ky = 0; ky < 3; ky++) {
+				const uint8_t *data = raw_image + (y + ky - 1) * width + x - 1;
+				for (int32_t kx = 0; kx < 3; kx++) {
+					__m128i pixel = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(data + kx)));
+					sum = _mm_add_epi16(sum, _mm_mullo_epi16(pixel, mask_vec[3 * ky + kx]));
+				}
+			}
+			__m128i center = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(raw_image + y * width + x)));
+			__m128i result = _mm_sub_epi16(center, sum);
+			_mm_storel_epi64((__m128i *)(new_image + y * width + x), _mm_packus_epi16(result, result));
+		}
+
+		for (; x < width - 1; x++) {
+			int16_t sum = 0;
+			for (int32_t ky = 0; ky < 3; ky++) {
+				const uint8_t *data = raw_image + (y + ky - 1) * width + x - 1;
+				for (int32_t kx = 0; kx < 3; kx++) {
+					sum = (int16_t)(sum + (int16_t)(mask[3 * ky + kx] * data[kx]));
+				}
+			}
+			new_image[y * width + x] = saturate_u8((int16_t)(raw_image[y * width + x] - sum));
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Median of nine with Paeth's sort network.
+//---------------------------------------------------------
+static inline __m128i paeth_sort_network_u8x16x9(
+	__m128i q0,
+	__m128i q1,
+	__m128i q2,
+	__m128i q3,
+	__m128i q4,
+	__m128i q5,
+	__m128i q6,
+	__m128i q7,
+	__m128i q8
+)	{
+	vminmax_epu8(q0, q3);
+	vminmax_epu8(q1, q4);
+	vminmax_epu8(q0, q1);
+	vminmax_epu8(q2, q5);
+	vminmax_epu8(q0, q2);
+	vminmax_epu8(q4, q5);
+	vminmax_epu8(q1, q2);
+	vminmax_epu8(q3, q5);
+	vminmax_epu8(q3, q4);
+	vminmax_epu8(q1, q3);
+	vminmax_epu8(q1, q6);
+	vminmax_epu8(q4, q6);
+	vminmax_epu8(q2, q6);
+	vminmax_epu8(q2, q3);
+	vminmax_epu8(q4, q7);
+	vminmax_epu8(q2, q4);
+	vminmax_epu8(q3, q7);
+	vminmax_epu8(q4, q8);
+	vminmax_epu8(q3, q8);
+	vminmax_epu8(q3, q4);
+	return q4;
+}
+
+//---------------------------------------------------------
+// 3x3 median filter.
+//---------------------------------------------------------
+static void median_filter3x3_sse41(
+	const uint8_t *raw_image,
+	int32_t width,
+	int32_t height,
+	uint8_t *new_image
+)	{
+	for (int32_t y = 1; y < height - 1; y++) {
+		const uint8_t *line[3] = {raw_image + (y - 1) * width, raw_image + y * width, raw_image + (y + 1) * width};
+		const uint8_t left = line[1][0];
+		const uint8_t right = line[1][width - 1];
+		int32_t x = 0;
+		while (x < width) {
+			if (x > 0 && x <= width - 17) {
+				__m128i q[9];
+				for (int32_t ky = 0; ky < 3; ky++) {
+					q[3 * ky + 0] = _mm_loadu_si128((const __m128i *)(line[ky] + x - 1));
+					q[3 * ky + 1] = _mm_loadu_si128((const __m128i *)(line[ky] + x));
+					q[3 * ky + 2] = _mm_loadu_si128((const __m128i *)(line[ky] + x + 1));
+				}
+				__m128i median = paeth_sort_network_u8x16x9(q[0], q[1], q[2], q[3], q[4], q[5], q[6], q[7], q[8]);
+				_mm_storeu_si128((__m128i *)(new_image + y * width + x), median);
+				x += 16;
+			} else {
+				uint8_t val[9];
+				for (int32_t ky = 0; ky < 3; ky++) {
+					val[3 * ky + 0] = x > 0 ? line[ky][x - 1] : left;
+					val[3 * ky + 1] = line[ky][x];
+					val[3 * ky + 2] = x < width - 1 ? line[ky][x + 1] : right;
+				}
+				std::nth_element(val, val + 4, val + 9);
+				new_image[y * width + x] = val[4];
+				x++;
+			}
+		}
+	}
+}
+
+//---------------------------------------------------------
+// Motion adaptive noise reduction.
+//---------------------------------------------------------
+static void motion_adapt_noise_reduction_sse41(
+	uint8_t *curr_image,
+	const uint8_t *prev_image,
+	int32_t npixels,
+	const uint8_t mtf[16]
+)	{
+	const __m128i mtf_vec = _mm_loadu_si128((const __m128i *)mtf);
+	const __m128i abs_diff_limit = _mm_set1_epi8(63);
+	const __m128i low_bits = _mm_set1_epi8(0x0f);
+
+	int32_t i = 0;
+	for (; i <= npixels - 16; i += 16) {
+		__m128i curr = _mm_loadu_si128((const __m128i *)(curr_image + i));
+		__m128i prev = _mm_loadu_si128((const __m128i *)(prev_image + i));
+		__m128i abs_diff = _mm_or_si128(_mm_subs_epu8(curr, prev), _mm_subs_epu8(prev, curr));
+		abs_diff = _mm_and_si128(_mm_srli_epi16(_mm_min_epu8(abs_diff, abs_diff_limit), 2), low_bits);
+		__m128i alpha = _mm_shuffle_epi8(mtf_vec, abs_diff);
+
+		const __m128i curr_half[2] = {curr, _mm_srli_si128(curr, 8)};
+		const __m128i prev_half[2] = {prev, _mm_srli_si128(prev, 8)};
+		const __m128i alpha_half[2] = {alpha, _mm_srli_si128(alpha, 8)};
+		__m128i result[2];
+		for (int32_t h = 0; h < 2; h++) {
+			__m128i c16 = _mm_cvtepu8_epi16(curr_half[h]);
+			__m128i p16 = _mm_cvtepu8_epi16(prev_half[h]);
+			__m128i a16 = _mm_cvtepu8_epi16(alpha_half[h]);
+			__m128i delta = _mm_srai_epi16(_mm_mullo_epi16(a16, _mm_sub_epi16(p16, c16)), 8);
+			result[h] = _mm_add_epi16(c16, delta);
+		}
+		_mm_storeu_si128((__m128i *)(curr_image + i), _mm_packus_epi16(result[0], result[1]));
+	}
+
+	for (; i < npixels; i++) {
+		const int32_t diff = prev_image[i] - curr_image[i];
+		const int32_t alpha = mtf[std::min(diff < 0 ? -diff : diff, 63) >> 2];
+		const int16_t delta = (int16_t)(alpha * diff) >> 8;
+		curr_image[i] = saturate_u8(curr_image[i] + delta);
+	}
+}
+
+//---------------------------------------------------------
+// Saturation adjustment.
+//---------------------------------------------------------
+static void saturation_adjustment_sse41(
+	const uint8_t *raw_y,
+	const uint8_t *new_y,
+	uint8_t *uv,
+	int32_t width,
+	int32_t height
+)	{
+	const int32_t uv_width = width >> 1;
+	const int32_t uv_height = height >> 1;
+	uint8_t *pU = uv;
+	uint8_t *pV = pU + uv_width * uv_height;
+	const __m128i even_mask = _mm_load_si128((const __m128i *)even_bytes_mask);
+	const __m128i s32_128 = _mm_set1_epi32(128);
+	const __m128 f32_128 = _mm_set1_ps(128.0f);
+	const __m128 f32_one = _mm_set1_ps(1.0f);
+	const __m128 f32_gain = _mm_set1_ps(1.2f);
+
+	for (int32_t y = 0; y < uv_height; y++) {
+		const uint8_t *raw_line = raw_y + 2 * y * width;
+		const uint8_t *new_line = new_y + 2 * y * width;
+		int32_t x = 0;
+		for (; x <= uv_width - 8 && 2 * x + 16 <= width; x += 8) {
+			__m128i y0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(raw_line + 2 * x)), even_mask);
+			__m128i y1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(new_line + 2 * x)), even_mask);
+			__m128i u = _mm_loadl_epi64((const __m128i *)(pU + x));
+			__m128i v = _mm_loadl_epi64((const __m128i *)(pV + x));
+			const __m128i y0_half[2] = {y0, _mm_srli_si128(y0, 4)};
+			const __m128i y1_half[2] = {y1, _mm_srli_si128(y1, 4)};
+			const __m128i u_half[2] = {u, _mm_srli_si128(u, 4)};
+			const __m128i v_half[2] = {v, _mm_srli_si128(v, 4)};
+			__m128i u_result[2], v_result[2];
+			for (int32_t h = 0; h < 2; h++) {
+				// Zero luma is taken as one.
+				__m128 f32_y0 = _mm_max_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(y0_half[h])), f32_one);
+				__m128 f32_y1 = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(y1_half[h]));
+				__m128 ratio = _mm_mul_ps(_mm_mul_ps(f32_y1, _mm_div_ps(f32_one, f32_y0)), f32_gain);
+				__m128 f32_u = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_cvtepu8_epi32(u_half[h]), s32_128));
+				__m128 f32_v = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_cvtepu8_epi32(v_half[h]), s32_128));
+				u_result[h] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(ratio, f32_u), f32_128));
+				v_result[h] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(ratio, f32_v), f32_128));
+			}
+			__m128i u16 = _mm_packs_epi32(u_result[0], u_result[1]);
+			__m128i v16 = _mm_packs_epi32(v_result[0], v_result[1]);
+			_mm_storel_epi64((__m128i *)(pU + x), _mm_packus_epi16(u16, u16));
+			_mm_storel_epi64((__m128i *)(pV + x), _mm_packus_epi16(v16, v16));
+		}
+
+		for (; x < uv_width; x++) {
+			const float inv = 1.0f / std::max(raw_line[2 * x], (uint8_t)1);
+			const float ratio = (new_line[2 * x] * inv) * 1.2f;
+			pU[x] = saturate_u8((int32_t)(ratio * (pU[x] - 128) + 128.0f));
+			pV[x] = saturate_u8((int32_t)(ratio * (pV[x] - 128) + 128.0f));
+		}
+		pU += uv_width;
+		pV += uv_width;
+	}
+}
+
+//---------------------------------------------------------
+// Apply lookup table and find the minimum and the maximum.
+// The table is split into 16 blocks of 16 entries for pshufb,
+// indices outside a block saturate to 0x80 and select zero.
+//---------------------------------------------------------
+static void lookup_table_minmax_sse41(
+	const uint8_t *raw_image,
+	int32_t npixels,
+	const uint8_t table[256],
+	uint8_t *processed_image,
+	uint8_t *minv,
+	uint8_t *maxv
+)	{
+	__m128i table_vec[16];
+	for (int32_t k = 0; k < 16; k++) {
+		table_vec[k] = _mm_loadu_si128((const __m128i *)(table + 16 * k));
+	}
+	const __m128i step = _mm_set1_epi8(16);
+	const __m128i bias = _mm_set1_epi8(0x70);
+	__m128i min_vec = _mm_set1_epi8((char)255);
+	__m128i max_vec = _mm_setzero_si128();
+	int32_t i = 0;
+	for (; i <= npixels - 16; i += 16) {
+		__m128i index = _mm_loadu_si128((const __m128i *)(raw_image + i));
+		__m128i result = _mm_setzero_si128();
+		for (int32_t k = 0; k < 16; k++) {
+			result = _mm_or_si128(result, _mm_shuffle_epi8(table_vec[k], _mm_adds_epu8(index, bias)));
+			index = _mm_sub_epi8(index, step);
+		}
+		_mm_storeu_si128((__m128i *)(processed_image + i), result);
+		min_vec = _mm_min_epu8(min_vec, result);
+		max_vec = _mm_max_epu8(max_vec, result);
+	}
+
+	uint8_t min_buf[16];
+	uint8_t max_buf[16];
+	_mm_storeu_si128((__m128i *)min_buf, min_vec);
+	_mm_storeu_si128((__m128i *)max_buf, max_vec);
+	uint8_t min_val = 255;
+	uint8_t max_val = 0;
+	for (int32_t j = 0; j < 16; j++) {
+		min_val = std::min(min_val, min_buf[j]);
+		max_val = std::max(max_val, max_buf[j]);
+	}
+
+	for (; i < npixels; i++) {
+		const uint8_t val = table[raw_image[i]];
+		processed_image[i] = val;
+		min_val = std::min(min_val, val);
+		max_val = std::max(max_val, val);
+	}
+	*minv = min_val;
+	*maxv = max_val;
+}
+
+//---------------------------------------------------------
+// Reciprocal.
+//---------------------------------------------------------
+static void reciprocal_sse41(
+	const float *data,
+	int32_t n,
+	float *inv
+)	{
+	const __m128 f32_one = _mm_set1_ps(1.0f);
+	int32_t i = 0;
+	for (; i <= n - 4; i += 4) {
+		_mm_storeu_ps(inv + i, _mm_div_ps(f32_one, _mm_loadu_ps(data + i)));
+	}
+
+	for (; i < n; i++) {
+		inv[i] = 1.0f / data[i];
+	}
+}
+
+//---------------------------------------------------------
+// Accumulate column sums and column minimum of one row.
+//---------------------------------------------------------
+static void min_pool_row_sse41(
+	const uint8_t *rgb_row,
+	int32_t width,
+	uint16_t *sum[3],
+	uint8_t *min_row
+)	{
+	int32_t x = 0;
+	for (; x <= width - 16; x += 16) {
+		__m128i channel[3];
+		deinterleave_u8x16x3(rgb_row + 3 * x, channel);
+		for (int32_t c = 0; c < 3; c++) {
+			__m128i low = _mm_loadu_si128((const __m128i *)(sum[c] + x));
+			__m128i hig = _mm_loadu_si128((const __m128i *)(sum[c] + x + 8));
+			low = _mm_add_epi16(low, _mm_cvtepu8_epi16(channel[c]));
+			hig = _mm_add_epi16(hig, _mm_cvtepu8_epi16(_mm_srli_si128(channel[c], 8)));
+			_mm_storeu_si128((__m128i *)(sum[c] + x), low);
+			_mm_storeu_si128((__m128i *)(sum[c] + x + 8), hig);
+		}
+		
+		__m128i minv = _mm_min_epu8(_mm_min_epu8(channel[0], channel[1]), channel[2]);
+		minv = _mm_min_epu8(minv, _mm_loadu_si128((const __m128i *)(min_row + x)));
+		_mm_storeu_si128((__m128i *)(min_row + x), minv);
+	}
+
+	for (; x < width; x++) {
+		const uint8_t *pixel = rgb_row + 3 * x;
+		sum[0][x] += pixel[0];
+		sum[1][x] += pixel[1];
+		sum[2][x] += pixel[2];
+		min_row[x] = std::min(min_row[x], std::min(std::min(pixel[0], pixel[1]), pixel[2]));
+	}
+}
+
+//---------------------------------------------------------
+// Fill kernel table with the SSE4.1 implementation.
+//---------------------------------------------------------
+void simd_init_sse41(
+	simd_kernels_t *kernels
+)	{
+	assert(kernels);
+	// Table lookup has no byte gather, keep the plain C version.
+	simd_init_c(kernels);
+	kernels->yuv2rgb = yuv2rgb_sse41;
+	kernels->rgb2yuv = rgb2yuv_sse41;
+	kernels->recover_scene_radiance = recover_scene_radiance_sse41;
+	kernels->clip_gray_level = clip_gray_level_sse41;
+	kernels->minmax = minmax_sse41;
+	kernels->seg_linear_transf = seg_linear_transf_sse41;
+	kernels->filter3x3 = filter3x3_sse41;
+	kernels->median_filter3x3 = median_filter3x3_sse41;
+	kernels->motion_adapt_noise_reduction = motion_adapt_noise_reduction_sse41;
+	kernels->saturation_adjustment = saturation_adjustment_sse41;
+	kernels->lookup_table_minmax = lookup_table_minmax_sse41;
+	kernels->reciprocal = reciprocal_sse41;
+	kernels->min_pool_row = min_pool_row_sse41;
+}
+
+#pragma GCC pop_options
+#endif
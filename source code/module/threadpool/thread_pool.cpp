@@ -0,0 +1,191 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <unistd.h>
+#include "thread_pool.h"
+
+//---------------------------------------------------------
+// Default constructor function of class thread_pool.
+//---------------------------------------------------------
+thread_pool::thread_pool()
+{
+	head = 0;
+	tail = 0;
+	tids = 0;
+	worker_params = 0;
+	nthreads = 0;
+	quit = false;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&job_cond, NULL);
+	pthread_cond_init(&done_cond, NULL);
+}
+
+//---------------------------------------------------------
+// Destructor function of class thread_pool.
+//---------------------------------------------------------
+thread_pool::~thread_pool()
+{
+	pthread_mutex_lock(&mutex);
+	quit = true;
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&mutex);
+
+	for (int32_t t = 0; t < nthreads; t++) {
+		pthread_join(tids[t], NULL);
+	}
+
+	if (tids) {
+		delete [] tids;
+		tids = 0;
+	}
+
+	if (worker_params) {
+		delete [] worker_params;
+		worker_params = 0;
+	}
+
+	pthread_mutex_destroy(&mutex);
+	pthread_cond_destroy(&job_cond);
+	pthread_cond_destroy(&done_cond);
+}
+
+//---------------------------------------------------------
+// Worker thread of class thread_pool.
+//---------------------------------------------------------
+void *thread_pool_worker(
+	void *param
+)	{
+	thread_pool::worker_param_t *worker = (thread_pool::worker_param_t *)param;
+	thread_pool *pool = worker->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (!pool->quit && !pool->head) {
+			pthread_cond_wait(&pool->job_cond, &pool->mutex);
+		}
+
+		if (pool->quit) {
+			break;
+		}
+
+		// Claim next chunk, dequeue the job when all its chunks are claimed.
+		thread_pool::job_t *job = pool->head;
+		const int32_t chunk = job->next_chunk++;
+		if (job->next_chunk == job->nchunks) {
+			pool->head = job->next;
+			if (!pool->head) {
+				pool->tail = 0;
+			}
+		}
+		pthread_mutex_unlock(&pool->mutex);
+
+		const int32_t count = job->end - job->begin;
+		const int32_t begin = job->begin + (int32_t)((int64_t)count * chunk / job->nchunks);
+		const int32_t end = job->begin + (int32_t)((int64_t)count * (chunk + 1) / job->nchunks);
+		job->task(begin, end, worker->index, job->param);
+
+		pthread_mutex_lock(&pool->mutex);
+		job->ndone++;
+		if (job->ndone == job->nchunks) {
+			pthread_cond_broadcast(&pool->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return (void *)(0);
+}
+
+//---------------------------------------------------------
+// Create the worker threads.
+//---------------------------------------------------------
+void thread_pool::init(
+	int32_t nthreads_
+)	{
+	assert(0 == nthreads);
+	if (nthreads_ <= 0) {
+		nthreads_ = (int32_t)sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads_ <= 0) {
+			nthreads_ = 1;
+		}
+	}
+
+	tids = new pthread_t[nthreads_];
+	assert(tids);
+
+	worker_params = new worker_param_t[nthreads_];
+	assert(worker_params);
+
+	for (int32_t t = 0; t < nthreads_; t++) {
+		worker_params[t].pool = this;
+		worker_params[t].index = t;
+		int32_t ret = pthread_create(&tids[t], NULL, thread_pool_worker, &worker_params[t]);
+		if (0 != ret) {
+			printf("Create thread pool worker[%d] fail!\n", t);
+			exit(-1);
+		}
+		nthreads = t + 1;
+	}
+}
+
+//---------------------------------------------------------
+// Run chunks of [begin, end) on the workers.
+//---------------------------------------------------------
+void thread_pool::parallel_for(
+	int32_t begin,
+	int32_t end,
+	int32_t nchunks,
+	parallel_task_t task,
+	void *param
+)	{
+	assert(task);
+	const int32_t count = end - begin;
+	if (count <= 0) {
+		return;
+	}
+
+	if (nchunks > count) {
+		nchunks = count;
+	}
+
+	if (nchunks < 1) {
+		nchunks = 1;
+	}
+
+	// Pool not started, run serially.
+	if (0 == nthreads) {
+		task(begin, end, 0, param);
+		return;
+	}
+
+	job_t job;
+	job.task = task;
+	job.param = param;
+	job.begin = begin;
+	job.end = end;
+	job.nchunks = nchunks;
+	job.next_chunk = 0;
+	job.ndone = 0;
+	job.next = 0;
+
+	pthread_mutex_lock(&mutex);
+	if (tail) {
+		tail->next = &job;
+	} else {
+		head = &job;
+	}
+	tail = &job;
+	pthread_cond_broadcast(&job_cond);
+
+	while (job.ndone < job.nchunks) {
+		pthread_cond_wait(&done_cond, &mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+//---------------------------------------------------------
+// Get number of workers.
+//---------------------------------------------------------
+int32_t thread_pool::size()
+{
+	return nthreads > 0 ? nthreads : 1;
+}
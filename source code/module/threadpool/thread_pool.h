@@ -0,0 +1,108 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <cstdint>
+#include "pthread.h"
+
+/**
+ * Task function of parallel loop.
+ * @param[in] begin First index of the chunk.
+ * @param[in] end One past the last index of the chunk.
+ * @param[in] worker Index of the worker running the chunk, in [0, size()).
+ * @param[in] param Task parameters.
+ * @return void.
+ */
+typedef void (*parallel_task_t)(
+	int32_t begin,
+	int32_t end,
+	int32_t worker,
+	void *param
+);
+
+class thread_pool
+{
+public:
+	/**
+	 * Default constructor function.
+	 */
+	thread_pool();
+	/**
+	 * Destructor function. Stop and join all workers.
+	 */
+	~thread_pool();
+	/**
+	 * Create the worker threads.
+	 * @param[in] nthreads_ Number of workers, zero or less means number of online processors.
+	 * @return void.
+	 */
+	void init(
+		int32_t nthreads_
+	);
+	/**
+	 * Split [begin, end) into chunks and run them on the workers. Return after all
+	 * chunks are done. Chunks of one call never run on the calling thread, so the
+	 * worker index can be used to select per-worker scratch memory. Do not call
+	 * from inside a task.
+	 * @param[in] begin First index.
+	 * @param[in] end One past the last index.
+	 * @param[in] nchunks Number of chunks, a hint clamped to [1, end - begin].
+	 * @param[in] task Task function.
+	 * @param[in] param Task parameters.
+	 * @return void.
+	 */
+	void parallel_for(
+		int32_t begin,
+		int32_t end,
+		int32_t nchunks,
+		parallel_task_t task,
+		void *param
+	);
+	/**
+	 * Get number of workers.
+	 * @return Number of workers.
+	 */
+	int32_t size();
+private:
+	/**
+	 * \typedef struct job_t
+	 * \brief Data structure for one parallel loop submitted to the pool.
+	 */
+	typedef struct job_t {
+		parallel_task_t task;	// Task function.
+		void *param;			// Task parameters.
+		int32_t begin;			// First index.
+		int32_t end;			// One past the last index.
+		int32_t nchunks;		// Number of chunks.
+		int32_t next_chunk;		// Next chunk to be claimed.
+		int32_t ndone;			// Number of finished chunks.
+		struct job_t *next;		// Next job in queue.
+	}job_t;
+	/**
+	 * \typedef struct worker_param_t
+	 * \brief Data structure for the worker thread parameters.
+	 */
+	typedef struct {
+		thread_pool *pool;		// Owner pool.
+		int32_t index;			// Worker index.
+	}worker_param_t;
+	/**
+	 * Worker thread.
+	 * @param[in] param Worker parameters.
+	 * @return void*.
+	 */
+	friend void *thread_pool_worker(
+		void *param
+	);
+
+	pthread_mutex_t mutex;			// Protect job queue.
+	pthread_cond_t job_cond;		// Signal new job or quit.
+	pthread_cond_t done_cond;		// Signal finished job.
+	job_t *head;					// Job queue head.
+	job_t *tail;					// Job queue tail.
+	pthread_t *tids;				// Worker thread identities.
+	worker_param_t *worker_params;	// Worker thread parameters.
+	int32_t nthreads;				// Number of workers.
+	bool quit;						// Stop workers.
+};
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef _FRAME_POOL_HPP_
+#define _FRAME_POOL_HPP_
+
+#include <cstdint>
+#include <cassert>
+#include "pthread.h"
+
+/**
+ * Fixed number of equally sized frame buffers allocated once. A frame is
+ * acquired at the pipeline entry, its ownership moves from stage to stage
+ * with the frame pointer, and the last owner releases it, so the steady state
+ * has no heap allocation. The free list is a stack under a mutex held only to
+ * take or put one pointer.
+ */
+class frame_pool
+{
+public:
+	/**
+	 * Default constructor function.
+	 */
+	frame_pool();
+	/**
+	 * Destructor function. Frames still acquired become invalid.
+	 */
+	~frame_pool();
+	/**
+	 * Allocate the frames. Not thread safe, call before the stages start.
+	 * @param[in] nframes_ Number of frames.
+	 * @param[in] frame_size Bytes per frame.
+	 * @return void.
+	 */
+	void init(
+		int32_t nframes_,
+		int32_t frame_size
+	);
+	/**
+	 * Take a free frame.
+	 * @return Frame, or 0 if all frames are in use.
+	 */
+	uint8_t *acquire();
+	/**
+	 * Give a frame back.
+	 * @param[in] frame Frame taken by acquire.
+	 * @return void.
+	 */
+	void release(
+		uint8_t *frame
+	);
+private:
+	uint8_t *memory;				// Memory of all frames.
+	uint8_t **free_frames;			// Stack of free frames.
+	int32_t nfree;					// Number of free frames.
+	int32_t nframes;				// Number of frames.
+	pthread_mutex_t mutex;			// Protect free frames.
+};
+
+//---------------------------------------------------------
+// Default constructor function of class frame_pool.
+//---------------------------------------------------------
+inline frame_pool::frame_pool()
+{
+	memory = 0;
+	free_frames = 0;
+	nfree = 0;
+	nframes = 0;
+	pthread_mutex_init(&mutex, NULL);
+}
+
+//---------------------------------------------------------
+// Destructor function of class frame_pool.
+//---------------------------------------------------------
+inline frame_pool::~frame_pool()
+{
+	if (memory) {
+		delete [] memory;
+		memory = 0;
+	}
+
+	if (free_frames) {
+		delete [] free_frames;
+		free_frames = 0;
+	}
+
+	pthread_mutex_destroy(&mutex);
+}
+
+//---------------------------------------------------------
+// Allocate frames.
+//---------------------------------------------------------
+inline void frame_pool::init(
+	int32_t nframes_,
+	int32_t frame_size
+)	{
+	assert(nframes_ > 0 && frame_size > 0);
+	if (memory) {
+		delete [] memory;
+	}
+
+	if (free_frames) {
+		delete [] free_frames;
+	}
+
+	// Frames start on 64 bytes boundaries for the vector kernels.
+	const int32_t stride = (frame_size + 63) & ~63;
+	memory = new uint8_t[(size_t)nframes_ * stride + 63];
+	assert(memory);
+	free_frames = new uint8_t *[nframes_];
+	assert(free_frames);
+
+	uint8_t *first = (uint8_t *)(((uintptr_t)memory + 63) & ~(uintptr_t)63);
+	for (int32_t i = 0; i < nframes_; i++) {
+		free_frames[i] = first + (size_t)i * stride;
+	}
+
+	nframes = nframes_;
+	nfree = nframes_;
+}
+
+//---------------------------------------------------------
+// Take a free frame.
+//---------------------------------------------------------
+inline uint8_t *frame_pool::acquire()
+{
+	uint8_t *frame = 0;
+	pthread_mutex_lock(&mutex);
+	if (nfree > 0) {
+		frame = free_frames[--nfree];
+	}
+	pthread_mutex_unlock(&mutex);
+	return frame;
+}
+
+//---------------------------------------------------------
+// Give a frame back.
+//---------------------------------------------------------
+inline void frame_pool::release(
+	uint8_t *frame
+)	{
+	assert(frame);
+	pthread_mutex_lock(&mutex);
+	assert(nfree < nframes);
+	free_frames[nfree++] = frame;
+	pthread_mutex_unlock(&mutex);
+}
+
+#endif
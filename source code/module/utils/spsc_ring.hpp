@@ -0,0 +1,272 @@
+#ifndef _SPSC_RING_HPP_
+#define _SPSC_RING_HPP_
+
+#include <cstdint>
+#include <cassert>
+#include "pthread.h"
+
+/**
+ * Bounded single producer single consumer ring buffer between two pipeline
+ * stages. Push and pop are lock free, the indices are published with atomic
+ * stores. A side that has to wait sleeps on a condition variable, and the
+ * other side takes the mutex only to wake it, so a stage never holds a lock
+ * while it processes and an empty ring costs no polling.
+ */
+template<typename T>
+class spsc_ring
+{
+public:
+	/**
+	 * Default constructor function.
+	 */
+	spsc_ring();
+	/**
+	 * Destructor function. The items left in the ring are not released.
+	 */
+	~spsc_ring();
+	/**
+	 * Allocate the slots. Not thread safe, call before the stages start.
+	 * @param[in] capacity_ Maximum number of items in the ring.
+	 * @return void.
+	 */
+	void init(
+		int32_t capacity_
+	);
+	/**
+	 * Push an item if the ring is not full. Producer only.
+	 * @param[in] item Item.
+	 * @return true if pushed, false if the ring is full.
+	 */
+	bool try_push(
+		const T &item
+	);
+	/**
+	 * Push an item, wait while the ring is full. Producer only.
+	 * @param[in] item Item.
+	 * @return void.
+	 */
+	void push(
+		const T &item
+	);
+	/**
+	 * Pop an item if the ring is not empty. Consumer only.
+	 * @param[out] item Item.
+	 * @return true if popped, false if the ring is empty.
+	 */
+	bool try_pop(
+		T &item
+	);
+	/**
+	 * Pop an item, wait while the ring is empty. Consumer only.
+	 * @param[out] item Item.
+	 * @return void.
+	 */
+	void pop(
+		T &item
+	);
+	/**
+	 * Get number of items in the ring, exact on the producer and the consumer
+	 * side only for the free slots and the items respectively.
+	 * @return Number of items.
+	 */
+	int32_t size() const;
+	/**
+	 * Test whether the ring is full. Exact on the producer side.
+	 * @return true if full.
+	 */
+	bool full() const;
+private:
+	/**
+	 * Wake the other side if it waits.
+	 * @param[in] waiting Wait flag of the other side.
+	 * @param[in] cond Condition variable of the other side.
+	 * @return void.
+	 */
+	void wake(
+		int32_t *waiting,
+		pthread_cond_t *cond
+	);
+
+	T *slots;						// Ring slots.
+	uint32_t mask;					// Number of slots minus one, slots are a power of two.
+	uint32_t capacity;				// Maximum number of items.
+	uint32_t head;					// Index of next pop, written by consumer.
+	char pad0[64];					// Keep head and tail on separate cache lines.
+	uint32_t tail;					// Index of next push, written by producer.
+	char pad1[64];
+	int32_t consumer_waiting;		// Consumer sleeps on not_empty.
+	int32_t producer_waiting;		// Producer sleeps on not_full.
+	pthread_mutex_t mutex;			// Protect sleeping.
+	pthread_cond_t not_empty;		// Signal pushed item.
+	pthread_cond_t not_full;		// Signal popped item.
+};
+
+//---------------------------------------------------------
+// Default constructor function of class spsc_ring.
+//---------------------------------------------------------
+template<typename T>
+spsc_ring<T>::spsc_ring()
+{
+	slots = 0;
+	mask = 0;
+	capacity = 0;
+	head = 0;
+	tail = 0;
+	consumer_waiting = 0;
+	producer_waiting = 0;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&not_empty, NULL);
+	pthread_cond_init(&not_full, NULL);
+}
+
+//---------------------------------------------------------
+// Destructor function of class spsc_ring.
+//---------------------------------------------------------
+template<typename T>
+spsc_ring<T>::~spsc_ring()
+{
+	if (slots) {
+		delete [] slots;
+		slots = 0;
+	}
+
+	pthread_mutex_destroy(&mutex);
+	pthread_cond_destroy(&not_empty);
+	pthread_cond_destroy(&not_full);
+}
+
+//---------------------------------------------------------
+// Allocate ring slots.
+//---------------------------------------------------------
+template<typename T>
+void spsc_ring<T>::init(
+	int32_t capacity_
+)	{
+	assert(capacity_ > 0);
+	uint32_t nslots = 1;
+	while (nslots < (uint32_t)capacity_) {
+		nslots <<= 1;
+	}
+
+	if (slots) {
+		delete [] slots;
+	}
+
+	slots = new T[nslots];
+	assert(slots);
+	mask = nslots - 1;
+	capacity = capacity_;
+	head = 0;
+	tail = 0;
+}
+
+//---------------------------------------------------------
+// Push item if ring is not full.
+//---------------------------------------------------------
+template<typename T>
+bool spsc_ring<T>::try_push(
+	const T &item
+)	{
+	const uint32_t t = tail;
+	if (t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) >= capacity) {
+		return false;
+	}
+
+	slots[t & mask] = item;
+	__atomic_store_n(&tail, t + 1, __ATOMIC_SEQ_CST);
+	wake(&consumer_waiting, &not_empty);
+	return true;
+}
+
+//---------------------------------------------------------
+// Push item, wait while ring is full.
+//---------------------------------------------------------
+template<typename T>
+void spsc_ring<T>::push(
+	const T &item
+)	{
+	while (!try_push(item)) {
+		pthread_mutex_lock(&mutex);
+		__atomic_store_n(&producer_waiting, 1, __ATOMIC_SEQ_CST);
+		while (full()) {
+			pthread_cond_wait(&not_full, &mutex);
+		}
+		__atomic_store_n(&producer_waiting, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+//---------------------------------------------------------
+// Pop item if ring is not empty.
+//---------------------------------------------------------
+template<typename T>
+bool spsc_ring<T>::try_pop(
+	T &item
+)	{
+	const uint32_t h = head;
+	if (h == __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	item = slots[h & mask];
+	__atomic_store_n(&head, h + 1, __ATOMIC_SEQ_CST);
+	wake(&producer_waiting, &not_full);
+	return true;
+}
+
+//---------------------------------------------------------
+// Pop item, wait while ring is empty.
+//---------------------------------------------------------
+template<typename T>
+void spsc_ring<T>::pop(
+	T &item
+)	{
+	while (!try_pop(item)) {
+		pthread_mutex_lock(&mutex);
+		__atomic_store_n(&consumer_waiting, 1, __ATOMIC_SEQ_CST);
+		while (0 == size()) {
+			pthread_cond_wait(&not_empty, &mutex);
+		}
+		__atomic_store_n(&consumer_waiting, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+//---------------------------------------------------------
+// Get number of items in ring.
+//---------------------------------------------------------
+template<typename T>
+int32_t spsc_ring<T>::size() const
+{
+	return (int32_t)(__atomic_load_n(&tail, __ATOMIC_SEQ_CST) -
+		__atomic_load_n(&head, __ATOMIC_SEQ_CST));
+}
+
+//---------------------------------------------------------
+// Test whether ring is full.
+//---------------------------------------------------------
+template<typename T>
+bool spsc_ring<T>::full() const
+{
+	return (uint32_t)size() >= capacity;
+}
+
+//---------------------------------------------------------
+// Wake other side if it waits.
+//---------------------------------------------------------
+template<typename T>
+void spsc_ring<T>::wake(
+	int32_t *waiting,
+	pthread_cond_t *cond
+)	{
+	// The sleeper sets its flag before it tests the ring under the mutex, and
+	// the index was stored before the flag is tested here, so one of the two
+	// sees the other and no wakeup is lost.
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&mutex);
+		pthread_cond_signal(cond);
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+#endif